@@ -53,11 +53,29 @@ struct ExtentList {
 	struct ExtentList *next;
 };
 typedef struct ExtentList ExtentList_t;
+
+/*
+ * The same extents, as they are actually read and copied:  sorted
+ * by base, with overlapping and adjacent extents merged as they are
+ * added.  Extents separated by no more than gap bytes are merged as
+ * well (copying the gap), which trades a little extra data for fewer,
+ * larger I/Os.  fid is kept only while all merged extents agree.
+ */
+struct ExtentSet {
+	Extents_t *extents;
+	size_t count;
+	size_t max;
+	off_t byteCount;
+	off_t gap;
+};
+typedef struct ExtentSet ExtentSet_t;
+
 /*
  * The in-core description of the volume:  an input source,
- * a description of the volume, the linked list of extents,
- * the total number of bytes, and the number of linked list
- * elements.
+ * a description of the volume, the linked list of extents
+ * in the order they were found, the number of extents added
+ * and their total number of bytes, and the sorted set of
+ * extents that will be copied.
  */
 struct VolumeObjects {
 	struct DeviceInfo *devp;
@@ -65,6 +83,7 @@ struct VolumeObjects {
 	size_t count;
 	off_t byteCount;
 	ExtentList_t *list;
+	ExtentSet_t set;
 };
 typedef struct VolumeObjects VolumeObjects_t;
 
@@ -74,9 +93,10 @@ extern VolumeObjects_t *InitVolumeObject(struct DeviceInfo *devp, struct VolumeD
 extern int AddExtent(VolumeObjects_t *vop, off_t start, off_t length);
 extern int AddExtentForFile(VolumeObjects_t *vop, off_t start, off_t length, unsigned int fid);
 extern void PrintVolumeObject(VolumeObjects_t*);
+extern void PrintExtentSchedule(VolumeObjects_t*);
 extern int CopyObjectsToDest(VolumeObjects_t*, struct IOWrapper *wrapper, off_t skip);
 
-extern void WriteGatheredData(const char *, VolumeObjects_t*);
+extern void WriteGatheredData(const char *, VolumeObjects_t*, int);
 
 extern struct DeviceInfo *OpenDevice(const char *, int);
 extern struct VolumeDescriptor *VolumeInfo(struct DeviceInfo *);
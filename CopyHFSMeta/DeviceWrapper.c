@@ -79,6 +79,17 @@ done:
 	return retval;
 }
 
+/*
+ * The writes above aren't synced, so do it once at the end.
+ */
+static int
+doFlush(struct IOWrapper *context)
+{
+	struct DeviceWrapperContext *ctx = (struct DeviceWrapperContext*)context->context;
+
+	return fsync(ctx->fd);
+}
+
 /*
  * Device files can't have progress information stored, so we don't do anything.
  */
@@ -160,6 +171,7 @@ InitDeviceWrapper(const char *path, DeviceInfo_t *devp)
 	retval->writer = &writeExtent;
 	retval->getprog = &GetProgress;
 	retval->setprog = &SetProgress;
+	retval->flush = &doFlush;
 	retval->cleanup = &noClean;
 
 done:
@@ -7,6 +7,8 @@
 #include <zlib.h>
 #include <limits.h>
 #include <assert.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "hfsmeta.h"
 #include "Data.h"
@@ -21,6 +23,20 @@ enum {
 	kHFSInfoHeaderVersion = 1,
 };
 
+/*
+ * The parallel gather path splits the extents into chunks of
+ * kGatherChunkSize bytes.  Worker threads read and compress chunks
+ * independently, each into its own gzip member, and the calling
+ * thread writes the members out in order.  A gzip file may consist
+ * of several members, which gunzip and gzread() concatenate, so the
+ * output reads back the same as the single-stream file.
+ */
+enum {
+	kGatherChunkSize = 4 * 1024 * 1024,
+	kGatherMaxThreads = 32,
+	kGatherSlotsPerThread = 2,	// chunks in flight per worker
+};
+
 
 #define MIN(a, b) \
 	({ __typeof(a) __a = (a); __typeof(b) __b = (b); \
@@ -66,39 +82,342 @@ WriteExtent(gzFile outf, DeviceInfo_t *devp, off_t start, off_t len)
 	return 0;
 }
 
+/*
+ * Compress len bytes at src into dst as one complete gzip member.
+ * dst must hold deflateBound() bytes for len.  Returns the member
+ * length, or -1 on error.
+ */
+static ssize_t
+GzipMember(z_stream *zs, const void *src, size_t len, void *dst, size_t dstLen)
+{
+	if (deflateReset(zs) != Z_OK)
+		return -1;
+	zs->next_in = (Bytef *)src;
+	zs->avail_in = (uInt)len;
+	zs->next_out = dst;
+	zs->avail_out = (uInt)dstLen;
+	if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+		return -1;
+	return dstLen - zs->avail_out;
+}
+
+static int
+GzipInit(z_stream *zs)
+{
+	memset(zs, 0, sizeof(*zs));
+	// 16 + MAX_WBITS asks for a gzip header and trailer instead of zlib's
+	return deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+}
+
+enum {
+	kSlotFree = 0,
+	kSlotBusy,
+	kSlotReady,
+	kSlotError,
+};
+
+/*
+ * One chunk in flight.  Chunk n always uses slot n % nslots; a worker
+ * may only claim a chunk once the writer has released its slot.
+ */
+struct GatherSlot {
+	int	state;
+	off_t	start;		// device offset of this chunk
+	size_t	len;
+	off_t	extStart;	// extent this chunk belongs to
+	off_t	extLen;
+	int	firstOfExtent;
+	int	lastOfExtent;
+	uint8_t	*out;		// compressed member
+	size_t	outSize;
+	ssize_t	outLen;
+};
+
+struct GatherPipeline {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	DeviceInfo_t	*devp;
+
+	// Next unclaimed position in the sorted extent set
+	ExtentSet_t	*set;
+	size_t		indx;
+	off_t		offset;
+	int		allClaimed;
+
+	uint64_t	nextSeq;	// next chunk to claim
+	uint64_t	writeSeq;	// next chunk the writer wants
+	int		stop;
+
+	int		nslots;
+	struct GatherSlot *slots;
+};
+
+/*
+ * Claim the next chunk of the extent set.  Called with the lock held;
+ * returns NULL once everything has been claimed or the pipeline stopped.
+ */
+static struct GatherSlot *
+GatherClaim(struct GatherPipeline *gp)
+{
+	struct GatherSlot *slot;
+	Extents_t *ext;
+
+	while (!gp->stop && !gp->allClaimed &&
+	       gp->nextSeq >= gp->writeSeq + gp->nslots)
+		pthread_cond_wait(&gp->cond, &gp->lock);
+	if (gp->stop || gp->allClaimed)
+		return NULL;
+
+	ext = &gp->set->extents[gp->indx];
+	slot = &gp->slots[gp->nextSeq++ % gp->nslots];
+	slot->state = kSlotBusy;
+	slot->extStart = ext->base;
+	slot->extLen = ext->length;
+	slot->start = ext->base + gp->offset;
+	slot->len = MIN((off_t)kGatherChunkSize, ext->length - gp->offset);
+	slot->firstOfExtent = (gp->offset == 0);
+
+	gp->offset += slot->len;
+	slot->lastOfExtent = (gp->offset >= ext->length);
+	if (slot->lastOfExtent) {
+		// Move on to the next extent
+		gp->offset = 0;
+		if (++gp->indx == gp->set->count)
+			gp->allClaimed = 1;
+	}
+	return slot;
+}
+
+static void *
+GatherWorker(void *arg)
+{
+	struct GatherPipeline *gp = arg;
+	struct GatherSlot *slot;
+	uint8_t *buffer = NULL;
+	z_stream zs;
+	int zinit = 0;
+
+	if (posix_memalign((void **)&buffer, getpagesize(), kGatherChunkSize) != 0)
+		buffer = NULL;
+	if (buffer != NULL && GzipInit(&zs) == Z_OK)
+		zinit = 1;
+
+	pthread_mutex_lock(&gp->lock);
+	while ((slot = GatherClaim(gp)) != NULL) {
+		int state = kSlotReady;
+		pthread_mutex_unlock(&gp->lock);
+
+		if (!zinit) {
+			warnx("Cannot set up gather worker");
+			state = kSlotError;
+		} else if (slot->len == 0) {
+			slot->outLen = 0;
+		} else {
+			ssize_t nread = pread(gp->devp->fd, buffer, slot->len, slot->start);
+			if (nread == -1) {
+				warn("Cannot read from device at offset %lld", slot->start);
+				state = kSlotError;
+			} else {
+				if (nread != slot->len) {
+					warnx("Tried to read %zu bytes, only read %zd", slot->len, nread);
+					memset(buffer + nread, 0, slot->len - nread);
+				}
+				slot->outLen = GzipMember(&zs, buffer, slot->len, slot->out, slot->outSize);
+				if (slot->outLen == -1) {
+					warnx("Cannot compress %zu bytes at offset %lld", slot->len, slot->start);
+					state = kSlotError;
+				}
+			}
+		}
+
+		pthread_mutex_lock(&gp->lock);
+		slot->state = state;
+		pthread_cond_broadcast(&gp->cond);
+	}
+	pthread_mutex_unlock(&gp->lock);
+
+	if (zinit)
+		deflateEnd(&zs);
+	free(buffer);
+	return NULL;
+}
+
+static int
+WriteAll(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len > 0) {
+		ssize_t nwritten = write(fd, p, len);
+		if (nwritten == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += nwritten;
+		len -= nwritten;
+	}
+	return 0;
+}
+
+/*
+ * Write the header and all of the extents to fd, using nthreads worker
+ * threads to read and compress.  Returns the number of extents written.
+ */
+static size_t
+WriteGatheredParallel(int fd, VolumeObjects_t *vop, const void *hdr, size_t hdrLen, const void *objs, size_t objsLen, int nthreads)
+{
+	struct GatherPipeline gp = { 0 };
+	pthread_t threads[kGatherMaxThreads];
+	int nstarted = 0;
+	size_t count = 0;
+	size_t bound;
+	uint8_t *head = NULL;
+	z_stream zs;
+	ssize_t len;
+	int i;
+
+	/* The header and object table go out first, as their own member */
+	if (GzipInit(&zs) != Z_OK) {
+		warnx("Cannot initialize compression");
+		return 0;
+	}
+	bound = deflateBound(&zs, hdrLen + objsLen);
+	head = malloc(hdrLen + objsLen + bound);
+	if (head == NULL) {
+		warn("Cannot allocate %zu bytes for gather header", hdrLen + objsLen + bound);
+		deflateEnd(&zs);
+		return 0;
+	}
+	memcpy(head, hdr, hdrLen);
+	memcpy(head + hdrLen, objs, objsLen);
+	len = GzipMember(&zs, head, hdrLen + objsLen, head + hdrLen + objsLen, bound);
+	if (len == -1 || WriteAll(fd, head + hdrLen + objsLen, len) == -1) {
+		warn("Cannot write gather header");
+		deflateEnd(&zs);
+		free(head);
+		return 0;
+	}
+	free(head);
+
+	pthread_mutex_init(&gp.lock, NULL);
+	pthread_cond_init(&gp.cond, NULL);
+	gp.devp = vop->devp;
+	gp.set = &vop->set;
+	gp.allClaimed = (gp.set->count == 0);
+	gp.nslots = nthreads * kGatherSlotsPerThread;
+	gp.slots = calloc(gp.nslots, sizeof(*gp.slots));
+	if (gp.slots == NULL) {
+		warn("Cannot allocate gather slots");
+		goto done;
+	}
+	bound = deflateBound(&zs, kGatherChunkSize);
+	for (i = 0; i < gp.nslots; i++) {
+		gp.slots[i].outSize = bound;
+		gp.slots[i].out = malloc(bound);
+		if (gp.slots[i].out == NULL) {
+			warn("Cannot allocate %zu bytes for compressed data", bound);
+			goto done;
+		}
+	}
+
+	for (nstarted = 0; nstarted < nthreads; nstarted++) {
+		if (pthread_create(&threads[nstarted], NULL, GatherWorker, &gp) != 0) {
+			warn("Cannot create gather thread");
+			break;
+		}
+	}
+	if (nstarted == 0)
+		goto done;
+
+	/* Write the chunks out in order as the workers finish them */
+	pthread_mutex_lock(&gp.lock);
+	for (;;) {
+		struct GatherSlot *slot = &gp.slots[gp.writeSeq % gp.nslots];
+
+		if (gp.allClaimed && gp.writeSeq == gp.nextSeq)
+			break;
+		if (gp.writeSeq == gp.nextSeq || slot->state == kSlotBusy) {
+			pthread_cond_wait(&gp.cond, &gp.lock);
+			continue;
+		}
+		if (slot->state == kSlotError) {
+			if (verbose)
+				fprintf(stderr, "\tWrite failed\n");
+			break;
+		}
+		pthread_mutex_unlock(&gp.lock);
+
+		if (verbose && slot->firstOfExtent)
+			fprintf(stderr, "Writing extent <%lld, %lld>\n", slot->extStart, slot->extLen);
+		if (WriteAll(fd, slot->out, slot->outLen) == -1) {
+			warn("tried to write %zd bytes", slot->outLen);
+			if (verbose)
+				fprintf(stderr, "\tWrite failed\n");
+			pthread_mutex_lock(&gp.lock);
+			break;
+		}
+		if (slot->lastOfExtent)
+			count++;
+
+		pthread_mutex_lock(&gp.lock);
+		slot->state = kSlotFree;
+		gp.writeSeq++;
+		pthread_cond_broadcast(&gp.cond);
+	}
+	gp.stop = 1;
+	pthread_cond_broadcast(&gp.cond);
+	pthread_mutex_unlock(&gp.lock);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+
+done:
+	deflateEnd(&zs);
+	if (gp.slots) {
+		for (i = 0; i < gp.nslots; i++)
+			free(gp.slots[i].out);
+		free(gp.slots);
+	}
+	pthread_cond_destroy(&gp.cond);
+	pthread_mutex_destroy(&gp.lock);
+	return count;
+}
+
+/*
+ * Create a gatherHFS-compatible file at pathname.  With nthreads > 1
+ * the extents are read and compressed in parallel (see above); with
+ * nthreads == 1 they are streamed through a single gzwrite() stream.
+ */
 void
-WriteGatheredData(const char *pathname, VolumeObjects_t *vop)
+WriteGatheredData(const char *pathname, VolumeObjects_t *vop, int nthreads)
 {
 	int fd;
 	gzFile outf;
 	struct HFSInfoHeader hdr = { 0 };
 	HFSDataObject *objs = NULL, *op;
-	ExtentList_t *ep;
-	int i;
+	ExtentSet_t *set = &vop->set;
+	size_t i;
 	size_t len;
+	size_t count = 0;
 
 	hdr.version = S32(kHFSInfoHeaderVersion);
 	hdr.deviceBlockSize = S32((uint32_t)vop->devp->blockSize);
 	hdr.rawDeviceSize = S64(vop->devp->size);
-	hdr.objectCount = S32(vop->count);
-	hdr.size = S32(sizeof(hdr) + sizeof(HFSDataObject) * vop->count);
+	hdr.objectCount = S32(set->count);
+	hdr.size = S32(sizeof(hdr) + sizeof(HFSDataObject) * set->count);
 
-	objs = malloc(sizeof(HFSDataObject) * vop->count);
+	objs = malloc(sizeof(HFSDataObject) * set->count);
 	if (objs == NULL) {
-		warn("Unable to allocate space for data objects (%zu bytes)", sizeof(HFSDataObject)* vop->count);
+		warn("Unable to allocate space for data objects (%zu bytes)", sizeof(HFSDataObject)* set->count);
 		goto done;
 	}
 
 	op = objs;
-	for (ep = vop->list;
-	     ep;
-	     ep = ep->next) {
-		int i;
-		for (i = 0; i < ep->count; i++) {
-			op->offset = S64(ep->extents[i].base);
-			op->size = S64(ep->extents[i].length);
-			op++;
-		}
+	for (i = 0; i < set->count; i++) {
+		op->offset = S64(set->extents[i].base);
+		op->size = S64(set->extents[i].length);
+		op++;
 	}
 
 	fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
@@ -106,6 +425,14 @@ WriteGatheredData(const char *pathname, VolumeObjects_t *vop)
 		warn("cannot create gather file %s", pathname);
 		goto done;
 	}
+	len = sizeof(HFSDataObject) * set->count;
+
+	if (nthreads > 1) {
+		count = WriteGatheredParallel(fd, vop, &hdr, sizeof(hdr), objs, len, MIN(nthreads, kGatherMaxThreads));
+		close(fd);
+		goto check;
+	}
+
 	outf = gzdopen(fd, "wb");
 	if (outf == NULL) {
 		warn("Cannot create gz descriptor from file %s", pathname);
@@ -114,29 +441,23 @@ WriteGatheredData(const char *pathname, VolumeObjects_t *vop)
 	}
 
 	gzwrite(outf, &hdr, sizeof(hdr));
-	len = sizeof(HFSDataObject) * vop->count;
 	assert(len < UINT_MAX);
 	gzwrite(outf, objs, (unsigned)len);
 
-	int count = 0;
-	for (ep = vop->list;
-	     ep;
-	     ep = ep->next) {
-		int i;
-		for (i = 0; i < ep->count; i++) {
+	for (i = 0; i < set->count; i++) {
+		if (verbose)
+			fprintf(stderr, "Writing extent <%lld, %lld>\n", set->extents[i].base, set->extents[i].length);
+		if (WriteExtent(outf, vop->devp, set->extents[i].base, set->extents[i].length) == -1) {
 			if (verbose)
-				fprintf(stderr, "Writing extent <%lld, %lld>\n", ep->extents[i].base, ep->extents[i].length);
-			if (WriteExtent(outf, vop->devp, ep->extents[i].base, ep->extents[i].length) == -1) {
-				if (verbose)
-					fprintf(stderr, "\tWrite failed\n");
-				break;
-			}
-			count++;
+				fprintf(stderr, "\tWrite failed\n");
+			break;
 		}
+		count++;
 	}
 	gzclose(outf);
-	if (count != vop->count)
-		fprintf(stderr, "WHOAH!  we're short by %zd objects!\n", vop->count - count);
+check:
+	if (count != set->count)
+		fprintf(stderr, "WHOAH!  we're short by %zd objects!\n", set->count - count);
 
 
 done:
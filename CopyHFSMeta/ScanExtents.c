@@ -12,6 +12,10 @@
 # define MAX(a, b) \
 	({ __typeof(a) __a = (a); __typeof(b) __b = (b); __a > __b ? __a : __b; })
 #endif
+#ifndef MIN
+# define MIN(a, b) \
+	({ __typeof(a) __a = (a); __typeof(b) __b = (b); __a < __b ? __a : __b; })
+#endif
 
 /*
  * Functions to scan through the extents overflow file, grabbing
@@ -21,10 +25,11 @@
 /*
  * Given an extent record, return the logical block address (in the volume)
  * for the requested block offset into the file.  It returns 0 if it can't
- * find it.
+ * find it.  If runp is not NULL, it's set to the number of blocks from
+ * there to the end of the extent, which are contiguous on disk.
  */
 static unsigned int
-FindBlock(HFSPlusExtentRecord *erp, unsigned int blockNum)
+FindBlock(HFSPlusExtentRecord *erp, unsigned int blockNum, unsigned int *runp)
 {
 	unsigned int lba = 0;
 	unsigned int base = 0;
@@ -36,6 +41,8 @@ FindBlock(HFSPlusExtentRecord *erp, unsigned int blockNum)
 			break;
 		if ((base + S32(ep->blockCount)) > blockNum) {
 			lba = S32(ep->startBlock) + (blockNum - base);
+			if (runp)
+				*runp = base + S32(ep->blockCount) - blockNum;
 			break;
 		}
 		base += S32(ep->blockCount);
@@ -44,79 +51,71 @@ FindBlock(HFSPlusExtentRecord *erp, unsigned int blockNum)
 	return lba;
 }
 
+/*
+ * Nodes are read through a window:  a miss reads as much of the rest
+ * of the extent as fits (up to kNodeBatchSize) in one request, and the
+ * following nodes -- the leaf chain is usually in order -- come from
+ * memory, instead of every node costing a read per device block.
+ */
+struct NodeWindow {
+	uint8_t *buffer;
+	size_t size;
+	off_t start;	// device offset of buffer[0]
+	size_t len;	// bytes of buffer that are valid
+};
+
 /*
  * Get the given node from the extents-overflow file.  Returns -1 on error, and
  * 0 on success.
  */
 static int
-GetNode(DeviceInfo_t *devp, HFSPlusVolumeHeader *hp, int nodeNum, size_t nodeSize, void *nodePtr)
+GetNode(DeviceInfo_t *devp, HFSPlusVolumeHeader *hp, int nodeNum, size_t nodeSize, void *nodePtr, struct NodeWindow *win)
 {
-	int retval = 0;
-	unsigned char *ptr, *endPtr;
-	unsigned int offset;
 	HFSPlusExtentRecord *erp = &hp->extentsFile.extents;
-	size_t bufferSize = MAX(nodeSize, S32(hp->blockSize));
+	off_t blockSize = S32(hp->blockSize);
+	off_t fileOffset = (off_t)nodeNum * nodeSize;
+	size_t copied = 0;
 
-	ptr = nodePtr;
-	endPtr = ptr + bufferSize;
 	/*
-	 * The block number for HFS Plus is guaranteed to be 32 bits.
-	 * But the multiplication could over-flow, so we cast one
-	 * of the variables to off_t, and cast the whole thing back
-	 * to uint32_t.
+	 * A node may be smaller than an allocation block (per 13080856, there
+	 * can be several nodes per block), or span several allocation blocks,
+	 * which need not be contiguous; copy it a contiguous piece at a time.
 	 */
-	offset = (uint32_t)(((off_t)nodeNum * nodeSize) / S32(hp->blockSize));
-
-	/*
-	 * We have two sizes to consider here:  the device blocksize, and the
-	 * buffer size.  The buffer size is the larger of the btree node size
-	 * and the volume allocation block size.
-	 *
-	 * This loop is the case where the device block size is smaller than
-	 * the amount we want to read (in a common case, 8kbyte node size, and
-	 * 512 byte block size).  It reads in a device block, and adds it to
-	 * the buffer; it continues until an error, or until it has gotten
-	 * the amount it needs.
-	 *
-	 * The variable "offset" is in *allocation blocks*, not *bytes*.
-	 */
-	while (ptr < endPtr) {
-		ssize_t rv;
-		off_t lba;
-		unsigned int i;
-
+	while (copied < nodeSize) {
+		/*
+		 * The block number for HFS Plus is guaranteed to be 32 bits;
+		 * the byte offset is computed as an off_t so it can't overflow.
+		 */
+		unsigned int blockNum = (uint32_t)((fileOffset + copied) / blockSize);
+		size_t blockOff = (size_t)((fileOffset + copied) % blockSize);
+		unsigned int run = 0;
+		off_t lba, devOffset;
+		size_t amt;
 
-		lba = FindBlock(erp, offset);
+		lba = FindBlock(erp, blockNum, &run);
 		if (lba == 0) {
-			warnx("Cannot find block %u in extents overflow file", offset);
+			warnx("Cannot find block %u in extents overflow file", blockNum);
 			return -1;
 		}
-		lba = lba * S32(hp->blockSize);
-		for (i = 0; i < S32(hp->blockSize) / devp->blockSize; i++) {
-//			printf("Trying to get block %lld\n", lba + i);
-			rv = GetBlock(devp, lba + (i * devp->blockSize), ptr);
-			if (rv == -1) {
-				warnx("Cannot read block %llu in extents overflow file", lba + i);
+		devOffset = lba * blockSize + blockOff;
+		amt = MIN(nodeSize - copied, (size_t)(run * blockSize - blockOff));
+
+		if (devOffset < win->start || devOffset + amt > win->start + (off_t)win->len) {
+			size_t want = (size_t)MIN((off_t)win->size, run * blockSize - blockOff);
+			ssize_t rv = UnalignedRead(devp, win->buffer, want, devOffset);
+
+			if (rv < (ssize_t)amt) {
+				warnx("Cannot read block %u in extents overflow file", blockNum);
+				win->len = 0;
 				return -1;
 			}
-			ptr += devp->blockSize;
+			win->start = devOffset;
+			win->len = rv;
 		}
-		offset++;
-	}
-
-	/*
-	 * Per 13080856:  if the node size is less than the allocation block size, we
-	 * have to deal with having multiple nodes per block.  The code above to read it
-	 * has read in either an allocation block, or a node block, depending on which
-	 * is larger.  If the allocation block is larger, then we have to move the node
-	 * we want to the beginning of the buffer.
-	 */
-	if (nodeSize < bufferSize) {
-		size_t indx = nodeNum % (S32(hp->blockSize) / nodeSize);
-		ptr = nodePtr;
-		memmove(ptr, ptr + (indx * nodeSize), nodeSize);
+		memcpy((uint8_t*)nodePtr + copied, win->buffer + (devOffset - win->start), amt);
+		copied += amt;
 	}
-	return retval;
+	return 0;
 }
 
 /*
@@ -193,8 +192,8 @@ ScanExtents(VolumeObjects_t *vop, int useAltHdr)
 	HFSPlusVolumeHeader *hp;
 	off_t vBlockSize;
 	size_t nodeSize;
-	size_t bufferSize;
 	void *nodePtr = NULL;
+	struct NodeWindow window = { 0 };
 	unsigned int nodeNum = 0;
 
 	hp = useAltHdr ? &vop->vdp->altHeader : & vop->vdp->priHeader;
@@ -214,28 +213,18 @@ ScanExtents(VolumeObjects_t *vop, int useAltHdr)
 	}
 
 	nodeSize = S16(headerNode->header.nodeSize);
-	/*
-	 * There are three cases here:
-	 * nodeSize == vBlockSize;
-	 * nodeSize > vBlockSize;
-	 * nodeSize < vBlockSize.
-	 * For the first two, everything is easy:  we just need to read in a nodeSize, and that
-	 * contains everything we care about.  For the third case, however, we will
-	 * need to read in an allocation block size, but then have GetNode move memory
-	 * around so the node we want is at the beginning of the buffer.  Note that this
-	 * does mean it is less efficient than it should be.
-	 */
-	if (nodeSize < vBlockSize) {
-		bufferSize = vBlockSize;
-	} else {
-		bufferSize = nodeSize;
-	}
 
-	nodePtr = malloc(bufferSize);
+	nodePtr = malloc(nodeSize);
 	if (nodePtr == NULL) {
 		warn("cannot allocate buffer for node");
 		goto done;
 	}
+	window.size = MAX((size_t)kNodeBatchSize, nodeSize);
+	window.buffer = malloc(window.size);
+	if (window.buffer == NULL) {
+		warn("cannot allocate %zu bytes for node window", window.size);
+		goto done;
+	}
 	nodeNum = S32(headerNode->header.firstLeafNode);
 
 	if (debug) printf("first leaf nodenum = %u\n", nodeNum);
@@ -247,12 +236,13 @@ ScanExtents(VolumeObjects_t *vop, int useAltHdr)
 		if (debug) printf("Getting node %u\n", nodeNum);
 
 		/*
-		 * GetNode() puts the node we want into nodePtr;
-		 * we have ensured that the buffer is large enough
-		 * to contain at least one node, or one allocation block,
-		 * whichever is larger.
+		 * GetNode() puts the node we want into nodePtr,
+		 * reading through the window when it has to.  The
+		 * parsing stays serial:  the next node comes from
+		 * this one's forward link, and we stop as soon as
+		 * we're past the system files.
 		 */
-		rv = GetNode(vop->devp, hp, nodeNum, nodeSize, nodePtr);
+		rv = GetNode(vop->devp, hp, nodeNum, nodeSize, nodePtr, &window);
 		if (rv == -1) {
 			warnx("Cannot get node %u", nodeNum);
 			retval = -1;
@@ -265,6 +255,7 @@ ScanExtents(VolumeObjects_t *vop, int useAltHdr)
 done:
 	if (nodePtr)
 		free(nodePtr);
+	free(window.buffer);
 	return retval;
 
 }
@@ -0,0 +1,717 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <CommonCrypto/CommonDigest.h>
+
+#include "hfsmeta.h"
+#include "Snapshot.h"
+
+/*
+ * Incremental metadata snapshots.
+ *
+ * A snapshot directory holds content-addressed chunk files
+ * (chunks/<xx>/<SHA-256 of the chunk>) and one manifest per capture.
+ * Each extent is hashed in kSnapshotChunkSize pieces, aligned to the
+ * device rather than to the extent so that a piece keeps its identity
+ * when the extents around it grow or shrink.  A piece is only written
+ * if it changed since the previous manifest and no chunk with its hash
+ * is in the store yet.  The manifest lists <offset, length, hash> for
+ * every piece, which is all RestoreSnapshot() needs to rebuild a full
+ * image.
+ *
+ * Captures only ever add chunks; nothing here removes chunks that no
+ * manifest refers to any more.
+ */
+
+#ifndef MIN
+# define MIN(a, b) \
+	({ __typeof(a) __a = (a); __typeof(b) __b = (b); \
+		__a < __b ? __a : __b; })
+#endif
+
+#define kSnapshotChunkSize	(64 * 1024)
+#define kSnapshotVersion	1
+#define kLatestName		"latest"
+
+static const char kSnapshotMagic[8] = { 'H', 'C', 'S', 'N', 'A', 'P', '0', '1' };
+
+/*
+ * On-disk manifest:  a header followed by entryCount entries, sorted
+ * by offset.  All fields are big-endian.
+ */
+struct SnapshotHeader {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	chunkSize;
+	uint64_t	deviceSize;
+	uint64_t	entryCount;
+};
+
+struct SnapshotEntry {
+	uint64_t	offset;
+	uint32_t	length;
+	uint32_t	reserved;
+	uint8_t		hash[CC_SHA256_DIGEST_LENGTH];
+};
+
+/*
+ * Context for a capture:  the snapshot directory, the previous
+ * manifest (in host order) to compare against, the manifest being
+ * built, and how much was read and written.
+ */
+struct SnapshotContext {
+	char *pathname;
+	off_t deviceSize;
+	struct SnapshotEntry *prev;
+	size_t prevCount;
+	struct SnapshotEntry *entries;
+	size_t count;
+	size_t max;
+	off_t bytesRead;
+	off_t bytesWritten;
+	size_t chunksWritten;
+	size_t chunksUnchanged;
+};
+
+/*
+ * Path of the chunk file for a given hash.  The caller frees it.
+ */
+static char *
+ChunkName(const char *dir, const uint8_t *hash)
+{
+	char hex[CC_SHA256_DIGEST_LENGTH * 2 + 1];
+	char *name = NULL;
+	int i;
+
+	for (i = 0; i < CC_SHA256_DIGEST_LENGTH; i++)
+		sprintf(hex + i * 2, "%02x", hash[i]);
+	asprintf(&name, "%s/chunks/%.2s/%s", dir, hex, hex);
+	return name;
+}
+
+static int
+CompareEntries(const void *left, const void *right)
+{
+	const struct SnapshotEntry *l = left, *r = right;
+
+	if (l->offset < r->offset)
+		return -1;
+	return l->offset > r->offset;
+}
+
+/*
+ * Read a manifest, converting it to host order.  Returns the number
+ * of entries, or -1; errno is ENOENT only if there is no manifest,
+ * which is not reported here.
+ */
+static ssize_t
+ReadManifest(const char *path, struct SnapshotHeader *hdr, struct SnapshotEntry **entriesp)
+{
+	struct SnapshotEntry *entries = NULL;
+	ssize_t retval = -1;
+	FILE *fp;
+	size_t i;
+
+	*entriesp = NULL;
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT) {
+			warn("Cannot open manifest %s", path);
+			errno = EIO;
+		}
+		return -1;
+	}
+
+	if (fread(hdr, sizeof(*hdr), 1, fp) != 1 ||
+	    memcmp(hdr->magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 ||
+	    S32(hdr->version) != kSnapshotVersion) {
+		warnx("%s is not a snapshot manifest", path);
+		goto done;
+	}
+	hdr->version = S32(hdr->version);
+	hdr->chunkSize = S32(hdr->chunkSize);
+	hdr->deviceSize = S64(hdr->deviceSize);
+	hdr->entryCount = S64(hdr->entryCount);
+
+	if (hdr->entryCount > SSIZE_MAX / sizeof(*entries)) {
+		warnx("%s has an impossible entry count (%llu)", path, hdr->entryCount);
+		goto done;
+	}
+	entries = malloc(hdr->entryCount ? hdr->entryCount * sizeof(*entries) : 1);
+	if (entries == NULL) {
+		warn("Cannot allocate %llu manifest entries", hdr->entryCount);
+		goto done;
+	}
+	if (fread(entries, sizeof(*entries), hdr->entryCount, fp) != hdr->entryCount) {
+		warnx("%s is truncated", path);
+		free(entries);
+		goto done;
+	}
+	for (i = 0; i < hdr->entryCount; i++) {
+		entries[i].offset = S64(entries[i].offset);
+		entries[i].length = S32(entries[i].length);
+	}
+	*entriesp = entries;
+	retval = (ssize_t)hdr->entryCount;
+done:
+	fclose(fp);
+	if (retval == -1)
+		errno = EINVAL;
+	return retval;
+}
+
+/*
+ * Find the previous manifest's entry for the chunk at offset, if any.
+ */
+static struct SnapshotEntry *
+FindPrevEntry(struct SnapshotContext *ctx, off_t offset)
+{
+	size_t lo = 0, hi = ctx->prevCount;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ctx->prev[mid].offset < (uint64_t)offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < ctx->prevCount && ctx->prev[lo].offset == (uint64_t)offset)
+		return &ctx->prev[lo];
+	return NULL;
+}
+
+/*
+ * Put a chunk in the store, unless one with the same hash is already
+ * there.  The chunk is written under a temporary name and synced before
+ * it is renamed, so a chunk file is never seen with partial contents.
+ */
+static int
+StoreChunk(struct SnapshotContext *ctx, const uint8_t *hash, const void *buffer, size_t len)
+{
+	char *chunkName = ChunkName(ctx->pathname, hash);
+	char *tmpName = NULL;
+	char *slash;
+	int retval = -1;
+	int fd;
+
+	if (chunkName == NULL) {
+		warnx("Cannot allocate memory for chunk name");
+		return -1;
+	}
+	if (access(chunkName, F_OK) == 0) {
+		retval = 0;
+		goto done;
+	}
+
+	slash = strrchr(chunkName, '/');
+	*slash = 0;
+	if (mkdir(chunkName, 0777) == -1 && errno != EEXIST) {
+		warn("Cannot create chunk directory %s", chunkName);
+		goto done;
+	}
+	*slash = '/';
+
+	asprintf(&tmpName, "%s.tmp.%d", chunkName, getpid());
+	if (tmpName == NULL) {
+		warnx("Cannot allocate memory for chunk name");
+		goto done;
+	}
+	fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1) {
+		warn("Cannot create chunk file %s", tmpName);
+		goto done;
+	}
+	if (write(fd, buffer, len) != (ssize_t)len || fsync(fd) == -1) {
+		warn("Cannot write chunk file %s", tmpName);
+		close(fd);
+		unlink(tmpName);
+		goto done;
+	}
+	close(fd);
+	if (rename(tmpName, chunkName) == -1) {
+		warn("Cannot rename %s to %s", tmpName, chunkName);
+		unlink(tmpName);
+		goto done;
+	}
+	ctx->bytesWritten += len;
+	ctx->chunksWritten++;
+	retval = 0;
+done:
+	free(tmpName);
+	free(chunkName);
+	return retval;
+}
+
+/*
+ * Hash one chunk, store it if needed, and add it to the new manifest.
+ */
+static int
+AddSnapshotChunk(struct SnapshotContext *ctx, off_t offset, const void *buffer, size_t len)
+{
+	struct SnapshotEntry *entry, *prev;
+
+	if (ctx->count == ctx->max) {
+		size_t newMax = ctx->max ? ctx->max * 2 : 1024;
+		struct SnapshotEntry *tmp = realloc(ctx->entries, newMax * sizeof(*tmp));
+		if (tmp == NULL) {
+			warn("Cannot grow the snapshot manifest to %zu entries", newMax);
+			return -1;
+		}
+		ctx->entries = tmp;
+		ctx->max = newMax;
+	}
+	entry = &ctx->entries[ctx->count];
+	memset(entry, 0, sizeof(*entry));
+	entry->offset = offset;
+	entry->length = (uint32_t)len;
+	CC_SHA256(buffer, (CC_LONG)len, entry->hash);
+
+	prev = FindPrevEntry(ctx, offset);
+	if (prev && prev->length == len &&
+	    memcmp(prev->hash, entry->hash, sizeof(entry->hash)) == 0) {
+		// Unchanged since the last capture, so the chunk is already stored
+		ctx->chunksUnchanged++;
+	} else if (StoreChunk(ctx, entry->hash, buffer, len) == -1) {
+		return -1;
+	}
+	ctx->count++;
+	ctx->bytesRead += len;
+	return 0;
+}
+
+/*
+ * Write a given extent (<start, length> pair) from an input device to the
+ * snapshot, one device-aligned chunk at a time.
+ */
+static ssize_t
+WriteExtentToSnapshot(struct IOWrapper *context, DeviceInfo_t *devp, off_t start, off_t len, void (^bp)(off_t))
+{
+	struct SnapshotContext *ctx = context->context;
+	uint8_t *buffer = NULL;
+	ssize_t retval = 0;
+	off_t total = 0;
+
+	if (debug) printf("Snapshotting extent <%lld, %lld>\n", start, len);
+	buffer = malloc(kSnapshotChunkSize);
+	if (buffer == NULL) {
+		warn("%s(%s):  Could not allocate %d bytes for buffer", __FILE__, __FUNCTION__, kSnapshotChunkSize);
+		return -1;
+	}
+
+	while (total < len) {
+		off_t pos = start + total;
+		ssize_t amt = MIN(len - total, kSnapshotChunkSize - (pos % kSnapshotChunkSize));
+		ssize_t nread;
+
+		nread = UnalignedRead(devp, buffer, amt, pos);
+		if (nread <= 0) {
+			warn("Cannot read from device at offset %lld", pos);
+			retval = -1;
+			break;
+		}
+		if (nread < amt) {
+			warnx("Short read from source device -- got %zd, expected %zd", nread, amt);
+		}
+		if (AddSnapshotChunk(ctx, pos, buffer, nread) == -1) {
+			retval = -1;
+			break;
+		}
+		bp(nread);
+		total += nread;
+	}
+	free(buffer);
+	return retval;
+}
+
+/*
+ * A snapshot isn't a volume image, so there is nothing to read back.
+ */
+static ssize_t
+doSnapshotRead(struct IOWrapper *context, off_t start, void *buffer, off_t len)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+/*
+ * No progress is kept:  an interrupted capture is simply run again,
+ * and the chunks it already stored are not written a second time.
+ */
+static off_t
+GetProgress(struct IOWrapper *context)
+{
+	return 0;
+}
+static void
+SetProgress(struct IOWrapper *context, off_t prog)
+{
+	return;
+}
+
+/*
+ * Chunks are synced as they are stored.
+ */
+static int
+noFlush(struct IOWrapper *context)
+{
+	return 0;
+}
+
+/*
+ * The chunk store is shared by all captures, so there is nothing to clean.
+ */
+static int
+noClean(struct IOWrapper *context)
+{
+	return 0;
+}
+
+/*
+ * Initialize the IOWrapper structure for a snapshot capture.  This creates
+ * the snapshot directory (but not its parents) if needed, and loads the
+ * latest manifest in it to compare against.  A manifest for a different
+ * device size or chunk size is ignored; chunks are then only deduplicated
+ * by their hashes.
+ */
+struct IOWrapper *
+InitSnapshot(const char *path, DeviceInfo_t *devp)
+{
+	struct SnapshotContext *ctx = NULL;
+	IOWrapper_t *wrapper = NULL;
+	struct SnapshotHeader hdr;
+	char *tmpname = NULL;
+	ssize_t n;
+
+	if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+		warn("cannot create snapshot directory %s", path);
+		goto done;
+	}
+	asprintf(&tmpname, "%s/chunks", path);
+	if (tmpname == NULL)
+		goto done;
+	if (mkdir(tmpname, 0777) == -1 && errno != EEXIST) {
+		warn("cannot create chunk directory %s", tmpname);
+		goto done;
+	}
+	free(tmpname);
+	tmpname = NULL;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		warn("Cannot allocate space for snapshot context");
+		goto done;
+	}
+	ctx->pathname = strdup(path);
+	if (ctx->pathname == NULL) {
+		warn("Cannot strdup the pathname");
+		goto done;
+	}
+	ctx->deviceSize = devp->size;
+
+	asprintf(&tmpname, "%s/%s", path, kLatestName);
+	if (tmpname == NULL)
+		goto done;
+	n = ReadManifest(tmpname, &hdr, &ctx->prev);
+	if (n == -1) {
+		if (errno != ENOENT)
+			warnx("Not comparing against previous snapshot %s", tmpname);
+	} else if (hdr.deviceSize != (uint64_t)devp->size || hdr.chunkSize != kSnapshotChunkSize) {
+		warnx("Previous snapshot does not match this device; comparing chunks by hash only");
+		free(ctx->prev);
+		ctx->prev = NULL;
+	} else {
+		ctx->prevCount = n;
+		qsort(ctx->prev, ctx->prevCount, sizeof(*ctx->prev), CompareEntries);
+	}
+
+	wrapper = malloc(sizeof(*wrapper));
+	if (wrapper == NULL) {
+		warn("Cannot allocate space for snapshot wrapper");
+		goto done;
+	}
+	wrapper->writer = &WriteExtentToSnapshot;
+	wrapper->reader = &doSnapshotRead;
+	wrapper->getprog = &GetProgress;
+	wrapper->setprog = &SetProgress;
+	wrapper->flush = &noFlush;
+	wrapper->cleanup = &noClean;
+	wrapper->context = ctx;
+
+done:
+	if (wrapper == NULL && ctx) {
+		free(ctx->prev);
+		free(ctx->pathname);
+		free(ctx);
+	}
+	free(tmpname);
+	return wrapper;
+}
+
+/*
+ * Write out the manifest for the capture, point "latest" at it, and
+ * release the wrapper.  The manifest is named for the (UTC) time of
+ * the capture, with a "-<n>" suffix if that name is already taken by
+ * another capture in the same second.
+ */
+int
+FinishSnapshot(struct IOWrapper *wrapper)
+{
+	struct SnapshotContext *ctx = wrapper->context;
+	struct SnapshotHeader hdr = { 0 };
+	char name[64];
+	char *tmpName = NULL, *manifestName = NULL, *latestName = NULL;
+	time_t now = time(NULL);
+	struct tm tm;
+	FILE *fp = NULL;
+	int retval = -1;
+	size_t nameLen;
+	int seq;
+	size_t i;
+
+	nameLen = strftime(name, sizeof(name), "manifest-%Y%m%dT%H%M%SZ", gmtime_r(&now, &tm));
+	asprintf(&tmpName, "%s/.%s.%d.tmp", ctx->pathname, name, (int)getpid());
+	asprintf(&latestName, "%s/%s", ctx->pathname, kLatestName);
+	if (tmpName == NULL || latestName == NULL) {
+		warnx("Cannot allocate memory for manifest name");
+		goto done;
+	}
+
+	fp = fopen(tmpName, "w");
+	if (fp == NULL) {
+		warn("Cannot create manifest %s", tmpName);
+		goto done;
+	}
+	memcpy(hdr.magic, kSnapshotMagic, sizeof(hdr.magic));
+	hdr.version = S32(kSnapshotVersion);
+	hdr.chunkSize = S32(kSnapshotChunkSize);
+	hdr.deviceSize = S64(ctx->deviceSize);
+	hdr.entryCount = S64(ctx->count);
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto writeErr;
+	for (i = 0; i < ctx->count; i++) {
+		struct SnapshotEntry entry = ctx->entries[i];
+
+		entry.offset = S64(entry.offset);
+		entry.length = S32(entry.length);
+		if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+			goto writeErr;
+	}
+	if (fflush(fp) == EOF || fsync(fileno(fp)) == -1)
+		goto writeErr;
+	fclose(fp);
+	fp = NULL;
+
+	/*
+	 * link() fails rather than replace an existing manifest, so a second
+	 * capture in the same second gets the next suffix instead.
+	 */
+	for (seq = 0; ; seq++) {
+		if (seq)
+			snprintf(name + nameLen, sizeof(name) - nameLen, "-%d", seq);
+		free(manifestName);
+		manifestName = NULL;
+		asprintf(&manifestName, "%s/%s", ctx->pathname, name);
+		if (manifestName == NULL) {
+			warnx("Cannot allocate memory for manifest name");
+			unlink(tmpName);
+			goto done;
+		}
+		if (link(tmpName, manifestName) == 0)
+			break;
+		if (errno != EEXIST) {
+			warn("Cannot link %s to %s", tmpName, manifestName);
+			unlink(tmpName);
+			goto done;
+		}
+	}
+	unlink(tmpName);
+
+	// Swap the "latest" link over to the new manifest
+	snprintf(tmpName, strlen(tmpName) + 1, "%s/.%s.%d.tmp", ctx->pathname, kLatestName, (int)getpid());
+	unlink(tmpName);
+	if (symlink(name, tmpName) == -1 || rename(tmpName, latestName) == -1) {
+		warn("Cannot update %s", latestName);
+		goto done;
+	}
+
+	if (verbose) {
+		printf("Snapshot %s: %lld bytes in %zu chunks, %zu unchanged, %zu new (%lld bytes written, %.1f%%)\n",
+		       name, ctx->bytesRead, ctx->count, ctx->chunksUnchanged, ctx->chunksWritten, ctx->bytesWritten,
+		       ctx->bytesRead ? (100.0 * ctx->bytesWritten) / ctx->bytesRead : 0.0);
+	}
+	retval = 0;
+	goto done;
+
+writeErr:
+	warn("Cannot write manifest %s", tmpName);
+	fclose(fp);
+	fp = NULL;
+	unlink(tmpName);
+done:
+	free(tmpName);
+	free(manifestName);
+	free(latestName);
+	free(ctx->entries);
+	free(ctx->prev);
+	free(ctx->pathname);
+	free(ctx);
+	free(wrapper);
+	return retval;
+}
+
+/*
+ * Rebuild a full image from a snapshot.  path is either a snapshot
+ * directory (its latest manifest is used) or a manifest in one.  image
+ * is a file -- created, or truncated to the size of the device -- or
+ * an existing device.  Every chunk is checked against its hash before
+ * it's written.
+ */
+int
+RestoreSnapshot(const char *path, const char *image)
+{
+	struct SnapshotHeader hdr;
+	struct SnapshotEntry *entries = NULL;
+	char *dir = NULL, *manifest = NULL;
+	uint8_t *buffer = NULL;
+	struct stat sb;
+	ssize_t count;
+	off_t total = 0;
+	int retval = -1;
+	int fd = -1;
+	ssize_t i;
+
+	if (stat(path, &sb) == -1) {
+		warn("Cannot examine snapshot %s", path);
+		return -1;
+	}
+	if ((sb.st_mode & S_IFMT) == S_IFDIR) {
+		dir = strdup(path);
+		asprintf(&manifest, "%s/%s", path, kLatestName);
+	} else {
+		char *slash;
+
+		manifest = strdup(path);
+		dir = strdup(path);
+		if (dir && (slash = strrchr(dir, '/')) != NULL)
+			*slash = 0;
+		else if (dir) {
+			free(dir);
+			dir = strdup(".");
+		}
+	}
+	if (dir == NULL || manifest == NULL) {
+		warnx("Cannot allocate memory for snapshot names");
+		goto done;
+	}
+
+	count = ReadManifest(manifest, &hdr, &entries);
+	if (count == -1) {
+		if (errno == ENOENT)
+			warnx("No manifest %s", manifest);
+		goto done;
+	}
+	buffer = malloc(hdr.chunkSize);
+	if (buffer == NULL) {
+		warn("Cannot allocate %u bytes for buffer", hdr.chunkSize);
+		goto done;
+	}
+
+	fd = open(image, O_WRONLY | O_CREAT, 0666);
+	if (fd == -1) {
+		warn("Cannot open image %s", image);
+		goto done;
+	}
+	if (fstat(fd, &sb) == 0 && (sb.st_mode & S_IFMT) == S_IFREG) {
+		// Start from an all-zero (sparse) image of the right size
+		if (ftruncate(fd, 0) == -1 || ftruncate(fd, hdr.deviceSize) == -1) {
+			warn("Cannot set size of %s to %llu", image, hdr.deviceSize);
+			goto done;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		uint8_t hash[CC_SHA256_DIGEST_LENGTH];
+		char *chunkName;
+		ssize_t nread;
+		int cfd;
+
+		if (entries[i].length > hdr.chunkSize ||
+		    entries[i].offset + entries[i].length > hdr.deviceSize) {
+			warnx("Manifest %s has a bad entry <%llu, %u>", manifest, entries[i].offset, entries[i].length);
+			goto done;
+		}
+		chunkName = ChunkName(dir, entries[i].hash);
+		if (chunkName == NULL) {
+			warnx("Cannot allocate memory for chunk name");
+			goto done;
+		}
+		cfd = open(chunkName, O_RDONLY);
+		if (cfd == -1) {
+			warn("Cannot open chunk %s", chunkName);
+			free(chunkName);
+			goto done;
+		}
+		nread = pread(cfd, buffer, entries[i].length, 0);
+		close(cfd);
+		CC_SHA256(buffer, entries[i].length, hash);
+		if (nread != entries[i].length || memcmp(hash, entries[i].hash, sizeof(hash)) != 0) {
+			warnx("Chunk %s is damaged", chunkName);
+			free(chunkName);
+			goto done;
+		}
+		free(chunkName);
+		if (pwrite(fd, buffer, entries[i].length, entries[i].offset) != entries[i].length) {
+			warn("Cannot write to %s at offset %llu", image, entries[i].offset);
+			goto done;
+		}
+		total += entries[i].length;
+	}
+	if (fsync(fd) == -1) {
+		warn("Cannot sync %s", image);
+		goto done;
+	}
+	if (verbose)
+		printf("Restored %lld bytes in %zd chunks from %s\n", total, count, manifest);
+	retval = 0;
+
+done:
+	if (fd != -1)
+		close(fd);
+	free(buffer);
+	free(entries);
+	free(manifest);
+	free(dir);
+	return retval;
+}
@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
+#include <pthread.h>
 #include <removefile.h>
 
 #include <CoreFoundation/CoreFoundation.h>
@@ -29,17 +30,76 @@
 		__a < __b ? __a : __b; })
 #endif
 
+/*
+ * Writes are collected in memory a band at a time, remembering which
+ * ranges of the band were written.  When the writer moves on to another
+ * band, the finished one is queued for one of the flusher threads,
+ * which writes its dirty ranges out; nothing is synced until flush()
+ * (or a progress checkpoint), which syncs the volume once.  Since the
+ * extents are copied in sorted order, each band is normally filled and
+ * flushed exactly once.
+ */
+#define kSparseBandBuffers	4	// bands being filled or flushed
+#define kSparseFlushThreads	2
+#define kBandFDCacheSize	32	// open band files, reused LRU
+#define kProgressInterval	(128 * 1024 * 1024)	// bytes between progress checkpoints
+
+enum {
+	kBandFree = 0,
+	kBandFilling,
+	kBandQueued,
+	kBandFlushing,
+};
+
+struct SparseRange {
+	size_t start;
+	size_t end;
+};
+
+struct SparseBand {
+	int state;
+	off_t bandNum;
+	uint8_t *data;		// bandSize bytes
+	struct SparseRange *ranges;	// the parts of data that were written
+	size_t rangeCount;
+	size_t rangeMax;
+	struct SparseBand *next;	// flush queue
+};
+
+struct BandFD {
+	off_t bandNum;
+	int fd;		// -1 if the slot is empty
+	int writable;
+	int refs;
+	uint64_t lastUse;
+};
+
 /*
  * Context for the sparse bundle routines.  The path name,
- * size of the band files, and cached file descriptor and
- * band numbers, to reduce the amount of pathname lookups
- * required.
+ * size of the band files, the cache of open band files (to
+ * reduce the amount of pathname lookups required), and the
+ * band buffers and flusher threads.  lock protects the band
+ * states and the flush queue; fdLock protects the cache.
  */
 struct SparseBundleContext {
 	char *pathname;
 	size_t bandSize;
-	int cfd;	// Cached file descriptor
-	int cBandNum;	// cached bandfile number
+
+	pthread_mutex_t fdLock;
+	struct BandFD fds[kBandFDCacheSize];
+	uint64_t fdClock;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct SparseBand bands[kSparseBandBuffers];
+	struct SparseBand *cur;		// band being filled, if any
+	struct SparseBand *queueHead;
+	struct SparseBand *queueTail;
+	pthread_t threads[kSparseFlushThreads];
+	int nthreads;
+	int flushError;		// first errno from a flusher; sticky
+
+	off_t savedProgress;	// last progress value written out
 };
 
 static const int kBandSize = 8388608;
@@ -64,6 +124,352 @@ static const char *bundlePrototype =
 	"</plist>\n";
 
 
+/*
+ * Get a file descriptor for a band file, from the cache if possible.
+ * Band files opened for writing are created if needed; a band opened
+ * for reading that doesn't exist fails with ENOENT.  *slotp is set to
+ * the cache slot, or -1 if every slot was busy and the descriptor is
+ * not cached.  Pass both to ReleaseBand() when done.
+ */
+static int
+OpenBand(struct SparseBundleContext *ctx, off_t bandNum, int forWrite, int *slotp)
+{
+	struct BandFD *victim = NULL;
+	char *bandName = NULL;
+	int fd = -1;
+	int i;
+
+	*slotp = -1;
+	pthread_mutex_lock(&ctx->fdLock);
+	for (i = 0; i < kBandFDCacheSize; i++) {
+		struct BandFD *bfd = &ctx->fds[i];
+
+		if (bfd->fd != -1 && bfd->bandNum == bandNum) {
+			if (bfd->writable || !forWrite) {
+				bfd->refs++;
+				bfd->lastUse = ++ctx->fdClock;
+				*slotp = i;
+				fd = bfd->fd;
+				goto done;
+			}
+			if (bfd->refs == 0) {
+				// Open read-only, but now we need to write to it
+				close(bfd->fd);
+				bfd->fd = -1;
+			}
+		}
+		// Reuse an empty slot if there is one, else the least recently used
+		if (bfd->refs == 0) {
+			if (victim == NULL)
+				victim = bfd;
+			else if (victim->fd != -1 && (bfd->fd == -1 || bfd->lastUse < victim->lastUse))
+				victim = bfd;
+		}
+	}
+
+	asprintf(&bandName, "%s/bands/%llx", ctx->pathname, bandNum);
+	if (!bandName) {
+		warnx("Cannot allocate memory for band %s/bands/%llx", ctx->pathname, bandNum);
+		errno = ENOMEM;
+		goto done;
+	}
+	fd = open(bandName, forWrite ? (O_RDWR | O_CREAT) : O_RDONLY, 0666);
+	if (fd == -1) {
+		if (errno != ENOENT || forWrite) {
+			int t = errno;
+			warn("Cannot open band file %s", bandName);
+			errno = t;
+		}
+		goto done;
+	}
+	if (forWrite)
+		fcntl(fd, F_NOCACHE, 1);
+
+	if (victim) {
+		if (victim->fd != -1)
+			close(victim->fd);
+		victim->bandNum = bandNum;
+		victim->fd = fd;
+		victim->writable = forWrite;
+		victim->refs = 1;
+		victim->lastUse = ++ctx->fdClock;
+		*slotp = (int)(victim - ctx->fds);
+	}
+done:
+	pthread_mutex_unlock(&ctx->fdLock);
+	free(bandName);
+	return fd;
+}
+
+static void
+ReleaseBand(struct SparseBundleContext *ctx, int fd, int slot)
+{
+	if (slot == -1) {
+		close(fd);
+		return;
+	}
+	pthread_mutex_lock(&ctx->fdLock);
+	ctx->fds[slot].refs--;
+	pthread_mutex_unlock(&ctx->fdLock);
+}
+
+/*
+ * Close every cached band file.  Nothing may be using them.
+ */
+static void
+CloseBands(struct SparseBundleContext *ctx)
+{
+	int i;
+
+	pthread_mutex_lock(&ctx->fdLock);
+	for (i = 0; i < kBandFDCacheSize; i++) {
+		if (ctx->fds[i].fd != -1) {
+			close(ctx->fds[i].fd);
+			ctx->fds[i].fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&ctx->fdLock);
+}
+
+/*
+ * Write the dirty ranges of a band buffer to its band file.
+ * Returns 0, or an errno.
+ */
+static int
+FlushBand(struct SparseBundleContext *ctx, struct SparseBand *band)
+{
+	int retval = 0;
+	size_t i;
+	int slot;
+	int fd;
+
+	fd = OpenBand(ctx, band->bandNum, 1, &slot);
+	if (fd == -1)
+		return errno;
+
+	for (i = 0; i < band->rangeCount && retval == 0; i++) {
+		size_t offset = band->ranges[i].start;
+
+		while (offset < band->ranges[i].end) {
+			ssize_t nwritten = pwrite(fd, band->data + offset, band->ranges[i].end - offset, offset);
+			if (nwritten == -1) {
+				retval = errno;
+				warn("Cannot write to band file %s/bands/%llx for offset %llu for amount %zu", ctx->pathname, band->bandNum, band->bandNum * ctx->bandSize + offset, band->ranges[i].end - offset);
+				break;
+			}
+			offset += nwritten;
+		}
+	}
+	ReleaseBand(ctx, fd, slot);
+	return retval;
+}
+
+static void *
+SparseFlusher(void *arg)
+{
+	struct SparseBundleContext *ctx = arg;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		struct SparseBand *band;
+		int error;
+
+		while (ctx->queueHead == NULL)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		band = ctx->queueHead;
+		ctx->queueHead = band->next;
+		if (ctx->queueHead == NULL)
+			ctx->queueTail = NULL;
+		band->state = kBandFlushing;
+		pthread_mutex_unlock(&ctx->lock);
+
+		error = FlushBand(ctx, band);
+
+		pthread_mutex_lock(&ctx->lock);
+		if (error && ctx->flushError == 0)
+			ctx->flushError = error;
+		band->state = kBandFree;
+		pthread_cond_broadcast(&ctx->cond);
+	}
+	/* NOTREACHED */
+	return NULL;
+}
+
+/*
+ * Hand a filled band to the flushers.
+ */
+static void
+QueueBand(struct SparseBundleContext *ctx, struct SparseBand *band)
+{
+	pthread_mutex_lock(&ctx->lock);
+	band->state = kBandQueued;
+	band->next = NULL;
+	if (ctx->queueTail)
+		ctx->queueTail->next = band;
+	else
+		ctx->queueHead = band;
+	ctx->queueTail = band;
+	pthread_cond_broadcast(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Get a free band buffer to fill for bandNum.  If an earlier buffer for
+ * the same band is still queued or being flushed, wait for it, so that
+ * writes to a band file land in order.  The flusher threads are started
+ * on first use.
+ */
+static struct SparseBand *
+GetBand(struct SparseBundleContext *ctx, off_t bandNum)
+{
+	struct SparseBand *band = NULL;
+	int error;
+	int i;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->nthreads < kSparseFlushThreads) {
+		error = pthread_create(&ctx->threads[ctx->nthreads], NULL, SparseFlusher, ctx);
+		if (error != 0) {
+			if (ctx->nthreads == 0) {
+				warnc(error, "Cannot create band flusher thread");
+				errno = error;
+				goto done;
+			}
+			break;
+		}
+		pthread_detach(ctx->threads[ctx->nthreads]);
+		ctx->nthreads++;
+	}
+	for (;;) {
+		int busy = 0;
+
+		band = NULL;
+		if (ctx->flushError) {
+			errno = ctx->flushError;
+			goto done;
+		}
+		for (i = 0; i < kSparseBandBuffers; i++) {
+			struct SparseBand *b = &ctx->bands[i];
+			if (b->state == kBandFree) {
+				if (band == NULL)
+					band = b;
+			} else if (b->bandNum == bandNum) {
+				busy = 1;
+			}
+		}
+		if (band && !busy)
+			break;
+		pthread_cond_wait(&ctx->cond, &ctx->lock);
+	}
+	if (band->data == NULL) {
+		band->data = malloc(ctx->bandSize);
+		if (band->data == NULL) {
+			warn("Cannot allocate %zu bytes for band buffer", ctx->bandSize);
+			band = NULL;
+			goto done;
+		}
+	}
+	band->state = kBandFilling;
+	band->bandNum = bandNum;
+	band->rangeCount = 0;
+done:
+	pthread_mutex_unlock(&ctx->lock);
+	return band;
+}
+
+/*
+ * Note that [start, end) of a band buffer was written.  Writes arrive
+ * mostly in order, so usually this just extends the last range.
+ */
+static int
+AddBandRange(struct SparseBand *band, size_t start, size_t end)
+{
+	struct SparseRange *last = band->rangeCount ? &band->ranges[band->rangeCount - 1] : NULL;
+
+	if (last && start >= last->start && start <= last->end) {
+		if (end > last->end)
+			last->end = end;
+		return 0;
+	}
+	if (band->rangeCount == band->rangeMax) {
+		size_t newMax = band->rangeMax ? band->rangeMax * 2 : 64;
+		struct SparseRange *tmp = realloc(band->ranges, newMax * sizeof(*tmp));
+		if (tmp == NULL) {
+			warn("Cannot allocate %zu band ranges", newMax);
+			return -1;
+		}
+		band->ranges = tmp;
+		band->rangeMax = newMax;
+	}
+	band->ranges[band->rangeCount].start = start;
+	band->ranges[band->rangeCount].end = end;
+	band->rangeCount++;
+	return 0;
+}
+
+/*
+ * Queue the band being filled, and wait for all queued bands to be
+ * written to their band files.  Doesn't sync anything.
+ */
+static int
+SparseDrain(struct SparseBundleContext *ctx)
+{
+	int retval = 0;
+	int i, busy;
+
+	if (ctx->cur) {
+		QueueBand(ctx, ctx->cur);
+		ctx->cur = NULL;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	do {
+		busy = 0;
+		for (i = 0; i < kSparseBandBuffers; i++) {
+			if (ctx->bands[i].state != kBandFree)
+				busy = 1;
+		}
+		if (busy)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+	} while (busy);
+	if (ctx->flushError) {
+		errno = ctx->flushError;
+		retval = -1;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return retval;
+}
+
+/*
+ * Write out everything that's buffered, and sync the volume the bundle
+ * is on.  One volume sync is much cheaper than syncing every band file
+ * that was touched.
+ */
+static int
+doSparseFlush(struct IOWrapper *context)
+{
+	struct SparseBundleContext *ctx = context->context;
+	int retval = -1;
+	int dfd;
+
+	if (SparseDrain(ctx) == -1)
+		return -1;
+
+	dfd = open(ctx->pathname, O_RDONLY);
+	if (dfd == -1) {
+		warn("Cannot open sparse bundle %s to sync it", ctx->pathname);
+		return -1;
+	}
+	if (fsync_volume_np(dfd, FSCTL_SYNC_WAIT | FSCTL_SYNC_FULLSYNC) == 0) {
+		retval = 0;
+	} else {
+		int t = errno;
+		warn("Cannot sync the volume for %s", ctx->pathname);
+		errno = t;
+	}
+	close(dfd);
+	return retval;
+}
+
 /*
  * Read from a sparse bundle.  If the band file doesn't exist, or is shorter than
  * what we need to get from it, we pad out with 0's.
@@ -76,48 +482,41 @@ doSparseRead(struct IOWrapper *context, off_t offset, void *buffer, off_t len)
 	ssize_t nread = 0;
 	ssize_t retval = -1;
 
+	// Anything still buffered has to be in the band files first
+	if (SparseDrain(ctx) == -1)
+		goto done;
+
 	while (nread < len) {
 		off_t bandNum = (offset + nread) / blockSize;	// Which band file to use
 		off_t bandOffset = (offset + nread) % blockSize;	// how far to go into the file
 		ssize_t amount = MIN(len - nread, blockSize - bandOffset);	// How many bytes to write in this band file
-		char *bandName;
 		ssize_t n;
+		int slot;
 		int fd;
 
-		asprintf(&bandName, "%s/bands/%llx", ctx->pathname, bandNum);
-		if (!bandName) {
-			warn("Cannot allocate memory for path '%s/bands/%llx'", ctx->pathname, bandNum);
-			retval = -1;
-			goto done;
-		}
-		fd = open(bandName, O_RDONLY);
+		fd = OpenBand(ctx, bandNum, 0, &slot);
 		if (fd == -1) {
 			if (errno == ENOENT) {
 				// Doesn't exist, so we just write zeroes
-				free(bandName);
 				memset(buffer + nread, 0, amount);
 				nread += amount;
 				continue;
 			}
-			warn("Cannot open band file %s for offset %llu", bandName, offset + nread);
+			warn("Cannot open band file %s/bands/%llx for offset %llu", ctx->pathname, bandNum, offset + nread);
 			retval = -1;
-			free(bandName);
 			goto done;
 		}
 
 		n = pread(fd, (char*)buffer + nread, amount, bandOffset);
+		ReleaseBand(ctx, fd, slot);
 		if (n == -1) {
-			warn("Cannot read from band file %s for offset %llu for amount %zu", bandName, offset+nread, amount);
-			close(fd);
-			free(bandName);
+			warn("Cannot read from band file %s/bands/%llx for offset %llu for amount %zu", ctx->pathname, bandNum, offset+nread, amount);
 			goto done;
 		}
 		if (n < amount) {	// hit EOF, pad out with zeroes
-			memset(buffer + nread + amount, 0, amount - n);
+			memset(buffer + nread + n, 0, amount - n);
 		}
-		free(bandName);
-		close(fd);
-		nread += n;
+		nread += amount;
 	}
 	retval = nread;
 done:
@@ -126,7 +525,8 @@ done:
 }
 
 /*
- * Write a chunk of data to a bundle.
+ * Write a chunk of data to a bundle.  The data is only buffered; see
+ * above.
  */
 static ssize_t
 doSparseWrite(IOWrapper_t *context, off_t offset, void *buffer, off_t len)
@@ -140,58 +540,22 @@ doSparseWrite(IOWrapper_t *context, off_t offset, void *buffer, off_t len)
 		off_t bandNum = (offset + written) / blockSize;	// Which band file to use
 		off_t bandOffset = (offset + written) % blockSize;	// how far to go into the file
 		size_t amount = MIN(len - written, blockSize - bandOffset);	// How many bytes to write in this band file
-		ssize_t nwritten;
-		int fd;
-
-		if (ctx->cfd == -1 || ctx->cBandNum != bandNum) {
-			char *bandName = NULL;
 
-			if (ctx->cfd != -1) {
-				close(ctx->cfd);
-				ctx->cfd = -1;
+		if (ctx->cur == NULL || ctx->cur->bandNum != bandNum) {
+			if (ctx->cur) {
+				QueueBand(ctx, ctx->cur);
+				ctx->cur = NULL;
 			}
-			asprintf(&bandName, "%s/bands/%llx", ctx->pathname, bandNum);
-			if (!bandName) {
-				warnx("Cannot allocate memory for band %s/bands/%llx", ctx->pathname, bandNum);
-				retval = -1;
+			ctx->cur = GetBand(ctx, bandNum);
+			if (ctx->cur == NULL) {
+				warn("Cannot write to band file %s/bands/%llx for offset %llu", ctx->pathname, bandNum, offset + written);
 				goto done;
 			}
-
-			fd = open(bandName, O_WRONLY | O_CREAT, 0666);
-			if (fd == -1) {
-				warn("Cannot open band file %s for offset %llu", bandName, offset + written);
-				free(bandName);
-				retval = -1;
-				goto done;
-			}
-			/*
-			 * When we create a new band file, we sync the volume
-			 * it's on, so that we can ensure that the band file is present
-			 * on disk.  (Otherwise, with a crash, we can end up with the
-			 * data not where we expected.)  In this case, however, we probably
-			 * don't need to wait for it -- just start the sync.
-			 */
-			fsync_volume_np(fd, 0);
-			fcntl(fd, F_NOCACHE, 1);
-			free(bandName);
-			bandName = NULL;
-			ctx->cfd = fd;
-			assert(bandNum < INT_MAX);
-			ctx->cBandNum = (int)bandNum;
-		} else {
-			fd = ctx->cfd;
 		}
-		nwritten = pwrite(fd, (char*)buffer + written, amount, bandOffset);
-		if (nwritten == -1) {
-			warn("Cannot write to band file %s/band/%llx for offset %llu for amount %zu", ctx->pathname, bandNum, offset+written, amount);
-			close(fd);
-			ctx->cfd = -1;
-			retval = -1;
+		memcpy(ctx->cur->data + bandOffset, (char*)buffer + written, amount);
+		if (AddBandRange(ctx->cur, bandOffset, bandOffset + amount) == -1)
 			goto done;
-		}
-		// Sync the data out.
-		fsync(fd);
-		written += nwritten;
+		written += amount;
 	}
 	retval = written;
 done:
@@ -360,6 +724,9 @@ done:
 /*
  * Write the progress information out.  This involves writing a file in
  * the sparse bundle with the amount -- in bytes -- we've written so far.
+ * Since writes are buffered, the amount is only recorded every
+ * kProgressInterval bytes, after flushing everything before it; a
+ * restart never skips data that didn't make it out.
  */
 static void
 SetProgress(struct IOWrapper *context, off_t prog)
@@ -371,7 +738,11 @@ SetProgress(struct IOWrapper *context, off_t prog)
 	sprintf(progFile, "%s/%s", ctx->pathname, kProgressName);
 	if (prog == 0) {
 		remove(progFile);
-	} else {
+		ctx->savedProgress = 0;
+	} else if (prog >= ctx->savedProgress + kProgressInterval) {
+		if (doSparseFlush(context) == -1)
+			return;
+		ctx->savedProgress = prog;
 		fp = fopen(progFile, "w");
 		if (fp) {
 			(void)fprintf(fp, "%llu\n", prog);
@@ -396,6 +767,10 @@ doCleanup(struct IOWrapper *ctx)
 
 	sprintf(bandsDir, "%s/bands", context->pathname);
 
+	// Nothing buffered or open may outlive the band files
+	(void)SparseDrain(context);
+	CloseBands(context);
+
 	if (debug)
 		fprintf(stderr, "Cleaning up, about to call removefile\n");
 	rv = removefile(bandsDir, NULL, REMOVEFILE_RECURSIVE | REMOVEFILE_KEEP_PARENT);
@@ -512,13 +887,20 @@ InitSparseBundle(const char *path, DeviceInfo_t *devp)
 
 		wrapped_ctx = malloc(sizeof(*wrapped_ctx));
 		if (wrapped_ctx) {
+			int i;
+
 			*wrapped_ctx = ctx;
-			wrapped_ctx->cfd = -1;
+			for (i = 0; i < kBandFDCacheSize; i++)
+				wrapped_ctx->fds[i].fd = -1;
+			pthread_mutex_init(&wrapped_ctx->fdLock, NULL);
+			pthread_mutex_init(&wrapped_ctx->lock, NULL);
+			pthread_cond_init(&wrapped_ctx->cond, NULL);
 
 			wrapper->writer = &WriteExtentToSparse;
 			wrapper->reader = &doSparseRead;
 			wrapper->getprog = &GetProgress;
 			wrapper->setprog = &SetProgress;
+			wrapper->flush = &doSparseFlush;
 			wrapper->cleanup = &doCleanup;
 			wrapper->context = wrapped_ctx;
 		} else {
@@ -41,6 +41,12 @@ typedef struct DeviceInfo DeviceInfo_t;
 # define S32(x)	OSSwapBigToHostInt32(x)
 # define S64(x)	OSSwapBigToHostInt64(x)
 
+/*
+ * B-tree nodes are read in batches of (up to) this many bytes
+ * when scanning the extents, catalog, and attributes files.
+ */
+# define kNodeBatchSize	(4 * 1024 * 1024)
+
 ssize_t GetBlock(DeviceInfo_t*, off_t, uint8_t*);
 int ScanExtents(VolumeObjects_t *, int);
 
@@ -51,6 +57,8 @@ int ScanExtents(VolumeObjects_t *, int);
  * reader() is used to get some data from the destination device (e.g., the header);
  * getprog() is used to find what the stored progress was (if any);
  * setprog() is used to write out the progress status so far.
+ * flush() is called once everything has been handed to writer(), and
+ * returns once it is all on stable storage.
  * cleanup() is called when the copy is done.
  */
 struct IOWrapper {
@@ -58,6 +66,7 @@ struct IOWrapper {
 	ssize_t (*reader)(struct IOWrapper *ctx, off_t start, void *buffer, off_t len);
 	off_t (*getprog)(struct IOWrapper *ctx);
 	void (*setprog)(struct IOWrapper *ctx, off_t prog);
+	int (*flush)(struct IOWrapper *ctx);
 	int (*cleanup)(struct IOWrapper *ctx);
 	void *context;
 };
@@ -6,6 +6,7 @@
 #include <err.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/disk.h>
 #include <sys/sysctl.h>
 #include <hfs/hfs_mount.h>
@@ -13,6 +14,7 @@
 #include "hfsmeta.h"
 #include "Data.h"
 #include "Sparse.h"
+#include "Snapshot.h"
 
 /*
  * Used to automatically run a corruption program after the
@@ -55,7 +57,44 @@ static void
 usage(const char *progname)
 {
 
-	errx(kBadExit, "usage: %s [-vdpS] [-g gatherFile] [-C] [-r <bytes>] <src device> <destination>", progname);
+	errx(kBadExit, "usage: %s [-vdpS] [-g gatherFile [-j threads] [-B]] [-G <gap bytes>] [-s snapshotDir] [-C] [-r <bytes>] <src device> [<destination>]\n"
+	     "       %s -R <snapshotDir | manifest> <image>", progname, progname);
+}
+
+static double
+Now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*
+ * Write the gather file once with the single-stream path and once with
+ * the parallel pipeline, and report the throughput of each.  The second
+ * run may find the metadata in the buffer cache; use a raw device to
+ * compare cold reads.
+ */
+static void
+BenchmarkGather(const char *gather, VolumeObjects_t *vop, int nthreads)
+{
+	int runs[2] = { 1, nthreads };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct stat sb;
+		double start, elapsed;
+
+		start = Now();
+		WriteGatheredData(gather, vop, runs[i]);
+		elapsed = Now() - start;
+		if (stat(gather, &sb) == -1)
+			sb.st_size = 0;
+		printf("gather with %d thread%s: %lld bytes in %.3f seconds (%.1f MB/s), %lld bytes compressed\n",
+		       runs[i], runs[i] == 1 ? "" : "s", vop->set.byteCount, elapsed,
+		       elapsed > 0 ? vop->set.byteCount / elapsed / (1024 * 1024) : 0.0, (long long)sb.st_size);
+	}
 }
 
 int
@@ -74,8 +113,13 @@ main(int ac, char **av)
 	int force = 0;
 	int retval = kGoodExit;
 	int find_all_metadata = 0;
+	int gatherThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int benchmark = 0;
+	off_t mergeGap = 0;
+	char *snapshot = NULL;
+	char *restoreFrom = NULL;
 
-	while ((ch = getopt(ac, av, "fvdg:Spr:CA")) != -1) {
+	while ((ch = getopt(ac, av, "fvdg:j:BG:s:R:Spr:CA")) != -1) {
 		switch (ch) {
 		case 'A':	find_all_metadata = 1; break;
 		case 'v':	verbose++; break;
@@ -84,6 +128,11 @@ main(int ac, char **av)
 		case 'p':	printProgress = 1; break;
 		case 'r':	restart = strtoull(optarg, NULL, 0); break;
 		case 'g':	gather = strdup(optarg); break;
+		case 'j':	gatherThreads = atoi(optarg); break;
+		case 'B':	benchmark = 1; break;
+		case 'G':	mergeGap = strtoll(optarg, NULL, 0); break;
+		case 's':	snapshot = strdup(optarg); break;
+		case 'R':	restoreFrom = strdup(optarg); break;
 		case 'f':	force = 1; break;
 		default:	usage(progname);
 		}
@@ -92,12 +141,26 @@ main(int ac, char **av)
 	ac -= optind;
 	av += optind;
 
+	/*
+	 * Restoring doesn't involve a source device:  the snapshot
+	 * has everything needed to rebuild the image.
+	 */
+	if (restoreFrom) {
+		if (ac != 1)
+			usage(progname);
+		if (RestoreSnapshot(restoreFrom, av[0]) == -1)
+			errx(kBadExit, "cannot restore %s from snapshot %s", av[0], restoreFrom);
+		return kGoodExit;
+	}
+
 	if (ac == 0 || ac > 2) {
 		usage(progname);
 	}
 	src = av[0];
 	if (ac == 2)
 		dst = av[1];
+	if (gatherThreads < 1)
+		gatherThreads = 1;
 
 	// Start by opening the input device
 	devp = OpenDevice(src, 1);
@@ -110,6 +173,12 @@ main(int ac, char **av)
 
 	// Start creating the in-core volume list
 	vop = InitVolumeObject(devp, vdp);
+	/*
+	 * Extents closer than this are copied as one, gap included;
+	 * this has to be set before any extents are added.
+	 */
+	if (mergeGap > 0)
+		vop->set.gap = mergeGap;
 
 	// Add the volume headers
 	if (AddHeaders(vop, 0) == 0) {
@@ -133,14 +202,39 @@ main(int ac, char **av)
 
 	if (debug)
 		PrintVolumeObject(vop);
+	if (verbose)
+		PrintExtentSchedule(vop);
 
 	if (printEstimate) {
-		printf("Estimate %llu\n", vop->byteCount);
+		printf("Estimate %llu\n", vop->set.byteCount);
 	}
 
 	// Create a gatherHFS-compatible file, if requested.
 	if (gather) {
-		WriteGatheredData(gather, vop);
+		if (benchmark)
+			BenchmarkGather(gather, vop, gatherThreads);
+		else
+			WriteGatheredData(gather, vop, gatherThreads);
+	}
+
+	/*
+	 * Capture an incremental snapshot, if requested.  Every extent
+	 * is still read and hashed, but only chunks that changed since
+	 * the previous capture are written.
+	 */
+	if (snapshot) {
+		IOWrapper_t *swrapper = InitSnapshot(snapshot, devp);
+
+		if (swrapper == NULL) {
+			errx(kBadExit, "cannot initialize snapshot directory %s", snapshot);
+		}
+		if (CopyObjectsToDest(vop, swrapper, 0) == -1) {
+			retval = (errno == EIO) ? kCopyIOExit : (errno == EINTR) ? kIntrExit : kBadExit;
+			err(retval, "Snapshot of %s failed", src);
+		}
+		if (FinishSnapshot(swrapper) == -1) {
+			errx(kBadExit, "cannot write snapshot manifest in %s", snapshot);
+		}
 	}
 
 	/*
@@ -165,8 +259,8 @@ main(int ac, char **av)
 			struct statfs sfs;
 			if (statfs(dst, &sfs) != -1) {
 				off_t freeSpace = (off_t)sfs.f_bsize * (off_t)sfs.f_bfree;
-				if (freeSpace < (vop->byteCount - restart)) {
-					errx(kNoSpaceExit, "free space (%lld) < required space (%lld)", freeSpace, vop->byteCount - restart);
+				if (freeSpace < (vop->set.byteCount - restart)) {
+					errx(kNoSpaceExit, "free space (%lld) < required space (%lld)", freeSpace, vop->set.byteCount - restart);
 				}
 			}
 		}
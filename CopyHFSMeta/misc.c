@@ -54,12 +54,87 @@ InitVolumeObject(struct DeviceInfo *devp, struct VolumeDescriptor *vdp)
 		retval->count = 0;
 		retval->byteCount = 0;
 		retval->list = NULL;
+		memset(&retval->set, 0, sizeof(retval->set));
 	}
 
 done:
 	return retval;
 }
 
+/*
+ * Find the first extent in the set whose end, plus the merge gap,
+ * reaches start.  Since the set is sorted and its extents are more
+ * than gap bytes apart, the ends are sorted as well.
+ */
+static size_t
+FindExtentSetSlot(ExtentSet_t *set, off_t start)
+{
+	size_t lo = 0, hi = set->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		Extents_t *ep = &set->extents[mid];
+
+		if (ep->base + ep->length + set->gap < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Add an extent to the sorted set, merging it with every extent it
+ * overlaps, touches, or comes within gap bytes of.
+ */
+static void
+AddToExtentSet(ExtentSet_t *set, off_t start, off_t length, unsigned int fid)
+{
+	off_t end = start + length;
+	size_t first, last;
+
+	if (length <= 0)
+		return;
+
+	first = FindExtentSetSlot(set, start);
+	for (last = first; last < set->count; last++) {
+		Extents_t *ep = &set->extents[last];
+
+		if (ep->base > end + set->gap)
+			break;
+		if (ep->base < start)
+			start = ep->base;
+		if (ep->base + ep->length > end)
+			end = ep->base + ep->length;
+		if (ep->fid != fid)
+			fid = 0;
+		set->byteCount -= ep->length;
+	}
+
+	if (first == last) {
+		// Nothing to merge with, so make room for a new entry
+		if (set->count == set->max) {
+			size_t newMax = set->max ? set->max * 2 : kExtentCount;
+			Extents_t *tmp = realloc(set->extents, newMax * sizeof(*tmp));
+			if (tmp == NULL) {
+				err(1, "cannot grow the sorted extent set to %zu entries", newMax);
+			}
+			set->extents = tmp;
+			set->max = newMax;
+		}
+		memmove(&set->extents[first + 1], &set->extents[first], (set->count - first) * sizeof(Extents_t));
+		set->count++;
+	} else if (last - first > 1) {
+		// Collapse the merged entries into the first one
+		memmove(&set->extents[first + 1], &set->extents[last], (set->count - last) * sizeof(Extents_t));
+		set->count -= (last - first - 1);
+	}
+	set->extents[first].base = start;
+	set->extents[first].length = end - start;
+	set->extents[first].fid = fid;
+	set->byteCount += end - start;
+}
+
 /*
  * Add an extent (<start, length> pair) to a volume list.
  * Note that this doesn't try to see if an extent is already
@@ -68,6 +143,10 @@ done:
  * in groups of kExtentCount; the goal here is to minimize the
  * number of objects we allocate, while still trying to keep
  * the waste memory allocation low.
+ *
+ * The extent is also merged into the sorted set (vdp->set),
+ * which is what actually gets copied; the list keeps the
+ * per-file extents for FindOtherMetadata().
  */
 __private_extern__
 int
@@ -110,6 +189,7 @@ AddExtentForFile(VolumeObjects_t *vdp, off_t start, off_t length, unsigned int f
 	}
 	vdp->count++;
 	vdp->byteCount += length;
+	AddToExtentSet(&vdp->set, start, length, fid);
 
 done:
 	return retval;
@@ -121,6 +201,7 @@ void
 PrintVolumeObject(VolumeObjects_t *vop)
 {
 	ExtentList_t *exts;
+	size_t i;
 
 	printf("Volume Information\n");
 	if (vop->devp) {
@@ -140,12 +221,59 @@ PrintVolumeObject(VolumeObjects_t *vop)
 			printf("\t\t<%lld, %lld> (file %u)\n", exts->extents[indx].base, exts->extents[indx].length, exts->extents[indx].fid);
 		}
 	}
+	printf("\tSorted extent set (gap %lld): %zu extents, %lld bytes\n", vop->set.gap, vop->set.count, vop->set.byteCount);
+	for (i = 0; i < vop->set.count; i++) {
+		Extents_t *ep = &vop->set.extents[i];
+		printf("\t\t<%lld, %lld> (file %u)\n", ep->base, ep->length, ep->fid);
+	}
 	return;
 }
 
+/*
+ * Report what sorting and merging the extents bought us:  the number of
+ * reads, and the total distance the source has to seek between them,
+ * for the extents in the order they were found versus the sorted set.
+ */
+__private_extern__
+void
+PrintExtentSchedule(VolumeObjects_t *vop)
+{
+	ExtentList_t *exts;
+	size_t indx;
+	size_t rawCount = 0;
+	off_t rawSeek = 0, setSeek = 0, pos = 0;
+
+	for (exts = vop->list;
+	     exts;
+	     exts = exts->next) {
+		for (indx = 0; indx < exts->count; indx++) {
+			Extents_t *ep = &exts->extents[indx];
+			if (ep->length == 0)
+				continue;
+			rawSeek += (ep->base > pos) ? ep->base - pos : pos - ep->base;
+			pos = ep->base + ep->length;
+			rawCount++;
+		}
+	}
+	for (indx = 0, pos = 0; indx < vop->set.count; indx++) {
+		Extents_t *ep = &vop->set.extents[indx];
+		setSeek += ep->base - pos;
+		pos = ep->base + ep->length;
+	}
+
+	printf("Extents as found: %zu reads, %lld bytes, %lld bytes of seeking\n", rawCount, vop->byteCount, rawSeek);
+	printf("Sorted and merged (gap %lld): %zu reads, %lld bytes, %lld bytes of seeking\n",
+	       vop->set.gap, vop->set.count, vop->set.byteCount, setSeek);
+	if (rawCount && rawSeek)
+		printf("\t%.1f%% fewer reads, %.1f%% less seeking\n",
+		       100.0 * (double)(rawCount - vop->set.count) / rawCount,
+		       100.0 * (double)(rawSeek - setSeek) / rawSeek);
+}
+
 /*
  * The main routine:  given a Volume descriptor, copy the metadata from it
- * to the given destination object (a device or sparse bundle).  It keeps
+ * to the given destination object (a device or sparse bundle), in the
+ * order of the sorted extent set so the source is read front to back.  It keeps
  * track of progress, and also takes an amount to skip (which happens if it's
  * resuming an earlier, interrupted copy).
  */
@@ -153,78 +281,81 @@ __private_extern__
 int
 CopyObjectsToDest(VolumeObjects_t *vop, struct IOWrapper *wrapper, off_t skip)
 {
-	ExtentList_t *exts;
+	size_t indx;
 	off_t total = 0;
 
 	if (skip == 0) {
 		wrapper->cleanup(wrapper);
 	}
-	for (exts = vop->list;
-	     exts;
-	     exts = exts->next) {
-		int indx;
-		for (indx = 0; indx < exts->count; indx++) {
-			off_t start = exts->extents[indx].base;
-			off_t len = exts->extents[indx].length;
-			if (skip < len) {
-				__block off_t totalWritten;
-				void (^bp)(off_t);
-
-				if (skip) {
-					off_t amt = MIN(skip, len);
-					len -= amt;
-					start += amt;
-					total += amt;
-					skip -= amt;
-					wrapper->setprog(wrapper, total);
+	for (indx = 0; indx < vop->set.count; indx++) {
+		off_t start = vop->set.extents[indx].base;
+		off_t len = vop->set.extents[indx].length;
+		if (skip < len) {
+			__block off_t totalWritten;
+			void (^bp)(off_t);
+
+			if (skip) {
+				off_t amt = MIN(skip, len);
+				len -= amt;
+				start += amt;
+				total += amt;
+				skip -= amt;
+				wrapper->setprog(wrapper, total);
+				if (debug)
+					printf("* * * Wrote %lld of %lld\n", total, vop->set.byteCount);
+				else
+					printf("%d%%\n", (int)((total * 100) / vop->set.byteCount));
+				fflush(stdout);
+			}
+			totalWritten = total;
+			if (printProgress) {
+				bp = ^(off_t amt) {
+					totalWritten += amt;
+					wrapper->setprog(wrapper, totalWritten);
 					if (debug)
-						printf("* * * Wrote %lld of %lld\n", total, vop->byteCount);
+						printf("* * Wrote %lld of %lld (%d%%)\n", totalWritten, vop->set.byteCount, (int)((totalWritten * 100) / vop->set.byteCount));
 					else
-						printf("%d%%\n", (int)((total * 100) / vop->byteCount));
+						printf("%d%%\n", (int)((totalWritten * 100) / vop->set.byteCount));
 					fflush(stdout);
-				}
-				totalWritten = total;
-				if (printProgress) {
-					bp = ^(off_t amt) {
-						totalWritten += amt;
-						wrapper->setprog(wrapper, totalWritten);
-						if (debug)
-							printf("* * Wrote %lld of %lld (%d%%)\n", totalWritten, vop->byteCount, (int)((totalWritten * 100) / vop->byteCount));
-						else
-							printf("%d%%\n", (int)((totalWritten * 100) / vop->byteCount));
-						fflush(stdout);
-						return;
-					};
-				} else {
-					bp = ^(off_t amt) {
-						totalWritten += amt;
-						return;
-					};
-				}
-				if (wrapper->writer(wrapper, vop->devp, start, len, bp) == -1) {
-					int t = errno;
-					if (verbose)
-						warnx("Writing extent <%lld, %lld> failed", start, len);
-					errno = t;
-					return -1;
-				}
-				total = totalWritten;
+					return;
+				};
 			} else {
-				skip -= len;
-				total += len;
-				if (printProgress) {
-					wrapper->setprog(wrapper, total);
-					if (debug)
-						printf("Wrote %lld of %lld\n", total, vop->byteCount);
-					else
-						printf("%d%%\n", (int)((total * 100) / vop->byteCount));
-					fflush(stdout);
-				}
+				bp = ^(off_t amt) {
+					totalWritten += amt;
+					return;
+				};
+			}
+			if (wrapper->writer(wrapper, vop->devp, start, len, bp) == -1) {
+				int t = errno;
+				if (verbose)
+					warnx("Writing extent <%lld, %lld> failed", start, len);
+				errno = t;
+				return -1;
+			}
+			total = totalWritten;
+		} else {
+			skip -= len;
+			total += len;
+			if (printProgress) {
+				wrapper->setprog(wrapper, total);
+				if (debug)
+					printf("Wrote %lld of %lld\n", total, vop->set.byteCount);
+				else
+					printf("%d%%\n", (int)((total * 100) / vop->set.byteCount));
+				fflush(stdout);
 			}
 		}
 	}
 
-	if (total == vop->byteCount) {
+	if (wrapper->flush(wrapper) == -1) {
+		int t = errno;
+		if (verbose)
+			warn("Flushing the destination failed");
+		errno = t;
+		return -1;
+	}
+
+	if (total == vop->set.byteCount) {
 		wrapper->setprog(wrapper, 0);	// remove progress
 	}
 
@@ -9,10 +9,21 @@
 #include <sys/disk.h>
 #include <sys/sysctl.h>
 #include <hfs/hfs_mount.h>
+#include <pthread.h>
 #include <Block.h>
 #include "hfsmeta.h"
 #include "Data.h"
 
+#ifndef MIN
+# define MIN(a, b) \
+	({ __typeof(a) __a = (a); __typeof(b) __b = (b); \
+		__a < __b ? __a : __b; })
+#endif
+#ifndef MAX
+# define MAX(a, b) \
+	({ __typeof(a) __a = (a); __typeof(b) __b = (b); __a > __b ? __a : __b; })
+#endif
+
 /*
  * Open the source device.  In addition to opening the device,
  * this also attempts to flush the journal, and then sets up a
@@ -426,6 +437,281 @@ ScanAttrNode(VolumeObjects_t *vop, uint8_t *buffer, size_t nodeSize, extent_hand
 }
 
 
+/*
+ * FindOtherMetadata() reads the catalog and attributes B-trees in
+ * batches of up to kNodeBatchSize bytes, and parses the nodes on a pool
+ * of worker threads.  As in the gather pipeline, batches are claimed in
+ * order, and batch n always uses slot n % nslots; each slot collects the
+ * extents its nodes describe, and the calling thread hands them to the
+ * extent handler in order, so the handler is never called concurrently
+ * and sees the same sequence it would from a serial scan.
+ */
+#define kScanMaxThreads		8
+#define kScanSlotsPerThread	2
+
+typedef int (*node_scanner_t)(VolumeObjects_t *, uint8_t *, size_t, extent_handler_t);
+
+/*
+ * One B-tree extent to scan.
+ */
+struct ScanJob {
+	off_t start;
+	off_t len;
+	size_t nodeSize;
+	node_scanner_t func;
+};
+
+struct ScanResult {
+	int fid;
+	off_t start;
+	off_t len;
+};
+
+enum {
+	kScanSlotFree = 0,
+	kScanSlotBusy,
+	kScanSlotReady,
+};
+
+struct ScanSlot {
+	int state;
+	struct ScanJob *job;
+	off_t start;		// device offset of this batch
+	size_t len;
+	uint8_t *buffer;
+	size_t bufSize;
+	struct ScanResult *results;
+	size_t count;
+	size_t max;
+	int error;		// non-zero return from the node scanner
+};
+
+struct ScanPipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	VolumeObjects_t *vop;
+
+	struct ScanJob *jobs;
+	size_t njobs;
+	size_t jobIndx;		// next unclaimed batch
+	off_t jobOffset;
+	int allClaimed;
+
+	uint64_t nextSeq;	// next batch to claim
+	uint64_t readSeq;	// next batch the collector wants
+	int stop;
+
+	int nslots;
+	struct ScanSlot *slots;
+};
+
+static int
+CompareScanJobs(const void *left, const void *right)
+{
+	const struct ScanJob *l = left, *r = right;
+
+	if (l->start != r->start)
+		return (l->start < r->start) ? -1 : 1;
+	if (l->len != r->len)
+		return (l->len < r->len) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Claim the next batch.  Called with the lock held; returns NULL once
+ * everything has been claimed or the pipeline stopped.
+ */
+static struct ScanSlot *
+ScanClaim(struct ScanPipeline *sp)
+{
+	struct ScanSlot *slot;
+	struct ScanJob *job;
+	size_t batch;
+
+	while (!sp->stop && !sp->allClaimed &&
+	       sp->nextSeq >= sp->readSeq + sp->nslots)
+		pthread_cond_wait(&sp->cond, &sp->lock);
+	if (sp->stop || sp->allClaimed)
+		return NULL;
+
+	job = &sp->jobs[sp->jobIndx];
+	// Whole nodes only; the node sizes all divide kNodeBatchSize
+	batch = kNodeBatchSize - (kNodeBatchSize % job->nodeSize);
+	slot = &sp->slots[sp->nextSeq++ % sp->nslots];
+	slot->state = kScanSlotBusy;
+	slot->job = job;
+	slot->start = job->start + sp->jobOffset;
+	slot->len = (size_t)MIN((off_t)batch, job->len - sp->jobOffset);
+	slot->count = 0;
+	slot->error = 0;
+
+	sp->jobOffset += slot->len;
+	if (sp->jobOffset >= job->len) {
+		sp->jobOffset = 0;
+		if (++sp->jobIndx == sp->njobs)
+			sp->allClaimed = 1;
+	}
+	return slot;
+}
+
+/*
+ * The thread-safe half of the collector:  each slot is only touched by
+ * the worker that claimed it until it's marked ready.
+ */
+static int
+ScanCollect(struct ScanSlot *slot, int fid, off_t start, off_t len)
+{
+	if (slot->count == slot->max) {
+		size_t newMax = slot->max ? slot->max * 2 : 64;
+		struct ScanResult *tmp = realloc(slot->results, newMax * sizeof(*tmp));
+		if (tmp == NULL) {
+			warn("Cannot allocate space for %zu extents", newMax);
+			return ENOMEM;
+		}
+		slot->results = tmp;
+		slot->max = newMax;
+	}
+	slot->results[slot->count].fid = fid;
+	slot->results[slot->count].start = start;
+	slot->results[slot->count].len = len;
+	slot->count++;
+	return 0;
+}
+
+static void *
+ScanWorker(void *arg)
+{
+	struct ScanPipeline *sp = arg;
+	DeviceInfo_t *devp = sp->vop->devp;
+
+	pthread_mutex_lock(&sp->lock);
+	for (;;) {
+		struct ScanSlot *slot = ScanClaim(sp);
+		ssize_t nread;
+
+		if (slot == NULL)
+			break;
+		pthread_mutex_unlock(&sp->lock);
+
+		if (slot->bufSize < slot->len) {
+			free(slot->buffer);
+			slot->buffer = malloc(slot->len);
+			slot->bufSize = slot->buffer ? slot->len : 0;
+		}
+		if (slot->buffer == NULL) {
+			warn("Cannot allocate %zu bytes for buffer, skipping node scan", slot->len);
+		} else if ((nread = UnalignedRead(devp, slot->buffer, slot->len, slot->start)) != (ssize_t)slot->len) {
+			warn("Attempted to read %zu bytes, only read %zd, skipping node scan", slot->len, nread);
+		} else {
+			size_t nodeSize = slot->job->nodeSize;
+			uint8_t *curPtr;
+
+			for (curPtr = slot->buffer;
+			     curPtr + nodeSize <= slot->buffer + slot->len && slot->error == 0;
+			     curPtr += nodeSize) {
+				slot->error = (*slot->job->func)(sp->vop, curPtr, nodeSize, ^(int fid, off_t start, off_t len) {
+						return ScanCollect(slot, fid, start, len);
+					});
+			}
+		}
+
+		pthread_mutex_lock(&sp->lock);
+		slot->state = kScanSlotReady;
+		pthread_cond_broadcast(&sp->cond);
+	}
+	pthread_mutex_unlock(&sp->lock);
+	return NULL;
+}
+
+/*
+ * Run the scan pipeline over the jobs, feeding what it finds to the
+ * handler from the calling thread.
+ */
+static int
+ScanBTreeExtents(VolumeObjects_t *vop, struct ScanJob *jobs, size_t njobs, extent_handler_t handler)
+{
+	struct ScanPipeline sp = { 0 };
+	pthread_t threads[kScanMaxThreads];
+	int nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int nstarted = 0;
+	int retval = 0;
+	int i;
+
+	if (njobs == 0)
+		return 0;
+	nthreads = MAX(1, MIN(nthreads, kScanMaxThreads));
+
+	pthread_mutex_init(&sp.lock, NULL);
+	pthread_cond_init(&sp.cond, NULL);
+	sp.vop = vop;
+	sp.jobs = jobs;
+	sp.njobs = njobs;
+	sp.nslots = nthreads * kScanSlotsPerThread;
+	sp.slots = calloc(sp.nslots, sizeof(*sp.slots));
+	if (sp.slots == NULL) {
+		warn("Cannot allocate node scan slots");
+		retval = ENOMEM;
+		goto done;
+	}
+
+	for (nstarted = 0; nstarted < nthreads; nstarted++) {
+		int error = pthread_create(&threads[nstarted], NULL, ScanWorker, &sp);
+		if (error) {
+			warnc(error, "Cannot create node scan thread");
+			if (nstarted == 0) {
+				retval = error;
+				goto done;
+			}
+			break;
+		}
+	}
+
+	/* Hand the collected extents to the handler, in order */
+	pthread_mutex_lock(&sp.lock);
+	for (;;) {
+		struct ScanSlot *slot = &sp.slots[sp.readSeq % sp.nslots];
+		size_t r;
+
+		if (sp.allClaimed && sp.readSeq == sp.nextSeq)
+			break;
+		if (sp.readSeq == sp.nextSeq || slot->state != kScanSlotReady) {
+			pthread_cond_wait(&sp.cond, &sp.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&sp.lock);
+
+		for (r = 0; r < slot->count && retval == 0; r++)
+			retval = handler(slot->results[r].fid, slot->results[r].start, slot->results[r].len);
+		if (retval == 0)
+			retval = slot->error;
+
+		pthread_mutex_lock(&sp.lock);
+		if (retval != 0)
+			break;
+		slot->state = kScanSlotFree;
+		sp.readSeq++;
+		pthread_cond_broadcast(&sp.cond);
+	}
+	sp.stop = 1;
+	pthread_cond_broadcast(&sp.cond);
+	pthread_mutex_unlock(&sp.lock);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+
+done:
+	if (sp.slots) {
+		for (i = 0; i < sp.nslots; i++) {
+			free(sp.slots[i].buffer);
+			free(sp.slots[i].results);
+		}
+		free(sp.slots);
+	}
+	pthread_cond_destroy(&sp.cond);
+	pthread_mutex_destroy(&sp.lock);
+	return retval;
+}
+
 /*
  * Given a VolumeObject_t, search for the other metadata that
  * aren't described by the system files, but rather in the
@@ -445,6 +731,8 @@ FindOtherMetadata(VolumeObjects_t *vop, extent_handler_t handler)
 	uint8_t *tBuffer;
 	BTHeaderRec *hdp;
 	BTNodeDescriptor *ndp;
+	struct ScanJob *jobs = NULL;
+	size_t njobs = 0, maxJobs = 0;
 	int retval = 0;
 
 	tBuffer = calloc(1, vop->devp->blockSize);
@@ -496,9 +784,10 @@ FindOtherMetadata(VolumeObjects_t *vop, extent_handler_t handler)
 		fprintf(stderr, "Catalog node size = %zu, attributes node size = %zu\n", catNodeSize, attrNodeSize);
 
 	/*
-	 * We start reading the extents now.
-	 *
-	 * This is a lot of duplicated code, unfortunately.
+	 * Collect the catalog and attributes file extents first:  the handler
+	 * adds to the list while we scan, and nothing it adds needs scanning.
+	 * Sorting them (and dropping the duplicates the alternate header can
+	 * contribute) makes the reads go front to back.
 	 */
 	ExtentList_t *exts;
 	for (exts = vop->list;
@@ -507,53 +796,47 @@ FindOtherMetadata(VolumeObjects_t *vop, extent_handler_t handler)
 		size_t indx;
 		
 		for (indx = 0; indx < exts->count; indx++) {
-			off_t start = exts->extents[indx].base;
-			off_t len = exts->extents[indx].length;
-			off_t nread = 0;
-			if (exts->extents[indx].fid == 0) {
-				continue;	// Unknown file, skip
-			} else {
-				if (debug) fprintf(stderr, "%s:  fid = %u, start = %llu, len = %llu\n", __FUNCTION__, exts->extents[indx].fid, start, len);
-				while (nread < len) {
-					size_t bufSize;
-					uint8_t *buffer;
-					bufSize = MIN(len - nread, 1024 * 1024);	// Read 1mbyte max
-					buffer = calloc(1, bufSize);
-					if (buffer == NULL) {
-						warn("Cannot allocate %zu bytes for buffer, skipping node scan", bufSize);
-					} else {
-						ssize_t t = UnalignedRead(vop->devp, buffer, bufSize, start + nread);
-						if (t != bufSize) {
-							warn("Attempted to read %zu bytes, only read %zd, skipping node scan", bufSize, t);
-						} else {
-							uint8_t *curPtr = buffer, *endPtr = (buffer + bufSize);
-							size_t nodeSize = 0;
-							int (*func)(VolumeObjects_t *, uint8_t *, size_t, extent_handler_t) = NULL;
-							if (exts->extents[indx].fid == kHFSCatalogFileID) {
-								func = ScanCatalogNode;
-								nodeSize = catNodeSize;
-							} else if (exts->extents[indx].fid == kHFSAttributesFileID) {
-								func = ScanAttrNode;
-								nodeSize = attrNodeSize;
-							}
-							if (func) {
-								while (curPtr < endPtr && retval == 0) {
-									retval = (*func)(vop, curPtr, nodeSize, handler);
-									curPtr += nodeSize;
-								}
-							}
-						}
-						free(buffer);
-					}
-					if (retval != 0)
-						goto done;
-					nread += bufSize;
+			struct ScanJob job = { exts->extents[indx].base, exts->extents[indx].length, 0, NULL };
+
+			if (exts->extents[indx].fid == kHFSCatalogFileID) {
+				job.func = ScanCatalogNode;
+				job.nodeSize = catNodeSize;
+			} else if (exts->extents[indx].fid == kHFSAttributesFileID) {
+				job.func = ScanAttrNode;
+				job.nodeSize = attrNodeSize;
+			}
+			if (job.func == NULL || job.nodeSize == 0 || job.len == 0)
+				continue;	// Not a B-tree we scan, or we couldn't read its header
+			if (debug) fprintf(stderr, "%s:  fid = %u, start = %llu, len = %llu\n", __FUNCTION__, exts->extents[indx].fid, job.start, job.len);
+			if (njobs == maxJobs) {
+				size_t newMax = maxJobs ? maxJobs * 2 : 16;
+				struct ScanJob *tmp = realloc(jobs, newMax * sizeof(*tmp));
+				if (tmp == NULL) {
+					warn("Cannot allocate space for %zu B-tree extents", newMax);
+					retval = ENOMEM;
+					goto done;
 				}
+				jobs = tmp;
+				maxJobs = newMax;
 			}
+			jobs[njobs++] = job;
 		}
 	}
+	if (njobs > 1) {
+		size_t i, n = 1;
+
+		qsort(jobs, njobs, sizeof(*jobs), CompareScanJobs);
+		for (i = 1; i < njobs; i++) {
+			if (CompareScanJobs(&jobs[i], &jobs[n - 1]) != 0)
+				jobs[n++] = jobs[i];
+		}
+		njobs = n;
+	}
+
+	retval = ScanBTreeExtents(vop, jobs, njobs, handler);
 
 done:
+	free(jobs);
 	if (tBuffer)
 		free(tBuffer);
 	return retval;
@@ -643,6 +926,7 @@ ReleaseVolumeObjects(VolumeObjects_t *vop)
 			free(extList);
 			extList = next;
 		}
+		free(vop->set.extents);
 		free(vop);
 	}
 }
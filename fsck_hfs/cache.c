@@ -40,12 +40,36 @@
 
 #define CACHE_DEBUG  0
 
+/*
+ * CacheShardOf
+ *
+ *  Find the shard that owns the cache block at the given offset.
+ */
+static inline CacheShard_t *
+CacheShardOf (Cache_t *cache, uint64_t off)
+{
+	return (&cache->Shards[(off / cache->BlockSize) & (cache->ShardCount - 1)]);
+}
+
+/*
+ * CacheHashOf
+ *
+ *  Hash bucket of the cache block at the given offset, within its shard.
+ */
+static inline uint32_t
+CacheHashOf (CacheShard_t *shard, uint64_t off)
+{
+	Cache_t *	cache = shard->Cache;
+
+	return ((uint32_t)((off / cache->BlockSize / cache->ShardCount) & (shard->HashSize - 1)));
+}
+
 /*
  * CacheAllocBlock
  *
  *  Allocate an unused cache block.
  */
-void *CacheAllocBlock (Cache_t *cache);
+void *CacheAllocBlock (CacheShard_t *shard);
 
 /*
  * CacheFreeBlock
@@ -53,7 +77,7 @@ void *CacheAllocBlock (Cache_t *cache);
  *  Release an active cache block.
  */
 static int 
-CacheFreeBlock( Cache_t *cache, Tag_t *tag );
+CacheFreeBlock( CacheShard_t *shard, Tag_t *tag );
 
 /*
  * CacheLookup
@@ -63,6 +87,17 @@ CacheFreeBlock( Cache_t *cache, Tag_t *tag );
  */
 int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag);
 
+/*
+ * CacheLookupShard
+ *
+ *  CacheLookup within a shard whose lock the caller holds.  A block that
+ *  has to be loaded is filled from the caller's data (if any) rather than
+ *  read from disk; that is how readahead puts blocks into the cache.
+ *  Demand lookups (the ones that read data for a client) are counted in the
+ *  shard's hit statistics.
+ */
+static int CacheLookupShard (CacheShard_t *shard, uint64_t off, Tag_t **tag, const void *data, int demand);
+
 /*
  * CacheRawRead
  *
@@ -86,12 +121,20 @@ int CacheRawWrite (Cache_t *cache, uint64_t off, uint32_t len, void *buf);
 static int
 CacheFlushRange( Cache_t *cache, uint64_t start, uint64_t len, int remove);
 
+/*
+ * CacheReport
+ *
+ *  Print the cache statistics.
+ */
+static void CacheReport (Cache_t *cache);
+
 /*
  * LRUInit
  *
- *  Initializes the LRU data structures.
+ *  Initializes the LRU data structures for a shard of the given number of
+ *  cache blocks.
  */
-static int LRUInit (LRU_t *lru);
+static int LRUInit (LRU_t *lru, uint32_t blocks);
 
 /*
  * LRUDestroy
@@ -103,25 +146,36 @@ static int LRUInit (LRU_t *lru);
  */
 static int LRUDestroy (LRU_t *lru);
 
+/*
+ * LRUDetach
+ *
+ *  Takes a node off whichever list it is on, if any.
+ */
+static void LRUDetach (LRUNode_t *node);
+
 /*
  * LRUHit
  *
  *  Registers data activity on the given node. If the node is already in the
  *  LRU, it is moved to the front. Otherwise, it is inserted at the front.
+ *  Nodes in the In queue are not moved, since it is a FIFO.
  *
  *  NOTE: If the node is not in the LRU, we assume that its pointers are NULL.
  */
 static int LRUHit (LRU_t *lru, LRUNode_t *node, int age);
 
 /*
- * LRUEvict
+ * LRURemove
  *
- *  Chooses a buffer to release.
+ *  Takes a node out of the replacement queues for good.
+ */
+static void LRURemove (LRU_t *lru, LRUNode_t *node);
+
+/*
+ * LRUEvict
  *
- *  TODO: Under extreme conditions, it should be possible to release the buffer
- *        of an actively referenced cache buffer, leaving the tag behind as a
- *        placeholder. This would be required for implementing 2Q-LRU
- *        replacement.
+ *  Chooses a buffer to release.  Blocks evicted from the In queue leave
+ *  their tag behind on the Out queue.
  */
 static int LRUEvict (LRU_t *lru, LRUNode_t *node);
 
@@ -192,34 +246,41 @@ out:
  *  be iterated through, with one byte per page touched.  (This is to ensure that
  *  the memory is actually created, and is used to avoid deadlocking due to swapping
  *  during a live verify of the boot volume.)
+ *
+ *  The cache blocks are split evenly between the shards, and each shard gets
+ *  a hash table big enough for its blocks and the tags on its Out queue.
+ *  hashSize is the minimum number of hash buckets for the whole cache.
  */
 int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
                uint32_t cacheBlockSize, uint32_t cacheTotalBlocks, uint32_t hashSize, int preTouch)
 {
 	void **		temp;
-	uint32_t	i;
+	void *		memory;
+	uint32_t	i, j;
+	uint32_t	blocks;
 	Buf_t *		buf;
+	CacheShard_t *	shard;
 	
 	memset (cache, 0x00, sizeof (Cache_t));
+	pthread_mutex_init (&cache->BufLock, NULL);
+	pthread_mutex_init (&cache->RALock, NULL);
+	pthread_cond_init (&cache->RACond, NULL);
 
 	cache->FD_R = fdRead;
 	cache->FD_W = fdWrite;
 	cache->DevBlockSize = devBlockSize;
-	/* CacheFlush requires cleared cache->Hash  */
-	cache->Hash = (Tag_t **) calloc( 1, (sizeof (Tag_t *) * hashSize) );
-	cache->HashSize = hashSize;
 	cache->BlockSize = cacheBlockSize;
 
 	/* Allocate the cache memory */
 	/* Break out of the loop on success, or when the proposed cache is < MinCacheSize */
 	while (1) {
-		cache->FreeHead = mmap (NULL,
+		memory = mmap (NULL,
 					cacheTotalBlocks * cacheBlockSize,
 					PROT_READ | PROT_WRITE,
 					MAP_ANON | MAP_PRIVATE,
 					-1,
 					0);
-		if (cache->FreeHead == (void *)-1) {
+		if (memory == (void *)-1) {
 			if ((cacheTotalBlocks * cacheBlockSize) <= MinCacheSize) {
 				if (debug)
 					printf("\tTried to allocate %dK, minimum is %dK\n",
@@ -240,7 +301,7 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 			break;
 		}
 	}
-	if (cache->FreeHead == (void*)-1) {
+	if (memory == (void*)-1) {
 #if CACHE_DEBUG
 		printf("%s(%d):  FreeHead = -1\n", __FUNCTION__, __LINE__);
 #endif
@@ -251,7 +312,7 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 	/* If necessary, touch a byte in each page */
 	if (preTouch) {
 		size_t pageSize = getpagesize();
-		unsigned char *ptr = (unsigned char *)cache->FreeHead;
+		unsigned char *ptr = (unsigned char *)memory;
 		unsigned char *end = ptr + (cacheTotalBlocks * cacheBlockSize);
 		while (ptr < end) {
 			*ptr = 0;
@@ -259,14 +320,51 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 		}
 	}
 
-	/* Initialize the cache memory free list */
-	temp = cache->FreeHead;
-	for (i = 0; i < cacheTotalBlocks - 1; i++) {
-		*temp = ((char *)temp + cacheBlockSize);
-		temp  = (void **)((char *)temp + cacheBlockSize);
+	/* Split the cache, but keep the shards big enough to be useful */
+	cache->ShardCount = 1;
+	while (cache->ShardCount < CacheMaxShards &&
+	       cacheTotalBlocks / (cache->ShardCount * 2) >= CacheMinShardBlocks)
+		cache->ShardCount *= 2;
+
+	for (i = 0; i < cache->ShardCount; i++) {
+		shard = &cache->Shards[i];
+		shard->Cache = cache;
+		pthread_mutex_init (&shard->Lock, NULL);
+
+		blocks = cacheTotalBlocks / cache->ShardCount;
+		if (i < cacheTotalBlocks % cache->ShardCount)
+			blocks++;
+		LRUInit (&shard->LRU, blocks);
+
+		/* CacheFlush requires cleared shard->Hash  */
+		shard->HashSize = 1;
+		while (shard->HashSize < blocks + shard->LRU.OutMax ||
+		       shard->HashSize < hashSize / cache->ShardCount)
+			shard->HashSize *= 2;
+		shard->Hash = (Tag_t **) calloc( 1, (sizeof (Tag_t *) * shard->HashSize) );
+		if (shard->Hash == NULL) {
+#if CACHE_DEBUG
+			printf("%s(%d):  calloc(%zu) failed\n", __FUNCTION__, __LINE__, sizeof (Tag_t *) * shard->HashSize);
+#endif
+			return (ENOMEM);
+		}
+
+		/* Initialize the shard's part of the cache memory free list */
+		shard->FreeHead = memory;
+		temp = memory;
+		for (j = 0; j < blocks - 1; j++) {
+			*temp = ((char *)temp + cacheBlockSize);
+			temp  = (void **)((char *)temp + cacheBlockSize);
+		}
+		*temp = NULL;
+		shard->FreeSize = blocks;
+		shard->TotalBlocks = blocks;
+		memory = (char *)memory + (size_t)blocks * cacheBlockSize;
+	}
+
+	if (debug) {
+		printf ("\tUsing %u cache shards with %u hash buckets each.\n", cache->ShardCount, cache->Shards[0].HashSize);
 	}
-	*temp = NULL;
-	cache->FreeSize = cacheTotalBlocks;
 
 	buf = (Buf_t *)malloc(sizeof(Buf_t) * MAXBUFS);
 	if (buf == NULL) {
@@ -288,7 +386,7 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
 	printf( "%s - cache memory %d \n", __FUNCTION__, (cacheTotalBlocks * cacheBlockSize) );
 #endif  
 
-	return (LRUInit (&cache->LRU));
+	return (EOK);
 }
 
 
@@ -299,24 +397,81 @@ int CacheInit (Cache_t *cache, int fdRead, int fdWrite, uint32_t devBlockSize,
  */
 int CacheDestroy (Cache_t *cache)
 {
+	uint32_t	i;
+
+	/* Stop the readahead threads */
+	pthread_mutex_lock (&cache->RALock);
+	cache->RAStop = 1;
+	cache->RACount = 0;
+	pthread_cond_broadcast (&cache->RACond);
+	pthread_mutex_unlock (&cache->RALock);
+	for (i = 0; i < cache->RAThreads; i++) {
+		pthread_join (cache->RAThread[i], NULL);
+	}
+	cache->RAThreads = 0;
+
 	CacheFlush( cache );
 
-#if CACHE_DEBUG
 	/* Print cache report */
-	printf ("Cache Report:\n");
-	printf ("\tRead Requests:  %d\n", cache->ReqRead);
-	printf ("\tWrite Requests: %d\n", cache->ReqWrite);
-	printf ("\tDisk Reads:     %d\n", cache->DiskRead);
-	printf ("\tDisk Writes:    %d\n", cache->DiskWrite);
-	printf ("\tSpans:          %d\n", cache->Span);
-#endif	
+	if (debug) {
+		CacheReport (cache);
+	}
+
 	/* Shutdown the LRU */
-	LRUDestroy (&cache->LRU);
+	for (i = 0; i < cache->ShardCount; i++) {
+		LRUDestroy (&cache->Shards[i].LRU);
+		pthread_mutex_destroy (&cache->Shards[i].Lock);
+	}
+	pthread_cond_destroy (&cache->RACond);
+	pthread_mutex_destroy (&cache->RALock);
+	pthread_mutex_destroy (&cache->BufLock);
 	
 	/* I'm lazy, I'll come back to it :P */
 	return (EOK);
 }
 
+/*
+ * CacheReport
+ *
+ *  Print the cache statistics, summed over the shards.
+ */
+static void CacheReport (Cache_t *cache)
+{
+	CacheShard_t *	shard;
+	uint64_t	hits = 0, misses = 0, ghostHits = 0, evictions = 0;
+	uint64_t	readAheads = 0, readAheadHits = 0;
+	uint32_t	blocks = 0, buckets = 0;
+	uint32_t	i;
+
+	for (i = 0; i < cache->ShardCount; i++) {
+		shard = &cache->Shards[i];
+		pthread_mutex_lock (&shard->Lock);
+		hits += shard->Hits;
+		misses += shard->Misses;
+		ghostHits += shard->GhostHits;
+		evictions += shard->Evictions;
+		readAheads += shard->ReadAheads;
+		readAheadHits += shard->ReadAheadHits;
+		blocks += shard->TotalBlocks;
+		buckets += shard->HashSize;
+		pthread_mutex_unlock (&shard->Lock);
+	}
+
+	printf ("\tCache statistics (%u shards, %u blocks, %u hash buckets):\n",
+		cache->ShardCount, blocks, buckets);
+	printf ("\t\t%u read requests, %u write requests, %u spanning cache blocks\n",
+		cache->ReqRead, cache->ReqWrite, cache->Span);
+	printf ("\t\t%llu block lookups: %llu hits, %llu misses (%.1f%% hit rate)\n",
+		(unsigned long long)(hits + misses), (unsigned long long)hits, (unsigned long long)misses,
+		(hits + misses) ? (100.0 * hits) / (hits + misses) : 0.0);
+	printf ("\t\t%llu evictions, %llu misses on blocks evicted after one use\n",
+		(unsigned long long)evictions, (unsigned long long)ghostHits);
+	printf ("\t\t%llu blocks read ahead, %llu of them used\n",
+		(unsigned long long)readAheads, (unsigned long long)readAheadHits);
+	printf ("\t\t%u disk reads, %u disk writes\n",
+		cache->DiskRead, cache->DiskWrite);
+}
+
 /*
  * CacheRead
  *
@@ -326,16 +481,22 @@ int CacheDestroy (Cache_t *cache)
  *  NOTE: The returned buffer may directly refer to a cache block, or an
  *        anonymous buffer. Do not make any assumptions about the nature of
  *        the returned buffer, except that it is contiguous.
+ *
+ *  Each cache block is looked up under the lock of its shard; the buffer
+ *  lists are protected by BufLock.  No two locks are ever held together.
  */
 int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 {
 	Tag_t *		tag;
 	Buf_t *		searchBuf;
 	Buf_t *		buf;
+	CacheShard_t *	shard;
 	uint32_t	coff = (off % cache->BlockSize);
 	uint64_t	cblk = (off - coff);
 	int			error;
 
+	pthread_mutex_lock (&cache->BufLock);
+
 	/* Check for conflicts with other bufs */
 	searchBuf = cache->ActiveBufs;
 	while (searchBuf != NULL) {
@@ -343,6 +504,7 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 #if CACHE_DEBUG
 			printf ("ERROR: CacheRead: Deadlock (searchBuff = <%llu, %u>, off = %llu, off+len = %llu)\n", searchBuf->Offset, searchBuf->Length, off, off+len);
 #endif
+			pthread_mutex_unlock (&cache->BufLock);
 			return (EDEADLK);
 		}
 		
@@ -354,9 +516,11 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 #if CACHE_DEBUG
 		printf ("ERROR: CacheRead: no more bufs!\n");
 #endif
+		pthread_mutex_unlock (&cache->BufLock);
 		return (ENOBUFS);
 	}
 	cache->FreeBufs = buf->Next; 
+	pthread_mutex_unlock (&cache->BufLock);
 	*bufp = buf;
 
 	/* Clear the buf structure */
@@ -375,11 +539,14 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 #if CACHE_DEBUG
 	printf("%s(%d):  Looking up cache block %llu for offset %llu, cache blockSize %u\n", __FUNCTION__, __LINE__, cblk, off, cache->BlockSize);
 #endif
-	error = CacheLookup (cache, cblk, &tag);
+	shard = CacheShardOf (cache, cblk);
+	pthread_mutex_lock (&shard->Lock);
+	error = CacheLookupShard (shard, cblk, &tag, NULL, true);
 	if (error != EOK) {
 #if CACHE_DEBUG
 		printf ("ERROR: CacheRead: CacheLookup error %d\n", error);
 #endif
+		pthread_mutex_unlock (&shard->Lock);
 		return (error);
 	}
 
@@ -392,7 +559,8 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 		tag->Refs++;
 		
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+		pthread_mutex_unlock (&shard->Lock);
 
 	/* Otherwise, things get ugly */
 	} else {
@@ -406,6 +574,7 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 #if CACHE_DEBUG
 			printf ("ERROR: CacheRead: No Memory\n");
 #endif
+			pthread_mutex_unlock (&shard->Lock);
 			return (ENOMEM);
 		}
 
@@ -421,7 +590,8 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 		tag->Refs++;
 
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+		pthread_mutex_unlock (&shard->Lock);
 
 		/* Next cache block */
 		cblk += cache->BlockSize;
@@ -429,8 +599,12 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 		/* Read data a cache block at a time */
 		while (blen) {
 			/* Fetch the next cache block */
-			error = CacheLookup (cache, cblk, &tag);
+			shard = CacheShardOf (cache, cblk);
+			pthread_mutex_lock (&shard->Lock);
+			error = CacheLookupShard (shard, cblk, &tag, NULL, true);
 			if (error != EOK) {
+				pthread_mutex_unlock (&shard->Lock);
+
 				/* Free the allocated buffer */
 				free (buf->Buffer);
 				buf->Buffer = NULL;
@@ -438,14 +612,17 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 				/* Release all the held tags */
 				cblk -= cache->BlockSize;
 				while (!boff) {
-					if (CacheLookup (cache, cblk, &tag) != EOK) {
+					shard = CacheShardOf (cache, cblk);
+					pthread_mutex_lock (&shard->Lock);
+					if (CacheLookupShard (shard, cblk, &tag, NULL, false) != EOK) {
 						fprintf (stderr, "CacheRead: Unrecoverable error\n");
 						exit (-1);
 					}
 					tag->Refs--;
 					
 					/* Kick the node into the right queue */
-					LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+					LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+					pthread_mutex_unlock (&shard->Lock);
 				}
 
 				return (error);
@@ -469,13 +646,13 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 			cblk += cache->BlockSize;
 
 			/* Kick the node into the right queue */
-			LRUHit (&cache->LRU, (LRUNode_t *)tag, 0);
+			LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+			pthread_mutex_unlock (&shard->Lock);
 		}
-
-		/* Count the spanned access */
-		cache->Span++;
 	}
 
+	pthread_mutex_lock (&cache->BufLock);
+
 	/* Attach to head of active buffers list */
 	if (cache->ActiveBufs != NULL) {
 		buf->Next = cache->ActiveBufs;
@@ -489,9 +666,66 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 
 	/* Update counters */
 	cache->ReqRead++;
+	if (buf->Flags & BUF_SPAN) {
+		/* Count the spanned access */
+		cache->Span++;
+	}
+
+	pthread_mutex_unlock (&cache->BufLock);
 	return (EOK);
 }
 
+/*
+ * CacheBufDone
+ *
+ *  Detaches a buffer from the active list and puts it back on the free
+ *  list, once CacheWrite or CacheRelease is done with it.
+ */
+static void CacheBufDone (Cache_t *cache, Buf_t *buf, int write)
+{
+	pthread_mutex_lock (&cache->BufLock);
+
+	/* Detach the buffer */
+	if (buf->Next != NULL)
+		buf->Next->Prev = buf->Prev;
+	if (buf->Prev != NULL)
+		buf->Prev->Next = buf->Next;
+	if (cache->ActiveBufs == buf)
+		cache->ActiveBufs = buf->Next;
+
+	/* Clear the buffer and put it back on free list */
+	memset (buf, 0x00, sizeof (Buf_t));
+	buf->Next = cache->FreeBufs; 
+	cache->FreeBufs = buf; 		
+
+	/* Update counters */
+	if (write)
+		cache->ReqWrite++;
+
+	pthread_mutex_unlock (&cache->BufLock);
+}
+
+/*
+ * CacheCommitBlock
+ *
+ *  Writes a cache block back to disk, or marks it to be written later.
+ *  The caller holds the shard lock.
+ */
+static int CacheCommitBlock (Cache_t *cache, Tag_t *tag, uint32_t writeOptions)
+{
+	if ( (writeOptions & (kLazyWrite | kLockWrite)) != 0 )
+	{
+		/* flag this for lazy write */
+		tag->Flags |= (writeOptions & (kLazyWrite | kLockWrite));
+		return (EOK);
+	}
+
+	return (CacheRawWrite (cache,
+						   tag->Offset,
+						   cache->BlockSize,
+						   tag->Buffer));
+}
+
 /*
  * XXX
  * All of the uses of kLockWrite need to be audited for
@@ -505,29 +739,27 @@ int CacheRead (Cache_t *cache, uint64_t off, uint32_t len, Buf_t **bufp)
 int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 {
 	Tag_t *		tag;
+	CacheShard_t *	shard;
 	uint32_t	coff = (buf->Offset % cache->BlockSize);
 	uint64_t	cblk = (buf->Offset - coff);
 	int			error;
 
 	/* Fetch the first cache block */
-	error = CacheLookup (cache, cblk, &tag);
-	if (error != EOK) return (error);
+	shard = CacheShardOf (cache, cblk);
+	pthread_mutex_lock (&shard->Lock);
+	error = CacheLookupShard (shard, cblk, &tag, NULL, false);
+	if (error != EOK) {
+		pthread_mutex_unlock (&shard->Lock);
+		return (error);
+	}
 	
 	/* If the buffer was a direct reference */
 	if (!(buf->Flags & BUF_SPAN)) {
 		/* Commit the dirty block */
-		if ( (writeOptions & (kLazyWrite | kLockWrite)) != 0 )
-		{
-			/* Copy flags to tag */
-			tag->Flags |= (writeOptions & (kLazyWrite | kLockWrite));
-		}
-		else
-		{
-			error = CacheRawWrite (cache,
-								   tag->Offset,
-								   cache->BlockSize,
-								   tag->Buffer);
-			if (error != EOK) return (error);
+		error = CacheCommitBlock (cache, tag, writeOptions);
+		if (error != EOK) {
+			pthread_mutex_unlock (&shard->Lock);
+			return (error);
 		}
 		
 		/* Release the reference */
@@ -535,7 +767,8 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 			tag->Refs--;
 
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+		pthread_mutex_unlock (&shard->Lock);
 
 	/* Otherwise, we do the ugly thing again */
 	} else {
@@ -549,18 +782,10 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 		memcpy (tag->Buffer + coff, buf->Buffer, boff);
 		
 		/* Commit the dirty block */
-		if ( (writeOptions & (kLazyWrite | kLockWrite)) != 0 ) 
-		{
-			/* flag this for lazy write */
-			tag->Flags |= (writeOptions & (kLazyWrite | kLockWrite));
-		}
-		else
-		{
-			error = CacheRawWrite (cache,
-								   tag->Offset,
-								   cache->BlockSize,
-								   tag->Buffer);
-			if (error != EOK) return (error);
+		error = CacheCommitBlock (cache, tag, writeOptions);
+		if (error != EOK) {
+			pthread_mutex_unlock (&shard->Lock);
+			return (error);
 		}
 		
 		/* Release the cache block reference */
@@ -568,7 +793,8 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 			tag->Refs--;
 
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+		pthread_mutex_unlock (&shard->Lock);
 			
 		/* Next cache block */
 		cblk += cache->BlockSize;
@@ -576,7 +802,9 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 		/* Write data a cache block at a time */
 		while (blen) {
 			/* Fetch the next cache block */
-			error = CacheLookup (cache, cblk, &tag);
+			shard = CacheShardOf (cache, cblk);
+			pthread_mutex_lock (&shard->Lock);
+			error = CacheLookupShard (shard, cblk, &tag, NULL, false);
 			/* We must go through with the write regardless */
 
 			/* Blit the next buffer chunk back into the cache */
@@ -586,18 +814,10 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 					temp);
 
 			/* Commit the dirty block */
-			if ( (writeOptions & (kLazyWrite | kLockWrite)) != 0 ) 
-			{
-				/* flag this for lazy write */
-				tag->Flags |= (writeOptions & (kLazyWrite | kLockWrite));
-			}
-			else
-			{
-				error = CacheRawWrite (cache,
-									   tag->Offset,
-									   cache->BlockSize,
-									   tag->Buffer);
-				if (error != EOK) return (error);
+			error = CacheCommitBlock (cache, tag, writeOptions);
+			if (error != EOK) {
+				pthread_mutex_unlock (&shard->Lock);
+				return (error);
 			}
 
 			/* Update counters */
@@ -607,7 +827,8 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 				tag->Refs--;
 
 			/* Kick the node into the right queue */
-			LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+			LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+			pthread_mutex_unlock (&shard->Lock);
 			/* And go to the next cache block */
 			cblk += cache->BlockSize;
 		}
@@ -616,21 +837,8 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 		free (buf->Buffer);
 	}
 
-	/* Detach the buffer */
-	if (buf->Next != NULL)
-		buf->Next->Prev = buf->Prev;
-	if (buf->Prev != NULL)
-		buf->Prev->Next = buf->Next;
-	if (cache->ActiveBufs == buf)
-		cache->ActiveBufs = buf->Next;
-
-	/* Clear the buffer and put it back on free list */
-	memset (buf, 0x00, sizeof (Buf_t));
-	buf->Next = cache->FreeBufs; 
-	cache->FreeBufs = buf; 		
-
-	/* Update counters */
-	cache->ReqWrite++;
+	/* Detach the buffer and put it back on the free list */
+	CacheBufDone (cache, buf, true);
 
 	return (EOK);
 }
@@ -645,16 +853,20 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions )
 int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 {
 	Tag_t *		tag;
+	CacheShard_t *	shard;
 	uint32_t	coff = (buf->Offset % cache->BlockSize);
 	uint64_t	cblk = (buf->Offset - coff);
 	int			error;
 
 	/* Fetch the first cache block */
-	error = CacheLookup (cache, cblk, &tag);
+	shard = CacheShardOf (cache, cblk);
+	pthread_mutex_lock (&shard->Lock);
+	error = CacheLookupShard (shard, cblk, &tag, NULL, false);
 	if (error != EOK) {
 #if CACHE_DEBUG
 		printf ("ERROR: CacheRelease: CacheLookup error\n");
 #endif
+		pthread_mutex_unlock (&shard->Lock);
 		return (error);
 	}
 	
@@ -666,7 +878,8 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 		}
 
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+		pthread_mutex_unlock (&shard->Lock);
 
 	/* Otherwise, we do the ugly thing again */
 	} else {
@@ -681,7 +894,8 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 		}
 
 		/* Kick the node into the right queue */
-		LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+		pthread_mutex_unlock (&shard->Lock);
 
 		/* Next cache block */
 		cblk += cache->BlockSize;
@@ -689,7 +903,9 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 		/* Release cache blocks one at a time */
 		while (blen) {
 			/* Fetch the next cache block */
-			error = CacheLookup (cache, cblk, &tag);
+			shard = CacheShardOf (cache, cblk);
+			pthread_mutex_lock (&shard->Lock);
+			error = CacheLookupShard (shard, cblk, &tag, NULL, false);
 			/* We must go through with the write regardless */
 
 			/* Update counters */
@@ -698,7 +914,8 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 				tag->Refs--;
 
 			/* Kick the node into the right queue */
-			LRUHit (&cache->LRU, (LRUNode_t *)tag, age);
+			LRUHit (&shard->LRU, (LRUNode_t *)tag, age);
+			pthread_mutex_unlock (&shard->Lock);
 			/* Advance to the next block */
 			cblk += cache->BlockSize;
 		}
@@ -707,22 +924,223 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
 		free (buf->Buffer);
 	}
 
-	/* Detach the buffer */
-	if (buf->Next != NULL)
-		buf->Next->Prev = buf->Prev;
-	if (buf->Prev != NULL)
-		buf->Prev->Next = buf->Next;
-	if (cache->ActiveBufs == buf)
-		cache->ActiveBufs = buf->Next;
+	/* Detach the buffer and put it back on the free list */
+	CacheBufDone (cache, buf, false);
 
-	/* Clear the buffer and put it back on free list */
-	memset (buf, 0x00, sizeof (Buf_t));
-	buf->Next = cache->FreeBufs; 
-	cache->FreeBufs = buf; 		
+	return (EOK);
+}
+
+/*
+ * CacheReadCopy
+ *
+ *  Copies a range of bytes out of the cache into the caller's buffer.
+ *  Unlike CacheRead, no buffer is left active, so this can never conflict
+ *  with (or be the cause of an EDEADLK for) a buffer someone else holds.
+ */
+int CacheReadCopy (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
+{
+	Tag_t *		tag;
+	CacheShard_t *	shard;
+	uint32_t	coff = (off % cache->BlockSize);
+	uint64_t	cblk = (off - coff);
+	uint32_t	temp;
+	int			error = EOK;
+
+	while (len) {
+		shard = CacheShardOf (cache, cblk);
+		pthread_mutex_lock (&shard->Lock);
+		error = CacheLookupShard (shard, cblk, &tag, NULL, true);
+		if (error != EOK) {
+			pthread_mutex_unlock (&shard->Lock);
+			break;
+		}
+
+		temp = cache->BlockSize - coff;
+		if (temp > len)
+			temp = len;
+		memcpy (buf, tag->Buffer + coff, temp);
+
+		/* Kick the node into the right queue */
+		LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+		pthread_mutex_unlock (&shard->Lock);
+
+		buf = (char *)buf + temp;
+		len -= temp;
+		coff = 0;
+		cblk += cache->BlockSize;
+	}
+	if (error == EOK) {
+		pthread_mutex_lock (&cache->BufLock);
+		cache->ReqRead++;
+		pthread_mutex_unlock (&cache->BufLock);
+	}
+
+	return (error);
+}
+
+/*
+ * CacheReadAhead
+ *
+ *  Brings the cache blocks covering a range into the cache, without handing
+ *  out a buffer.  The disk read is done without holding any lock.  A block
+ *  that someone else loads in the meantime is left alone, and so is
+ *  everything if the cache wrote to the disk while we were reading, so the
+ *  cache never picks up data older than what it has written.
+ */
+int CacheReadAhead (Cache_t *cache, uint64_t off, uint32_t len)
+{
+	Tag_t *		tag;
+	CacheShard_t *	shard;
+	uint64_t	cblk = off - (off % cache->BlockSize);
+	uint32_t	writes;
+	int			cached;
+	void *		data;
+	int			error = EOK;
+
+	data = malloc (cache->BlockSize);
+	if (data == NULL)
+		return (ENOMEM);
+
+	for (; cblk < off + len; cblk += cache->BlockSize) {
+		shard = CacheShardOf (cache, cblk);
+
+		/* Skip blocks that are already cached */
+		pthread_mutex_lock (&shard->Lock);
+		for (tag = shard->Hash[CacheHashOf (shard, cblk)]; tag != NULL; tag = tag->Next) {
+			if (tag->Offset == cblk) break;
+		}
+		cached = (tag != NULL && tag->Buffer != NULL);
+		pthread_mutex_unlock (&shard->Lock);
+		if (cached)
+			continue;
+
+		writes = __sync_fetch_and_add (&cache->DiskWrite, 0);
+		error = CacheRawRead (cache, cblk, cache->BlockSize, data);
+		if (error != EOK)
+			break;
+
+		pthread_mutex_lock (&shard->Lock);
+		if (__sync_fetch_and_add (&cache->DiskWrite, 0) == writes) {
+			error = CacheLookupShard (shard, cblk, &tag, data, false);
+			if (error == EOK) {
+				/* Kick the node into the right queue */
+				LRUHit (&shard->LRU, (LRUNode_t *)tag, 0);
+			}
+		}
+		pthread_mutex_unlock (&shard->Lock);
+		if (error != EOK)
+			break;
+	}
+
+	free (data);
+	return (error);
+}
+
+/*
+ * CacheReadAheadThread
+ *
+ *  Serves the readahead queue until CacheDestroy.
+ */
+static void *CacheReadAheadThread (void *arg)
+{
+	Cache_t *		cache = arg;
+	CacheReadAheadReq_t	req;
+
+	pthread_mutex_lock (&cache->RALock);
+	while (1) {
+		while (cache->RACount == 0 && !cache->RAStop)
+			pthread_cond_wait (&cache->RACond, &cache->RALock);
+		if (cache->RAStop)
+			break;
+
+		req = cache->RAQueue[cache->RAHead];
+		cache->RAHead = (cache->RAHead + 1) % CacheReadAheadQueueSize;
+		if (cache->RACount-- == CacheReadAheadQueueSize) {
+			/* Wake up anyone waiting for room */
+			pthread_cond_broadcast (&cache->RACond);
+		}
+		pthread_mutex_unlock (&cache->RALock);
+
+		/* Errors are left for whoever reads the block for real */
+		(void) CacheReadAhead (cache, req.Offset, req.Length);
+
+		pthread_mutex_lock (&cache->RALock);
+	}
+	pthread_mutex_unlock (&cache->RALock);
+
+	return (NULL);
+}
+
+/*
+ * CacheStartReadAhead
+ *
+ *  Starts up to the given number of threads to serve CacheReadAheadAsync.
+ *  Calling it again only adds threads.  Returns an error if no thread is
+ *  running.
+ */
+int CacheStartReadAhead (Cache_t *cache, int threads)
+{
+	int			error = EINVAL;
+
+	if (threads > CacheMaxReadAheadThreads)
+		threads = CacheMaxReadAheadThreads;
+
+	pthread_mutex_lock (&cache->RALock);
+	while (!cache->RAStop && cache->RAThreads < threads) {
+		error = pthread_create (&cache->RAThread[cache->RAThreads], NULL, CacheReadAheadThread, cache);
+		if (error != 0)
+			break;
+		cache->RAThreads++;
+	}
+	if (cache->RAThreads > 0)
+		error = EOK;
+	pthread_mutex_unlock (&cache->RALock);
+
+	return (error);
+}
+
+/*
+ * CacheReadAheadAsync
+ *
+ *  Queues a range to be read ahead.  Waits only while the queue is full.
+ */
+int CacheReadAheadAsync (Cache_t *cache, uint64_t off, uint32_t len)
+{
+	CacheReadAheadReq_t *	req;
+
+	pthread_mutex_lock (&cache->RALock);
+	while (cache->RAThreads > 0 && !cache->RAStop &&
+	       cache->RACount == CacheReadAheadQueueSize)
+		pthread_cond_wait (&cache->RACond, &cache->RALock);
+
+	if (cache->RAThreads > 0 && !cache->RAStop) {
+		req = &cache->RAQueue[(cache->RAHead + cache->RACount) % CacheReadAheadQueueSize];
+		req->Offset = off;
+		req->Length = len;
+		if (cache->RACount++ == 0) {
+			/* Wake up the readahead threads */
+			pthread_cond_broadcast (&cache->RACond);
+		}
+	}
+	pthread_mutex_unlock (&cache->RALock);
 
 	return (EOK);
 }
 
+/*
+ * CacheCancelReadAhead
+ *
+ *  Drops the readahead requests that haven't been started yet.
+ */
+void CacheCancelReadAhead (Cache_t *cache)
+{
+	pthread_mutex_lock (&cache->RALock);
+	if (cache->RACount == CacheReadAheadQueueSize)
+		pthread_cond_broadcast (&cache->RACond);
+	cache->RACount = 0;
+	pthread_mutex_unlock (&cache->RALock);
+}
+
 /*
  * CacheRemove
  *
@@ -730,6 +1148,8 @@ int CacheRelease (Cache_t *cache, Buf_t *buf, int age)
  */
 int CacheRemove (Cache_t *cache, Tag_t *tag)
 {
+	CacheShard_t *	shard = CacheShardOf (cache, tag->Offset);
+	uint32_t	hash = CacheHashOf (shard, tag->Offset);
 	int			error;
 
 	/* Make sure it's not busy */
@@ -741,20 +1161,23 @@ int CacheRemove (Cache_t *cache, Tag_t *tag)
 	if (tag->Prev != NULL)
 		tag->Prev->Next = tag->Next;
 	else
-		cache->Hash[tag->Offset % cache->HashSize] = tag->Next;
+		shard->Hash[hash] = tag->Next;
 	
 	/* Make sure the head node doesn't have a back pointer */
-	if ((cache->Hash[tag->Offset % cache->HashSize] != NULL) &&
-	    (cache->Hash[tag->Offset % cache->HashSize]->Prev != NULL)) {
+	if ((shard->Hash[hash] != NULL) &&
+	    (shard->Hash[hash]->Prev != NULL)) {
 #if CACHE_DEBUG
 		printf ("ERROR: CacheRemove: Corrupt hash chain\n");
 #endif
 	}
+
+	/* Take it off the replacement queues */
+	LRURemove (&shard->LRU, (LRUNode_t *)tag);
 	
 	/* Release it's buffer (if it has one) */
 	if (tag->Buffer != NULL)
 	{
-		error = CacheFreeBlock (cache, tag);
+		error = CacheFreeBlock (shard, tag);
 		if ( EOK != error )
 			return( error );
 	}
@@ -783,7 +1206,7 @@ int CacheEvict (Cache_t *cache, Tag_t *tag)
 	/* Release the buffer */
 	if (tag->Buffer != NULL)
 	{
-		error = CacheFreeBlock (cache, tag);
+		error = CacheFreeBlock (CacheShardOf (cache, tag->Offset), tag);
 		if ( EOK != error )
 			return( error );
 	}
@@ -797,18 +1220,18 @@ int CacheEvict (Cache_t *cache, Tag_t *tag)
  *
  *  Allocate an unused cache block.
  */
-void *CacheAllocBlock (Cache_t *cache)
+void *CacheAllocBlock (CacheShard_t *shard)
 {
 	void *	temp;
 	
-	if (cache->FreeHead == NULL)
+	if (shard->FreeHead == NULL)
 		return (NULL);
-	if (cache->FreeSize == 0)
+	if (shard->FreeSize == 0)
 		return (NULL);
 
-	temp = cache->FreeHead;
-	cache->FreeHead = *((void **)cache->FreeHead);
-	cache->FreeSize--;
+	temp = shard->FreeHead;
+	shard->FreeHead = *((void **)shard->FreeHead);
+	shard->FreeSize--;
 
 	return (temp);
 }
@@ -819,16 +1242,16 @@ void *CacheAllocBlock (Cache_t *cache)
  *  Release an active cache block.
  */
 static int 
-CacheFreeBlock( Cache_t *cache, Tag_t *tag )
+CacheFreeBlock( CacheShard_t *shard, Tag_t *tag )
 {
 	int			error;
 	
 	if ( (tag->Flags & kLazyWrite) != 0 )
 	{
 		/* this cache block has been marked for lazy write - do it now */
-		error = CacheRawWrite( cache,
+		error = CacheRawWrite( shard->Cache,
 							   tag->Offset,
-							   cache->BlockSize,
+							   shard->Cache->BlockSize,
 							   tag->Buffer );
 		if ( EOK != error ) 
 		{
@@ -842,9 +1265,9 @@ CacheFreeBlock( Cache_t *cache, Tag_t *tag )
 
 	if ((tag->Flags & kLockWrite) == 0)
 	{
-		*((void **)tag->Buffer) = cache->FreeHead;
-		cache->FreeHead = (void **)tag->Buffer;
-		cache->FreeSize++;
+		*((void **)tag->Buffer) = shard->FreeHead;
+		shard->FreeHead = (void **)tag->Buffer;
+		shard->FreeSize++;
 	}
 	return( EOK );
 }
@@ -860,32 +1283,41 @@ CacheFlush( Cache_t *cache )
 {
 	int			error;
 	int			i;
+	uint32_t	s;
+	CacheShard_t *	shard;
 	Tag_t *		myTagPtr;
 	
-	for ( i = 0; i < cache->HashSize; i++ )
+	for ( s = 0; s < cache->ShardCount; s++ )
 	{
-		myTagPtr = cache->Hash[ i ];
-		
-		while ( NULL != myTagPtr )
+		shard = &cache->Shards[ s ];
+		pthread_mutex_lock( &shard->Lock );
+		for ( i = 0; i < shard->HashSize; i++ )
 		{
-			if ( (myTagPtr->Flags & kLazyWrite) != 0 )
+			myTagPtr = shard->Hash[ i ];
+			
+			while ( NULL != myTagPtr )
 			{
-				/* this cache block has been marked for lazy write - do it now */
-				error = CacheRawWrite( cache,
-									   myTagPtr->Offset,
-									   cache->BlockSize,
-									   myTagPtr->Buffer );
-				if ( EOK != error ) 
+				if ( (myTagPtr->Flags & kLazyWrite) != 0 )
 				{
+					/* this cache block has been marked for lazy write - do it now */
+					error = CacheRawWrite( cache,
+										   myTagPtr->Offset,
+										   cache->BlockSize,
+										   myTagPtr->Buffer );
+					if ( EOK != error ) 
+					{
 #if CACHE_DEBUG
-					printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
+						printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
 #endif 
-					return( error );
+						pthread_mutex_unlock( &shard->Lock );
+						return( error );
+					}
+					myTagPtr->Flags &= ~kLazyWrite;
 				}
-				myTagPtr->Flags &= ~kLazyWrite;
-			}
-			myTagPtr = myTagPtr->Next; 
-		} /* while */
+				myTagPtr = myTagPtr->Next; 
+			} /* while */
+		} /* for */
+		pthread_mutex_unlock( &shard->Lock );
 	} /* for */
 
 	return( EOK );
@@ -923,39 +1355,48 @@ CacheFlushRange( Cache_t *cache, uint64_t start, uint64_t len, int remove)
 {
 	int error;
 	int i;
+	uint32_t s;
+	CacheShard_t *shard;
 	Tag_t *currentTag, *nextTag;
 	
-	for ( i = 0; i < cache->HashSize; i++ )
+	for ( s = 0; s < cache->ShardCount; s++ )
 	{
-		currentTag = cache->Hash[ i ];
-		
-		while ( NULL != currentTag )
+		shard = &cache->Shards[ s ];
+		pthread_mutex_lock( &shard->Lock );
+		for ( i = 0; i < shard->HashSize; i++ )
 		{
-			/* Keep track of the next block, in case we remove the current block */
-			nextTag = currentTag->Next;
-
-			if ( currentTag->Flags & kLazyWrite &&
-				 RangeIntersect(currentTag->Offset, cache->BlockSize, start, len))
+			currentTag = shard->Hash[ i ];
+			
+			while ( NULL != currentTag )
 			{
-				error = CacheRawWrite( cache,
-									   currentTag->Offset,
-									   cache->BlockSize,
-									   currentTag->Buffer );
-				if ( EOK != error )
+				/* Keep track of the next block, in case we remove the current block */
+				nextTag = currentTag->Next;
+
+				if ( currentTag->Flags & kLazyWrite &&
+					 RangeIntersect(currentTag->Offset, cache->BlockSize, start, len))
 				{
+					error = CacheRawWrite( cache,
+										   currentTag->Offset,
+										   cache->BlockSize,
+										   currentTag->Buffer );
+					if ( EOK != error )
+					{
 #if CACHE_DEBUG
-					printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
+						printf( "%s - CacheRawWrite failed with error %d \n", __FUNCTION__, error );
 #endif 
-					return error;
-				}
-				currentTag->Flags &= ~kLazyWrite;
+						pthread_mutex_unlock( &shard->Lock );
+						return error;
+					}
+					currentTag->Flags &= ~kLazyWrite;
 
-				if ( remove && ((currentTag->Flags & kLockWrite) == 0))
-					CacheRemove( cache, currentTag );
-			}
-			
-			currentTag = nextTag;
-		} /* while */
+					if ( remove && ((currentTag->Flags & kLockWrite) == 0))
+						CacheRemove( cache, currentTag );
+				}
+				
+				currentTag = nextTag;
+			} /* while */
+		} /* for */
+		pthread_mutex_unlock( &shard->Lock );
 	} /* for */
 	
 	return EOK;
@@ -1217,19 +1658,27 @@ out:
  * CacheLookup
  *
  *  Obtain a cache block. If one already exists, it is returned. Otherwise a
- *  new one is created and inserted into the cache.
+ *  new one is created and inserted into the cache.  The caller holds the
+ *  lock of the block's shard.
  */
 int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 {
+	return (CacheLookupShard (CacheShardOf (cache, off), off, tag, NULL, false));
+}
+
+static int CacheLookupShard (CacheShard_t *shard, uint64_t off, Tag_t **tag, const void *data, int demand)
+{
+	Cache_t *	cache = shard->Cache;
+	LRU_t *		lru = &shard->LRU;
 	Tag_t *		temp;
-	uint32_t	hash = off % cache->HashSize;
+	uint32_t	hash = CacheHashOf (shard, off);
 	int			error;
 
 	*tag = NULL;
 	
 	/* Search the hash table */
 	error = 0;
-	temp = cache->Hash[hash];
+	temp = shard->Hash[hash];
 	while (temp != NULL) {
 		if (temp->Offset == off) break;
 		temp = temp->Next;
@@ -1238,7 +1687,7 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 	/* If it's a hit */
 	if (temp != NULL) {
 		/* Perform MTF if necessary */
-		if (cache->Hash[hash] != temp) {
+		if (shard->Hash[hash] != temp) {
 			/* Disconnect the tag */
 			if (temp->Next != NULL)
 				temp->Next->Prev = temp->Prev;
@@ -1253,40 +1702,79 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 		temp->Offset = off;
 
 		/* Kick the tag onto the LRU */
-		//LRUHit (&cache->LRU, (LRUNode_t *)temp, 0);
+		//LRUHit (&shard->LRU, (LRUNode_t *)temp, 0);
 	}
 
 	/* Insert at the head (if it's not already there) */
-	if (cache->Hash[hash] != temp) {
+	if (shard->Hash[hash] != temp) {
 		temp->Prev = NULL;
-		temp->Next = cache->Hash[hash];
+		temp->Next = shard->Hash[hash];
 		if (temp->Next != NULL)
 			temp->Next->Prev = temp;
-		cache->Hash[hash] = temp;
+		shard->Hash[hash] = temp;
 	}
 
 	/* Make sure there's a buffer */
 	if (temp->Buffer == NULL) {
+		/* Keep it out of LRUEvict's way until LRUHit puts it back */
+		LRUDetach ((LRUNode_t *)temp);
+		temp->Busy = 0;
+
+		/* A tag on the Out queue means the block was used before */
+		if (temp->Queue == kQueueOut) {
+			lru->OutCount--;
+			if (data == NULL) {
+				temp->Queue = kQueueMain;
+				shard->GhostHits++;
+			} else {
+				/* Readahead isn't a use */
+				temp->Queue = kQueueIn;
+				lru->InCount++;
+			}
+		}
+
 		/* Find a free buffer */
-		temp->Buffer = CacheAllocBlock (cache);
+		temp->Buffer = CacheAllocBlock (shard);
 		if (temp->Buffer == NULL) {
 			/* Try to evict a buffer */
-			error = LRUEvict (&cache->LRU, (LRUNode_t *)temp);
-			if (error != EOK) return (error);
+			error = LRUEvict (lru, (LRUNode_t *)temp);
+			if (error != EOK) {
+				(void) CacheRemove (cache, temp);
+				return (error);
+			}
 
 			/* Try again */
-			temp->Buffer = CacheAllocBlock (cache);
+			temp->Buffer = CacheAllocBlock (shard);
 			if (temp->Buffer == NULL) {
 #if CACHE_DEBUG
-				printf("%s(%d):  CacheAllocBlock failed (FreeHead = %p, FreeSize = %u)\n", __FUNCTION__, __LINE__, cache->FreeHead, cache->FreeSize);
+				printf("%s(%d):  CacheAllocBlock failed (FreeHead = %p, FreeSize = %u)\n", __FUNCTION__, __LINE__, shard->FreeHead, shard->FreeSize);
 #endif
+				(void) CacheRemove (cache, temp);
 				return (ENOMEM);
 			}
 		}
 
-		/* Load the block from disk */
-		error = CacheRawRead (cache, off, cache->BlockSize, temp->Buffer);
-		if (error != EOK) return (error);
+		/* Load the block, from disk unless the caller already read it */
+		if (data != NULL) {
+			memcpy (temp->Buffer, data, cache->BlockSize);
+			temp->Flags |= kReadAhead;
+			shard->ReadAheads++;
+		} else {
+			error = CacheRawRead (cache, off, cache->BlockSize, temp->Buffer);
+			if (error != EOK) {
+				(void) CacheRemove (cache, temp);
+				return (error);
+			}
+		}
+		if (demand)
+			shard->Misses++;
+
+	} else if (demand) {
+		shard->Hits++;
+		if (temp->Flags & kReadAhead) {
+			temp->Flags &= ~kReadAhead;
+			shard->ReadAheadHits++;
+		}
 	}
 
 #if 0
@@ -1302,33 +1790,27 @@ int CacheLookup (Cache_t *cache, uint64_t off, Tag_t **tag)
 /*
  * CacheRawRead
  *
- *  Perform a direct read on the file.
+ *  Perform a direct read on the file.  This uses pread, since threads
+ *  working in different shards may read at the same time.
  */
 int CacheRawRead (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
 {
-	uint64_t	result;
 	ssize_t		nread;
 		
 	/* Both offset and length must be multiples of the device block size */
 	if (off % cache->DevBlockSize) return (EINVAL);
 	if (len % cache->DevBlockSize) return (EINVAL);
 	
-	/* Seek to the position */
-	errno = 0;
-	result = lseek (cache->FD_R, off, SEEK_SET);
-	if (result == (off_t)-1 && errno != 0)
-		return errno;
-	if (result != off) return (ENXIO);
 	/* Read into the buffer */
 #if CACHE_DEBUG
 	printf("%s:  offset %llu, len %u\n", __FUNCTION__, off, len);
 #endif
-	nread = read (cache->FD_R, buf, len);
+	nread = pread (cache->FD_R, buf, len, off);
 	if (nread == -1) return (errno);
 	if (nread == 0) return (ENXIO);
 
 	/* Update counters */
-	cache->DiskRead++;
+	__sync_fetch_and_add (&cache->DiskRead, 1);
 	
 	return (EOK);
 }
@@ -1340,26 +1822,19 @@ int CacheRawRead (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
  */
 int CacheRawWrite (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
 {
-	uint64_t	result;
 	ssize_t		nwritten;
 	
 	/* Both offset and length must be multiples of the device block size */
 	if (off % cache->DevBlockSize) return (EINVAL);
 	if (len % cache->DevBlockSize) return (EINVAL);
 	
-	/* Seek to the position */
-	errno = 0;
-	result = lseek (cache->FD_W, off, SEEK_SET);
-	if (result == (off_t)-1 && errno != 0) return (errno);
-	if (result != off) return (ENXIO);
-	
 	/* Write into the buffer */
-	nwritten = write (cache->FD_W, buf, len);
+	nwritten = pwrite (cache->FD_W, buf, len, off);
 	if (nwritten == -1) return (errno);
 	if (nwritten == 0) return (ENXIO);
 	
-	/* Update counters */
-	cache->DiskWrite++;
+	/* Update counters (CacheReadAhead watches this one) */
+	__sync_fetch_and_add (&cache->DiskWrite, 1);
 	
 	return (EOK);
 }
@@ -1369,9 +1844,11 @@ int CacheRawWrite (Cache_t *cache, uint64_t off, uint32_t len, void *buf)
 /*
  * LRUInit
  *
- *  Initializes the LRU data structures.
+ *  Initializes the LRU data structures.  The In queue gets a quarter of the
+ *  blocks, and the Out queue remembers half as many tags as there are
+ *  blocks, as suggested for 2Q.
  */
-static int LRUInit (LRU_t *lru)
+static int LRUInit (LRU_t *lru, uint32_t blocks)
 {
 	/* Make the dummy nodes point to themselves */
 	lru->Head.Next = &lru->Head;
@@ -1380,6 +1857,17 @@ static int LRUInit (LRU_t *lru)
 	lru->Busy.Next = &lru->Busy;
 	lru->Busy.Prev = &lru->Busy;
 
+	lru->In.Next = &lru->In;
+	lru->In.Prev = &lru->In;
+
+	lru->Out.Next = &lru->Out;
+	lru->Out.Prev = &lru->Out;
+
+	lru->InCount = 0;
+	lru->InMax = (blocks / 4) ? (blocks / 4) : 1;
+	lru->OutCount = 0;
+	lru->OutMax = blocks / 2;
+
 	return (EOK);
 }
 
@@ -1397,94 +1885,180 @@ static int LRUDestroy (LRU_t *lru)
 	return (EOK);
 }
 
+/*
+ * LRUDetach
+ *
+ *  Takes a node off whichever list it is on, if any.
+ */
+static void LRUDetach (LRUNode_t *node)
+{
+	if ((node->Next != NULL) && (node->Prev != NULL)) {
+		node->Next->Prev = node->Prev;
+		node->Prev->Next = node->Next;
+	}
+	node->Next = NULL;
+	node->Prev = NULL;
+}
+
+/*
+ * LRUInsert
+ *
+ *  Puts a node at the head (or, if age is set, the tail) of a list.
+ */
+static void LRUInsert (LRUNode_t *list, LRUNode_t *node, int age)
+{
+	if (age) {
+		node->Next = list;
+		node->Prev = list->Prev;
+	} else {
+		node->Next = list->Next;
+		node->Prev = list;
+	}
+
+	node->Next->Prev = node;
+	node->Prev->Next = node;
+}
+
 /*
  * LRUHit
  *
  *  Registers data activity on the given node. If the node is already in the
  *  LRU, it is moved to the front. Otherwise, it is inserted at the front.
+ *  Nodes in the In queue are not moved, since it is a FIFO.
  *
  *  NOTE: If the node is not in the LRU, we assume that its pointers are NULL.
  */
 static int LRUHit (LRU_t *lru, LRUNode_t *node, int age)
 {
-	/* Handle existing nodes */
-	if ((node->Next != NULL) && (node->Prev != NULL)) {
-		/* Detach the node */
-		node->Next->Prev = node->Prev;
-		node->Prev->Next = node->Next;
+	Tag_t *		tag = (Tag_t *)node;
+
+	/* New blocks start out in the In queue */
+	if (tag->Queue == kQueueNone) {
+		tag->Queue = kQueueIn;
+		lru->InCount++;
 	}
 
 	/* If it's busy (we can't evict it) */
-	if (((Tag_t *)node)->Refs) {
+	if (tag->Refs) {
 		/* Insert at the head of the Busy queue */
-		node->Next = lru->Busy.Next;
-		node->Prev = &lru->Busy;
-
-	} else if (age) {
-		/* Insert at the head of the LRU */
-		node->Next = &lru->Head;
-		node->Prev = lru->Head.Prev;
-		
-	} else {
-		/* Insert at the head of the LRU */
-		node->Next = lru->Head.Next;
-		node->Prev = &lru->Head;
+		LRUDetach (node);
+		LRUInsert (&lru->Busy, node, 0);
+		tag->Busy = 1;
+		return (EOK);
 	}
 
-	node->Next->Prev = node;
-	node->Prev->Next = node;
+	/* Leave blocks in the In queue where they are */
+	if (tag->Queue == kQueueIn && !tag->Busy && node->Next != NULL && !age)
+		return (EOK);
+
+	/* Insert at the head (or tail, if aged) of its queue */
+	LRUDetach (node);
+	LRUInsert ((tag->Queue == kQueueIn) ? &lru->In : &lru->Head, node, age);
+	tag->Busy = 0;
 
 	return (EOK);
 }
 
 /*
- * LRUEvict
+ * LRURemove
  *
- *  Chooses a buffer to release.
+ *  Takes a node out of the replacement queues for good.
+ */
+static void LRURemove (LRU_t *lru, LRUNode_t *node)
+{
+	Tag_t *		tag = (Tag_t *)node;
+
+	LRUDetach (node);
+	if (tag->Queue == kQueueIn)
+		lru->InCount--;
+	else if (tag->Queue == kQueueOut)
+		lru->OutCount--;
+	tag->Queue = kQueueNone;
+	tag->Busy = 0;
+}
+
+/*
+ * LRUEvict
  *
- *  TODO: Under extreme conditions, it shoud be possible to release the buffer
- *        of an actively referenced cache buffer, leaving the tag behind as a
- *        placeholder. This would be required for implementing 2Q-LRU
- *        replacement.
+ *  Chooses a buffer to release.  While the In queue holds more than its
+ *  share, the victim is the oldest block in it, and its tag moves to the
+ *  Out queue; otherwise it is the least recently used block of the main
+ *  queue, and its tag is freed.
  *
  *  NOTE: Make sure we never evict the node we're trying to find a buffer for!
+ *        CacheLookupShard takes it off the queues before calling us.
  */
 static int LRUEvict (LRU_t *lru, LRUNode_t *node)
 {
+	CacheShard_t *	shard = (CacheShard_t *)lru;
+	LRUNode_t *	list;
 	LRUNode_t *	temp;
+	Tag_t *		tag;
+	int		error;
 
 	/* Find a victim */
 	while (1) {
+		/* Pick the queue */
+		if (lru->In.Prev != &lru->In &&
+		    (lru->InCount > lru->InMax || lru->Head.Prev == &lru->Head))
+			list = &lru->In;
+		else
+			list = &lru->Head;
+
 		/* Grab the tail */
-		temp = lru->Head.Prev;
+		temp = list->Prev;
 		
 		/* Stop if we're empty */
-		if (temp == &lru->Head) {
+		if (temp == list) {
 #if CACHE_DEBUG
 			printf("%s(%d):  empty?\n", __FUNCTION__, __LINE__);
 #endif
 			return (ENOMEM);
 		}
+		tag = (Tag_t *)temp;
 
-		/* Detach the tail */
-		temp->Next->Prev = temp->Prev;
-		temp->Prev->Next = temp->Next;
+		/* Tags left without a buffer by CacheEvict just go away */
+		if (tag->Buffer == NULL && tag->Refs == 0) {
+			CacheRemove (shard->Cache, tag);
+			continue;
+		}
 
 		/* If it's not busy, we have a victim */
-		if (!((Tag_t *)temp)->Refs) break;
+		if (!tag->Refs) break;
 
 		/* Insert at the head of the Busy queue */
-		temp->Next = lru->Busy.Next;
-		temp->Prev = &lru->Busy;
-				
-		temp->Next->Prev = temp;
-		temp->Prev->Next = temp;
+		LRUDetach (temp);
+		LRUInsert (&lru->Busy, temp, 0);
+		tag->Busy = 1;
 
 		/* Try again */
 	}
 
-	/* Remove the tag */
-	CacheRemove ((Cache_t *)lru, (Tag_t *)temp);
+	shard->Evictions++;
+
+	/* Blocks from the main queue are forgotten altogether */
+	if (tag->Queue != kQueueIn) {
+		CacheRemove (shard->Cache, tag);
+		return (EOK);
+	}
+
+	/* Release the buffer, but remember the block on the Out queue */
+	error = CacheFreeBlock (shard, tag);
+	if (error != EOK)
+		return (error);
+	tag->Buffer = NULL;
+	tag->Flags &= ~kReadAhead;
+
+	LRUDetach (temp);
+	lru->InCount--;
+	tag->Queue = kQueueOut;
+	LRUInsert (&lru->Out, temp, 0);
+	lru->OutCount++;
+
+	/* Forget the oldest tags once there are too many */
+	while (lru->OutCount > lru->OutMax) {
+		CacheRemove (shard->Cache, (Tag_t *)lru->Out.Prev);
+	}
 
 	return (EOK);
 }
@@ -1498,22 +2072,29 @@ void
 dumpCache(Cache_t *cache)
 {
 	int i;
+	uint32_t s;
 	int numEntries = 0;
 
 	printf("Cache:\n");
 	printf("\tDevBlockSize = %u\n", cache->DevBlockSize);
 	printf("\tCache Block Size = %u\n", cache->BlockSize);
-	printf("\tHash Size = %u\n", cache->HashSize);
-	printf("\tHash Table:\n");
-	for (i = 0; i < cache->HashSize; i++) {
-		Tag_t *tag;
-
-		for (tag = cache->Hash[i]; tag; tag = tag->Next) {
-			numEntries++;
-			printf("\t\tOffset %llu, refs %u, Flags %#x (%skLazyWrite, %skLockWrite)\n",
-			       tag->Offset, tag->Refs, tag->Flags,
-			       (tag->Flags & kLazyWrite) ? "" : "no ",
-			       (tag->Flags & kLockWrite) ? "" : "no ");
+	printf("\tShards = %u\n", cache->ShardCount);
+	for (s = 0; s < cache->ShardCount; s++) {
+		CacheShard_t *shard = &cache->Shards[s];
+
+		printf("\tShard %u: Hash Size = %u, In = %u, Out = %u\n", s, shard->HashSize,
+		       shard->LRU.InCount, shard->LRU.OutCount);
+		printf("\tHash Table:\n");
+		for (i = 0; i < shard->HashSize; i++) {
+			Tag_t *tag;
+
+			for (tag = shard->Hash[i]; tag; tag = tag->Next) {
+				numEntries++;
+				printf("\t\tOffset %llu, refs %u, Flags %#x (%skLazyWrite, %skLockWrite)\n",
+				       tag->Offset, tag->Refs, tag->Flags,
+				       (tag->Flags & kLazyWrite) ? "" : "no ",
+				       (tag->Flags & kLockWrite) ? "" : "no ");
+			}
 		}
 	}
 	printf("\tNumber of entries: %u\n", numEntries);
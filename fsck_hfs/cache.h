@@ -29,6 +29,7 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 #include <stdint.h>
+#include <pthread.h>
 
 /* Different values for initializing cache */
 enum {
@@ -51,7 +52,15 @@ enum {
 #endif
 	/* MaxCacheSize will be 3G for 64-bit, and 1G for 32-bit */
 	MaxCacheSize			=	((unsigned)MaxCacheBlockSize * MaxCacheBlocks),
-	CacheHashSize			=	257,		/* prime number */
+	CacheHashSize			=	257,		/* minimum hash buckets; grown to fit the cache */
+
+	/* Lock striping */
+	CacheMaxShards			=	16,		/* power of two */
+	CacheMinShardBlocks		=	256,		/* don't split the cache finer than this */
+
+	/* Asynchronous readahead */
+	CacheReadAheadQueueSize	=	512,		/* requests waiting for a readahead thread */
+	CacheMaxReadAheadThreads	=	16,
 };
 
 /*
@@ -67,10 +76,27 @@ typedef struct LRUNode_t
 	struct LRUNode_t *	Prev;	/* Previous node in the LRU */
 } LRUNode_t;
 
+/*
+ * LRU_t
+ *
+ *  2Q replacement.  Blocks read for the first time go on the In queue, which
+ *  is a FIFO; when they fall off its end only their tag is kept, on the Out
+ *  queue.  A block that is asked for again while its tag is on the Out queue
+ *  has been used more than once, and goes on the main queue (Head), which is
+ *  an ordinary LRU.  A scan of blocks that are used once therefore only ever
+ *  pushes other blocks out of the In queue.
+ */
 typedef struct LRU_t
 {
-	LRUNode_t			Head;	/* Dummy node for the head of the LRU */
+	LRUNode_t			Head;	/* Dummy node for the head of the main LRU */
 	LRUNode_t			Busy;	/* List of busy nodes */
+	LRUNode_t			In;	/* Blocks seen once, first in first out */
+	LRUNode_t			Out;	/* Tags of blocks pushed out of In */
+
+	uint32_t			InCount;	/* Tags in the In queue (busy or not) */
+	uint32_t			InMax;		/* Evict from In rather than the LRU beyond this */
+	uint32_t			OutCount;	/* Tags in the Out queue */
+	uint32_t			OutMax;		/* Forget the oldest Out tags beyond this */
 } LRU_t;
 
 
@@ -116,6 +142,9 @@ typedef struct Tag_t
 	uint64_t		Offset;	/* Offset of the buffer */
 	
 	void *			Buffer;	/* Cache page */
+
+	uint16_t		Queue;	/* 2Q queue the tag belongs to */
+	uint16_t		Busy;	/* Tag is parked on the Busy list */
 } Tag_t;
 
 
@@ -123,42 +152,98 @@ typedef struct Tag_t
 enum {
 	kLazyWrite		 = 0x00000001, 	/* only write this page when evicting or forced */
 	kLockWrite		 = 0x00000002,  /* Never evict this page -- will not work with writing yet! */
+	kReadAhead		 = 0x00000004,	/* Brought in by readahead, not yet asked for */
+};
+
+/* Tag_t.Queue values */
+enum {
+	kQueueNone		 = 0,		/* Not on any queue yet */
+	kQueueIn		 = 1,		/* LRU_t.In */
+	kQueueMain		 = 2,		/* LRU_t.Head */
+	kQueueOut		 = 3,		/* LRU_t.Out; the tag has no buffer */
 };
 
 /*
- * Cache_t
+ * CacheShard_t
  *
- *  The main cache data structure. The cache manages access between an open
- *  file and the cache client program.
+ *  The cache is split into shards, each with its own lock, hash table,
+ *  replacement queues and cache blocks.  Consecutive cache blocks of the
+ *  disk go to consecutive shards, so threads reading different parts of a
+ *  file rarely wait for one another.
  *
  *  NOTE: The LRU field must be the first field, so we can easily cast between
  *        the two.
  */
-typedef struct Cache_t
+typedef struct CacheShard_t
 {
 	LRU_t		LRU;		/* LRU replacement data structure */
-	
+
+	struct Cache_t *	Cache;		/* Cache this shard belongs to */
+	pthread_mutex_t	Lock;		/* Protects everything below */
+
+	Tag_t **	Hash;		/* Lookup hash table (move to front) */
+	uint32_t	HashSize;	/* Size of the hash table (power of two) */
+
+	void *		FreeHead;	/* Head of the free list */
+	uint32_t	FreeSize;	/* Size of the free list */
+	uint32_t	TotalBlocks;	/* Cache blocks owned by this shard */
+
+	uint64_t	Hits;		/* Reads found in the cache */
+	uint64_t	Misses;		/* Reads that went to the disk */
+	uint64_t	GhostHits;	/* Misses whose tag was still on the Out queue */
+	uint64_t	Evictions;	/* Buffers taken away from a block */
+	uint64_t	ReadAheads;	/* Blocks brought in by readahead */
+	uint64_t	ReadAheadHits;	/* ... that were then read */
+} CacheShard_t;
+
+/*
+ * CacheReadAheadReq_t
+ *
+ *  A range waiting to be read ahead.
+ */
+typedef struct CacheReadAheadReq_t
+{
+	uint64_t	Offset;
+	uint32_t	Length;
+} CacheReadAheadReq_t;
+
+/*
+ * Cache_t
+ *
+ *  The main cache data structure. The cache manages access between an open
+ *  file and the cache client program.
+ */
+typedef struct Cache_t
+{
 	int		FD_R;		/* File descriptor (read-only) */
 	int		FD_W;		/* File descriptor (write-only) */
 	uint32_t	DevBlockSize;	/* Device block size */
-	
-	Tag_t **	Hash;		/* Lookup hash table (move to front) */
-	uint32_t	HashSize;	/* Size of the hash table */
 	uint32_t	BlockSize;	/* Size of the cache page */
 
-	void *		FreeHead;	/* Head of the free list */
-	uint32_t	FreeSize;	/* Size of the free list */
+	CacheShard_t	Shards[CacheMaxShards];	/* Lock stripes */
+	uint32_t	ShardCount;	/* Shards in use (power of two) */
 
+	pthread_mutex_t	BufLock;	/* Protects the buffer lists and request counters */
 	Buf_t *		ActiveBufs;	/* List of active buffers */
 	Buf_t *		FreeBufs;	/* List of free buffers */
 
 	uint32_t	ReqRead;	/* Number of read requests */
 	uint32_t	ReqWrite;	/* Number of write requests */
 	
-	uint32_t	DiskRead;	/* Number of actual disk reads */
-	uint32_t	DiskWrite;	/* Number of actual disk writes */
+	uint32_t	DiskRead;	/* Number of actual disk reads (atomic) */
+	uint32_t	DiskWrite;	/* Number of actual disk writes (atomic) */
 
 	uint32_t	Span;		/* Requests that spanned cache blocks */
+
+	/* Asynchronous readahead, see CacheReadAheadAsync */
+	pthread_mutex_t	RALock;		/* Protects the readahead queue */
+	pthread_cond_t	RACond;		/* Queue changed, or the threads should stop */
+	CacheReadAheadReq_t	RAQueue[CacheReadAheadQueueSize];
+	uint32_t	RAHead;		/* Oldest waiting request */
+	uint32_t	RACount;	/* Requests waiting */
+	int		RAStop;		/* Readahead threads should exit */
+	int		RAThreads;	/* Readahead threads running */
+	pthread_t	RAThread[CacheMaxReadAheadThreads];
 } Cache_t;
 
 extern Cache_t fscache;
@@ -215,16 +300,59 @@ int CacheWrite ( Cache_t *cache, Buf_t *buf, int age, uint32_t writeOptions );
  */
 int CacheRelease (Cache_t *cache, Buf_t *buf, int age);
 
+/*
+ * CacheReadCopy
+ *
+ *  Copies a range of bytes out of the cache into the caller's buffer,
+ *  without leaving an active buffer behind.
+ */
+int CacheReadCopy (Cache_t *cache, uint64_t off, uint32_t len, void *buf);
+
+/*
+ * CacheReadAhead
+ *
+ *  Brings the cache blocks covering a range into the cache.  The disk read
+ *  is done without holding any cache lock, so this may be called from a
+ *  helper thread while the cache is otherwise in use.
+ */
+int CacheReadAhead (Cache_t *cache, uint64_t off, uint32_t len);
+
+/*
+ * CacheStartReadAhead
+ *
+ *  Starts up to the given number of threads to serve CacheReadAheadAsync.
+ *  They keep running until CacheDestroy.
+ */
+int CacheStartReadAhead (Cache_t *cache, int threads);
+
+/*
+ * CacheReadAheadAsync
+ *
+ *  Queues a range for CacheReadAhead on one of the readahead threads, and
+ *  returns without waiting for it, unless the queue is full.  Does nothing
+ *  if no readahead threads have been started.
+ */
+int CacheReadAheadAsync (Cache_t *cache, uint64_t off, uint32_t len);
+
+/*
+ * CacheCancelReadAhead
+ *
+ *  Drops the readahead requests that haven't been started yet.
+ */
+void CacheCancelReadAhead (Cache_t *cache);
+
 /* CacheRemove
  *
- *  Disposes of a particular tag and buffer.
+ *  Disposes of a particular tag and buffer.  The caller holds the lock of
+ *  the tag's shard.
  */
 int CacheRemove (Cache_t *cache, Tag_t *tag);
 
 /*
  * CacheEvict
  *
- *  Only dispose of the buffer, leave the tag intact.
+ *  Only dispose of the buffer, leave the tag intact.  The caller holds the
+ *  lock of the tag's shard.
  */
 int CacheEvict (Cache_t *cache, Tag_t *tag);
 
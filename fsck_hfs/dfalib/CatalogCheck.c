@@ -83,12 +83,11 @@ static Boolean 	FixDecomps(	u_int16_t charCount, const u_int16_t *inFilename, HF
 /*
  * This structure is used to keep track of the folderCount field in
  * HFSPlusCatalogFolder records.  For now, this is only done on HFSX volumes.
+ * Entries are kept in an IDHash keyed by folder ID.
  */
 struct folderCountInfo {
-	UInt32 folderID;
 	UInt32 recordedCount;
 	UInt32 computedCount;
-	struct folderCountInfo *next;
 };
 
 /*
@@ -178,86 +177,15 @@ CountFolderRecords(HFSPlusCatalogKey *myKey, HFSPlusCatalogFolder *folder, SGlob
 	return err;
 }
 
-static void
-releaseFolderCountInfo(struct folderCountInfo *fcip, int numFolders)
-{
-	int i;
-
-	for (i = 0; i < numFolders; i++) {
-		struct folderCountInfo *f = &fcip[i];
-
-		f = f->next;
-		while (f) {
-			struct folderCountInfo *t = f->next;
-			free(f);
-			f = t;
-		}
-	}
-	free(fcip);
-}
-
-static struct folderCountInfo *
-findFolderEntry(struct folderCountInfo *fcip, int numFolders, UInt32 fid)
-{
-	struct folderCountInfo *retval = NULL;
-	int indx;
-
-	indx = fid % numFolders;	// Slot index
-
-	retval = &fcip[indx];
-	if (retval->folderID == fid) {
-		goto done;
-	}
-	while (retval->next != NULL) {
-		retval = retval->next;
-		if (retval->folderID == fid)
-			goto done;
-	}
-	retval = NULL;
-done:
-	return retval;
-}
-
-static struct folderCountInfo *
-addFolderEntry(struct folderCountInfo *fcip, int numFolders, UInt32 fid)
-{
-	struct folderCountInfo *retval = NULL;
-	int indx;
-
-	indx = fid % numFolders;
-	retval = &fcip[indx];
-
-	if (retval->folderID == fid)
-		goto done;
-	while (retval->folderID != 0) {
-		if (retval->next == NULL) {
-			retval->next = calloc(1, sizeof(struct folderCountInfo));
-			if (retval->next == NULL) {
-				retval = NULL;
-				goto done;
-			} else
-				retval = retval->next;
-		} else if (retval->folderID == fid) {
-			goto done;
-		} else
-			retval = retval->next;
-	}
-
-	retval->folderID = fid;
-
-done:
-	return retval;
-}
-
 /*
  * folderCountAdd - Accounts for given folder record or directory hard link  
  * for folder count of the given parent directory.  For directory hard links, 
  * the folder ID and count should be zero.  For a folder record, the values 
  * read from the catalog record are provided which are used to add the 
- * given folderID to the cache (folderCountInfo *ficp).
+ * given folderID to the cache (fcip).
  */
 static int
-folderCountAdd(struct folderCountInfo *fcip, int numFolders, UInt32 parentID, UInt32 folderID, UInt32 count)
+folderCountAdd(IDHash *fcip, UInt32 parentID, UInt32 folderID, UInt32 count)
 {
 	int retval = 0;
 	struct folderCountInfo *curp = NULL;
@@ -271,13 +199,10 @@ folderCountAdd(struct folderCountInfo *fcip, int numFolders, UInt32 parentID, UI
 		 * we add it.  If we do find it, or if we add it, we set the recordedCount.
 		 */
 
-		curp = findFolderEntry(fcip, numFolders, folderID);
+		curp = IDHashInsert(fcip, folderID, NULL);
 		if (curp == NULL) {
-			curp = addFolderEntry(fcip, numFolders, folderID);
-			if (curp == NULL) {
-				retval = ENOMEM;
-				goto done;
-			}
+			retval = ENOMEM;
+			goto done;
 		}
 		curp->recordedCount = count;
 
@@ -287,13 +212,10 @@ folderCountAdd(struct folderCountInfo *fcip, int numFolders, UInt32 parentID, UI
 	 * After that, we try to find the parent to this entry.  When we find it
 	 * (or if we add it to the list), we increment the computedCount.
 	 */
-	curp = findFolderEntry(fcip, numFolders, parentID);
+	curp = IDHashInsert(fcip, parentID, NULL);
 	if (curp == NULL) {
-		curp = addFolderEntry(fcip, numFolders, parentID);
-		if (curp == NULL) {
-			retval = ENOMEM;
-			goto done;
-		}
+		retval = ENOMEM;
+		goto done;
 	}
 	curp->computedCount++;
 
@@ -311,20 +233,19 @@ done:
  *
  * However, since scanning the entire catalog can be a very costly operation, we dot
  * it one of two ways.  The first way is to simply iterate through the catalog once,
- * and keep track of each folder ID we come across.  This uses a fair bit of memory,
- * so we limit the cache to 5MBytes, which works out to some 400k folderCountInfo
- * entries (at the current size of three 4-byte entries per folderCountInfo entry).
- * If the filesystem has more than that, we instead use the slower (but significantly
- * less memory-intensive) method in CountFolderRecords:  for each folder ID we
- * come across, we call CountFolderRecords, which does its own iteration through the
- * catalog, looking for children of the given folder.
+ * and keep track of each folder ID we come across, in an IDHash of folderCountInfo
+ * entries (16 bytes per folder).  If that table cannot be allocated or grown, we
+ * instead use the slower (but significantly less memory-intensive) method in
+ * CountFolderRecords:  for each folder ID we come across, we call CountFolderRecords,
+ * which does its own iteration through the catalog, looking for children of the
+ * given folder.
  */
 
 OSErr
 CheckFolderCount( SGlobPtr GPtr )
 {
 	OSErr err = 0;
-	int numFolders;
+	UInt32 numFolders;
 	BTreeIterator iterator;
 	FSBufferDescriptor btRecord;
 	HFSPlusCatalogKey *key;
@@ -333,7 +254,8 @@ CheckFolderCount( SGlobPtr GPtr )
 		HFSPlusCatalogFile catFile;
 	} catRecord;
 	UInt16 recordSize = 0;
-	struct folderCountInfo *fcip = NULL;
+	IDHash folderCounts;
+	IDHash *fcip = NULL;
 
 	ClearMemory(&iterator, sizeof(iterator));
 	if (!VolumeObjectIsHFSX(GPtr)) {
@@ -345,37 +267,22 @@ CheckFolderCount( SGlobPtr GPtr )
 		goto done;
 	}
 
-#if 0
 	/*
 	 * We add two so we can account for the root folder, and
 	 * the root folder's parent.  Neither of which is real,
 	 * but they show up as parent IDs in the catalog.
+	 * The folder count only sizes the table up front (and
+	 * may be wrong on a damaged volume), so don't trust it
+	 * for more than 5Mbytes; the table grows if needed.
 	 */
+#define MAXCACHEFOLDERS	((5 * 1024 * 1024) / 16)	/* 5Mbytes */
 	numFolders = GPtr->calculatedVCB->vcbFolderCount + 2;
-#else
-	/*
-	 * Since we're using a slightly smarter hash method,
-	 * we don't care so much about the number of folders
-	 * allegedly on the volume; instead, we'll pick a nice
-	 * prime number to use as the number of buckets.
-	 * This bears some performance checking later.
-	 */
-	numFolders = 257;
-#endif
+	if (numFolders < 2 || numFolders > MAXCACHEFOLDERS)
+		numFolders = MAXCACHEFOLDERS;
+#undef MAXCACHEFOLDERS
 
-	/*
-	 * Limit the size of the folder count cache to 5Mbytes;
-	 * if the requested number of folders don't fit, then
-	 * we don't use the cache at all.
-	 */
-#define MAXCACHEMEM	(5 * 1024 * 1024)	/* 5Mbytes */
-#define LCALLOC(c, s, l)	\
-	({ __typeof(c) _count = (c); __typeof(s) _size = (s); __typeof(l) _lim = (l); \
-		((_count * _size) > _lim) ? NULL : calloc(_count, _size); })
-
-	fcip = LCALLOC(numFolders, sizeof(*fcip), MAXCACHEMEM);
-#undef MAXCACHEMEM
-#undef LCALLOC
+	if (IDHashInit(&folderCounts, sizeof(struct folderCountInfo), numFolders) == 0)
+		fcip = &folderCounts;
 
 restart:
 	/* these objects are used by the BT* functions to iterate through the catalog */
@@ -412,7 +319,7 @@ restart:
 					goto done;
 			}
 			if (fcip) {
-				if (folderCountAdd(fcip, numFolders,
+				if (folderCountAdd(fcip,
 					key->parentID,
 					catRecord.catRecord.folderID,
 					catRecord.catRecord.folderCount)) {
@@ -425,7 +332,7 @@ restart:
 					 * the cache was allocated, and start over as if we had never
 					 * allocated a cache in the first place.
 					 */
-					releaseFolderCountInfo(fcip, numFolders);
+					IDHashFree(fcip);
 					fcip = NULL;
 					goto restart;
 				}
@@ -451,10 +358,10 @@ restart:
 				 * in CountFolderRecords()
 				 */
 			    	if (fcip) {
-					if (folderCountAdd(fcip, numFolders, 
+					if (folderCountAdd(fcip,
 						key->parentID, 0, 0)) {
 						/* See above for why we release & restart */
-						releaseFolderCountInfo(fcip, numFolders);
+						IDHashFree(fcip);
 						fcip = NULL;
 						goto restart;
 					}
@@ -467,40 +374,35 @@ restart:
 	if (err == btNotFound)
 		err = 0;	// We hit the end of the file, which is okay
 	if (err == 0 && fcip != NULL) {
-		int i;
+		struct folderCountInfo *curp;
+		UInt32 cursor = 0;
+		UInt32 folderID;
 
 		/*
 		 * At this point, we are itereating through the cache, looking for
 		 * mis-counts. (If we're not using the cache, then CountFolderRecords has
 		 * already dealt with any miscounts.)
 		 */
-		for (i = 0; i < numFolders; i++) {
-			struct folderCountInfo *curp;
-
-			for (curp = &fcip[i]; curp; curp = curp->next) {
-				if (curp->folderID == 0) {
-					// fplog(stderr, "fcip[%d] has a folderID of 0?\n", i);
-				} else if (curp->folderID == kHFSRootParentID) {
-					// Root's parent doesn't really exist
-					continue;
-				} else {
-					if (curp->recordedCount != curp->computedCount) {
-						/* RcdFCntErr requests a repair order to correct the folder count */
-						err = RcdFCntErr( GPtr,
-									E_FldCount,
-									curp->computedCount,
-									curp->recordedCount,
-									curp->folderID );
-						if (err != 0)
-							goto done;
-					}
-				}
+		while ((curp = IDHashNext(fcip, &cursor, &folderID)) != NULL) {
+			if (folderID == 0 || folderID == kHFSRootParentID) {
+				// Root's parent doesn't really exist
+				continue;
+			}
+			if (curp->recordedCount != curp->computedCount) {
+				/* RcdFCntErr requests a repair order to correct the folder count */
+				err = RcdFCntErr( GPtr,
+							E_FldCount,
+							curp->computedCount,
+							curp->recordedCount,
+							folderID );
+				if (err != 0)
+					goto done;
 			}
 		}
 	}
 done:
 	if (fcip) {
-		releaseFolderCountInfo(fcip, numFolders);
+		IDHashFree(fcip);
 		fcip = NULL;
 	}
 	return err;
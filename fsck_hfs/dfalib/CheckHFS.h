@@ -68,6 +68,7 @@ enum {
 #define REBUILD_ATTRIBUTE	0x4
 
 extern int gGUIControl;
+extern int gBTCheckThreads;	/* leaf readahead threads for the B-tree checks */
 
 extern int CheckHFS(	const char *rdevnode, int fsReadRef, int fsWriteRef, 
 						int checkLevel, int repairLevel, 
@@ -31,12 +31,11 @@
 /* If set, verification of corresponding inode is completed successfully */
 #define LINKINFO_CHECK	0x02
 
-/* info saved for each indirect link encountered */
+/* info saved for each indirect link encountered, in an IDHash keyed by
+ * link reference number for file hard links, and inodeID for directory
+ * hard links.
+ */
 struct IndirectLinkInfo {
-	/* linkID is link reference number for file hard links, and 
-	 * inodeID for directory hard links.
-	 */
-	UInt32	linkID;	
 	UInt32	linkCount;
 	UInt32 	flags;
 	struct HardLinkList *list;
@@ -82,14 +81,13 @@ static int  RecordBadHardLinkPrev(SGlobPtr gp, UInt32 fileID, UInt32 is, UInt32
 static int  RecordBadLinkCount(SGlobPtr gp, UInt32 inodeID, UInt32 is, UInt32 shouldbe) ;
 static int  RecordOrphanLink(SGlobPtr gp, Boolean isdir, UInt32 linkID);
 static int  RecordOrphanInode(SGlobPtr gp, Boolean isdir, UInt32 inodeID);
-static void hash_insert(UInt32 linkID, int totalSlots, int slotsUsed, struct IndirectLinkInfo *linkInfo);
-static struct IndirectLinkInfo * hash_search(UInt32 linkID, int totalSlots, int slotsUsed, struct IndirectLinkInfo *linkInfo);
 
 /*
  * Some functions used when sorting the hard link chain.
  * chain_compare() is used by qsort; find_id is just a linear
- * search to find a specific fileID; and tsort does a
- * topological sort on the linked list.
+ * search to find a specific fileID, and find_id_hashed does the
+ * same lookup through an IDHash for long chains; and tsort does
+ * a topological sort on the linked list.
  */
 static int
 chain_compare(const void *a1, const void *a2) {
@@ -110,11 +108,41 @@ find_id(struct HardLinkList *list, int nel, int id)
 	return 0;
 }
 
+/*
+ * Chains longer than this get an IDHash of their fileIDs in tsort;
+ * shorter ones are cheaper to search linearly.
+ */
+#define LINKLIST_HASH_MIN	32
+
+/* Position of a fileID in the list, and how many more entries share it */
+struct LinkListPos {
+	int	first;
+	int	dups;
+};
+
+static int
+find_id_hashed(struct HardLinkList *list, int nel, IDHash *ids, int id)
+{
+	struct LinkListPos *pos;
+
+	pos = IDHashFind(ids, id);
+	if (pos == NULL) {
+		return 0;
+	}
+	if (list[pos->first].fileID == id) {
+		return pos->first;
+	}
+	/* The first node with this ID was already visited; look for another */
+	return pos->dups ? find_id(list, nel, id) : 0;
+}
+
 static int
 tsort(struct HardLinkList *list, int nel)
 {
 	struct HardLinkList *tmp;
 	int cur_indx, tmp_indx = 0;
+	IDHash ids;
+	Boolean useHash = false;
 
 	int rv = 0;
 
@@ -132,6 +160,32 @@ tsort(struct HardLinkList *list, int nel)
 	 */
 	qsort(list, nel, sizeof(list[0]), chain_compare);
 
+	/*
+	 * Following the next links with find_id is quadratic in the chain
+	 * length, which hurts for inodes with thousands of links.  Index
+	 * long chains by fileID instead; if that fails, fall back to find_id.
+	 */
+	if (nel > LINKLIST_HASH_MIN &&
+	    IDHashInit(&ids, sizeof(struct LinkListPos), nel) == 0) {
+		struct LinkListPos *pos;
+		int added;
+
+		useHash = true;
+		for (cur_indx = 0; cur_indx < nel; cur_indx++) {
+			pos = IDHashInsert(&ids, list[cur_indx].fileID, &added);
+			if (pos == NULL) {
+				IDHashFree(&ids);
+				useHash = false;
+				break;
+			}
+			if (added) {
+				pos->first = cur_indx;
+			} else {
+				pos->dups++;
+			}
+		}
+	}
+
 	for (cur_indx = 0; cur_indx < nel; cur_indx++) {
 		int i;
 		/* Skip nodes we've already come across */
@@ -145,7 +199,7 @@ tsort(struct HardLinkList *list, int nel)
 		/* ... and then find all its children. */
 		for (i = tmp[tmp_indx-1].next; i != 0; ) {
 			// look for the node in list with that fileID
-			int j = find_id(list, nel, i);
+			int j = useHash ? find_id_hashed(list, nel, &ids, i) : find_id(list, nel, i);
 			if (j == 0) {
 				// We couldn't find it
 				// So we're done
@@ -165,6 +219,9 @@ done:
 	if (tmp) {
 		free(tmp);
 	}
+	if (useHash) {
+		IDHashFree(&ids);
+	}
 
 	return rv;
 }
@@ -329,60 +386,28 @@ HardLinkCheckEnd(void * cookie)
  * link count for such hard links cannot be verified 
  * using CRT, therefore it is accounted in this hash.
  */
-#define FILELINK_HASH_SIZE 257
-
 struct filelink_hash {
-	UInt32 link_ref_num;
 	UInt32 found_link_count;
 	UInt32 calc_link_count;
-	struct filelink_hash *next;
 };
 
-struct filelink_hash **filelink_head = NULL;
-UInt32 filelink_entry_count = 0;
+/* IDHash of struct filelink_hash, keyed by link reference number */
+static IDHash filelink_table;
 
-/* Search and return pointer to the entry for given inode ID.
- * If no entry is found, return NULL.
+/* Return the entry for given link reference number, inserting 
+ * a new entry (and allocating the hash) if none exists.
+ * Returns NULL on allocation failure.
  */
-static struct filelink_hash *filelink_hash_search(UInt32 link_ref_num) 
+static struct filelink_hash *filelink_hash_get(UInt32 link_ref_num) 
 {
-	struct filelink_hash *cur;
-
-	if (filelink_head == NULL) {
-		return NULL;
-	}
-
-	cur = filelink_head[link_ref_num % FILELINK_HASH_SIZE];
-	while (cur) {
-		if (link_ref_num == cur->link_ref_num) {
-			break;
+	/* If no hash exists, allocate the hash */
+	if (filelink_table.slots == NULL) {
+		if (IDHashInit(&filelink_table, sizeof(struct filelink_hash), 0) != 0) {
+			return NULL;
 		}
-		cur = cur->next;
 	}
 
-	return cur;
-}
-
-/* Allocate and insert entry for given inode ID in the 
- * hash.  The caller function is responsible for searching 
- * for duplicates before calling this function.  
- * Returns the pointer to the new hash entry.
- */
-static struct filelink_hash *filelink_hash_insert(UInt32 link_ref_num) 
-{
-	struct filelink_hash *cur;
-
-	cur = malloc(sizeof(struct filelink_hash));
-	if (!cur) {
-		return cur;
-	}
-	cur->link_ref_num = link_ref_num;
-	cur->found_link_count = 0;
-	cur->calc_link_count = 0;
-	cur->next = filelink_head[link_ref_num % FILELINK_HASH_SIZE];
-	filelink_head[link_ref_num % FILELINK_HASH_SIZE] = cur; 
-	filelink_entry_count++;
-	return cur;
+	return IDHashInsert(&filelink_table, link_ref_num, NULL);
 }
 
 /* Update the hash with information about a file hard link 
@@ -395,18 +420,7 @@ static int filelink_hash_link(UInt32 link_ref_num)
 {
 	struct filelink_hash *cur;
 	
-	/* If no hash exists, allocate the hash */
-	if (filelink_head == NULL) {
-		filelink_head = calloc(FILELINK_HASH_SIZE, sizeof(struct filelink_hash *));
-		if (filelink_head == NULL) {
-			return ENOMEM;
-		}
-	}
-
-	cur = filelink_hash_search(link_ref_num);
-	if (!cur) {
-		cur = filelink_hash_insert(link_ref_num);
-	}
+	cur = filelink_hash_get(link_ref_num);
 	if (cur) {
 		cur->calc_link_count++;
 		return 0;
@@ -425,18 +439,7 @@ int filelink_hash_inode(UInt32 link_ref_num, UInt32 linkCount)
 {
 	struct filelink_hash *cur;
 
-	/* If no hash exists, allocate the hash */
-	if (filelink_head == NULL) {
-		filelink_head = calloc(FILELINK_HASH_SIZE, sizeof(struct filelink_hash *));
-		if (filelink_head == NULL) {
-			return ENOMEM;
-		}
-	}
-
-	cur = filelink_hash_search(link_ref_num);
-	if (!cur) {
-		cur = filelink_hash_insert(link_ref_num);
-	}
+	cur = filelink_hash_get(link_ref_num);
 	if (cur) {
 		cur->found_link_count = linkCount;
 		return 0;
@@ -451,19 +454,7 @@ int filelink_hash_inode(UInt32 link_ref_num, UInt32 linkCount)
  */
 static void filelink_hash_destroy(void) 
 {
-	int i;
-	struct filelink_hash *cur;
-
-	for (i = 0; i < FILELINK_HASH_SIZE; i++) {
-		while (filelink_head[i]) {
-			cur = filelink_head[i];
-			filelink_head[i] = cur->next;
-			free (cur);
-		}
-	}
-	free(filelink_head);
-	filelink_head = NULL;
-	filelink_entry_count = 0;
+	IDHashFree(&filelink_table);
 }
 
 /*
@@ -542,7 +533,7 @@ int
 RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 {
 	int result = 0;
-	struct IndirectLinkInfo *linkInfo = NULL;
+	IDHash	linkInfo;
 	CatalogRecord	rec;
 	HFSPlusCatalogKey	*keyp;
 	BTreeIterator	iterator;
@@ -552,13 +543,14 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 	UInt32	metadirid;
 	SFCB	*fcb;
 	size_t	prefixlen;
-	int	slotsUsed = 0, slots = 0;
 	char *prefixName;
 	UInt32 folderID;
 	UInt32 link_ref_num;
 	int entries;
 	UInt32 flags;
 
+	ClearMemory(&linkInfo, sizeof(linkInfo));
+
 	if (isdir) {
 		metadirid = gp->dirlink_priv_dir_id;
 		prefixlen = strlen(HFS_DIRINODE_PREFIX);
@@ -590,14 +582,9 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 		folderID = 0;
 	}
 
-	for (slots = 1; slots <= entries; slots <<= 1)
-		continue;
-	if (slots < (entries + (entries/3)))
-		slots <<= 1;
-	linkInfo = calloc(slots, sizeof(struct IndirectLinkInfo));
-	if (linkInfo == NULL) {
+	if (IDHashInit(&linkInfo, sizeof(struct IndirectLinkInfo), entries) != 0) {
 		if (fsckGetVerbosity(gp->context) >= kDebugLog) {
-			plog("RepairHardLinkChains:  calloc(%d, %zu) failed\n", slots, sizeof(struct IndirectLinkInfo));
+			plog("RepairHardLinkChains:  hash allocation for %d entries failed\n", entries);
 		}
 		result = ENOMEM;
 		goto done;
@@ -667,6 +654,7 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 			struct HardLinkList *tlist = NULL;
 			int i;
 			int count;
+			int added;
 
 			linkID = file->fileID;
 			inodeID = file->bsdInfo.special.iNodeNum;
@@ -710,25 +698,19 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 			 * created post-Tiger).  For each inodeID, add the 
 			 * <prev, id, next> triad.
 			 */
-			li = hash_search(inodeID, slots, slotsUsed, linkInfo);
-			if (li) {
-				li->linkCount++;
-			} else {
-				entries++;
-				/* hash_insert() initializes linkCount to 1 */
-				hash_insert(inodeID, slots, slotsUsed++, linkInfo);
-				li = hash_search(inodeID, slots, slotsUsed, linkInfo);
-			}
+			li = IDHashInsert(&linkInfo, inodeID, &added);
 			if (li == NULL) {
-				/*
-				 * Either the hash passed in should have the entry, or
-				 * the one we just created should (because we just added it);
-				 * either way, if it's not here, we've got something weird
-				 * going on, so let's just abort now.
-				 */
-				result = ENOENT;
+				/* The hash could not grow to hold this inode */
+				result = ENOMEM;
 				goto done;
 			}
+			if (added) {
+				entries++;
+				li->flags |= LINKINFO_INIT;
+				li->linkCount = 1;
+			} else {
+				li->linkCount++;
+			}
 
 			count = li->linkCount - 1;
 			/* Reallocate memory to store information about file/directory hard links */
@@ -800,7 +782,7 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 			inodeID = rec.hfsPlusFolder.folderID;
 			link_ref_num = 0;
 			flags = rec.hfsPlusFolder.flags;
-			li = hash_search(inodeID, slots, slotsUsed, linkInfo);
+			li = IDHashFind(&linkInfo, inodeID);
 		} else {
             long ref_num;
 
@@ -815,7 +797,7 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
             }
 			link_ref_num = (UInt32)ref_num;
 			flags = rec.hfsPlusFile.flags;
-			li = hash_search(link_ref_num, slots, slotsUsed, linkInfo);
+			li = IDHashFind(&linkInfo, link_ref_num);
 		}
 
 		/* file/directory inode should always have kHFSHasLinkChainBit set */
@@ -859,26 +841,29 @@ RepairHardLinkChains(SGlobPtr gp, Boolean isdir)
 
 	/* Check for orphan hard links */
 	if (entries) {
-	 	int i, j;
-		for (i = 0; i < slots; i++) {
+		struct IndirectLinkInfo *li;
+		UInt32 cursor = 0;
+	 	int j;
+		while ((li = IDHashNext(&linkInfo, &cursor, NULL)) != NULL) {
 			/* If node is initialized but never checked, record orphan link */
-			if ((linkInfo[i].flags & LINKINFO_INIT) && 
-			    ((linkInfo[i].flags & LINKINFO_CHECK) == 0)) {
-				for (j = 0; j < linkInfo[i].linkCount; j++) {
-					RecordOrphanLink(gp, isdir, linkInfo[i].list[j].fileID);
+			if ((li->flags & LINKINFO_INIT) && 
+			    ((li->flags & LINKINFO_CHECK) == 0)) {
+				for (j = 0; j < li->linkCount; j++) {
+					RecordOrphanLink(gp, isdir, li->list[j].fileID);
 				}
 			}
 		}
 	}
 
 done:
-	if (linkInfo) {
-		int i;
-		for (i = 0; i < slots; i++) {
-			if (linkInfo[i].list)
-				free(linkInfo[i].list);
+	{
+		struct IndirectLinkInfo *li;
+		UInt32 cursor = 0;
+		while ((li = IDHashNext(&linkInfo, &cursor, NULL)) != NULL) {
+			if (li->list)
+				free(li->list);
 		}
-		free(linkInfo);
+		IDHashFree(&linkInfo);
 	}
 
 	return result;
@@ -1011,8 +996,8 @@ CheckHardLinks(void *cookie)
 	 * and the hard links, and the first/prev/next ID is zero --- and 
 	 * hence they were ignored from CRT check and added to hash.
 	 */
-	if (filelink_entry_count) {
-		int i;
+	if (filelink_table.count) {
+		UInt32 cursor = 0;
 		struct filelink_hash *cur;
 
 		/* Since pre-Leopard OS hard links were detected, they 
@@ -1022,27 +1007,21 @@ CheckHardLinks(void *cookie)
 		 * file hard link repairs are performed.
 		 */
 		if (fsckGetVerbosity(gp->context) >= kDebugLog) {
-			plog("\tCheckHardLinks: found %u pre-Leopard file inodes.\n", filelink_entry_count);
+			plog("\tCheckHardLinks: found %u pre-Leopard file inodes.\n", filelink_table.count);
 		}
 
-		for (i = 0; i < FILELINK_HASH_SIZE; i++) {
-			cur = filelink_head[i];
-			while (cur) {
-				if ((cur->found_link_count == 0) || 
-				    (cur->calc_link_count == 0) ||
-				    (cur->found_link_count != cur->calc_link_count)) {
-					record_link_badchain(gp, false);
-					goto exit;
-				}
-				cur = cur->next;
+		while ((cur = IDHashNext(&filelink_table, &cursor, NULL)) != NULL) {
+			if ((cur->found_link_count == 0) || 
+			    (cur->calc_link_count == 0) ||
+			    (cur->found_link_count != cur->calc_link_count)) {
+				record_link_badchain(gp, false);
+				goto exit;
 			}
 		}
 	}
 
 exit:
-	if (filelink_entry_count) {
-		filelink_hash_destroy();
-	}
+	filelink_hash_destroy();
 
 	if (catBucket)
 		free(catBucket);
@@ -1272,61 +1251,3 @@ RecordBadLinkCount(SGlobPtr gp, UInt32 inodeID, UInt32 is, UInt32 shouldbe)
 	p->parid = inodeID;	// *Not* the parent ID
 	return (0);
 }
-
-
-static void
-hash_insert(UInt32 linkID, int totalSlots, int slotsUsed, struct IndirectLinkInfo *linkInfo)
-{
-	int i, last;
-	
-	i = linkID & (totalSlots - 1);
-	
-	last = (i + (totalSlots-1)) % totalSlots;
-	while ((i != last) && 
-	       (linkInfo[i].flags & LINKINFO_INIT) &&
-	       (linkInfo[i].linkID != linkID)) {
-		i = (i + 1) % totalSlots;
-	}
-
-	if ((linkInfo[i].flags & LINKINFO_INIT) == 0) {
-		if (linkInfo[i].list) {
-			plog ("hash: overwriting data! (old:%u, new:%u)\n", linkInfo[i].linkID, linkID);
-			exit(13);
-		}
-		linkInfo[i].flags |= LINKINFO_INIT;
-		linkInfo[i].linkID = linkID;
-		linkInfo[i].linkCount = 1;
-	} else if (linkInfo[i].linkID == linkID) {
-		plog("hash: duplicate insert! (%d)\n", linkID);
-		exit(13);
-	} else {
-		plog("hash table full (%d entries) \n", slotsUsed);
-		exit(14);
-	}
-}
-
-
-static struct IndirectLinkInfo *
-hash_search(UInt32 linkID, int totalSlots, int slotsUsed, struct IndirectLinkInfo *linkInfo)
-{
-	int i, last;
-	int p = 1;
-
-	
-	i = linkID & (totalSlots - 1);
-
-	last = (i + (slotsUsed-1)) % totalSlots;
-	while ((i != last) && 
-	       (linkInfo[i].flags & LINKINFO_INIT) &&
-	       (linkInfo[i].linkID != linkID)) {
-		i = (i + 1) % totalSlots;
-		++p;
-	}
-	
-	if ((linkInfo[i].flags & LINKINFO_INIT) && 
-	    (linkInfo[i].linkID == linkID)) {
-		return (&linkInfo[i]);
-	} else {
-		return (NULL);
-	}
-}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "IDHash.h"
+
+/* Every slot starts with this header; the caller's value follows it */
+typedef struct IDHashSlot {
+	uint32_t	id;
+	uint32_t	used;
+} IDHashSlot;
+
+enum {
+	kIDHashMinSlots = 64,
+};
+
+#define SLOT(table, i)	((IDHashSlot *)((table)->slots + (size_t)(i) * (table)->slotSize))
+#define VALUE(slot)	((void *)((IDHashSlot *)(slot) + 1))
+
+/*
+ * CNIDs are handed out sequentially, so spread them with a Fibonacci
+ * (multiplicative) hash rather than masking off the low bits.
+ */
+static inline uint32_t
+IDHashIndex(const IDHash *table, uint32_t id)
+{
+	return (uint32_t)(id * 2654435769U) >> table->shift;
+}
+
+/* Allocate an empty arena of the given (power of two) number of slots */
+static int
+IDHashAlloc(IDHash *table, uint32_t nslots)
+{
+	uint32_t bits = 0;
+
+	table->slots = calloc(nslots, table->slotSize);
+	if (table->slots == NULL)
+		return ENOMEM;
+
+	while ((1U << bits) < nslots)
+		bits++;
+	table->mask = nslots - 1;
+	table->shift = 32 - bits;
+	table->count = 0;
+	return 0;
+}
+
+/* Linear probe for id; returns its slot, or the empty slot where it belongs */
+static IDHashSlot *
+IDHashProbe(const IDHash *table, uint32_t id)
+{
+	uint32_t i = IDHashIndex(table, id);
+	IDHashSlot *slot;
+
+	for (;;) {
+		slot = SLOT(table, i);
+		if (!slot->used || slot->id == id)
+			return slot;
+		i = (i + 1) & table->mask;
+	}
+}
+
+/* Double the number of slots and rehash every entry into the new arena */
+static int
+IDHashGrow(IDHash *table)
+{
+	IDHash old = *table;
+	IDHashSlot *from, *to;
+	uint32_t i;
+
+	if (old.mask >= 0x7fffffffU)
+		return ENOMEM;
+	if (IDHashAlloc(table, (old.mask + 1) * 2) != 0) {
+		*table = old;
+		return ENOMEM;
+	}
+
+	for (i = 0; i <= old.mask; i++) {
+		from = SLOT(&old, i);
+		if (!from->used)
+			continue;
+		to = IDHashProbe(table, from->id);
+		memcpy(to, from, table->slotSize);
+		table->count++;
+	}
+	free(old.slots);
+	return 0;
+}
+
+/*
+ * IDHashInit - set up an empty table for values of valueSize bytes,
+ * sized so that about expected IDs fit before it has to grow.
+ * Returns 0 or ENOMEM.
+ */
+int
+IDHashInit(IDHash *table, size_t valueSize, uint32_t expected)
+{
+	uint32_t nslots = kIDHashMinSlots;
+
+	memset(table, 0, sizeof(*table));
+	table->valueSize = valueSize;
+	/* Round slots up so that values holding pointers stay aligned */
+	table->slotSize = (sizeof(IDHashSlot) + valueSize + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+
+	/* Keep the load factor under 3/4 */
+	while (nslots < 0x80000000U && (uint64_t)nslots * 3 < (uint64_t)expected * 4)
+		nslots <<= 1;
+
+	return IDHashAlloc(table, nslots);
+}
+
+void
+IDHashFree(IDHash *table)
+{
+	free(table->slots);
+	table->slots = NULL;
+	table->mask = 0;
+	table->count = 0;
+}
+
+/*
+ * IDHashFind - return the value stored for id, or NULL if id has not
+ * been inserted.
+ */
+void *
+IDHashFind(IDHash *table, uint32_t id)
+{
+	IDHashSlot *slot;
+
+	if (table->slots == NULL)
+		return NULL;
+
+	slot = IDHashProbe(table, id);
+	return slot->used ? VALUE(slot) : NULL;
+}
+
+/*
+ * IDHashInsert - return the value stored for id, inserting a zero-filled
+ * value first if id is not in the table yet.  If added is not NULL, it
+ * is set to 1 when a new value was inserted and 0 otherwise.  Returns
+ * NULL if the table could not grow.
+ */
+void *
+IDHashInsert(IDHash *table, uint32_t id, int *added)
+{
+	IDHashSlot *slot;
+
+	if (added)
+		*added = 0;
+	if (table->slots == NULL)
+		return NULL;
+
+	slot = IDHashProbe(table, id);
+	if (slot->used)
+		return VALUE(slot);
+
+	if ((uint64_t)(table->count + 1) * 4 > (uint64_t)(table->mask + 1) * 3) {
+		if (IDHashGrow(table) != 0)
+			return NULL;
+		slot = IDHashProbe(table, id);
+	}
+
+	slot->id = id;
+	slot->used = 1;
+	table->count++;
+	if (added)
+		*added = 1;
+	return VALUE(slot);
+}
+
+/*
+ * IDHashNext - iterate over the table in slot order.  Start with *cursor
+ * set to zero; each call returns the next value and its ID, or NULL once
+ * every entry has been visited.  The table must not be inserted into
+ * while iterating.
+ */
+void *
+IDHashNext(IDHash *table, uint32_t *cursor, uint32_t *id)
+{
+	IDHashSlot *slot;
+
+	if (table->slots == NULL)
+		return NULL;
+
+	while ((uint64_t)*cursor <= table->mask) {
+		slot = SLOT(table, *cursor);
+		(*cursor)++;
+		if (slot->used) {
+			if (id)
+				*id = slot->id;
+			return VALUE(slot);
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef __IDHASH_H__
+#define __IDHASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * IDHash - open-addressing hash table keyed by a 32-bit ID (CNID,
+ * link reference number, ...), used by the folder count and hard link
+ * checks to keep per-ID bookkeeping.
+ *
+ * Every slot holds the ID followed by a caller-defined value of fixed
+ * size, and all slots live in a single power-of-two arena probed
+ * linearly, so a lookup touches one or two cache lines and inserting
+ * an ID costs no allocation until the table has to grow.  Values are
+ * zero-filled when an ID is first inserted.
+ *
+ * Pointers returned by IDHashFind and IDHashInsert stay valid only
+ * until the next IDHashInsert, which may move the arena.
+ */
+typedef struct IDHash {
+	uint8_t		*slots;		/* arena of (mask + 1) slots */
+	size_t		slotSize;	/* bytes per slot, including the slot header */
+	size_t		valueSize;	/* bytes of caller data per slot */
+	uint32_t	mask;		/* number of slots - 1 */
+	uint32_t	shift;		/* 32 - log2(number of slots) */
+	uint32_t	count;		/* IDs in the table */
+} IDHash;
+
+extern int	IDHashInit(IDHash *table, size_t valueSize, uint32_t expected);
+extern void	IDHashFree(IDHash *table);
+extern void	*IDHashFind(IDHash *table, uint32_t id);
+extern void	*IDHashInsert(IDHash *table, uint32_t id, int *added);
+extern void	*IDHashNext(IDHash *table, uint32_t *cursor, uint32_t *id);
+
+#endif /* __IDHASH_H__ */
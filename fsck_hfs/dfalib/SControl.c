@@ -62,6 +62,7 @@
 extern const unsigned char fsck_hfsVersionString[];
 
 int gGUIControl;
+int gBTCheckThreads;
 extern char lflag;
 
 
@@ -317,6 +318,8 @@ DoAgain:
 	dataArea.DrvNum				= fsReadRef;
 	dataArea.liveVerifyState 	= liveMode;
 	dataArea.scanCount		= scanCount;
+	/* Exiting early longjmps out of the checks, which would strand BTCheck's helper threads */
+	dataArea.btCheckThreads		= exitEarly ? 0 : gBTCheckThreads;
     	if (strlcpy(dataArea.deviceNode, rdevnode, sizeof(dataArea.deviceNode)) != strlen(rdevnode)) {
 		dataArea.deviceNode[0] = '\0';
 	}
@@ -1411,6 +1414,8 @@ static int ScavTerm( SGlobPtr GPtr )
 	if( GPtr->validFilesList != nil )
 		DisposeHandle( (Handle) GPtr->validFilesList );
 	
+	DisposeOverlapIndex(GPtr);
+
 	if( GPtr->overlappedExtents != nil ) {
  		extentsTableH = GPtr->overlappedExtents;
  	
@@ -63,7 +63,7 @@ static OSErr	SeekVolumeHeader( SGlobPtr GPtr, UInt64 startSector, UInt32 numSect
 /* overlapping extents verification functions prototype */
 static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber, const char *attrName, UInt32 extentStartBlock, UInt32 extentBlockCount, UInt8 forkType );
 
-static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *extentInfo);
+static	Boolean	ExtentInfoExists( OverlapIndex *index, ExtentInfo *extentInfo, UInt32 *position );
 
 static void CheckHFSPlusExtentRecords(SGlobPtr GPtr, UInt32 fileID, const char *attrname, HFSPlusExtentRecord extent, UInt8 forkType); 
 
@@ -3946,6 +3946,162 @@ void	BuildExtentKey( Boolean isHFSPlus, UInt8 forkType, HFSCatalogNodeID fileNum
 
 
 
+/*
+ * Lookup index kept alongside GPtr->overlappedExtents.  The table itself
+ * stays an unsorted Handle (PrintOverlapFiles and FixOverlappingExtents
+ * re-sort it in place), so the index keeps its own sorted copies:
+ *
+ * keys   - every extent in the table, ordered by CompareOverlapKey, so
+ *          that duplicates are found with a binary search.
+ * ranges - the blocks claimed by those extents as half-open ranges,
+ *          sorted by start block with overlapping ranges merged, so that
+ *          DoesOverlap is a binary search instead of a table scan.
+ *
+ * The attrname pointers in keys belong to the table entries.
+ */
+typedef struct OverlapRange {
+	UInt64	start;
+	UInt64	end;
+} OverlapRange;
+
+struct OverlapIndex {
+	ExtentInfo		*keys;
+	UInt32			keyCount;
+	UInt32			keyMax;
+	OverlapRange	*ranges;
+	UInt32			rangeCount;
+	UInt32			rangeMax;
+};
+
+/* Order overlap keys by start block, block count, file ID, fork and attribute name */
+static int CompareOverlapKey(const ExtentInfo *first, const ExtentInfo *second)
+{
+	if (first->startBlock != second->startBlock)
+		return (first->startBlock < second->startBlock) ? -1 : 1;
+	if (first->blockCount != second->blockCount)
+		return (first->blockCount < second->blockCount) ? -1 : 1;
+	if (first->fileID != second->fileID)
+		return (first->fileID < second->fileID) ? -1 : 1;
+	if (first->forkType != second->forkType)
+		return (first->forkType < second->forkType) ? -1 : 1;
+
+	/* An extent without an attribute name sorts before one with a name */
+	if (first->attrname == NULL || second->attrname == NULL)
+		return (first->attrname != NULL) - (second->attrname != NULL);
+	return strcmp(first->attrname, second->attrname);
+}
+
+/* Return the position of extentInfo in the sorted keys, or where it would be inserted */
+static UInt32 FindOverlapKey(OverlapIndex *index, const ExtentInfo *extentInfo, Boolean *found)
+{
+	UInt32 lo = 0, hi = index->keyCount, mid;
+	int cmp;
+
+	*found = false;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = CompareOverlapKey(&index->keys[mid], extentInfo);
+		if (cmp == 0) {
+			*found = true;
+			return mid;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Return the first range that ends after the given block */
+static UInt32 FindOverlapRange(OverlapIndex *index, UInt64 block)
+{
+	UInt32 lo = 0, hi = index->rangeCount, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->ranges[mid].end > block)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/* Make room for one more key and one more range */
+static OSErr GrowOverlapIndex(OverlapIndex *index)
+{
+	void *p;
+	UInt32 newMax;
+
+	if (index->keyCount == index->keyMax) {
+		newMax = index->keyMax ? index->keyMax * 2 : 64;
+		p = realloc(index->keys, newMax * sizeof(ExtentInfo));
+		if (p == NULL)
+			return (memFullErr);
+		index->keys = p;
+		index->keyMax = newMax;
+	}
+	if (index->rangeCount == index->rangeMax) {
+		newMax = index->rangeMax ? index->rangeMax * 2 : 64;
+		p = realloc(index->ranges, newMax * sizeof(OverlapRange));
+		if (p == NULL)
+			return (memFullErr);
+		index->ranges = p;
+		index->rangeMax = newMax;
+	}
+	return (noErr);
+}
+
+/*
+ * Add the blocks of an extent to the sorted ranges.  An empty extent
+ * claims its start block, which keeps DoesOverlap returning the same
+ * answers as a pairwise comparison against every extent in the table.
+ * Only ranges that share a block are merged; ranges that merely touch
+ * are kept apart for the same reason.  GrowOverlapIndex must have been
+ * called first.
+ */
+static void InsertOverlapRange(OverlapIndex *index, const ExtentInfo *extentInfo)
+{
+	UInt64 start = extentInfo->startBlock;
+	UInt64 end = start + (extentInfo->blockCount ? extentInfo->blockCount : 1);
+	UInt32 first, last;
+
+	first = FindOverlapRange(index, start);
+	for (last = first; last < index->rangeCount && index->ranges[last].start < end; last++) {
+		if (index->ranges[last].start < start)
+			start = index->ranges[last].start;
+		if (index->ranges[last].end > end)
+			end = index->ranges[last].end;
+	}
+
+	if (first == last) {
+		memmove(&index->ranges[first + 1], &index->ranges[first],
+		        (index->rangeCount - first) * sizeof(OverlapRange));
+		index->rangeCount++;
+	} else if (last - first > 1) {
+		memmove(&index->ranges[first + 1], &index->ranges[last],
+		        (index->rangeCount - last) * sizeof(OverlapRange));
+		index->rangeCount -= last - first - 1;
+	}
+	index->ranges[first].start = start;
+	index->ranges[first].end = end;
+}
+
+void DisposeOverlapIndex(SGlobPtr GPtr)
+{
+	OverlapIndex *index = GPtr->overlapIndex;
+
+	if (index == NULL)
+		return;
+
+	free(index->keys);
+	free(index->ranges);
+	free(index);
+	GPtr->overlapIndex = NULL;
+}
+
+
 //
 //	Adds this extent to our OverlappedExtentList for later repair.
 //
@@ -3954,6 +4110,9 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 	size_t			newHandleSize;
 	ExtentInfo		extentInfo;
 	ExtentsTable	**extentsTableH;
+	OverlapIndex	*index;
+	UInt32			capacity;
+	UInt32			position;
 	size_t attrlen;
 	
 	ClearMemory(&extentInfo, sizeof(extentInfo));
@@ -3961,38 +4120,59 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 	extentInfo.startBlock	= extentStartBlock;
 	extentInfo.blockCount	= extentBlockCount;
 	extentInfo.forkType		= forkType;
-	/* store the name of extended attribute */
 	if (forkType == kEAData) {
 		assert(attrname != NULL);
-
-		attrlen = strlen(attrname) + 1;
-		extentInfo.attrname = malloc(attrlen);  
-		if (extentInfo.attrname == NULL) {
-			return(memFullErr);
-		}
-		strlcpy(extentInfo.attrname, attrname, attrlen);
+		extentInfo.attrname = (char *)attrname;
 	}
 	
 	//	If it's uninitialized
 	if ( GPtr->overlappedExtents == nil )
 	{
+		GPtr->overlapIndex = calloc(1, sizeof(OverlapIndex));
+		if (GPtr->overlapIndex == NULL)
+			return(memFullErr);
 		GPtr->overlappedExtents	= (ExtentsTable **) NewHandleClear( sizeof(ExtentsTable) );
-		extentsTableH	= GPtr->overlappedExtents;
+		if (GPtr->overlappedExtents == nil) {
+			DisposeOverlapIndex(GPtr);
+			return(memFullErr);
+		}
 	}
-	else
-	{
-		extentsTableH	= GPtr->overlappedExtents;
+	extentsTableH	= GPtr->overlappedExtents;
+	index			= GPtr->overlapIndex;
 
-		if ( ExtentInfoExists( extentsTableH, &extentInfo) == true )
-			return( noErr );
+	if ( ExtentInfoExists( index, &extentInfo, &position ) == true )
+		return( noErr );
 
-		//	Grow the Extents table for a new entry.
-		newHandleSize = ( sizeof(ExtentInfo) ) + ( GetHandleSize( (Handle)extentsTableH ) );
+	//	Grow the Extents table geometrically rather than one entry at a time.
+	capacity = 1 + (GetHandleSize( (Handle)extentsTableH ) - sizeof(ExtentsTable)) / sizeof(ExtentInfo);
+	if ( (**extentsTableH).count == capacity )
+	{
+		newHandleSize = sizeof(ExtentsTable) + (2 * capacity - 1) * sizeof(ExtentInfo);
 		SetHandleSize( (Handle)extentsTableH, newHandleSize );
+		if ( GetHandleSize( (Handle)extentsTableH ) != newHandleSize )
+			return( memFullErr );
+	}
+	if ( GrowOverlapIndex( index ) != noErr )
+		return( memFullErr );
+
+	/* store the name of extended attribute */
+	if (forkType == kEAData) {
+		attrlen = strlen(attrname) + 1;
+		extentInfo.attrname = malloc(attrlen);  
+		if (extentInfo.attrname == NULL) {
+			return(memFullErr);
+		}
+		strlcpy(extentInfo.attrname, attrname, attrlen);
 	}
 
 	//	Copy the new extents into the end of the table
 	CopyMemory( &extentInfo, &((**extentsTableH).extentInfo[(**extentsTableH).count]), sizeof(ExtentInfo) );
+
+	//	Index the new extent by key and by the blocks it claims
+	memmove( &index->keys[position + 1], &index->keys[position], (index->keyCount - position) * sizeof(ExtentInfo) );
+	index->keys[position] = extentInfo;
+	index->keyCount++;
+	InsertOverlapRange( index, &extentInfo );
 	
 	// 	Update the overlap extent bit
 	GPtr->VIStat |= S_OverlappingExtents;
@@ -4005,50 +4185,12 @@ static OSErr	AddExtentToOverlapList( SGlobPtr GPtr, HFSCatalogNodeID fileNumber,
 
 
 /* Compare if the given extentInfo exsists in the extents table */
-static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *extentInfo)
+static	Boolean	ExtentInfoExists( OverlapIndex *index, ExtentInfo *extentInfo, UInt32 *position )
 {
-	UInt32		i;
-	ExtentInfo	*aryExtentInfo;
-	
-
-	for ( i = 0 ; i < (**extentsTableH).count ; i++ )
-	{
-		aryExtentInfo	= &((**extentsTableH).extentInfo[i]);
-		
-		if ( extentInfo->fileID == aryExtentInfo->fileID )
-		{
-			if (	(extentInfo->startBlock == aryExtentInfo->startBlock)	&& 
-					(extentInfo->blockCount == aryExtentInfo->blockCount)	&&
-					(extentInfo->forkType	== aryExtentInfo->forkType)		)
-			{
-				/* startBlock, blockCount, forkType are same.  
-				 * Compare the extended attribute names, if they exist.
-				 */
-
-				/* If no attribute name exists, the two extents are same */
-				if ((extentInfo->attrname == NULL) &&
-					(aryExtentInfo->attrname == NULL)) {
-					return(true);
-				}
-
-				/* If only one attribute name exists, the two extents are not same */
-				if (((extentInfo->attrname != NULL) && (aryExtentInfo->attrname == NULL)) ||
-					((extentInfo->attrname == NULL) && (aryExtentInfo->attrname != NULL))) {
-					return(false);
-				}
-
-				/* Both attribute name exist.  Compare the names */
-				if (!strcmp(extentInfo->attrname, aryExtentInfo->attrname)) {
-					return (true);
-				} else {
-					return (false);
-				}
+	Boolean		found;
 
-			}
-		}
-	}
-	
-	return( false );
+	*position = FindOverlapKey( index, extentInfo, &found );
+	return( found );
 }
 
 /* Function :  DoesOverlap
@@ -4060,6 +4202,8 @@ static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *exten
  * This is useful in finding the original files that overlap with
  * the files found in catalog btree check.  If a file is found
  * overlapping, it is added to the overlap list. 
+ * The comparison is a binary search of the block ranges in
+ * GPtr->overlapIndex, which covers every extent in the list.
  * 
  * Input: 
  * 1. GPtr - global scavenger pointer.
@@ -4073,26 +4217,20 @@ static	Boolean	ExtentInfoExists( ExtentsTable **extentsTableH, ExtentInfo *exten
  */
 static Boolean DoesOverlap(SGlobPtr GPtr, UInt32 fileID, const char *attrname, UInt32 startBlock, UInt32 blockCount, UInt8 forkType) 
 {
-	int i;
+	UInt32 i;
 	Boolean isOverlapped = false;
-	ExtentInfo	*curExtentInfo;
-	ExtentsTable **extentsTableH = GPtr->overlappedExtents;
-
-	for (i = 0; i < (**extentsTableH).count; i++) {
-		curExtentInfo = &((**extentsTableH).extentInfo[i]);
-		/* Check extents */
-		if (curExtentInfo->startBlock < startBlock) {
-			if ((curExtentInfo->startBlock + curExtentInfo->blockCount) > startBlock) {
-				isOverlapped = true;
-				break;
-			}
-		} else {	/* curExtentInfo->startBlock >= startBlock */
-			if (curExtentInfo->startBlock < (startBlock + blockCount)) {
-				isOverlapped = true;
-				break;
-			}
-		}
-	} /* for loop Extents Table */	
+	OverlapIndex *index = GPtr->overlapIndex;
+
+	if (index == NULL) {
+		return false;
+	}
+
+	/* The first range ending after startBlock is the only candidate */
+	i = FindOverlapRange(index, startBlock);
+	if ((i < index->rangeCount) &&
+	    (index->ranges[i].start < (UInt64)startBlock + blockCount)) {
+		isOverlapped = true;
+	}
 
 	/* Add this extent to overlap list */
 	if (isOverlapped) {
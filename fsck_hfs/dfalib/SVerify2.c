@@ -32,11 +32,13 @@
 
 #include <sys/ioctl.h>
 #include <sys/disk.h>
+#include <pthread.h>
 
 #include "BTree.h"
 #include "BTreePrivate.h"
 
 #include "Scavenger.h"
+#include "../cache.h"
 
 
 //	Prototypes for internal subroutines
@@ -156,6 +158,323 @@ OSErr ChkExtRec ( SGlobPtr GPtr, UInt32 fileID, const void *extents , unsigned i
 }
 
 
+/*------------------------------------------------------------------------------
+
+Leaf readahead for BTCheck
+
+	BTCheck visits the leaf nodes in key order, one GetNode at a time, so on
+	a large volume most of its time is spent waiting for the disk.  When
+	GPtr->btCheckThreads is set, a walker thread follows the index nodes
+	ahead of BTCheck to enumerate the leaf node numbers, and queues them in
+	batches, sorted by disk offset, for the cache's readahead threads (see
+	CacheReadAheadAsync) to pull into the cache.  BTCheck itself is
+	unchanged: it still checks every node and record on the calling thread,
+	in tree order, and finds the leaves already in the cache.
+
+	The helper threads never change anything.  They parse index nodes in
+	their on-disk form from a private copy, never hold a cache buffer, and
+	quietly stop at anything that doesn't look right, leaving it for
+	BTCheck to find and report.  Nodes that live in the extents overflow
+	file are not read ahead, since that would mean a B-Tree search.
+------------------------------------------------------------------------------*/
+
+enum {
+	kBTReadAheadBatchSize	= 256,	/* leaves per batch */
+	kBTReadAheadBatches	= 2,	/* batches queued ahead of BTCheck */
+	kBTReadAheadWindow	= kBTReadAheadBatchSize * kBTReadAheadBatches	/* leaves the walker may get ahead of BTCheck */
+};
+
+typedef struct BTReadAheadBatch {
+	UInt32		count;		/* leaves in this batch */
+	UInt64		offsets[kBTReadAheadBatchSize];	/* disk offsets, sorted */
+} BTReadAheadBatch;
+
+typedef struct BTReadAhead {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;		/* progress, or stop */
+	Cache_t			*cache;
+
+	/* Copied from the B-Tree on the calling thread */
+	HFSPlusExtentDescriptor	extents[kHFSPlusExtentDensity];
+	UInt64			volumeOffset;	/* byte offset of allocation block 0 */
+	UInt32			blockSize;	/* allocation block size */
+	UInt32			nodeSize;
+	UInt32			totalNodes;
+	UInt32			rootNode;
+	UInt16			treeDepth;
+	Boolean			bigKeys;
+
+	/* Protected by lock */
+	Boolean			stop;		/* BTCheck is done with the tree */
+	UInt64			leavesWalked;	/* leaves the walker has gone past */
+	UInt64			leavesChecked;	/* leaves BTCheck has visited */
+
+	pthread_t		walker;
+	BTReadAheadBatch	walkBatch;	/* batch being filled by the walker */
+	UInt64			leavesQueued;	/* leaves handed to the cache */
+} BTReadAhead;
+
+static int
+BTReadAheadCompareOffsets(const void *a, const void *b)
+{
+	UInt64	left = *(const UInt64 *)a;
+	UInt64	right = *(const UInt64 *)b;
+
+	return (left < right) ? -1 : (left > right);
+}
+
+/*
+ * Map a node number to its disk offset, using only the extents in the
+ * control file FCB.  Returns false for nodes beyond those extents or split
+ * across two of them.
+ */
+static Boolean
+BTReadAheadMapNode(const BTReadAhead *ra, UInt32 nodeNum, UInt64 *offset)
+{
+	UInt64	fileOffset = (UInt64)nodeNum * ra->nodeSize;
+	UInt64	extentBytes;
+	int	i;
+
+	for (i = 0; i < kHFSPlusExtentDensity; i++) {
+		extentBytes = (UInt64)ra->extents[i].blockCount * ra->blockSize;
+		if (extentBytes == 0)
+			break;
+		if (fileOffset < extentBytes) {
+			if (fileOffset + ra->nodeSize > extentBytes)
+				break;
+			*offset = ra->volumeOffset +
+			          (UInt64)ra->extents[i].startBlock * ra->blockSize + fileOffset;
+			return true;
+		}
+		fileOffset -= extentBytes;
+	}
+	return false;
+}
+
+/*
+ * Get the child node number from record "index" of a big endian index
+ * node.  Returns false if the record doesn't make sense.
+ */
+static Boolean
+BTReadAheadChild(const BTReadAhead *ra, const UInt8 *node, UInt16 index, UInt32 *child)
+{
+	UInt16	offset;
+	UInt32	keySize;
+
+	offset = SWAP_BE16(*(const UInt16 *)(node + ra->nodeSize - ((index + 1) << 1)));
+	if (offset < sizeof(BTNodeDescriptor) || offset >= ra->nodeSize - sizeof(UInt16))
+		return false;
+
+	if (ra->bigKeys)
+		keySize = SWAP_BE16(*(const UInt16 *)(node + offset)) + sizeof(UInt16);
+	else
+		keySize = node[offset] + sizeof(UInt8);
+	if (keySize & 1)
+		++keySize;	/* pad byte */
+	if (offset + keySize + sizeof(UInt32) > ra->nodeSize)
+		return false;
+
+	*child = SWAP_BE32(*(const UInt32 *)(node + offset + keySize));
+	return (*child != kHeaderNodeNum && *child < ra->totalNodes);
+}
+
+/*
+ * Queue the walker's batch for the cache's readahead threads, waiting
+ * while BTCheck is too far behind.  Returns false once BTCheck is done.
+ */
+static Boolean
+BTReadAheadQueueBatch(BTReadAhead *ra, UInt64 leavesWalked)
+{
+	BTReadAheadBatch	*batch = &ra->walkBatch;
+	Boolean			queued = false;
+	UInt32			i;
+
+	qsort(batch->offsets, batch->count, sizeof(batch->offsets[0]), BTReadAheadCompareOffsets);
+
+	pthread_mutex_lock(&ra->lock);
+	while (!ra->stop &&
+	       (SInt64)(ra->leavesWalked - ra->leavesChecked) >= kBTReadAheadWindow) {
+		pthread_cond_wait(&ra->cond, &ra->lock);
+	}
+	if (!ra->stop) {
+		ra->leavesWalked = leavesWalked;
+		queued = true;
+	}
+	pthread_mutex_unlock(&ra->lock);
+
+	for (i = 0; queued && i < batch->count; i++)
+		(void) CacheReadAheadAsync(ra->cache, batch->offsets[i], ra->nodeSize);
+	if (queued)
+		ra->leavesQueued += batch->count;
+
+	batch->count = 0;
+	return queued;
+}
+
+/*
+ * Walk the index nodes depth first, in the same order as BTCheck, queueing
+ * the leaves found under each bottom level index node.
+ */
+static void *
+BTReadAheadWalk(void *arg)
+{
+	BTReadAhead	*ra = arg;
+	UInt8		*nodes;
+	UInt8		*node;
+	UInt32		nodeNum;
+	UInt16		index[BTMaxDepth];
+	UInt16		numRecords[BTMaxDepth];
+	UInt64		offset;
+	UInt64		leavesWalked = 0;
+	int		level;
+	BTNodeDescriptor *desc;
+
+	/* One node buffer for each index level */
+	nodes = malloc((size_t)ra->nodeSize * (ra->treeDepth - 1));
+	if (nodes == NULL)
+		goto done;
+
+	level = 0;
+	nodeNum = ra->rootNode;
+	for (;;) {
+		/* Read and sanity check the index node at this level */
+		node = nodes + (size_t)level * ra->nodeSize;
+		if (!BTReadAheadMapNode(ra, nodeNum, &offset) ||
+		    CacheReadCopy(ra->cache, offset, ra->nodeSize, node) != 0)
+			break;
+		desc = (BTNodeDescriptor *)node;
+		numRecords[level] = SWAP_BE16(desc->numRecords);
+		if (desc->kind != kBTIndexNode ||
+		    desc->height != ra->treeDepth - level ||
+		    sizeof(BTNodeDescriptor) + (numRecords[level] + 1) * sizeof(UInt16) > ra->nodeSize)
+			break;
+		index[level] = 0;
+
+		/* Find the next index node to visit, queueing leaves on the way */
+		for (;;) {
+			while (level >= 0 && index[level] >= numRecords[level])
+				--level;
+			if (level < 0)
+				goto flush;
+			node = nodes + (size_t)level * ra->nodeSize;
+			if (!BTReadAheadChild(ra, node, index[level]++, &nodeNum))
+				goto flush;
+			if (level < ra->treeDepth - 2)
+				break;
+
+			++leavesWalked;
+			if (BTReadAheadMapNode(ra, nodeNum, &offset)) {
+				ra->walkBatch.offsets[ra->walkBatch.count++] = offset;
+				if (ra->walkBatch.count == kBTReadAheadBatchSize &&
+				    !BTReadAheadQueueBatch(ra, leavesWalked))
+					goto done;
+			}
+		}
+		++level;
+	}
+
+flush:
+	(void) BTReadAheadQueueBatch(ra, leavesWalked);
+done:
+	if (nodes != NULL)
+		free(nodes);
+
+	return NULL;
+}
+
+/*
+ * Start reading the leaves of a B-Tree ahead of BTCheck.  Returns NULL if
+ * readahead isn't wanted or can't be started; BTCheck works the same
+ * either way.
+ */
+static BTReadAhead *
+BTReadAheadStart(SGlobPtr GPtr, BTreeControlBlock *btcb)
+{
+	BTReadAhead	*ra;
+	SFCB		*fcb = btcb->fcbPtr;
+	SVCB		*vcb = fcb->fcbVolume;
+	int		i;
+
+	/* Repairs change the trees underneath us, so only read ahead while verifying */
+	if (GPtr->btCheckThreads <= 0 || GetDFAStage() != kVerifyStage)
+		return NULL;
+	if (btcb->treeDepth < 2 || btcb->treeDepth > BTMaxDepth)
+		return NULL;
+
+	if (CacheStartReadAhead((Cache_t *)vcb->vcbBlockCache, GPtr->btCheckThreads) != 0)
+		return NULL;
+
+	ra = calloc(1, sizeof(BTReadAhead));
+	if (ra == NULL)
+		return NULL;
+
+	ra->cache	= (Cache_t *)vcb->vcbBlockCache;
+	ra->blockSize	= vcb->vcbBlockSize;
+	ra->nodeSize	= btcb->nodeSize;
+	ra->totalNodes	= btcb->totalNodes;
+	ra->rootNode	= btcb->rootNode;
+	ra->treeDepth	= btcb->treeDepth;
+	ra->bigKeys	= (btcb->attributes & kBTBigKeysMask) != 0;
+	if (vcb->vcbSignature == kHFSSigWord) {
+		ra->volumeOffset = (UInt64)vcb->vcbAlBlSt << kSectorShift;
+		for (i = 0; i < kHFSExtentDensity; i++) {
+			ra->extents[i].startBlock = fcb->fcbExtents16[i].startBlock;
+			ra->extents[i].blockCount = fcb->fcbExtents16[i].blockCount;
+		}
+	} else {
+		ra->volumeOffset = vcb->vcbEmbeddedOffset;
+		CopyMemory(fcb->fcbExtents32, ra->extents, sizeof(ra->extents));
+	}
+
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+
+	if (pthread_create(&ra->walker, NULL, BTReadAheadWalk, ra) != 0) {
+		pthread_cond_destroy(&ra->cond);
+		pthread_mutex_destroy(&ra->lock);
+		free(ra);
+		return NULL;
+	}
+
+	return ra;
+}
+
+/*
+ * Called by BTCheck for each leaf it visits, so the walker knows how far
+ * ahead it is.
+ */
+static void
+BTReadAheadLeafChecked(BTReadAhead *ra)
+{
+	pthread_mutex_lock(&ra->lock);
+	ra->leavesChecked++;
+	if ((SInt64)(ra->leavesWalked - ra->leavesChecked) == kBTReadAheadWindow - 1)
+		pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+static void
+BTReadAheadStop(BTReadAhead *ra)
+{
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = true;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+
+	/* Leaves BTCheck won't get to again aren't worth reading */
+	pthread_join(ra->walker, NULL);
+	CacheCancelReadAhead(ra->cache);
+
+	if (debug)
+		plog("\tB-Tree leaf readahead: %llu leaves walked, %llu queued for the cache\n",
+		     ra->leavesWalked, ra->leavesQueued);
+
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra);
+}
+
+
 /*------------------------------------------------------------------------------
 
 Routine:	BTCheck - (BTree Check)
@@ -230,6 +549,7 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 	UInt16			*statusFlag = NULL;
 	UInt32			leafRecords = 0;
 	BTreeControlBlock	*calculatedBTCB	= GetBTreeControlBlock( refNum );
+	BTReadAhead		*readAhead = NULL;
 	
 	node.buffer = NULL;
 
@@ -444,6 +764,9 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 	tprP->TPRRIndx	= -1;	/* last index accessed in a node */
 	tprP->TPRLtSib	= 0;
 	tprP->TPRRtSib	= 0;
+
+	/* Start pulling leaf nodes into the cache ahead of us, if asked to */
+	readAhead = BTReadAheadStart( GPtr, calculatedBTCB );
 		
 	/*
 	 * Now enumerate the entire BTree
@@ -737,6 +1060,8 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 			if ( tprP->TPRRtSib == 0 )
 				calculatedBTCB->lastLeafNode = nodeNum;
 			leafRecords	+= nodeDescP->numRecords;
+			if ( readAhead != NULL )
+				BTReadAheadLeafChecked( readAhead );
 
 			if (checkLeafRecord != NULL) {
 				/* For total number of records in this leaf node, get each record sequentially 
@@ -760,6 +1085,8 @@ BTCheck(SGlobPtr GPtr, short refNum, CheckLeafRecordProcPtr checkLeafRecord)
 	calculatedBTCB->leafRecords = leafRecords;
 	
 exit:
+	if (readAhead != NULL)
+		BTReadAheadStop(readAhead);
 	if (result == noErr && (*statusFlag & S_RebuildBTree))
 		result = errRebuildBtree;
 	if (node.buffer != NULL)
@@ -32,6 +32,7 @@
 #include "BTreePrivate.h"
 #include "CheckHFS.h"
 #include "BTreeScanner.h"
+#include "IDHash.h"
 #include "hfs_endian.h"
 #include "../fsck_debug.h"
 #include "../fsck_messages.h"
@@ -412,6 +413,9 @@ struct ExtentsTable {
 };
 typedef struct ExtentsTable ExtentsTable;
 
+/* Sorted lookup index kept alongside the overlapped extents table (SVerify1.c) */
+typedef struct OverlapIndex OverlapIndex;
+
 
 struct FileIdentifier {
 	Boolean 						hasThread;
@@ -707,6 +711,7 @@ typedef struct SGlob {
 	UInt32				**validFilesList;		//	List of valid HFS file IDs
 
 	ExtentsTable		**overlappedExtents;	//	List of overlapped extents
+	OverlapIndex		*overlapIndex;			//	Sorted index over overlappedExtents
 	FileIdentifierTable	**fileIdentifierTable;	//	List of files for post processing
 
 	UInt32				inputFlags;				//	Caller can specify some DFA behaviors
@@ -757,6 +762,7 @@ typedef struct SGlob {
 	int				writeRef;	// file descriptor with write access on the volume	
 	int				lostAndFoundMode;  // used when creating lost+found directory
 	int				liveVerifyState; // indicates if live verification is being done or not 
+	int				btCheckThreads;	// number of leaf readahead threads for BTCheck (0 = none)
 	BTScanState		scanState;
 	int		scanCount;	/* Number of times fsck_hfs has looped */		
 
@@ -1088,6 +1094,8 @@ extern  int FindOrigOverlapFiles(SGlobPtr GPtr);
 
 extern  void PrintOverlapFiles (SGlobPtr GPtr);
 
+extern  void DisposeOverlapIndex(SGlobPtr GPtr);
+
 /* ------------------------------- From SVerify2.c -------------------------------- */
 
 typedef int (* CheckLeafRecordProcPtr)(SGlobPtr GPtr, void *key, void *record, UInt16 recordLen);
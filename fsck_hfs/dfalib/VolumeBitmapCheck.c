@@ -22,9 +22,9 @@
  */
 
 /* Summary for in-memory volume bitmap:
- * A binary search tree is used to store bitmap segments that are
- * partially full.  If a segment does not exist in the tree, it
- * can be assumed to be in the following state:
+ * A two level table, indexed by segment number, is used to store
+ * bitmap segments that are partially full.  If a segment does not
+ * exist in the table, it can be assumed to be in the following state:
  *	1. Full if the coresponding segment map bit is set
  *	2. Empty (implied)
  */
@@ -50,7 +50,10 @@ enum {
 	kBitsWithinSegmentMask	= kBitsPerSegment-1,
 	
 	kBMS_NodesPerPool	= 450,
-	kBMS_PoolMax		= 2000
+
+	kBMS_PageShift		= 8,
+	kBMS_SegmentsPerPage	= 1 << kBMS_PageShift,	/* segment slots per table page */
+	kBMS_PageMask		= kBMS_SegmentsPerPage - 1
 };
 
 
@@ -80,36 +83,37 @@ UInt32*   gFullBitmapSegment;   /* points to a FULL bitmap segment*/
 UInt32*   gEmptyBitmapSegment;  /* points to an EMPTY bitmap segment*/
 
 /*
- * Bitmap Segment (BMS) Tree node
+ * Bitmap Segment (BMS) node
  * Bitmap segments that are partially full are
- * saved in the BMS Tree.
+ * saved in the BMS Table.
  */
 typedef struct BMS_Node {
-	struct BMS_Node *left;
-	struct BMS_Node *right;
+	struct BMS_Node *next;		/* next node on the free list */
 	UInt32 segment;
 	UInt32 bitmap[kWordsPerSegment];
 } BMS_Node;
 
-BMS_Node *gBMS_Root;           /* root of BMS tree */
+BMS_Node ***gBMS_Pages;        /* gBMS_Pages[segment >> kBMS_PageShift][segment & kBMS_PageMask] */
+UInt32 gBMS_PageCount;         /* number of entries in gBMS_Pages */
 BMS_Node *gBMS_FreeNodes;      /* list of free BMS nodes */
-BMS_Node *gBMS_PoolList[kBMS_PoolMax];  /* list of BMS node pools */
+BMS_Node **gBMS_PoolList;      /* list of BMS node pools */
 int gBMS_PoolCount;            /* count of pools allocated */
+int gBMS_PoolMax;              /* enough pools for every segment */
 
 /* Bitmap operations routines */
 static int FindContigClearedBitmapBits (SVCB *vcb, UInt32 numBlocks, UInt32 *actualStartBlock);
 
-/* Segment Tree routines (binary search tree) */
-static int        BMS_InitTree(void);
-static int        BMS_DisposeTree(void);
+/* Segment Table routines (two level table indexed by segment number) */
+static int        BMS_InitTable(void);
+static int        BMS_DisposeTable(void);
 static BMS_Node * BMS_Lookup(UInt32 segment);
 static BMS_Node * BMS_Insert(UInt32 segment, int segmentType);
 static BMS_Node * BMS_Delete(UInt32 segment);
 static void	  BMS_GrowNodePool(void);
+static int        BMS_SegmentState(const UInt32 *bitmap);
 
 #if _VBC_DEBUG_
-static void       BMS_PrintTree(BMS_Node * root);
-static void       BMS_MaxDepth(BMS_Node * root, int depth, int *maxdepth);
+static void       BMS_PrintTable(void);
 #endif
 
 /*
@@ -138,7 +142,15 @@ int BitMapCheckBegin(SGlobPtr g)
 	gFullSegmentList = bit_alloc(gTotalSegments);
 	bit_nclear(gFullSegmentList, 0, gTotalSegments - 1);
 
-	BMS_InitTree();
+	if (BMS_InitTable() != 0) {
+		free(gFullBitmapSegment);
+		gFullBitmapSegment = NULL;
+		free(gEmptyBitmapSegment);
+		gEmptyBitmapSegment = NULL;
+		bit_dealloc(gFullSegmentList);
+		gFullSegmentList = NULL;
+		return (R_NoMem);
+	}
 	gBitMapInited = 1;
 	gBitsMarked = 0;
 
@@ -178,11 +190,8 @@ int BitMapCheckEnd(void)
 {
 	if (gBitMapInited) {
 #if _VBC_DEBUG_
-		int maxdepth = 0;
-
-		BMS_MaxDepth(gBMS_Root, 0, &maxdepth);
-		plog("   %d full segments, %d segment nodes (max depth was %d nodes)\n",
-		       gFullSegments, gSegmentNodes, maxdepth);
+		plog("   %d full segments, %d segment nodes in %d pools\n",
+		       gFullSegments, gSegmentNodes, gBMS_PoolCount);
 #endif
 		free(gFullBitmapSegment);
 		gFullBitmapSegment = NULL;
@@ -193,7 +202,7 @@ int BitMapCheckEnd(void)
 		bit_dealloc(gFullSegmentList);
 		gFullSegmentList = NULL;
 
-		BMS_DisposeTree();
+		BMS_DisposeTable();
 		gBitMapInited = 0;
 	}
 	return (0);
@@ -207,12 +216,12 @@ int BitMapCheckEnd(void)
  *	2. If the segment exists in full segment list,
  *			If bitOperation is to clear bits, 
  *			a. Remove segment from full segment list.
- *			b. Insert a full segment in the bitmap tree.
+ *			b. Insert a full segment in the bitmap table.
  *			Else return pointer to dummy full segment
- *	3. If segment found in tree, it is partially full.  Return it.
+ *	3. If segment found in table, it is partially full.  Return it.
  *	4. If (2) and (3) are not true, it is a empty segment.
  *			If bitOperation is to set bits,
- *			a. Insert empty segment in the bitmap tree.
+ *			a. Insert empty segment in the bitmap table.
  *			Else return pointer to dummy empty segment.
  *
  * Input:	
@@ -268,8 +277,7 @@ static int GetSegmentBitmap(UInt32 startBit, UInt32 **buffer, int bitOperation)
 #if 0
 	if (segNode) {
 		int i;
-		plog("  segment %d: L=0x%08x, R=0x%08x \n< ",
-			(int)segNode->segment, (int)segNode->left, segNode->right);
+		plog("  segment %d: \n< ", (int)segNode->segment);
 		for (i = 0; i < kWordsPerSegment; ++i) {
 			plog("0x%08x ", segNode->bitmap[i]);
 			if ((i & 0x3) == 0x3)
@@ -327,20 +335,21 @@ void TestSegmentBitmap(UInt32 startBit)
 		}
 		plog("\n");
 #endif
-		if (segment != 0 && bcmp(&segNode->bitmap[0], gFullBitmapSegment, kBytesPerSegment) == 0) {
+		switch (segment != 0 ? BMS_SegmentState(&segNode->bitmap[0]) : -1) {
+		case kFullSegment:
 			if (BMS_Delete(segment) != NULL) {
 				bit_set(gFullSegmentList, segment);
 				/* debugging stats */
 				++gFullSegments;
 				--gSegmentNodes;
 			}
-		}
-		
-		if (segment != 0 && bcmp(&segNode->bitmap[0], gEmptyBitmapSegment, kBytesPerSegment) == 0) {
+			break;
+		case kEmptySegment:
 			if (BMS_Delete(segment) != NULL) {
 				/* debugging stats */
 				--gSegmentNodes;
 			}
+			break;
 		}
 	}
 }
@@ -796,14 +805,15 @@ int CheckVolumeBitMap(SGlobPtr g, Boolean repair)
 			 * Once we determine we have under-allocated, we can just stop and print out
 			 * the message.
 			 */
-			for (indx = 0; indx < kBytesPerSegment; indx++) {
-				uint8_t *bufp, *diskp;
-				bufp = (uint8_t *)buffer;
-				diskp = vbmBlockP + (bit & bitsWithinFileBlkMask)/8;
-				if (bufp[indx] & ~diskp[indx]) {
+			{
+				const UInt32 *diskp = (const UInt32 *)(vbmBlockP + (bit & bitsWithinFileBlkMask)/8);
+				UInt32 missing = 0;
+
+				/* Bits we have set that are clear on disk, a word at a time */
+				for (indx = 0; indx < kWordsPerSegment; indx++)
+					missing |= buffer[indx] & ~diskp[indx];
+				if (missing)
 					underalloc++;
-					break;
-				}
 			}
 			g->VIStat = g->VIStat | S_VBM;
 			if (underalloc) {
@@ -1264,98 +1274,96 @@ int IsTrimSupported(void)
 }
 
 /*
- * BITMAP SEGMENT TREE
+ * BITMAP SEGMENT TABLE
  *
- * A binary search tree is used to store bitmap segments that are
- * partially full.  If a segment does not exist in the tree, it
- * can be assumed to be in the following state:
+ * A two level table, indexed by segment number, is used to store
+ * bitmap segments that are partially full.  The first level has one
+ * entry per kBMS_SegmentsPerPage segments, and points to a page of
+ * node pointers that is only allocated once a segment in its range
+ * becomes partially full.  If a segment does not exist in the table,
+ * it can be assumed to be in the following state:
  *	1. Full if the coresponding segment map bit is set
  *	2. Empty (implied)
+ *
+ * Segment 0 always has a node (it used to be the root of a tree, and
+ * is never deleted).
  */
 
 static int
-BMS_InitTree(void)
+BMS_InitTable(void)
 {
+	gBMS_PageCount = (gTotalSegments + kBMS_SegmentsPerPage - 1) >> kBMS_PageShift;
+	gBMS_Pages = (BMS_Node ***)calloc(gBMS_PageCount, sizeof(BMS_Node **));
+
+	gBMS_PoolMax = (gTotalSegments + kBMS_NodesPerPool - 1) / kBMS_NodesPerPool;
+	gBMS_PoolList = (BMS_Node **)calloc(gBMS_PoolMax, sizeof(BMS_Node *));
 	gBMS_PoolCount = 0;
-	BMS_GrowNodePool();
+	gBMS_FreeNodes = NULL;
 
-	gBMS_Root = gBMS_FreeNodes;
-	gBMS_FreeNodes = gBMS_FreeNodes->right; 
-	gBMS_Root->right = NULL; 
+	if (gBMS_Pages == NULL || gBMS_PoolList == NULL ||
+	    BMS_Insert(0, kEmptySegment) == NULL) {
+		BMS_DisposeTable();
+		return (-1);
+	}
+	--gSegmentNodes;  /* debugging stats don't count segment 0 */
 
 	return (0);
 }
 
 
 static int
-BMS_DisposeTree(void)
+BMS_DisposeTable(void)
 {
-	while(gBMS_PoolCount > 0)
-		free(gBMS_PoolList[--gBMS_PoolCount]);
+	UInt32 i;
 
-	gBMS_Root = gBMS_FreeNodes = 0;
-	return (0);
-}
-
-
-static BMS_Node *
-BMS_Lookup(UInt32 segment)
-{
-	BMS_Node *ptree = gBMS_Root;
-
-	while (ptree && ptree->segment != segment) {
+	if (gBMS_Pages != NULL) {
+		for (i = 0; i < gBMS_PageCount; i++)
+			if (gBMS_Pages[i] != NULL)
+				free(gBMS_Pages[i]);
+		free(gBMS_Pages);
+	}
 
-		if (segment > ptree->segment)
-			ptree = ptree->right;
-		else
-			ptree = ptree->left;
+	if (gBMS_PoolList != NULL) {
+		while(gBMS_PoolCount > 0)
+			free(gBMS_PoolList[--gBMS_PoolCount]);
+		free(gBMS_PoolList);
 	}
 
-	return ((BMS_Node *)ptree);
+	gBMS_Pages = NULL;
+	gBMS_PageCount = 0;
+	gBMS_PoolList = NULL;
+	gBMS_PoolMax = 0;
+	gBMS_FreeNodes = NULL;
+	return (0);
 }
 
 
 static BMS_Node *
-BMS_InsertTree(BMS_Node *NewEntry)
+BMS_Lookup(UInt32 segment)
 {
-	BMS_Node *ptree;
-	register UInt32 segment;
-
-	segment = NewEntry->segment;
-	ptree = gBMS_Root;
-	if (ptree == (BMS_Node *)NULL) {
-		gBMS_Root = NewEntry;
-		return (NewEntry);
-	}
+	BMS_Node **page = gBMS_Pages[segment >> kBMS_PageShift];
 
-	while (ptree) {
-		if (segment > ptree->segment) { /* walk the right sub-tree */
-			if (ptree->right)
-				ptree = ptree->right;
-			else {
-				ptree->right = NewEntry;
-				return (ptree);
-			}
-		}
-		else { /* walk the left sub-tree */
-			if (ptree->left) 
-				ptree = ptree->left;
-			else {
-			    	ptree->left = NewEntry;
-				return (ptree);
-			}
-		}
-	}	
+	if (page == NULL)
+		return ((BMS_Node *)NULL);
 
-	return ((BMS_Node *)NULL);
+	return (page[segment & kBMS_PageMask]);
 }
 
 
-/* insert a new segment into the tree */
+/* insert a new segment into the table */
 static BMS_Node *
 BMS_Insert(UInt32 segment, int segmentType) 
 {
 	BMS_Node *new; 
+	BMS_Node **page;
+
+	page = gBMS_Pages[segment >> kBMS_PageShift];
+	if (page == NULL) {
+		page = (BMS_Node **)calloc(kBMS_SegmentsPerPage, sizeof(BMS_Node *));
+		if (page == NULL)
+			return ((BMS_Node *)NULL);
+		gBMS_Pages[segment >> kBMS_PageShift] = page;
+	}
 
 	if ((new = gBMS_FreeNodes) == NULL) {
 		BMS_GrowNodePool();
@@ -1363,78 +1371,43 @@ BMS_Insert(UInt32 segment, int segmentType)
 			return ((BMS_Node *)NULL);
 	}
 
-	gBMS_FreeNodes = gBMS_FreeNodes->right; 
+	gBMS_FreeNodes = gBMS_FreeNodes->next; 
 
 	++gSegmentNodes;  /* debugging stats */
 
-	new->right = NULL; 
+	new->next = NULL; 
 	new->segment = segment;
 	if (segmentType == kFullSegment)
 		bcopy(gFullBitmapSegment, new->bitmap, kBytesPerSegment);
 	else
 		bzero(new->bitmap, sizeof(new->bitmap));	
 
-	if (BMS_InsertTree(new) != NULL)
-		return (new);
-	else
-		return ((BMS_Node *)NULL);
+	page[segment & kBMS_PageMask] = new;
+	return (new);
 }
 
 
 static BMS_Node *
 BMS_Delete(UInt32 segment)
 {
-	BMS_Node *seg_found, *pprevious, *pnext, *pnextl, *psub;
+	BMS_Node *seg_found;
+	BMS_Node **page;
 
-	pprevious = NULL; 
-	seg_found = gBMS_Root;
-	
-	/* don't allow the root to be deleted! */
-	if (seg_found->segment == segment)
+	/* don't allow segment 0 to be deleted! */
+	if (segment == 0)
 		return ((BMS_Node *)NULL);
 
-	while (seg_found && seg_found->segment != segment) {
-		pprevious = seg_found;
-		if (segment > seg_found->segment)
-			seg_found = seg_found->right;
-		else
-			seg_found = seg_found->left;
-	}
+	page = gBMS_Pages[segment >> kBMS_PageShift];
+	if (page == NULL)
+		return ((BMS_Node *)NULL);
 
+	seg_found = page[segment & kBMS_PageMask];
 	if (seg_found) {
-		/*
-		 * we found the entry, now reorg the sub-trees
-		 * spanning from our node.
-		 */
-		if ((pnext = seg_found->right)) {
-			/*
-			 * Tree pruning: take the left branch of the
-			 * current node and place it at the lowest
-			 * left branch of the current right branch 
-			 */
-			psub = pnext;
-			
-			/* walk the Right/Left sub tree from current node */
-			while ((pnextl = psub->left))
-				psub = pnextl;	
-			
-			/* plug the old left tree to the new ->Right leftmost node */	
-			psub->left = seg_found->left;
-		} else {  /* only left sub-tree, simple case */
-			pnext = seg_found->left;
-		}
-		/* 
-		 * Now, plug the current node sub tree to
-		 * the good pointer of our parent node.
-		 */
-		if (pprevious->left == seg_found)
-			pprevious->left = pnext;
-		else
-			pprevious->right = pnext;	
-		
+		page[segment & kBMS_PageMask] = NULL;
+
 		/* add node back to the free-list */
 		bzero(seg_found, sizeof(BMS_Node));
-		seg_found->right = gBMS_FreeNodes; 
+		seg_found->next = gBMS_FreeNodes; 
 		gBMS_FreeNodes = seg_found; 		
 	}
 	
@@ -1448,14 +1421,14 @@ BMS_GrowNodePool(void)
 	BMS_Node *nodePool;
 	short i;
 
-	if (gBMS_PoolCount >= kBMS_PoolMax)
+	if (gBMS_PoolCount >= gBMS_PoolMax)
 		return;
 
 	nodePool = (BMS_Node *)malloc(sizeof(BMS_Node) * kBMS_NodesPerPool);
 	if (nodePool != NULL) {
 		bzero(&nodePool[0], sizeof(BMS_Node) * kBMS_NodesPerPool);
 		for (i = 1 ; i < kBMS_NodesPerPool ; i++) {
-			(&nodePool[i-1])->right = &nodePool[i];
+			(&nodePool[i-1])->next = &nodePool[i];
 		}
 	
 		gBMS_FreeNodes = &nodePool[0];
@@ -1464,27 +1437,42 @@ BMS_GrowNodePool(void)
 }
 
 
-#if _VBC_DEBUG_
-static void
-BMS_MaxDepth(BMS_Node * root, int depth, int *maxdepth)
+/*
+ * Classify a segment as kFullSegment, kEmptySegment, or -1 if it is
+ * partially full.  This looks at whole words rather than comparing
+ * against the shared full and empty segments byte by byte; the loop has
+ * no branches, so the compiler can vectorize it.
+ */
+static int
+BMS_SegmentState(const UInt32 *bitmap)
 {
-	if (root) {
-		depth++;
-		if (depth > *maxdepth)
-			*maxdepth = depth;
-		BMS_MaxDepth(root->left, depth, maxdepth);
-		BMS_MaxDepth(root->right, depth, maxdepth);
+	UInt32 allSet = kAllBitsSetInWord;
+	UInt32 anySet = 0;
+	int i;
+
+	for (i = 0; i < kWordsPerSegment; i++) {
+		allSet &= bitmap[i];
+		anySet |= bitmap[i];
 	}
+
+	if (allSet == kAllBitsSetInWord)
+		return (kFullSegment);
+	if (anySet == 0)
+		return (kEmptySegment);
+	return (-1);
 }
 
+
+#if _VBC_DEBUG_
 static void
-BMS_PrintTree(BMS_Node * root)
+BMS_PrintTable(void)
 {
-	if (root) {
-		BMS_PrintTree(root->left);
-		plog("seg %d\n", root->segment);
-		BMS_PrintTree(root->right);
+	UInt32 segment;
+	BMS_Node *node;
+
+	for (segment = 0; segment < gTotalSegments; segment++) {
+		if ((node = BMS_Lookup(segment)) != NULL)
+			plog("seg %d\n", node->segment);
 	}
 }
 #endif
-
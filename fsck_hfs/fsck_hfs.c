@@ -133,7 +133,7 @@ main(argc, argv)
 	else
 		progname = *argv;
 
-	while ((ch = getopt(argc, argv, "b:B:c:D:e:Edfglm:npqrR:SuyxJ")) != EOF) {
+	while ((ch = getopt(argc, argv, "b:B:c:D:e:Edfglm:npqrR:St:uyxJ")) != EOF) {
 		switch (ch) {
 		case 'b':
 			gBlockSize = atoi(optarg);
@@ -146,6 +146,15 @@ main(argc, argv)
 		case 'S':
 			scanflag = 1;
 			break;
+		case 't':
+			/* Threads used to read B-tree leaf nodes ahead of the checks */
+			gBTCheckThreads = atoi(optarg);
+			if (gBTCheckThreads < 0) {
+				(void) fprintf(stderr, "%s invalid thread count %d\n",
+					progname, gBTCheckThreads);
+				exit(2);
+			}
+			break;
 		case 'B':
 			getblocklist(optarg);
 			break;
@@ -884,7 +893,7 @@ ExitThisRoutine:
 static void
 usage()
 {
-	(void) fplog(stderr, "usage: %s [-b [size] B [path] c [size] e [mode] ESdfglx m [mode] npqruy] special-device\n", progname);
+	(void) fplog(stderr, "usage: %s [-b [size] B [path] c [size] e [mode] ESdfglx m [mode] npqruy t [count]] special-device\n", progname);
 	(void) fplog(stderr, "  b size = size of physical blocks (in bytes) for -B option\n");
 	(void) fplog(stderr, "  B path = file containing physical block numbers to map to paths\n");
 	(void) fplog(stderr, "  c size = cache size (ex. 512m, 1g)\n");
@@ -901,6 +910,7 @@ usage()
 	(void) fplog(stderr, "  q = quick check returns clean, dirty, or failure \n");
 	(void) fplog(stderr, "  r = rebuild catalog btree \n");
 	(void) fplog(stderr, "  S = Scan disk for bad blocks\n");
+	(void) fplog(stderr, "  t count = threads used to read b-tree leaf nodes ahead \n");
 	(void) fplog(stderr, "  u = usage \n");
 	(void) fplog(stderr, "  y = assume a yes response \n");
 	
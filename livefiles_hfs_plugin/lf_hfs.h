@@ -37,6 +37,9 @@ enum { kMDBOffset = kMasterDirectoryBlock * 512 };      /* MDB offset on disk in
 /* How many free extents to cache per volume */
 #define kMaxFreeExtents        10
 
+/* Number of locks protecting the cnode hash (must be a power of 2) */
+#define HFS_CHASH_NUM_LOCKS    16
+
 /* Maximum file size that we're willing to defrag on open */
 #define HFS_MAX_DEFRAG_SIZE         (104857600)     // 100 * 1024 * 1024 (100MB)
 #define HFS_INITIAL_DEFRAG_SIZE     (20971520)      // 20 * 1024 * 1024 (20MB)
@@ -179,6 +182,9 @@ typedef struct hfsmount {
     u_int32_t            hfs_summary_size;    /* number of BITS in summary table defined above (not bytes!) */
     u_int32_t            hfs_summary_bytes;    /* number of BYTES in summary table */
 
+    /* Free extent index, see lf_hfs_volume_allocation.c */
+    struct hfs_free_extent_index *hfs_free_index;
+
     u_int32_t             scan_var;            /* For initializing the summary table */
 
 
@@ -222,6 +228,10 @@ typedef struct hfsmount {
     time_t        hfs_mount_time;
     time_t        hfs_last_mounted_mtime;
 
+    /* Buffer cache capacity added by this mount, given back at unmount */
+    u_int32_t     hfs_buf_cache_entries;
+    u_int64_t     hfs_buf_cache_data;
+
     /* Metadata allocation zone variables: */
     u_int32_t    hfs_metazone_start;
     u_int32_t    hfs_metazone_end;
@@ -245,6 +255,12 @@ typedef struct hfsmount {
 
     pthread_mutex_t      hfs_mutex;      /* protects access to hfsmount data */
     pthread_mutex_t      sync_mutex;     
+
+    /* Write-back of appended file data, see lf_hfs_readwrite_ops.c */
+    pthread_mutex_t      hfs_writeback_mutex;   /* protects the list and the dirty count */
+    TAILQ_HEAD(, hfs_writeback) hfs_writeback_list; /* forks with buffered data */
+    u_int64_t            hfs_writeback_dirty;   /* bytes buffered on this mount */
+    u_int64_t            hfs_writeback_limit;   /* max bytes buffered, 0 disables write-back */
     
     enum {
         HFS_THAWED,
@@ -279,13 +295,28 @@ typedef struct hfsmount {
     uuid_t         hfs_full_uuid;
 
     /* Per mount cnode hash variables: */
-    pthread_mutex_t      hfs_chash_mutex;  /* protects access to cnode hash table */
+    pthread_mutex_t      hfs_chash_mutex[HFS_CHASH_NUM_LOCKS];  /* protects access to cnode hash table, striped by cnid */
     u_long               hfs_cnodehash;    /* size of cnode hash table - 1 */
     LIST_HEAD(cnodehashhead, cnode) *hfs_cnodehashtbl;    /* base of cnode hash */
+    u_int64_t            hfs_chash_cnodes;      /* number of cnodes in the hash */
+    u_int64_t            hfs_chash_lookups;     /* statistics, updated atomically */
+    u_int64_t            hfs_chash_contended;
+    u_int64_t            hfs_chash_waits;
+    u_int64_t            hfs_chash_resizes;
+
+    /* Per mount name cache, see lf_hfs_lookup.c */
+    struct hfs_name_cache *hfs_name_cache;
+
+    /* Catalog reads without the catalog lock, see hfs_systemfile_read_begin */
+    u_int64_t            hfs_btread_sections;   /* statistics, updated atomically */
+    u_int64_t            hfs_btread_conflicts;
+    u_int64_t            hfs_btread_fallbacks;  /* gave up and took the lock */
+    u_int32_t            hfs_btread_disabled;   /* always take the lock, for comparison */
 
     /* Per mount fileid hash variables  (protected by catalog lock!) */
     u_long hfs_idhash; /* size of cnid/fileid hash table -1 */
     LIST_HEAD(idhashhead, cat_preflightid) *hfs_idhashtbl; /* base of ID hash */
+    struct cat_idcache *hfs_idcache;   /* cnid to catalog key cache, see lf_hfs_catalog.c */
 
     // Records the oldest outstanding sync request
     struct timeval    hfs_sync_req_oldest;
@@ -14,6 +14,7 @@
 #include "lf_hfs_fileops_handler.h"
 #include "lf_hfs_logger.h"
 #include "lf_hfs_chash.h"
+#include "lf_hfs_btrees_internal.h"
 
 static void SetAttrIntoStruct(UVFSDirEntryAttr* psAttrEntry, struct cat_attr* pAttr, struct cat_desc* psDesc, struct hfsmount* psHfsm, struct cat_fork* pDataFork)
 {
@@ -232,6 +233,51 @@ check_if_directory:
     return bIsMatch;
 }
 
+/*
+ * hfs_scandir fetches about a leaf node's worth of catalog records per
+ * cat_getentriesattr call, plus one entry to build the cookie of the last
+ * record evaluated.
+ */
+#define SCANDIR_MIN_RECORD_SIZE         (kHFSPlusCatalogKeyMinimumLength + sizeof(HFSPlusCatalogFolder) + sizeof(u_int16_t))
+#define SCANDIR_ENTRIES_PER_LEAF(size)  ((((size) - sizeof(BTNodeDescriptor)) / SCANDIR_MIN_RECORD_SIZE) + 1)
+
+/*
+ * Remember the given entry in a directory hint, so the next catalog lookup
+ * resumes right after it instead of walking the directory from its start.
+ */
+static int
+hfs_dirhint_set_position(directoryhint_t* dirhint, struct cat_desc* psDesc, int index)
+{
+    if ((dirhint->dh_desc.cd_flags & CD_HASBUF) && (dirhint->dh_desc.cd_nameptr != NULL))
+    {
+        dirhint->dh_desc.cd_flags &= ~CD_HASBUF;
+        hfs_free((void *) dirhint->dh_desc.cd_nameptr);
+    }
+    dirhint->dh_desc.cd_namelen = 0;
+    dirhint->dh_desc.cd_nameptr = NULL;
+
+    dirhint->dh_index = index;
+    dirhint->dh_desc.cd_cnid = psDesc->cd_cnid;
+    dirhint->dh_desc.cd_hint = psDesc->cd_hint;
+    dirhint->dh_desc.cd_encoding = psDesc->cd_encoding;
+
+    if (psDesc->cd_nameptr != NULL)
+    {
+        /* Without a name the catalog falls back to positioning by index */
+        u_int8_t* puName = hfs_malloc(sizeof(char)*psDesc->cd_namelen);
+        if (puName == NULL)
+        {
+            return ENOMEM;
+        }
+        memcpy((void *) puName, (void *) psDesc->cd_nameptr, psDesc->cd_namelen);
+        dirhint->dh_desc.cd_nameptr = puName;
+        dirhint->dh_desc.cd_namelen = psDesc->cd_namelen;
+        dirhint->dh_desc.cd_flags |= CD_HASBUF;
+    }
+
+    return 0;
+}
+
 int
 hfs_scandir(struct vnode *dvp, ScanDirRequest_s* psScanDirRequest)
 {
@@ -240,7 +286,11 @@ hfs_scandir(struct vnode *dvp, ScanDirRequest_s* psScanDirRequest)
     struct cnode* dcp = VTOC(dvp);
     struct hfsmount*  hfsmp = VTOHFS(dvp);
     uint64_t uCookie = psScanDirRequest->psMatchingCriteria->smr_start_cookie;
+    directoryhint_t* dirhint = NULL;
+    u_int32_t uMaxEntries = 2;
+    BTreeInfoRec btinfo;
     int reachedeof = 0;
+    int lockflags;
 
     /*
      * Take an exclusive directory lock since we manipulate the directory hints
@@ -250,32 +300,51 @@ hfs_scandir(struct vnode *dvp, ScanDirRequest_s* psScanDirRequest)
         return (error);
     }
 
-    /* Initialize a catalog entry list - allocating 2 for eof reference. */
-    ce_list = hfs_mallocz(CE_LIST_SIZE(2));
-    ce_list->maxentries = 2;
+    lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
+    if (BTGetInformation(VTOF(hfsmp->hfs_catalog_vp), 0, &btinfo) == 0)
+    {
+        uMaxEntries = MAX(uMaxEntries, SCANDIR_ENTRIES_PER_LEAF(btinfo.nodeSize));
+    }
+    hfs_systemfile_unlock(hfsmp, lockflags);
+
+    /* Initialize a catalog entry list - one extra entry for the next cookie. */
+    ce_list = hfs_mallocz(CE_LIST_SIZE(uMaxEntries));
+    if (ce_list == NULL)
+    {
+        error = ENOMEM;
+        goto exit;
+    }
+    ce_list->maxentries = uMaxEntries;
+
+    /* Extract directory index and tag (sequence number) from uio_offset */
+    int index = uCookie & HFS_INDEX_MASK;
+    unsigned int tag = (unsigned int) uCookie & ~HFS_INDEX_MASK;
+
+    /*
+     * Get a detached directory hint (cnode must be locked exclusive).
+     * It serves as the scan cursor until a match is found.
+     */
+    dirhint = hfs_getdirhint(dcp, ((index - 1) & HFS_INDEX_MASK) | tag, TRUE);
+
+    /* Hide tag from catalog layer. */
+    dirhint->dh_index &= HFS_INDEX_MASK;
+    if (dirhint->dh_index == HFS_INDEX_MASK)
+    {
+        dirhint->dh_index = -1;
+    }
 
     bool bContinueIterating = true;
     while (bContinueIterating)
     {
+        /* Index of the first entry cat_getentriesattr returns */
+        int iBaseIndex = dirhint->dh_index + 1;
+
         /*
          * Populate the ce_list from the catalog file.
          */
-        int lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
-
-        /* Extract directory index and tag (sequence number) from uio_offset */
-        int index = uCookie & HFS_INDEX_MASK;
-        unsigned int tag = (unsigned int) uCookie & ~HFS_INDEX_MASK;
-
-        /* Get a detached directory hint (cnode must be locked exclusive) */
-        directoryhint_t* dirhint = hfs_getdirhint(dcp, ((index - 1) & HFS_INDEX_MASK) | tag, TRUE);
-
-        /* Hide tag from catalog layer. */
-        dirhint->dh_index &= HFS_INDEX_MASK;
-        if (dirhint->dh_index == HFS_INDEX_MASK)
-        {
-            dirhint->dh_index = -1;
-        }
+        lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
 
+        ce_list->skipentries = 0;
         error = cat_getentriesattr(hfsmp, dirhint, ce_list, &reachedeof);
         /* Don't forget to release the descriptors later! */
 
@@ -283,19 +352,19 @@ hfs_scandir(struct vnode *dvp, ScanDirRequest_s* psScanDirRequest)
 
         if (error == ENOENT)
         {
-            //In case of an empty directory need to set EOF and go to exit
-            //We can get ENOENT with partial results so check if really no file was found
+            //We can get ENOENT with partial results, which are the last entries of the directory
             error = 0;
-            if (ce_list->realentries == 0)
-            {
-                psScanDirRequest->psMatchingResult->smr_entry->dea_nextcookie = UVFS_DIRCOOKIE_EOF;
-                hfs_reldirhint(dcp, dirhint);
-                goto exit;
-            }
+            reachedeof = 1;
         }
         else if (error)
         {
-            hfs_reldirhint(dcp, dirhint);
+            goto exit;
+        }
+
+        //In case of an empty directory need to set EOF and go to exit
+        if (ce_list->realentries == 0)
+        {
+            psScanDirRequest->psMatchingResult->smr_entry->dea_nextcookie = UVFS_DIRCOOKIE_EOF;
             goto exit;
         }
 
@@ -317,68 +386,99 @@ hfs_scandir(struct vnode *dvp, ScanDirRequest_s* psScanDirRequest)
             hfs_update(dvp, 0);
         }
 
-        struct cnode *cp = NULL;
-        struct cat_desc* psDesc = &ce_list->entry[0].ce_desc;
-        struct cat_attr* psAttr = &ce_list->entry[0].ce_attr;
-        struct hfsmount* psHfsmp = VTOHFS(dvp);
-        struct cat_fork sDataFork;
+        /*
+         * Unless this is the end of the directory, the last entry is only
+         * used for the cookie of the one before it, and is evaluated in the
+         * next batch.
+         */
+        u_int32_t uEntriesToCheck = reachedeof ? ce_list->realentries : ce_list->realentries - 1;
+        u_int32_t uEntriesChecked = 0;
 
-        bzero(&sDataFork, sizeof(sDataFork));
-        sDataFork.cf_size   = ce_list->entry[0].ce_datasize;
-        sDataFork.cf_blocks = ce_list->entry[0].ce_datablks;
+        while (uEntriesChecked < uEntriesToCheck)
+        {
+            u_int32_t i = uEntriesChecked++;
+            struct cnode *cp = NULL;
+            struct cat_desc* psDesc = &ce_list->entry[i].ce_desc;
+            struct cat_attr* psAttr = &ce_list->entry[i].ce_attr;
+            struct cat_fork sDataFork;
 
-        struct vnode *vp = hfs_chash_getvnode(hfsmp, psAttr->ca_fileid, false, false, false);
+            bzero(&sDataFork, sizeof(sDataFork));
+            sDataFork.cf_size   = ce_list->entry[i].ce_datasize;
+            sDataFork.cf_blocks = ce_list->entry[i].ce_datablks;
 
-        if (vp != NULL)
-        {
-            cp = VTOC(vp);
-            /* Only use cnode's decriptor for non-hardlinks */
-            if (!(cp->c_flag & C_HARDLINK) && cp->c_desc.cd_nameptr != NULL)
-                psDesc = &cp->c_desc;
-            psAttr = &cp->c_attr;
-            if (cp->c_datafork)
+            struct vnode *vp = hfs_chash_getvnode(hfsmp, psAttr->ca_fileid, false, false, false);
+
+            if (vp != NULL)
             {
-                sDataFork.cf_size   = cp->c_datafork->ff_size;
-                sDataFork.cf_blocks = cp->c_datafork->ff_blocks;
+                cp = VTOC(vp);
+                /* Only use cnode's decriptor for non-hardlinks */
+                if (!(cp->c_flag & C_HARDLINK) && cp->c_desc.cd_nameptr != NULL)
+                    psDesc = &cp->c_desc;
+                psAttr = &cp->c_attr;
+                if (cp->c_datafork)
+                {
+                    sDataFork.cf_size   = cp->c_datafork->ff_size;
+                    sDataFork.cf_blocks = cp->c_datafork->ff_blocks;
+                }
             }
-        }
 
-        bool bIsAMatch = DirScanIsMatch(psScanDirRequest, psDesc, psAttr, psHfsmp, &sDataFork);
+            bool bIsAMatch = DirScanIsMatch(psScanDirRequest, psDesc, psAttr, hfsmp, &sDataFork);
 
-        if (vp != NULL)
-        {
-            /* All done with cnode. */
-            hfs_unlock(cp);
-            cp = NULL;
-            
-            hfs_vnop_reclaim(vp);
-        }
-        
-        /* If we skipped catalog entries for reserved files that should
-         * not be listed in namespace, update the index accordingly.
-         */
-        index++;
-        if (ce_list->skipentries)
-        {
-            index += ce_list->skipentries;
-            ce_list->skipentries = 0;
-        }
+            if (vp != NULL)
+            {
+                /* All done with cnode. */
+                hfs_unlock(cp);
+                cp = NULL;
 
-        uCookie = reachedeof ? UVFS_DIRCOOKIE_EOF : (index | ((u_int64_t)ce_list->entry[1].ce_desc.cd_cnid << 32));
+                hfs_vnop_reclaim(vp);
+            }
 
-        if (bIsAMatch)
+            if (bIsAMatch)
+            {
+                /* Entries skipped for reserved files are counted in the index as well */
+                if (i + 1 < ce_list->realentries)
+                {
+                    int iNextIndex = iBaseIndex + (i + 1) + ce_list->entry[i + 1].ce_skipped;
+                    uCookie = iNextIndex | ((u_int64_t)ce_list->entry[i + 1].ce_desc.cd_cnid << 32);
+                }
+                else
+                {
+                    uCookie = UVFS_DIRCOOKIE_EOF;
+                }
+
+                bContinueIterating = false;
+                psScanDirRequest->psMatchingResult->smr_entry->dea_nextcookie = uCookie;
+                psScanDirRequest->psMatchingResult->smr_entry->dea_nextrec = 0;
+                break;
+            }
+        }
+
+        if (bContinueIterating && reachedeof)
         {
+            /* Nothing matched up to the end of the directory */
+            psScanDirRequest->psMatchingResult->smr_entry->dea_nextcookie = UVFS_DIRCOOKIE_EOF;
             bContinueIterating = false;
-            psScanDirRequest->psMatchingResult->smr_entry->dea_nextcookie = uCookie;
-            psScanDirRequest->psMatchingResult->smr_entry->dea_nextrec = 0;
+            hfs_reldirhint(dcp, dirhint);
+            dirhint = NULL;
         }
-
-        if (reachedeof)
+        else if (!bContinueIterating && (uCookie == UVFS_DIRCOOKIE_EOF))
+        {
             hfs_reldirhint(dcp, dirhint);
+            dirhint = NULL;
+        }
         else
-            hfs_insertdirhint(dcp, dirhint);
+        {
+            /* Move the cursor past the last evaluated entry. On failure the catalog positions by index. */
+            u_int32_t uLast = uEntriesChecked - 1;
+            (void) hfs_dirhint_set_position(dirhint, &ce_list->entry[uLast].ce_desc,
+                                            iBaseIndex + uLast + ce_list->entry[uLast].ce_skipped);
+            if (!bContinueIterating)
+            {
+                hfs_insertdirhint(dcp, dirhint);
+                dirhint = NULL;
+            }
+        }
 
-        // **** check if can move to exit *******
         /* All done with the catalog descriptors. */
         for (uint32_t i =0; i < ce_list->realentries; i++)
         {
@@ -388,6 +488,11 @@ hfs_scandir(struct vnode *dvp, ScanDirRequest_s* psScanDirRequest)
     }
 
 exit:
+    if (dirhint)
+    {
+        hfs_reldirhint(dcp, dirhint);
+    }
+
     //Drop the directory lock
     hfs_unlock(dcp);
     dcp = NULL;
@@ -599,34 +704,11 @@ hfs_readdirattr_internal(struct vnode *dvp, ReadDirBuff_s* psReadDirBuffer, int
     if ((*(eofflag) == 0) && (lastdescp != NULL))
     {
         /* Remember last entry */
-        if ((dirhint->dh_desc.cd_flags & CD_HASBUF) && (dirhint->dh_desc.cd_nameptr != NULL))
-        {
-            dirhint->dh_desc.cd_flags &= ~CD_HASBUF;
-            if (dirhint->dh_desc.cd_nameptr != NULL)
-                hfs_free((void *) dirhint->dh_desc.cd_nameptr);
-            dirhint->dh_desc.cd_nameptr = NULL;
-        }
-        if (lastdescp->cd_nameptr != NULL)
-        {
-            dirhint->dh_desc.cd_namelen = lastdescp->cd_namelen;
-            dirhint->dh_desc.cd_nameptr = hfs_malloc(sizeof(char)*lastdescp->cd_namelen);
-            if (dirhint->dh_desc.cd_nameptr == NULL)
-            {
-                error = ENOMEM;
-                goto exit2;
-            }
-            memcpy((void *) dirhint->dh_desc.cd_nameptr,(void *) lastdescp->cd_nameptr,lastdescp->cd_namelen);
-            dirhint->dh_desc.cd_flags |= CD_HASBUF;
-        }
-        else
+        error = hfs_dirhint_set_position(dirhint, lastdescp, index - 1);
+        if (error)
         {
-            dirhint->dh_desc.cd_namelen = 0;
-            dirhint->dh_desc.cd_nameptr = NULL;
+            goto exit2;
         }
-        dirhint->dh_index = index - 1;
-        dirhint->dh_desc.cd_cnid = lastdescp->cd_cnid;
-        dirhint->dh_desc.cd_hint = lastdescp->cd_hint;
-        dirhint->dh_desc.cd_encoding = lastdescp->cd_encoding;
     }
 
     /* All done with the catalog descriptors. */
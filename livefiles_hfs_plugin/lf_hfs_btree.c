@@ -13,6 +13,10 @@
 
 //////////////////////////////////// Globals ////////////////////////////////////
 
+static __thread BTReadSection  *gpsBTReadSection;   // this thread's read section, if any
+
+static Boolean BTFailReadSection(BTreeControlBlockPtr btreePtr);
+
 
 /////////////////////////// BTree Module Entry Points ///////////////////////////
 
@@ -70,6 +74,7 @@ OSStatus BTOpenPath(FCB *filePtr, KeyCompareProcPtr keyCompareProc)
     btreePtr->releaseBlockProc    = ReleaseBTreeBlock;
     btreePtr->setEndOfForkProc    = ExtendBTreeFile;
     btreePtr->keyCompareProc      = keyCompareProc;
+    btreePtr->nodeVersions        = hfs_mallocz(kBTNodeVersionSlots * sizeof(u_int32_t));
     
     /////////////////////////// Read Header Node ////////////////////////////////
     
@@ -223,6 +228,7 @@ ErrorExit:
     
     filePtr->fcbBTCBPtr = nil;
     (void) ReleaseNode (btreePtr, &nodeRec);
+    hfs_free(btreePtr->nodeVersions);
     hfs_free(btreePtr);
     
     return err;
@@ -263,6 +269,7 @@ OSStatus    BTClosePath            (FCB                    *filePtr)
     err = UpdateHeader (btreePtr, true);
     M_ExitOnError (err);
     
+    hfs_free(btreePtr->nodeVersions);
     hfs_free(btreePtr);
     filePtr->fcbBTCBPtr = nil;
     
@@ -323,6 +330,7 @@ OSStatus    BTSearchRecord        (FCB                        *filePtr,
     u_int16_t                len;
     Boolean                    foundRecord;
     Boolean                    validHint;
+    BTReadSection            *readSection;
     
     if (filePtr == nil)
     {
@@ -343,7 +351,9 @@ OSStatus    BTSearchRecord        (FCB                        *filePtr,
         return    fsBTInvalidFileErr;
     }
     
-    REQUIRE_FILE_LOCK(btreePtr->fileRefNum, true);
+    readSection = BTGetReadSection(btreePtr);
+    if (readSection == nil)
+        REQUIRE_FILE_LOCK(btreePtr->fileRefNum, true);
     
     foundRecord = false;
     
@@ -356,13 +366,21 @@ OSStatus    BTSearchRecord        (FCB                        *filePtr,
     {
         nodeNum = searchIterator->hint.nodeNum;
         
-        err = GetNode (btreePtr, nodeNum, kGetNodeHint, &node);
+        if (readSection != nil)
+        {
+            err = GetNodeInReadSection (btreePtr, readSection, nodeNum, kGetNodeHint, &node);
+            M_ExitOnError (err);
+        }
+        else
+        {
+            err = GetNode (btreePtr, nodeNum, kGetNodeHint, &node);
+        }
         if( err == noErr )
         {
             if ( ((BTNodeDescriptor*) node.buffer)->kind == kBTLeafNode &&
                 ((BTNodeDescriptor*) node.buffer)->numRecords    >  0 )
             {
-                foundRecord = SearchNode (btreePtr, node.buffer, &searchIterator->key, &index);
+                foundRecord = SearchNodeBlock (btreePtr, &node, &searchIterator->key, &index);
                 
                 //if !foundRecord, we could still skip tree search if ( 0 < index < numRecords )
             }
@@ -406,7 +424,14 @@ OSStatus    BTSearchRecord        (FCB                        *filePtr,
     if (foundRecord == true)
     {
         //XXX Should check for errors! Or BlockMove could choke on recordPtr!!!
-        GetRecordByIndex (btreePtr, node.buffer, index, &keyPtr, &recordPtr, &len);
+        err = GetRecordByIndex (btreePtr, node.buffer, index, &keyPtr, &recordPtr, &len);
+        if (err != noErr && readSection != nil)
+        {
+            (void) ReleaseNode (btreePtr, &node);
+            readSection->conflict = true;
+            err = fsBTReadConflictErr;
+            goto ErrorExit;
+        }
         
         if (recordLen != nil)            *recordLen = len;
         
@@ -541,6 +566,10 @@ OSStatus    BTIterateRecord        (FCB                        *filePtr,
     
     REQUIRE_FILE_LOCK(btreePtr->fileRefNum, true);
     
+    // Iterating holds sibling nodes in pairs, which a reader without the b-tree lock must not do
+    if (BTFailReadSection(btreePtr))
+        return    fsBTReadConflictErr;
+    
     if ((operation != kBTreeFirstRecord)    &&
         (operation != kBTreeNextRecord)        &&
         (operation != kBTreeCurrentRecord)    &&
@@ -847,6 +876,9 @@ BTIterateRecords(FCB *filePtr, BTreeIterationOperation operation, BTreeIterator
     
     REQUIRE_FILE_LOCK(btreePtr->fileRefNum, true);
     
+    if (BTFailReadSection(btreePtr))
+        return    fsBTReadConflictErr;
+    
     if ((operation != kBTreeFirstRecord)    &&
         (operation != kBTreeNextRecord)        &&
         (operation != kBTreeCurrentRecord)    &&
@@ -1124,6 +1156,7 @@ OSStatus    BTInsertRecord        (FCB                        *filePtr,
     u_int32_t                insertNodeNum;
     u_int16_t                index;
     Boolean                    recordFit;
+    Boolean                    changeStarted = false;
     
     ////////////////////////// Priliminary Checks ///////////////////////////////
     
@@ -1153,6 +1186,8 @@ OSStatus    BTInsertRecord        (FCB                        *filePtr,
             
         case fsBTEmptyErr:    // if tree empty add 1st leaf node
             
+            changeStarted = BTBeginStructureChange (btreePtr);
+            
             if (btreePtr->freeNodes == 0)
             {
                 err = ExtendBTree (btreePtr, btreePtr->totalNodes + 1);
@@ -1250,6 +1285,9 @@ Success:
     iterator->hint.reserved1    = 0;
     iterator->hint.reserved2    = 0;
     
+    if (changeStarted)
+        BTEndStructureChange (btreePtr);
+    
     return noErr;
     
     
@@ -1265,6 +1303,9 @@ ErrorExit:
     iterator->hint.reserved1    = 0;
     iterator->hint.reserved2    = 0;
     
+    if (changeStarted)
+        BTEndStructureChange (btreePtr);
+    
     if (err == fsBTEmptyErr)
         err = fsBTRecordNotFoundErr;
     
@@ -1459,7 +1500,7 @@ BTUpdateRecord(FCB *filePtr, BTreeIterator *iterator,
         if (err == noErr)
         {
             if (((NodeDescPtr)nodeRec.buffer)->kind == kBTLeafNode &&
-                SearchNode (btreePtr, nodeRec.buffer, &iterator->key, &index))
+                SearchNodeBlock (btreePtr, &nodeRec, &iterator->key, &index))
             {
                 err = GetRecordByIndex(btreePtr, nodeRec.buffer, index, &keyPtr, &recordPtr, &recordLen);
                 M_ExitOnError (err);
@@ -1719,6 +1760,7 @@ BTReloadData(FCB *filePtr)
     BTreeControlBlockPtr btreePtr;
     BlockDescriptor node;
     BTHeaderRec *header;
+    Boolean changeStarted;
     
     
     node.buffer = nil;
@@ -1730,9 +1772,16 @@ BTReloadData(FCB *filePtr)
     
     REQUIRE_FILE_LOCK(btreePtr->fileRefNum, false);
     
+    // Everything cached about the tree may be stale now
+    changeStarted = BTBeginStructureChange(btreePtr);
+    
     err = GetNode(btreePtr, kHeaderNodeNum, 0, &node);
     if (err != noErr)
+    {
+        if (changeStarted)
+            BTEndStructureChange(btreePtr);
         return (err);
+    }
     
     header = (BTHeaderRec*)((char *)node.buffer + sizeof(BTNodeDescriptor));
     if ((err = VerifyHeader (filePtr, header)) == 0) {
@@ -1751,6 +1800,9 @@ BTReloadData(FCB *filePtr)
     
     (void) ReleaseNode(btreePtr, &node);
     
+    if (changeStarted)
+        BTEndStructureChange(btreePtr);
+    
     return    err;
 }
 
@@ -1782,6 +1834,200 @@ OSStatus    BTInvalidateHint    (BTreeIterator                *iterator )
 
 
 
+/*-------------------------------------------------------------------------------
+ Routine:    BTBeginReadSection    -    Start reading a B-tree without the b-tree lock.
+ 
+ Function:    Until BTEndReadSection, BTSearchRecord calls for this B-tree made by
+ the current thread don't need the b-tree lock.  Each node is read while it
+ is owned, one at a time, and the version it was read at is remembered.
+ Nothing read in the section may be trusted until BTEndReadSection says
+ so; the caller must not change anything that depends on it before then.
+ 
+ BTIterateRecord and BTIterateRecords fail with fsBTReadConflictErr in a
+ section, and a thread can't be in two sections at once.
+ 
+ Input:        filePtr        - pointer file control block
+ 
+ Output:        section        - the section, kept by the caller until BTEndReadSection
+ 
+ Result:        noErr                - success
+ fsBTInvalidFileErr    - the B-tree wasn't opened with version tracking
+ fsBTReadConflictErr    - a writer is changing the tree structure, take the lock
+ -------------------------------------------------------------------------------*/
+
+OSStatus    BTBeginReadSection    (FCB                    *filePtr,
+                                   BTReadSection            *section )
+{
+    BTreeControlBlockPtr    btreePtr;
+    
+    btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
+    if (btreePtr == nil || btreePtr->nodeVersions == nil || gpsBTReadSection != nil)
+        return    fsBTInvalidFileErr;
+    
+    section->btreePtr       = btreePtr;
+    section->numNodes       = 0;
+    section->conflict       = false;
+    section->structureSeq   = __atomic_load_n(&btreePtr->structureSeq, __ATOMIC_ACQUIRE);
+    if (section->structureSeq & 1)
+        return    fsBTReadConflictErr;
+    
+    gpsBTReadSection = section;
+    
+    return    noErr;
+}
+
+
+
+/*-------------------------------------------------------------------------------
+ Routine:    BTEndReadSection    -    Check what was read without the b-tree lock.
+ 
+ Function:    Ends the current thread's read section.  The reads in it are good if
+ no read conflicted, the tree structure didn't change, and no node
+ read in it changed since it was read.
+ 
+ Input:        filePtr        - pointer file control block
+ section        - the section passed to BTBeginReadSection
+ 
+ Result:        true if the reads in the section are good, false if they must be
+ redone with the b-tree lock held
+ -------------------------------------------------------------------------------*/
+
+Boolean    BTEndReadSection    (FCB                    *filePtr,
+                                BTReadSection            *section )
+{
+    BTreeControlBlockPtr    btreePtr;
+    u_int32_t               i;
+    
+    btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
+    
+    if (gpsBTReadSection == section)
+        gpsBTReadSection = nil;
+    
+    if (section->conflict || btreePtr == nil || btreePtr != section->btreePtr)
+        return    false;
+    
+    // Node versions first: a change to a node we read bumps its version before structureSeq goes even again
+    for (i = 0; i < section->numNodes; ++i)
+    {
+        if (__atomic_load_n(M_NodeVersionSlot(btreePtr, section->nodes[i].nodeNum), __ATOMIC_ACQUIRE) != section->nodes[i].version)
+            return    false;
+    }
+    
+    return    (__atomic_load_n(&btreePtr->structureSeq, __ATOMIC_ACQUIRE) == section->structureSeq);
+}
+
+
+
+/*-------------------------------------------------------------------------------
+ Routine:    BTInReadSection    -    Is the current thread reading without the b-tree lock?
+ 
+ Function:    Lets callers skip caching anything read in a section before it has
+ been checked by BTEndReadSection.
+ 
+ Result:        true if the current thread is in a read section
+ -------------------------------------------------------------------------------*/
+
+Boolean    BTInReadSection    (void)
+{
+    return    (gpsBTReadSection != nil);
+}
+
+
+
+/*-------------------------------------------------------------------------------
+ Routine:    BTBeginUpdateGroup    -    Make several record changes look like one to readers.
+ 
+ Function:    A BTReadSection only checks the nodes it read, so a reader could see
+ a B-tree between two record changes that only make sense together, such
+ as a record deleted from one node and its replacement inserted in
+ another.  Read sections that overlap the group fail until
+ BTEndUpdateGroup.  Called with the b-tree lock held exclusive.
+ 
+ Input:        filePtr        - pointer file control block
+ 
+ Result:        true if this call started the group, false if a change was already
+ in progress; pass it to BTEndUpdateGroup
+ -------------------------------------------------------------------------------*/
+
+Boolean    BTBeginUpdateGroup    (FCB                    *filePtr )
+{
+    BTreeControlBlockPtr    btreePtr;
+    
+    btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
+    if (btreePtr == nil)
+        return    false;
+    
+    return    BTBeginStructureChange(btreePtr);
+}
+
+
+
+/*-------------------------------------------------------------------------------
+ Routine:    BTEndUpdateGroup    -    End a group started by BTBeginUpdateGroup.
+ 
+ Input:        filePtr        - pointer file control block
+ started        - what BTBeginUpdateGroup returned
+ 
+ Result:        none
+ -------------------------------------------------------------------------------*/
+
+void    BTEndUpdateGroup    (FCB                    *filePtr,
+                             Boolean                started )
+{
+    BTreeControlBlockPtr    btreePtr;
+    
+    btreePtr = (BTreeControlBlockPtr) filePtr->fcbBTCBPtr;
+    if (started && btreePtr != nil)
+        BTEndStructureChange(btreePtr);
+}
+
+
+
+/*-------------------------------------------------------------------------------
+ Routine:    BTGetReadSection    -    The current thread's read section for a B-tree.
+ 
+ Input:        btreePtr    - pointer to BTree control block
+ 
+ Result:        the section, or nil if the thread isn't reading this B-tree in one
+ -------------------------------------------------------------------------------*/
+
+BTReadSection *    BTGetReadSection    (BTreeControlBlockPtr    btreePtr )
+{
+    BTReadSection    *section = gpsBTReadSection;
+    
+    if (section != nil && section->btreePtr == btreePtr)
+        return    section;
+    
+    return    nil;
+}
+
+
+
+/*-------------------------------------------------------------------------------
+ Routine:    BTFailReadSection    -    Refuse an operation in a read section.
+ 
+ Function:    Marks the current thread's read section for a B-tree as conflicted,
+ for operations that can't be done without the b-tree lock.
+ 
+ Input:        btreePtr    - pointer to BTree control block
+ 
+ Result:        true if the thread is in a read section for this B-tree
+ -------------------------------------------------------------------------------*/
+
+static Boolean    BTFailReadSection    (BTreeControlBlockPtr    btreePtr )
+{
+    BTReadSection    *section = BTGetReadSection(btreePtr);
+    
+    if (section == nil)
+        return    false;
+    
+    section->conflict = true;
+    
+    return    true;
+}
+
+
+
 
 /*-------------------------------------------------------------------------------
  Routine:    BTGetLastSync
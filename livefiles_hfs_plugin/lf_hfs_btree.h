@@ -109,6 +109,11 @@ typedef struct BTreeControlBlock {                    // fields specific to BTre
     u_int32_t                    reservedNodes;
     BTreeIterator   iterator; // useable when holding exclusive b-tree lock
 
+    // optimistic reads, see BTBeginReadSection
+    u_int64_t                    structureSeq;      // odd while a writer changes the tree structure
+    Boolean                      structureChanging;
+    u_int32_t                    *nodeVersions;     // kBTNodeVersionSlots change counters, hashed by node number
+
 #if DEBUG
     void                        *madeDirtyBy[2];
 #endif
@@ -255,12 +255,15 @@ OSStatus    ExtendBTree    (BTreeControlBlockPtr    btreePtr,
     u_int16_t                 mapNodeRecSize;
     u_int32_t                 bitInWord, bitInRecord;
     u_int16_t                 mapIndex;
+    Boolean                   changeStarted;
 
 
     oldTotalNodes = btreePtr->totalNodes;
     if (newTotalNodes <= oldTotalNodes)                // we're done!
         return    noErr;
 
+    changeStarted = BTBeginStructureChange(btreePtr);  // totalNodes and the node map change below
+
     nodeSize            = btreePtr->nodeSize;
     filePtr             = GetFileControlBlock(btreePtr->fileRefNum);
 
@@ -430,6 +433,9 @@ Success:
     /* Force the b-tree header changes to disk */
     (void) UpdateHeader (btreePtr, true);
 
+    if (changeStarted)
+        BTEndStructureChange(btreePtr);
+
     return    noErr;
 
 
@@ -440,6 +446,9 @@ ErrorExit:
     (void) ReleaseNode (btreePtr, &mapNode);
     (void) ReleaseNode (btreePtr, &newNode);
 
+    if (changeStarted)
+        BTEndStructureChange(btreePtr);
+
     return    err;
 }
 
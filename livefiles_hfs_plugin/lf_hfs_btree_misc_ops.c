@@ -260,7 +260,7 @@ OSStatus    FindIteratorPosition    (BTreeControlBlockPtr     btreePtr,
         goto SearchTheTree;
     }
 
-    foundIt = SearchNode (btreePtr, middle->buffer, &iterator->key, &index);
+    foundIt = SearchNodeBlock (btreePtr, middle, &iterator->key, &index);
     if (foundIt == true)
     {
         ++btreePtr->numValidHints;
@@ -297,7 +297,7 @@ OSStatus    FindIteratorPosition    (BTreeControlBlockPtr     btreePtr,
             goto SearchTheTree;
         }
 
-        foundIt = SearchNode (btreePtr, left->buffer, &iterator->key, &leftIndex);
+        foundIt = SearchNodeBlock (btreePtr, left, &iterator->key, &leftIndex);
         if (foundIt == true)
         {
             *right            = *middle;
@@ -350,7 +350,7 @@ OSStatus    FindIteratorPosition    (BTreeControlBlockPtr     btreePtr,
             goto SearchTheTree;
         }
 
-        foundIt = SearchNode (btreePtr, right->buffer, &iterator->key, &rightIndex);
+        foundIt = SearchNodeBlock (btreePtr, right, &iterator->key, &rightIndex);
         if (rightIndex >= ((NodeDescPtr) right->buffer)->numRecords)        // we're lost
         {
             goto SearchTheTree;
@@ -16,6 +16,11 @@
 //    ReleaseNode            - Call FS Agent to release node obtained by GetNode.
 //    UpdateNode            - Mark a node as dirty and call FS Agent to release it.
 //
+//    GetNodeInReadSection - GetNode for a reader without the b-tree lock.
+//    BTNodeVersionBump    - Tell readers without the b-tree lock that a node changed.
+//    BTBeginStructureChange - Tell them that records are moving between nodes.
+//    BTEndStructureChange - Tell them that the tree structure is stable again.
+//
 //    ClearNode            - Clear a node to all zeroes.
 //
 //    InsertRecord        - Inserts a record into a BTree node.
@@ -23,6 +28,7 @@
 //    DeleteRecord        - Deletes a record from a BTree node.
 //
 //    SearchNode            - Return index for record that matches key.
+//    SearchNodeBlock        - SearchNode using the node's search accelerator.
 //    LocateRecord        - Return pointer to key and data, and size of data.
 //
 //    GetNodeDataSize        - Return the amount of space used for data in the node.
@@ -216,6 +222,10 @@ OSStatus    ReleaseNode    (BTreeControlBlockPtr     btreePtr,
 
     if (nodePtr->buffer != nil)
     {
+        // A node changed but released clean is still changed for readers
+        if (nodePtr->isChanged)
+            BTNodeVersionBump (btreePtr, (u_int32_t) nodePtr->blockNum);
+
         releaseNodeProc = btreePtr->releaseBlockProc;
         err = releaseNodeProc (btreePtr->fileRefNum,
                                nodePtr,
@@ -262,6 +272,8 @@ OSStatus    TrashNode    (BTreeControlBlockPtr     btreePtr,
 
     if (nodePtr->buffer != nil)
     {
+        BTNodeVersionBump (btreePtr, (u_int32_t) nodePtr->blockNum);
+
         releaseNodeProc = btreePtr->releaseBlockProc;
         err = releaseNodeProc (btreePtr->fileRefNum,
                                nodePtr,
@@ -312,6 +324,9 @@ OSStatus    UpdateNode    (BTreeControlBlockPtr     btreePtr,
 
     if (nodePtr->buffer != nil)            // Why call UpdateNode if nil ?!?
     {
+        // Bump while the node is still ours, so readers see the new version with the new data
+        BTNodeVersionBump (btreePtr, (u_int32_t) nodePtr->blockNum);
+
         releaseNodeProc = btreePtr->releaseBlockProc;
         err = releaseNodeProc (btreePtr->fileRefNum,
                                nodePtr,
@@ -325,6 +340,154 @@ OSStatus    UpdateNode    (BTreeControlBlockPtr     btreePtr,
     return    err;
 }
 
+/*-------------------------------------------------------------------------------
+
+ Routine:    GetNodeInReadSection    -    GetNode for a reader without the b-tree lock.
+
+ Function:    Gets a node for a reader in a BTReadSection, and remembers the
+ version it was read at.  Once the node is ours no writer can change
+ it, so if the tree structure didn't start changing since the section
+ began, the node belongs to the tree the section has been reading.
+
+ Input:        btreePtr        - pointer to BTree control block
+ section        - the current thread's read section
+ nodeNum            - number of node to request
+ flags            - kGetNodeHint, as for GetNode
+
+ Output:        nodePtr            - pointer to beginning of node (nil if error)
+
+ Result:        noErr                - success
+ fsBTReadConflictErr    - the read raced a writer, the section is over
+ -------------------------------------------------------------------------------*/
+
+OSStatus    GetNodeInReadSection    (BTreeControlBlockPtr     btreePtr,
+                                     BTReadSection            *section,
+                                     u_int32_t                nodeNum,
+                                     u_int32_t                flags,
+                                     NodeRec                  *nodePtr )
+{
+    OSStatus    err;
+    u_int32_t   totalNodes;
+
+    nodePtr->buffer         = nil;
+    nodePtr->blockHeader    = nil;
+
+    // ExtendBTree changes the structure before totalNodes, so a node past the
+    // old end is never mapped while the file is being extended
+    totalNodes = __atomic_load_n(&btreePtr->totalNodes, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&btreePtr->structureSeq, __ATOMIC_ACQUIRE) != section->structureSeq)
+    {
+        goto Conflict;
+    }
+
+    // A child pointer from a node a writer has since freed could point anywhere
+    if ( section->conflict ||
+         nodeNum == 0 || nodeNum >= totalNodes ||
+         section->numNodes >= kBTReadSectionMaxNodes )
+    {
+        goto Conflict;
+    }
+
+    err = GetNode (btreePtr, nodeNum, flags, nodePtr);
+    if (err != noErr)
+    {
+        goto Conflict;
+    }
+
+    if (__atomic_load_n(&btreePtr->structureSeq, __ATOMIC_ACQUIRE) != section->structureSeq)
+    {
+        (void) ReleaseNode (btreePtr, nodePtr);
+        goto Conflict;
+    }
+
+    section->nodes[section->numNodes].nodeNum = nodeNum;
+    section->nodes[section->numNodes].version = __atomic_load_n(M_NodeVersionSlot(btreePtr, nodeNum), __ATOMIC_ACQUIRE);
+    ++section->numNodes;
+
+    return noErr;
+
+Conflict:
+    section->conflict = true;
+
+    return fsBTReadConflictErr;
+}
+
+
+
+/*-------------------------------------------------------------------------------
+
+ Routine:    BTNodeVersionBump    -    Tell readers without the b-tree lock that a node changed.
+
+ Function:    Bumps the version slot of a node.  Called by the writer while it
+ still owns the changed node, before releasing it.
+
+ Input:        btreePtr        - pointer to BTree control block
+ nodeNum            - number of the changed node
+
+ Result:        none
+ -------------------------------------------------------------------------------*/
+
+void    BTNodeVersionBump    (BTreeControlBlockPtr     btreePtr,
+                              u_int32_t                nodeNum )
+{
+    if (btreePtr->nodeVersions != nil)
+    {
+        __atomic_add_fetch(M_NodeVersionSlot(btreePtr, nodeNum), 1, __ATOMIC_RELEASE);
+    }
+}
+
+
+
+/*-------------------------------------------------------------------------------
+
+ Routine:    BTBeginStructureChange    -    Tell readers that records are moving between nodes.
+
+ Function:    Makes structureSeq odd before a split, rotate, node free or new
+ root, so readers in a BTReadSection stop trusting the links between nodes.
+ Called with the b-tree lock held exclusive, while the first node to be
+ changed is still owned by the writer.
+
+ Input:        btreePtr        - pointer to BTree control block
+
+ Result:        true if this call started the change, false if one was
+ already in progress
+ -------------------------------------------------------------------------------*/
+
+Boolean    BTBeginStructureChange    (BTreeControlBlockPtr     btreePtr )
+{
+    if (btreePtr->structureChanging)
+        return false;
+
+    btreePtr->structureChanging = true;
+    __atomic_add_fetch(&btreePtr->structureSeq, 1, __ATOMIC_SEQ_CST);
+
+    return true;
+}
+
+
+
+/*-------------------------------------------------------------------------------
+
+ Routine:    BTEndStructureChange    -    Tell readers the tree structure is stable again.
+
+ Function:    Makes structureSeq even again.  A no-op if no change is in progress.
+
+ Input:        btreePtr        - pointer to BTree control block
+
+ Result:        none
+ -------------------------------------------------------------------------------*/
+
+void    BTEndStructureChange    (BTreeControlBlockPtr     btreePtr )
+{
+    if (btreePtr->structureChanging)
+    {
+        btreePtr->structureChanging = false;
+        __atomic_add_fetch(&btreePtr->structureSeq, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+
 /*-------------------------------------------------------------------------------
 
  Routine:    ClearNode    -    Clear a node to all zeroes.
@@ -627,6 +790,86 @@ SearchNode( BTreeControlBlockPtr btreePtr,
 }
 
 
+/*-------------------------------------------------------------------------------
+
+ Routine:    SearchNodeBlock    -    SearchNode for a node obtained with GetBTreeBlock.
+
+ Function:    Same as SearchNode, but uses the node's search accelerator when the
+ buffer layer keeps one (see GetBTreeBlockSearchCache).  Probes are
+ first compared by parentID and folded name prefix; the key compare
+ procedure is only called when those are equal and don't already
+ decide the result.
+
+ Input:        btreePtr    - pointer to BTree control block
+ block        - block descriptor of the node that contains the record
+ searchKey    - pointer to the key to match
+
+ Output:        index        - pointer to beginning of key for record
+
+ Result:        true    - success (index = record index)
+ false    - key did not match anything in node (index = insert index)
+ -------------------------------------------------------------------------------*/
+Boolean
+SearchNodeBlock( BTreeControlBlockPtr btreePtr,
+                BlockDescPtr block,
+                KeyPtr searchKey,
+                u_int16_t *returnIndex )
+{
+    NodeDescPtr   node = (NodeDescPtr) block->buffer;
+    int32_t        lowerBound;
+    int32_t        upperBound;
+    int32_t        index;
+    int32_t        result;
+    KeyPtr        trialKey;
+    u_int16_t    *offset;
+    BTNodeSearchCache *cache;
+    BTNodeSearchEntry  search;
+    BTNodeSearchEntry *trial;
+    KeyCompareProcPtr compareProc = btreePtr->keyCompareProc;
+
+    cache = GetBTreeBlockSearchCache(btreePtr, block);
+    if (cache == NULL) {
+        return SearchNode(btreePtr, node, searchKey, returnIndex);
+    }
+
+    BTNodeSearchEntryFromKey((HFSPlusCatalogKey *) searchKey, kHFSPlusMaxFileNameChars, &search);
+
+    lowerBound = 0;
+    upperBound = node->numRecords - 1;
+    offset = (u_int16_t *) ((u_int8_t *)(node) + (btreePtr)->nodeSize - kOffsetSize);
+
+    while (lowerBound <= upperBound) {
+        index = (lowerBound + upperBound) >> 1;
+        trial = &cache->entries[index];
+
+        if (search.parentID != trial->parentID) {
+            result = (search.parentID < trial->parentID) ? -1 : 1;
+        } else if (search.prefix[0] != trial->prefix[0]) {
+            result = (search.prefix[0] < trial->prefix[0]) ? -1 : 1;
+        } else if (search.prefix[1] != trial->prefix[1]) {
+            result = (search.prefix[1] < trial->prefix[1]) ? -1 : 1;
+        } else if (search.complete && trial->complete) {
+            result = 0;
+        } else {
+            trialKey = (KeyPtr) ((u_int8_t *)node + *(offset - index));
+            result = compareProc(searchKey, trialKey);
+        }
+
+        if (result <  0) {
+            upperBound = index - 1;      /* search < trial */
+        } else if (result >  0) {
+            lowerBound = index + 1;      /* search > trial */
+        } else {
+            *returnIndex = index;      /* search == trial */
+            return true;
+        }
+    }
+
+    *returnIndex = lowerBound;    /* lowerBound is insert index */
+    return false;
+}
+
+
 /*-------------------------------------------------------------------------------
 
  Routine:    GetRecordByIndex    -    Return pointer to key and data, and size of data.
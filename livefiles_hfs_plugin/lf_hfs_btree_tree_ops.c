@@ -122,7 +122,11 @@ OSStatus    SearchTree    (BTreeControlBlockPtr     btreePtr,
     KeyPtr        keyPtr;
     u_int8_t *    dataPtr;
     u_int16_t    dataSize;
+    BTReadSection *readSection;
 
+    readSection        = BTGetReadSection (btreePtr);
+    nodeRec.buffer    = nil;
+    nodeRec.blockHeader = nil;
 
     curNodeNum        = btreePtr->rootNode;
     level            = btreePtr->treeDepth;
@@ -152,11 +156,21 @@ OSStatus    SearchTree    (BTreeControlBlockPtr     btreePtr,
             goto ErrorExit;
         }
 
-        err = GetNode (btreePtr, curNodeNum, 0, &nodeRec);
-        if (err != noErr)
+        if (readSection != nil)
         {
-            LFHFS_LOG(LEVEL_ERROR, "SearchTree: GetNode returned with error %d!",err);
-            goto ErrorExit;
+            // Without the b-tree lock, any surprise from here on is a writer we raced
+            err = GetNodeInReadSection (btreePtr, readSection, curNodeNum, 0, &nodeRec);
+            if (err != noErr)
+                goto ErrorExit;
+        }
+        else
+        {
+            err = GetNode (btreePtr, curNodeNum, 0, &nodeRec);
+            if (err != noErr)
+            {
+                LFHFS_LOG(LEVEL_ERROR, "SearchTree: GetNode returned with error %d!",err);
+                goto ErrorExit;
+            }
         }
 
         //
@@ -167,6 +181,8 @@ OSStatus    SearchTree    (BTreeControlBlockPtr     btreePtr,
         //
         if (((BTNodeDescriptor*)nodeRec.buffer)->height != level)
         {
+            if (readSection != nil)
+                goto ReadConflict;
             LFHFS_LOG(LEVEL_ERROR, "Incorrect node height");
             err = btBadNode;
             goto ReleaseAndExit;
@@ -177,6 +193,8 @@ OSStatus    SearchTree    (BTreeControlBlockPtr     btreePtr,
             //    Nodes at level 1 must be leaves, by definition
             if (nodeKind != kBTLeafNode)
             {
+                if (readSection != nil)
+                    goto ReadConflict;
                 LFHFS_LOG(LEVEL_ERROR, "Incorrect node type: expected leaf");
                 err = btBadNode;
                 goto ReleaseAndExit;
@@ -187,13 +205,15 @@ OSStatus    SearchTree    (BTreeControlBlockPtr     btreePtr,
             //    A node at any other depth must be an index node
             if (nodeKind != kBTIndexNode)
             {
+                if (readSection != nil)
+                    goto ReadConflict;
                 LFHFS_LOG(LEVEL_ERROR, "Incorrect node type: expected index");
                 err = btBadNode;
                 goto ReleaseAndExit;
             }
         }
 
-        keyFound = SearchNode (btreePtr, nodeRec.buffer, searchKey, &index);
+        keyFound = SearchNodeBlock (btreePtr, &nodeRec, searchKey, &index);
 
         treePathTable [level].node        = curNodeNum;
 
@@ -209,6 +229,10 @@ OSStatus    SearchTree    (BTreeControlBlockPtr     btreePtr,
         treePathTable [level].index = index;
 
         err = GetRecordByIndex (btreePtr, nodeRec.buffer, index, &keyPtr, &dataPtr, &dataSize);
+        if (err != noErr && readSection != nil)
+        {
+            goto ReadConflict;
+        }
         if (err != noErr)
         {
             //    [2550929] If we got an error, it is probably because the index was bad
@@ -244,6 +268,11 @@ OSStatus    SearchTree    (BTreeControlBlockPtr     btreePtr,
     else
         return    fsBTRecordNotFoundErr;    // searchKey not found, index identifies insert point
 
+ReadConflict:
+    readSection->conflict = true;
+    err = fsBTReadConflictErr;
+    //    fall into ReleaseAndExit
+
 ReleaseAndExit:
     (void) ReleaseNode(btreePtr, &nodeRec);
     //    fall into ErrorExit
@@ -272,6 +301,9 @@ OSStatus    InsertTree ( BTreeControlBlockPtr         btreePtr,
 {
     InsertKey            primaryKey;
     OSStatus            err;
+    Boolean                changeInProgress;
+
+    changeInProgress        = btreePtr->structureChanging;
 
     primaryKey.keyPtr        = keyPtr;
     primaryKey.keyLength    = GetKeyLength(btreePtr, primaryKey.keyPtr, (level == 1));
@@ -283,6 +315,10 @@ OSStatus    InsertTree ( BTreeControlBlockPtr         btreePtr,
     err    = InsertLevel (btreePtr, treePathTable, &primaryKey, nil,
                           targetNode, index, level, insertNode );
 
+    // InsertNode starts a structure change when it has to rotate or split
+    if ( !changeInProgress )
+        BTEndStructureChange (btreePtr);
+
     return err;
 
 } // End of InsertTree
@@ -535,6 +571,10 @@ static OSErr    InsertNode    (BTreeControlBlockPtr     btreePtr,
     }
 
 
+    // Records are about to move between nodes, see BTBeginStructureChange
+    if ( !recordFit )
+        (void) BTBeginStructureChange (btreePtr);
+
     //////////////////////// Try Rotate Left ////////////////////////////////
 
     if ( !recordFit && leftNodeNum > 0 )
@@ -637,12 +677,15 @@ OSStatus    DeleteTree            (BTreeControlBlockPtr         btreePtr,
     u_int32_t            targetNodeNum;
     Boolean                deleteRequired;
     Boolean                updateRequired;
+    Boolean                changeInProgress;
 
     // XXXdbg - initialize these to null in case we get an
     //          error and try to exit before it's initialized
     parentNode.buffer      = nil;
     parentNode.blockHeader = nil;
 
+    changeInProgress = btreePtr->structureChanging;
+
     deleteRequired = false;
     updateRequired = false;
 
@@ -671,6 +714,9 @@ OSStatus    DeleteTree            (BTreeControlBlockPtr         btreePtr,
         siblingNode.buffer = nil;
         siblingNode.blockHeader = nil;
 
+        // The node is about to be unlinked and freed
+        (void) BTBeginStructureChange (btreePtr);
+
         ////////////////// Get Siblings & Update Links //////////////////////////
 
         siblingNodeNum = targetNodePtr->bLink;                // Left Sibling Node
@@ -739,6 +785,7 @@ OSStatus    DeleteTree            (BTreeControlBlockPtr         btreePtr,
         }
         else if ( ((NodeDescPtr)targetNode->buffer)->numRecords == 1 )
         {
+            (void) BTBeginStructureChange (btreePtr);
             err = CollapseTree (btreePtr, targetNode);
             M_ExitOnError (err);
         }
@@ -794,6 +841,9 @@ OSStatus    DeleteTree            (BTreeControlBlockPtr         btreePtr,
     err = UpdateNode (btreePtr, targetNode, 0, kLockTransaction);
     M_ExitOnError (err);
 
+    if ( !changeInProgress )
+        BTEndStructureChange (btreePtr);
+
     return    noErr;
 
 ErrorExit:
@@ -801,6 +851,9 @@ ErrorExit:
     (void) ReleaseNode (btreePtr, targetNode);
     (void) ReleaseNode (btreePtr, &parentNode);
 
+    if ( !changeInProgress )
+        BTEndStructureChange (btreePtr);
+
     return    err;
 
 } // end DeleteTree
@@ -37,7 +37,8 @@ enum {
     fsInvalidIterationMovmentErr        = ERR_BASE + 0x0A05,    /* iterator movement is invalid in current context*/
     fsClientIDMismatchErr               = ERR_BASE + 0x0A06,    /* wrong client process ID*/
     fsEndOfIterationErr                 = ERR_BASE + 0x0A07,    /* there were no objects left to return on iteration*/
-    fsBTTimeOutErr                      = ERR_BASE + 0x0A08     /* BTree scan interrupted -- no time left for physical I/O */
+    fsBTTimeOutErr                      = ERR_BASE + 0x0A08,    /* BTree scan interrupted -- no time left for physical I/O */
+    fsBTReadConflictErr                 = ERR_BASE + 0x0A09     /* a read in a BTReadSection raced a writer, redo it locked */
 };
 
 typedef struct {
@@ -47,7 +48,8 @@ typedef struct {
     ByteCount       blockSize;
     Boolean         blockReadFromDisk;
     Byte            isModified;             // XXXdbg - for journaling
-    Byte            reserved[2];
+    Byte            isChanged;              // ModifyBlockStart was called, the node version is bumped on release
+    Byte            reserved[1];
 
 } BlockDescriptor, *BlockDescPtr;
 
@@ -245,6 +247,23 @@ typedef struct {
 } BTreeIterator, *BTreeIteratorPtr;
 
 
+/*
+ BTree Read Section - b-tree reads without the b-tree lock, see BTBeginReadSection
+ */
+#define kBTReadSectionMaxNodes      48
+
+typedef struct {
+    void                    *btreePtr;
+    u_int64_t               structureSeq;       // structure change sequence the section started at
+    u_int32_t               numNodes;
+    Boolean                 conflict;
+    struct {
+        u_int32_t           nodeNum;
+        u_int32_t           version;
+    } nodes[kBTReadSectionMaxNodes];            // nodes read in the section and their versions
+} BTReadSection;
+
+
 /*============================================================================
  B*Tree SPI
  ============================================================================*/
@@ -311,6 +330,16 @@ OSStatus    BTReloadData         (FCB *filePtr);
 
 OSStatus    BTInvalidateHint     (BTreeIterator *iterator );
 
+OSStatus    BTBeginReadSection   (FCB *filePtr, BTReadSection *section);
+
+Boolean     BTEndReadSection     (FCB *filePtr, BTReadSection *section);
+
+Boolean     BTInReadSection      (void);
+
+Boolean     BTBeginUpdateGroup   (FCB *filePtr);
+
+void        BTEndUpdateGroup     (FCB *filePtr, Boolean started);
+
 OSStatus    BTGetLastSync        (FCB                        *filePtr,
                                   u_int32_t                  *lastfsync );
 
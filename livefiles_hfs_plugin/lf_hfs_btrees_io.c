@@ -22,10 +22,17 @@
 #include "lf_hfs_file_extent_mapping.h"
 #include "lf_hfs_vnops.h"
 #include "lf_hfs_journal.h"
+#include "lf_hfs_catalog.h"
+#include "lf_hfs_unicode_wrappers.h"
 
 static int ClearBTNodes(struct vnode *vp, int blksize, off_t offset, off_t amount);
 static int btree_journal_modify_block_end(struct hfsmount *hfsmp, GenericLFBuf *bp);
 void btree_swap_node(GenericLFBuf *bp, __unused void *arg);
+static void btree_search_cache_invalidate(GenericLFBuf *bp);
+
+// uSearchCacheFlags
+#define BT_SEARCH_CACHE_MODIFYING   0x0001  // Between ModifyBlockStart and ReleaseBTreeBlock, don't build an accelerator
+#define BT_SEARCH_CACHE_SEARCHED    0x0002  // The node was searched once since it was read or modified
 
 /*
  * Return btree node size for given vnode.
@@ -65,6 +72,114 @@ OSStatus SetBTreeBlockSize(FileReference vp, ByteCount blockSize, __unused ItemC
 }
 
 
+/*
+ * B-tree node search accelerator
+ *
+ * A catalog node that is searched more than once gets a compact array of
+ * (parentID, folded name prefix) next to its cached buffer, so SearchNodeBlock
+ * can settle most probes with integer compares instead of a full key compare.
+ * The accelerator lives as long as the buffer, and is dropped when the node is
+ * re-read, when ModifyBlockStart is called on it, or when it is trashed.
+ */
+static void
+btree_search_cache_invalidate(GenericLFBuf *bp)
+{
+    if (bp->pvSearchCache) {
+        hfs_free(bp->pvSearchCache);
+        bp->pvSearchCache = NULL;
+    }
+    bp->uSearchCacheFlags &= ~BT_SEARCH_CACHE_SEARCHED;
+}
+
+/*
+ * Fill a search entry from an HFS Plus catalog key.  maxNameLength bounds
+ * the name to what fits in the key.
+ */
+void
+BTNodeSearchEntryFromKey(const HFSPlusCatalogKey *key, u_int32_t maxNameLength, BTNodeSearchEntry *entry)
+{
+    u_int16_t folded[kBTNodeSearchPrefixUnits] = {0};
+    u_int32_t nameLength = MIN(key->nodeName.length, maxNameLength);
+    Boolean complete;
+    ItemCount count;
+
+    count = FastUnicodeFoldPrefix(key->nodeName.unicode, nameLength, folded, kBTNodeSearchPrefixUnits, &complete);
+
+    entry->parentID = key->parentID;
+    for (int i = 0; i < kBTNodeSearchPrefixWords; i++) {
+        entry->prefix[i] = ((u_int64_t)folded[4*i]     << 48) | ((u_int64_t)folded[4*i + 1] << 32) |
+                           ((u_int64_t)folded[4*i + 2] << 16) |  (u_int64_t)folded[4*i + 3];
+    }
+
+    /*
+     * CompareExtendedCatalogKeys orders an empty name before a name made only of
+     * ignorable characters, while both fold to nothing; leave those to it.
+     */
+    entry->complete = complete && (count != 0 || nameLength == 0);
+}
+
+/*
+ * Return the search accelerator for a node obtained with GetBTreeBlock, or
+ * NULL if the node should be searched with SearchNode.  The caller owns the
+ * buffer, so nobody else can be building or freeing it.
+ */
+BTNodeSearchCache *
+GetBTreeBlockSearchCache(BTreeControlBlockPtr btreePtr, BlockDescPtr blockPtr)
+{
+    GenericLFBufPtr bp = (GenericLFBufPtr) blockPtr->blockHeader;
+    NodeDescPtr node = (NodeDescPtr) blockPtr->buffer;
+    BTNodeSearchCache *cache;
+    u_int16_t freeOffset;
+
+    if (bp == NULL || btreePtr->keyCompareProc != (KeyCompareProcPtr) CompareExtendedCatalogKeys) {
+        return NULL;
+    }
+    if ((node->kind != kBTLeafNode && node->kind != kBTIndexNode) || node->numRecords == 0) {
+        return NULL;
+    }
+    if (bp->uSearchCacheFlags & BT_SEARCH_CACHE_MODIFYING) {
+        return NULL;
+    }
+
+    freeOffset = (u_int16_t) (GetRecordAddress(btreePtr, node, node->numRecords) - (u_int8_t *) node);
+
+    cache = bp->pvSearchCache;
+    if (cache) {
+        // Catch a modification that didn't go through ModifyBlockStart
+        if (cache->numRecords == node->numRecords && cache->freeOffset == freeOffset) {
+            return cache;
+        }
+        btree_search_cache_invalidate(bp);
+    }
+
+    // A node searched only once would not repay the cost of building
+    if (!(bp->uSearchCacheFlags & BT_SEARCH_CACHE_SEARCHED)) {
+        bp->uSearchCacheFlags |= BT_SEARCH_CACHE_SEARCHED;
+        return NULL;
+    }
+
+    cache = hfs_malloc(sizeof(BTNodeSearchCache) + node->numRecords * sizeof(BTNodeSearchEntry));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->numRecords = node->numRecords;
+    cache->freeOffset = freeOffset;
+
+    for (u_int16_t index = 0; index < node->numRecords; index++) {
+        HFSPlusCatalogKey *key = (HFSPlusCatalogKey *) GetRecordAddress(btreePtr, node, index);
+        u_int32_t maxNameLength = 0;
+
+        if (key->keyLength > sizeof(key->parentID) + sizeof(key->nodeName.length)) {
+            maxNameLength = (key->keyLength - sizeof(key->parentID) - sizeof(key->nodeName.length)) / sizeof(UniChar);
+        }
+        BTNodeSearchEntryFromKey(key, maxNameLength, &cache->entries[index]);
+    }
+
+    bp->pvSearchCache = cache;
+    return cache;
+}
+
+
 OSStatus GetBTreeBlock(FileReference vp, uint64_t blockNum, GetBlockOptions options, BlockDescriptor *block)
 {
     OSStatus     retval = E_NONE;
@@ -108,6 +223,11 @@ OSStatus GetBTreeBlock(FileReference vp, uint64_t blockNum, GetBlockOptions opti
 
         // XXXdbg
         block->isModified = 0;
+        block->isChanged = 0;
+
+        if ((options & kGetEmptyBlock) || block->blockReadFromDisk) {
+            btree_search_cache_invalidate(bp);
+        }
 
         /* Check and endian swap B-Tree node (only if it's a valid block) */
         if (!(options & kGetEmptyBlock))
@@ -185,12 +305,18 @@ void ModifyBlockStart(FileReference vp, BlockDescPtr blockPtr)
     struct hfsmount *hfsmp = VTOHFS(vp);
     GenericLFBuf *bp = NULL;
 
+    bp = (GenericLFBuf *) blockPtr->blockHeader;
+
+    if (bp) {
+        btree_search_cache_invalidate(bp);
+        bp->uSearchCacheFlags |= BT_SEARCH_CACHE_MODIFYING;
+    }
+    blockPtr->isChanged = 1;
+
     if (hfsmp->jnl == NULL) {
         return;
     }
 
-    bp = (GenericLFBuf *) blockPtr->blockHeader;
-
     if (bp == NULL) {
         LFHFS_LOG(LEVEL_ERROR, "ModifyBlockStart: ModifyBlockStart: null bp for blockdescptr %p?!?\n", blockPtr);
         hfs_assert(0);
@@ -257,6 +383,11 @@ OSStatus ReleaseBTreeBlock(FileReference vp, BlockDescPtr blockPtr, ReleaseBlock
         goto exit;
     }
 
+    if (options & kTrashBlock) {
+        btree_search_cache_invalidate(bp);
+    }
+    bp->uSearchCacheFlags &= ~BT_SEARCH_CACHE_MODIFYING;
+
     if (options & kTrashBlock) {
         if (hfsmp->jnl && (bp->uCacheFlags & GEN_BUF_WRITE_LOCK))
         {
@@ -109,6 +109,11 @@ typedef struct {                    // fields specific to BTree CBs
     u_int32_t                       reservedNodes;
     BTreeIterator                   iterator;               // useable when holding exclusive b-tree lock
 
+    // optimistic reads, see BTBeginReadSection
+    u_int64_t                       structureSeq;           // odd while a writer changes the tree structure
+    Boolean                         structureChanging;
+    u_int32_t                       *nodeVersions;          // kBTNodeVersionSlots change counters, hashed by node number
+
 #if DEBUG
     void                        *madeDirtyBy[2];
 #endif
@@ -291,6 +296,68 @@ u_int16_t    GetNodeFreeSize            (BTreeControlBlockPtr       btreePtr,
                                          NodeDescPtr                node );
 
 
+//// Node Search Accelerator
+
+/*
+ * Kept with the buffer of a catalog node by GetBTreeBlockSearchCache.
+ * Entries hold the parent ID and the case folded start of each key's name,
+ * four UTF-16 units per word with the first one in the top bits and zero
+ * padding, so comparing (parentID, prefix[]) as integers orders them like
+ * CompareExtendedCatalogKeys.
+ */
+#define kBTNodeSearchPrefixWords    2
+#define kBTNodeSearchPrefixUnits    (kBTNodeSearchPrefixWords * 4)
+
+typedef struct BTNodeSearchEntry {
+    u_int64_t   prefix[kBTNodeSearchPrefixWords];
+    u_int32_t   parentID;
+    u_int32_t   complete;               // prefix holds the whole folded name
+} BTNodeSearchEntry;
+
+typedef struct BTNodeSearchCache {
+    u_int16_t           numRecords;     // Node state the accelerator was built from
+    u_int16_t           freeOffset;
+    BTNodeSearchEntry   entries[];
+} BTNodeSearchCache;
+
+BTNodeSearchCache   *GetBTreeBlockSearchCache   (BTreeControlBlockPtr       btreePtr,
+                                                 BlockDescPtr               blockPtr );
+
+void                BTNodeSearchEntryFromKey    (const HFSPlusCatalogKey    *key,
+                                                 u_int32_t                  maxNameLength,
+                                                 BTNodeSearchEntry          *entry );
+
+
+//// Optimistic Reads
+
+/*
+ * Readers in a BTReadSection don't hold the b-tree lock.  Buffer ownership
+ * keeps each node they read consistent, and a reader holds one node at a
+ * time.  Writers bump a node's version whenever they release it changed, and
+ * keep structureSeq odd while records move between nodes or nodes are added
+ * or freed, so BTEndReadSection can tell whether everything a reader saw
+ * belongs to one tree.
+ */
+#define kBTNodeVersionSlots     1024
+
+#define M_NodeVersionSlot(btreePtr,nodeNum)     (&(btreePtr)->nodeVersions[(nodeNum) & (kBTNodeVersionSlots - 1)])
+
+Boolean     BTBeginStructureChange  (BTreeControlBlockPtr       btreePtr );
+
+void        BTEndStructureChange    (BTreeControlBlockPtr       btreePtr );
+
+void        BTNodeVersionBump       (BTreeControlBlockPtr       btreePtr,
+                                     u_int32_t                  nodeNum );
+
+BTReadSection *BTGetReadSection     (BTreeControlBlockPtr       btreePtr );
+
+OSStatus    GetNodeInReadSection    (BTreeControlBlockPtr       btreePtr,
+                                     BTReadSection              *section,
+                                     u_int32_t                  nodeNum,
+                                     u_int32_t                  flags,
+                                     NodeRec                    *nodePtr );
+
+
 //// Record Operations
 
 Boolean        InsertRecord            (BTreeControlBlockPtr     btreePtr,
@@ -317,6 +384,11 @@ Boolean        SearchNode           (BTreeControlBlockPtr       btree,
                                      KeyPtr                     searchKey,
                                      u_int16_t                  *index );
 
+Boolean        SearchNodeBlock      (BTreeControlBlockPtr       btree,
+                                     BlockDescPtr               block,
+                                     KeyPtr                     searchKey,
+                                     u_int16_t                  *index );
+
 OSStatus    GetRecordByIndex        (BTreeControlBlockPtr       btree,
                                      NodeDescPtr                node,
                                      u_int16_t                  index,
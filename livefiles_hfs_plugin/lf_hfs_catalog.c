@@ -26,6 +26,7 @@
 #include "lf_hfs_chash.h"
 #include "lf_hfs_generic_buf.h"
 #include "lf_hfs_journal.h"
+#include "lf_hfs_lookup.h"
 
 #define HFS_LOOKUP_SYSFILE          0x1    /* If set, allow lookup of system files */
 #define HFS_LOOKUP_HARDLINK         0x2    /* If set, allow lookup of hard link records and not resolve the hard links */
@@ -169,11 +170,248 @@ struct position_state {
     u_int32_t  parentID;
     struct hfsmount *hfsmp;
 };
+
+/*
+ * CNID cache
+ *
+ * Remembers the key found in a cnid's thread record, and the b-tree node its
+ * file or folder record was last found in, so that looking a cnid up again
+ * is a single hinted search for the record rather than a thread record
+ * search followed by a record search.
+ *
+ * Lookups take the catalog lock shared, so the cache has its own locks,
+ * striped by cnid.  cat_create, cat_createlink, cat_delete and cat_rename
+ * drop the cnids whose key they change.  The record hint is only a hint;
+ * BTSearchRecord checks it and searches from the root if the record moved.
+ */
+#define CAT_IDCACHE_NUM_STRIPES         (16)
+#define CAT_IDCACHE_STRIPE_BUCKETS      (128)
+#define CAT_IDCACHE_STRIPE_MAX_ENTRIES  (512)
+
+struct cat_idcache_entry {
+    LIST_ENTRY(cat_idcache_entry)   ice_hash;
+    TAILQ_ENTRY(cat_idcache_entry)  ice_lru;
+    cnid_t                          ice_cnid;
+    cnid_t                          ice_parentcnid;
+    u_int32_t                       ice_hint;       /* node of the file/folder record, 0 if unknown */
+    u_int16_t                       ice_isdir;
+    u_int16_t                       ice_namelen;    /* UniChars in ice_name */
+    UniChar                         ice_name[];
+};
+
+struct cat_idcache_stripe {
+    pthread_mutex_t                                     ics_lock;
+    LIST_HEAD(, cat_idcache_entry)                      ics_buckets[CAT_IDCACHE_STRIPE_BUCKETS];
+    TAILQ_HEAD(cat_idcache_lru, cat_idcache_entry)      ics_lru;    /* most recently used at the head */
+    u_int32_t                                           ics_entries;
+};
+
+struct cat_idcache {
+    struct cat_idcache_stripe   ic_stripes[CAT_IDCACHE_NUM_STRIPES];
+};
+
+#define IDCACHE_STRIPE(icp, cnid)       (&(icp)->ic_stripes[(cnid) % CAT_IDCACHE_NUM_STRIPES])
+#define IDCACHE_BUCKET(icsp, cnid)      (&(icsp)->ics_buckets[((cnid) / CAT_IDCACHE_NUM_STRIPES) % CAT_IDCACHE_STRIPE_BUCKETS])
+
+static void
+cat_idcache_init(struct hfsmount *hfsmp)
+{
+    struct cat_idcache *icp = hfs_mallocz(sizeof(*icp));
+    if (icp == NULL) {
+        LFHFS_LOG(LEVEL_ERROR, "cat_idcache_init: failed to allocate the cnid cache\n");
+        return;
+    }
+
+    for (int i = 0; i < CAT_IDCACHE_NUM_STRIPES; i++) {
+        struct cat_idcache_stripe *icsp = &icp->ic_stripes[i];
+
+        lf_lck_mtx_init(&icsp->ics_lock);
+        for (int j = 0; j < CAT_IDCACHE_STRIPE_BUCKETS; j++) {
+            LIST_INIT(&icsp->ics_buckets[j]);
+        }
+        TAILQ_INIT(&icsp->ics_lru);
+    }
+
+    hfsmp->hfs_idcache = icp;
+}
+
+static void
+cat_idcache_destroy(struct hfsmount *hfsmp)
+{
+    struct cat_idcache *icp = hfsmp->hfs_idcache;
+    struct cat_idcache_entry *icep, *next;
+
+    if (icp == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < CAT_IDCACHE_NUM_STRIPES; i++) {
+        struct cat_idcache_stripe *icsp = &icp->ic_stripes[i];
+
+        TAILQ_FOREACH_SAFE(icep, &icsp->ics_lru, ice_lru, next) {
+            hfs_free(icep);
+        }
+        lf_lck_mtx_destroy(&icsp->ics_lock);
+    }
+
+    hfs_free(icp);
+    hfsmp->hfs_idcache = NULL;
+}
+
+/* Called with the stripe lock held */
+static struct cat_idcache_entry *
+cat_idcache_find(struct cat_idcache_stripe *icsp, cnid_t cnid)
+{
+    struct cat_idcache_entry *icep;
+
+    LIST_FOREACH(icep, IDCACHE_BUCKET(icsp, cnid), ice_hash) {
+        if (icep->ice_cnid == cnid) {
+            return (icep);
+        }
+    }
+    return (NULL);
+}
+
+/* Called with the stripe lock held */
+static void
+cat_idcache_remove(struct cat_idcache_stripe *icsp, struct cat_idcache_entry *icep)
+{
+    LIST_REMOVE(icep, ice_hash);
+    TAILQ_REMOVE(&icsp->ics_lru, icep, ice_lru);
+    icsp->ics_entries--;
+    hfs_free(icep);
+}
+
+/*
+ * Fill in the catalog key of a cached cnid.  Returns ENOENT if the cnid
+ * isn't cached.
+ */
+static int
+cat_idcache_getkey(struct hfsmount *hfsmp, cnid_t cnid, HFSPlusCatalogKey *key, u_int32_t *hintp, int *isdirp)
+{
+    struct cat_idcache *icp = hfsmp->hfs_idcache;
+    struct cat_idcache_stripe *icsp;
+    struct cat_idcache_entry *icep;
+    int result = ENOENT;
+
+    if (icp == NULL) {
+        return (ENOENT);
+    }
+
+    icsp = IDCACHE_STRIPE(icp, cnid);
+    lf_lck_mtx_lock(&icsp->ics_lock);
+
+    if ((icep = cat_idcache_find(icsp, cnid)) != NULL) {
+        TAILQ_REMOVE(&icsp->ics_lru, icep, ice_lru);
+        TAILQ_INSERT_HEAD(&icsp->ics_lru, icep, ice_lru);
+
+        key->parentID = icep->ice_parentcnid;
+        key->nodeName.length = icep->ice_namelen;
+        bcopy(icep->ice_name, key->nodeName.unicode, icep->ice_namelen * sizeof(UniChar));
+        key->keyLength = kHFSPlusCatalogKeyMinimumLength + (icep->ice_namelen * 2);
+        if (hintp)
+            *hintp = icep->ice_hint;
+        if (isdirp)
+            *isdirp = icep->ice_isdir;
+        result = 0;
+    }
+
+    lf_lck_mtx_unlock(&icsp->ics_lock);
+    return (result);
+}
+
+/* Remember the key of a cnid, as found in its thread record */
+static void
+cat_idcache_enter(struct hfsmount *hfsmp, cnid_t cnid, const HFSPlusCatalogKey *key, u_int32_t hint, int isdir)
+{
+    struct cat_idcache *icp = hfsmp->hfs_idcache;
+    struct cat_idcache_stripe *icsp;
+    struct cat_idcache_entry *icep, *oldp;
+
+    if (icp == NULL || key->nodeName.length == 0 || key->nodeName.length > kHFSPlusMaxFileNameChars) {
+        return;
+    }
+
+    /* A key read without the catalog lock isn't checked yet, see hfs_systemfile_read_begin */
+    if (BTInReadSection()) {
+        return;
+    }
+
+    icep = hfs_malloc(sizeof(*icep) + key->nodeName.length * sizeof(UniChar));
+    if (icep == NULL) {
+        return;
+    }
+    icep->ice_cnid = cnid;
+    icep->ice_parentcnid = key->parentID;
+    icep->ice_hint = hint;
+    icep->ice_isdir = isdir;
+    icep->ice_namelen = key->nodeName.length;
+    bcopy(key->nodeName.unicode, icep->ice_name, key->nodeName.length * sizeof(UniChar));
+
+    icsp = IDCACHE_STRIPE(icp, cnid);
+    lf_lck_mtx_lock(&icsp->ics_lock);
+
+    if ((oldp = cat_idcache_find(icsp, cnid)) != NULL) {
+        cat_idcache_remove(icsp, oldp);
+    } else if (icsp->ics_entries >= CAT_IDCACHE_STRIPE_MAX_ENTRIES) {
+        cat_idcache_remove(icsp, TAILQ_LAST(&icsp->ics_lru, cat_idcache_lru));
+    }
+
+    LIST_INSERT_HEAD(IDCACHE_BUCKET(icsp, cnid), icep, ice_hash);
+    TAILQ_INSERT_HEAD(&icsp->ics_lru, icep, ice_lru);
+    icsp->ics_entries++;
+
+    lf_lck_mtx_unlock(&icsp->ics_lock);
+}
+
+/* Update the record hint of a cached cnid */
+static void
+cat_idcache_sethint(struct hfsmount *hfsmp, cnid_t cnid, u_int32_t hint)
+{
+    struct cat_idcache *icp = hfsmp->hfs_idcache;
+    struct cat_idcache_stripe *icsp;
+    struct cat_idcache_entry *icep;
+
+    if (icp == NULL) {
+        return;
+    }
+
+    icsp = IDCACHE_STRIPE(icp, cnid);
+    lf_lck_mtx_lock(&icsp->ics_lock);
+    if ((icep = cat_idcache_find(icsp, cnid)) != NULL) {
+        icep->ice_hint = hint;
+    }
+    lf_lck_mtx_unlock(&icsp->ics_lock);
+}
+
+/* Forget a cnid whose name or parent is changing */
+static void
+cat_idcache_purge(struct hfsmount *hfsmp, cnid_t cnid)
+{
+    struct cat_idcache *icp = hfsmp->hfs_idcache;
+    struct cat_idcache_stripe *icsp;
+    struct cat_idcache_entry *icep;
+
+    if (icp == NULL) {
+        return;
+    }
+
+    icsp = IDCACHE_STRIPE(icp, cnid);
+    lf_lck_mtx_lock(&icsp->ics_lock);
+    if ((icep = cat_idcache_find(icsp, cnid)) != NULL) {
+        cat_idcache_remove(icsp, icep);
+    }
+    lf_lck_mtx_unlock(&icsp->ics_lock);
+}
+
 /* Initialize the HFS ID hash table */
 void
 hfs_idhash_init (struct hfsmount *hfsmp) {
     /* secured by catalog lock so no lock init needed */
     hfsmp->hfs_idhashtbl = hashinit(HFS_IDHASH_DEFAULT, &hfsmp->hfs_idhash);
+
+    /* The cnid cache is used under a shared catalog lock, it has its own locks */
+    cat_idcache_init(hfsmp);
 }
 
 /* Free the HFS ID hash table */
@@ -181,6 +419,7 @@ void
 hfs_idhash_destroy (struct hfsmount *hfsmp) {
     /* during failed mounts & unmounts */
     hashDeinit(hfsmp->hfs_idhashtbl);
+    cat_idcache_destroy(hfsmp);
 }
 
 /*
@@ -777,6 +1016,10 @@ cat_findname(struct hfsmount *hfsmp, cnid_t cnid, struct cat_desc *outdescp)
     memset(recp,0,sizeof(CatalogRecord));
     BDINIT(btdata, recp);
 
+    keyp = (CatalogKey *)&recp->hfsPlusThread.reserved;
+    if (cat_idcache_getkey(hfsmp, cnid, &keyp->hfsPlus, NULL, &isdir) == 0)
+        goto found;
+
     result = BTSearchRecord(VTOF(hfsmp->hfs_catalog_vp), iterator, &btdata, NULL, NULL);
     if (result)
         goto exit;
@@ -796,7 +1039,9 @@ cat_findname(struct hfsmount *hfsmp, cnid_t cnid, struct cat_desc *outdescp)
             result = ENOENT;
             goto exit;
     }
+    cat_idcache_enter(hfsmp, cnid, &keyp->hfsPlus, 0, isdir);
 
+found:
 
     builddesc((HFSPlusCatalogKey *)keyp, cnid, 0, 0, isdir, outdescp);
 
@@ -1520,12 +1765,34 @@ cleanup:
 int
 cat_idlookup(struct hfsmount *hfsmp, cnid_t cnid, int allow_system_files, int wantrsrc,
              struct cat_desc *outdescp, struct cat_attr *attrp, struct cat_fork *forkp)
+{
+    return cat_idlookup_withhints(hfsmp, cnid, allow_system_files, wantrsrc, NULL, NULL, outdescp, attrp, forkp);
+}
+
+/*
+ * cat_idlookup_withhints - lookup a catalog node using a cnode id
+ *
+ * Same as cat_idlookup, but starts the thread and file record searches
+ * at the given b-tree nodes and returns the nodes where the records
+ * were found. Callers resolving many cnids in ascending order can pass
+ * the hints back in, so that neighbouring ids are usually found in the
+ * last leaf node without walking down the tree.
+ *
+ * Either hint may be NULL. A zero hint means "no hint".
+ */
+int
+cat_idlookup_withhints(struct hfsmount *hfsmp, cnid_t cnid, int allow_system_files, int wantrsrc,
+                       u_int32_t *threadhintp, u_int32_t *recordhintp,
+                       struct cat_desc *outdescp, struct cat_attr *attrp, struct cat_fork *forkp)
 {
     BTreeIterator * iterator = NULL;
     FSBufferDescriptor btdata = {0};
     u_int16_t    datasize = 0;
     CatalogKey * keyp = NULL;
     CatalogRecord * recp = NULL;
+    u_int32_t cachedhint = 0;
+    cnid_t reccnid = 0;
+    int isdir = 0;
     int result = 0;
 
     iterator = hfs_mallocz(sizeof(*iterator));
@@ -1533,12 +1800,42 @@ cat_idlookup(struct hfsmount *hfsmp, cnid_t cnid, int allow_system_files, int wa
         return MacToVFSError(ENOMEM);
     
     buildthreadkey(cnid, (CatalogKey *)&iterator->key);
+    if (threadhintp)
+        iterator->hint.nodeNum = *threadhintp;
 
     recp = hfs_malloc(sizeof(CatalogRecord));
     BDINIT(btdata, recp);
 
+    /* A cached cnid needs no thread record, just a search for its record */
+    keyp = (CatalogKey *)&recp->hfsPlusThread.reserved;
+    if (cat_idcache_getkey(hfsmp, cnid, &keyp->hfsPlus, &cachedhint, NULL) == 0) {
+        result = cat_lookupbykey(hfsmp, keyp,
+                                 ((allow_system_files != 0) ? HFS_LOOKUP_SYSFILE : 0),
+                                 (cachedhint ? cachedhint : (recordhintp ? *recordhintp : 0)),
+                                 wantrsrc, outdescp, attrp, forkp, &reccnid);
+        if (result == 0 && reccnid != cnid) {
+            if (outdescp)
+                cat_releasedesc(outdescp);
+            result = ENOENT;
+        }
+        if (result != ENOENT) {
+            if (result == 0 && outdescp) {
+                if (recordhintp)
+                    *recordhintp = outdescp->cd_hint;
+                if (outdescp->cd_hint != cachedhint)
+                    cat_idcache_sethint(hfsmp, cnid, outdescp->cd_hint);
+            }
+            goto exit;
+        }
+        /* The cache is out of date, go through the thread record */
+        cat_idcache_purge(hfsmp, cnid);
+        result = 0;
+    }
+
     result = BTSearchRecord(VTOF(HFSTOVCB(hfsmp)->catalogRefNum), iterator,
                             &btdata, &datasize, iterator);
+    if (threadhintp)
+        *threadhintp = iterator->hint.nodeNum;
     if (result)
         goto exit;
 
@@ -1547,6 +1844,7 @@ cat_idlookup(struct hfsmount *hfsmp, cnid_t cnid, int allow_system_files, int wa
 
         case kHFSPlusFileThreadRecord:
         case kHFSPlusFolderThreadRecord:
+            isdir = (recp->recordType == kHFSPlusFolderThreadRecord);
             keyp = (CatalogKey *)&recp->hfsPlusThread.reserved;
 
             /* check for NULL name */
@@ -1566,7 +1864,9 @@ cat_idlookup(struct hfsmount *hfsmp, cnid_t cnid, int allow_system_files, int wa
 
     result = cat_lookupbykey(hfsmp, keyp,
                              ((allow_system_files != 0) ? HFS_LOOKUP_SYSFILE : 0),
-                             0, wantrsrc, outdescp, attrp, forkp, NULL);
+                             (recordhintp ? *recordhintp : 0), wantrsrc, outdescp, attrp, forkp, NULL);
+    if (result == 0 && outdescp && recordhintp)
+        *recordhintp = outdescp->cd_hint;
     /* No corresponding file/folder record found for a thread record,
      * mark the volume inconsistent.
      */
@@ -1578,10 +1878,14 @@ cat_idlookup(struct hfsmount *hfsmp, cnid_t cnid, int allow_system_files, int wa
          */
         if (cnid != dcnid)
         {
-            LFHFS_LOG(LEVEL_ERROR, "cat_idlookup: Requested cnid (%d / %08x) != dcnid (%d / %08x)\n", cnid, cnid, dcnid, dcnid);
+            /* Without the catalog lock this is a writer we raced, not a bad volume */
+            if (!BTInReadSection())
+                LFHFS_LOG(LEVEL_ERROR, "cat_idlookup: Requested cnid (%d / %08x) != dcnid (%d / %08x)\n", cnid, cnid, dcnid, dcnid);
             result = ENOENT;
         }
     }
+    if (result == 0)
+        cat_idcache_enter(hfsmp, cnid, &keyp->hfsPlus, (outdescp ? outdescp->cd_hint : 0), isdir);
 exit:
     hfs_free(recp);
     hfs_free(iterator);
@@ -1818,6 +2122,7 @@ getentriesattr_callback(const CatalogKey *key, const CatalogRecord *rec, struct
     }
 
     cep = &list->entry[list->realentries++];
+    cep->ce_skipped = list->skipentries;
 
     getbsdattr(hfsmp, (const struct HFSPlusCatalogFile *)rec, &cep->ce_attr);
     builddesc((const HFSPlusCatalogKey *)key, getcnid(rec), 0, getencoding(rec),
@@ -2213,6 +2518,7 @@ cat_rename (
     u_int16_t datasize;
     int sourcegone = 0;
     int skipthread = 0;
+    Boolean grouped = false;
     int directory = from_cdp->cd_flags & CD_ISDIR;
     int is_dirlink = 0;
     u_int32_t encoding = 0;
@@ -2363,6 +2669,12 @@ cat_rename (
             out_cdp->cd_encoding = encoding;
     }
 
+    /*
+     * Until the new thread record is in, a lookup by cnid would find the
+     * old thread and no record.  Fail catalog reads without the lock
+     * that overlap steps 2 through 5, see BTBeginUpdateGroup.
+     */
+    grouped = BTBeginUpdateGroup(fcb);
 
     /* Step 2: Insert cnode at new location */
     result = BTInsertRecord(fcb, to_iterator, &btdata, datasize);
@@ -2485,8 +2797,13 @@ cat_rename (
 
     }
 exit:
+    BTEndUpdateGroup(fcb, grouped);
     (void) BTFlushPath(fcb);
 
+    hfs_namecache_purge(hfsmp, from_cdp->cd_parentcnid, from_cdp->cd_nameptr, from_cdp->cd_namelen);
+    hfs_namecache_purge(hfsmp, to_cdp->cd_parentcnid, to_cdp->cd_nameptr, to_cdp->cd_namelen);
+    cat_idcache_purge(hfsmp, from_cdp->cd_cnid);
+
     hfs_free(from_iterator);
     hfs_free(to_iterator);
     hfs_free(recp);
@@ -2721,6 +3038,9 @@ getkey(struct hfsmount *hfsmp, cnid_t cnid, CatalogKey * key)
     CatalogRecord * recp = NULL;
     int result = 0;
 
+    /* The key of a cached cnid is already known */
+    if (cat_idcache_getkey(hfsmp, cnid, &key->hfsPlus, NULL, NULL) == 0)
+        return (0);
 
     BTreeIterator* iterator = hfs_mallocz(sizeof(BTreeIterator));
     if (iterator == NULL)
@@ -2751,6 +3071,7 @@ getkey(struct hfsmount *hfsmp, cnid_t cnid, CatalogKey * key)
             keyp->hfsPlus.keyLength = kHFSPlusCatalogKeyMinimumLength +
             (keyp->hfsPlus.nodeName.length * 2);
             bcopy(keyp, key, keyp->hfsPlus.keyLength + 2);
+            cat_idcache_enter(hfsmp, cnid, &keyp->hfsPlus, 0, (recp->recordType == kHFSPlusFolderThreadRecord));
             break;
 
         default:
@@ -2853,6 +3174,7 @@ cat_delete(struct hfsmount *hfsmp, struct cat_desc *descp, struct cat_attr *attr
     BTreeIterator *iterator;
     cnid_t cnid;
     int result = 0;
+    Boolean grouped = false;
 
     /* Preflight check:
      *
@@ -2886,6 +3208,9 @@ cat_delete(struct hfsmount *hfsmp, struct cat_desc *descp, struct cat_attr *attr
     if (result)
         goto exit;
 
+    /* A lookup by cnid between the two deletes would find a thread and no record */
+    grouped = BTBeginUpdateGroup(fcb);
+
     /* Delete record */
     result = BTDeleteRecord(fcb, iterator);
     if (result)
@@ -2929,8 +3254,13 @@ cat_delete(struct hfsmount *hfsmp, struct cat_desc *descp, struct cat_attr *attr
     }
 
 exit:
+    BTEndUpdateGroup(fcb, grouped);
     (void) BTFlushPath(fcb);
 
+    if (descp->cd_namelen != 0)
+        hfs_namecache_purge(hfsmp, descp->cd_parentcnid, descp->cd_nameptr, descp->cd_namelen);
+    cat_idcache_purge(hfsmp, cnid);
+
     return MacToVFSError(result);
 }
 
@@ -3101,6 +3431,8 @@ cat_create(struct hfsmount *hfsmp, cnid_t new_fileid, struct cat_desc *descp, st
 
 exit:
     (void) BTFlushPath(fcb);
+    hfs_namecache_purge(hfsmp, descp->cd_parentcnid, descp->cd_nameptr, descp->cd_namelen);
+    cat_idcache_purge(hfsmp, new_fileid);
     if (iterator)
         hfs_free(iterator);
     if (key)
@@ -3817,6 +4149,8 @@ cat_createlink(struct hfsmount *hfsmp, struct cat_desc *descp, struct cat_attr *
         *linkfileid = nextCNID;
     }
 exit:
+    hfs_namecache_purge(hfsmp, descp->cd_parentcnid, descp->cd_nameptr, descp->cd_namelen);
+    cat_idcache_purge(hfsmp, nextCNID);
     if (result) {
         if (thread_inserted) {
             LFHFS_LOG(LEVEL_ERROR, "cat_createlink: BTInsertRecord err=%d, vol=%s\n", MacToVFSError(result), hfsmp->vcbVN);
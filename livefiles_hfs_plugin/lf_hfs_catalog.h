@@ -222,6 +222,7 @@ struct cat_entry {
     off_t        ce_rsrcsize;
     u_int32_t        ce_datablks;
     u_int32_t        ce_rsrcblks;
+    u_int32_t        ce_skipped;    /* entries skipped before this one in the same lookup */
 };
 
 /*
@@ -256,6 +257,9 @@ int     cat_lookup(struct hfsmount *hfsmp, struct cat_desc *descp, int wantrsrc,
                    struct cat_fork *forkp, cnid_t *desc_cnid);
 int     cat_idlookup(struct hfsmount *hfsmp, cnid_t cnid, int allow_system_files, int wantrsrc,
                      struct cat_desc *outdescp, struct cat_attr *attrp, struct cat_fork *forkp);
+int     cat_idlookup_withhints(struct hfsmount *hfsmp, cnid_t cnid, int allow_system_files, int wantrsrc,
+                               u_int32_t *threadhintp, u_int32_t *recordhintp,
+                               struct cat_desc *outdescp, struct cat_attr *attrp, struct cat_fork *forkp);
 int     cat_lookupmangled(struct hfsmount *hfsmp, struct cat_desc *descp, int wantrsrc,
                           struct cat_desc *outdescp, struct cat_attr *attrp, struct cat_fork *forkp);
 int     cat_findname(struct hfsmount *hfsmp, cnid_t cnid, struct cat_desc *outdescp);
@@ -14,15 +14,26 @@
 #include "lf_hfs_vfsutils.h"
 
 #define DESIRED_VNODES (128)        /* number of vnodes desired */
+#define CHASH_MAX_LOAD      (2)             /* average chain length that makes the table grow */
+#define CHASH_MAX_BUCKETS   (1024*1024)
 #define CNODEHASH(hfsmp, inum) (&hfsmp->hfs_cnodehashtbl[(inum) & hfsmp->hfs_cnodehash])
 
+/*
+ * The hash is protected by HFS_CHASH_NUM_LOCKS mutexes, picked by the low bits
+ * of the cnid. The table always has at least as many buckets as locks, so every
+ * bucket is covered by a single lock, and a cnid keeps its lock across resizes.
+ * Growing the table takes all the locks.
+ */
+#define CHASH_LOCK(hfsmp, inum) (&hfsmp->hfs_chash_mutex[(inum) & (HFS_CHASH_NUM_LOCKS - 1)])
+
 static void
 hfs_chash_wait(struct hfsmount *hfsmp, struct cnode  *cp,  bool bUnlock)
 {
     SET(cp->c_hflag, H_WAITING);
-    pthread_cond_wait(&cp->c_cacsh_cond, &hfsmp->hfs_chash_mutex);
+    __atomic_fetch_add(&hfsmp->hfs_chash_waits, 1, __ATOMIC_RELAXED);
+    pthread_cond_wait(&cp->c_cacsh_cond, CHASH_LOCK(hfsmp, cp->c_fileid));
     if (bUnlock)
-        hfs_chash_unlock(hfsmp);
+        hfs_chash_unlock(hfsmp, cp->c_fileid);
 }
 
 void
@@ -57,26 +68,114 @@ hfs_chashinit()
 {
 }
 
-void hfs_chash_lock(struct hfsmount *hfsmp)
+void hfs_chash_lock(struct hfsmount *hfsmp, ino_t inum)
 {
-    lf_lck_mtx_lock(&hfsmp->hfs_chash_mutex);
+    pthread_mutex_t* psLock = CHASH_LOCK(hfsmp, inum);
+
+    if (lf_lck_mtx_try_lock(psLock) != 0)
+    {
+        __atomic_fetch_add(&hfsmp->hfs_chash_contended, 1, __ATOMIC_RELAXED);
+        lf_lck_mtx_lock(psLock);
+    }
 }
 
-void hfs_chash_lock_spin(struct hfsmount *hfsmp)
+void hfs_chash_lock_spin(struct hfsmount *hfsmp, ino_t inum)
 {
-    lf_lck_mtx_lock_spin(&hfsmp->hfs_chash_mutex);
+    hfs_chash_lock(hfsmp, inum);
 }
 
 
-void hfs_chash_unlock(struct hfsmount *hfsmp)
+void hfs_chash_unlock(struct hfsmount *hfsmp, ino_t inum)
+{
+    lf_lck_mtx_unlock(CHASH_LOCK(hfsmp, inum));
+}
+
+static void
+hfs_chash_lock_all(struct hfsmount *hfsmp)
 {
-    lf_lck_mtx_unlock(&hfsmp->hfs_chash_mutex);
+    for (uint32_t u = 0; u < HFS_CHASH_NUM_LOCKS; u++)
+    {
+        lf_lck_mtx_lock(&hfsmp->hfs_chash_mutex[u]);
+    }
+}
+
+static void
+hfs_chash_unlock_all(struct hfsmount *hfsmp)
+{
+    for (uint32_t u = HFS_CHASH_NUM_LOCKS; u > 0; u--)
+    {
+        lf_lck_mtx_unlock(&hfsmp->hfs_chash_mutex[u - 1]);
+    }
+}
+
+/*
+ * Double the number of buckets once the average chain gets longer than
+ * CHASH_MAX_LOAD. Must be called without any of the hash locks held.
+ */
+static void
+hfs_chash_grow(struct hfsmount *hfsmp)
+{
+    hfs_chash_lock_all(hfsmp);
+
+    u_long uBuckets = hfsmp->hfs_cnodehash + 1;
+    if ((hfsmp->hfs_chash_cnodes > uBuckets * CHASH_MAX_LOAD) && (uBuckets < CHASH_MAX_BUCKETS))
+    {
+        u_long uNewMask = 0;
+        struct cnodehashhead *psNewTbl = hashinit((int)(uBuckets * 2), &uNewMask);
+        if (psNewTbl != NULL)
+        {
+            for (u_long u = 0; u < uBuckets; u++)
+            {
+                struct cnode *cp;
+                while ((cp = LIST_FIRST(&hfsmp->hfs_cnodehashtbl[u])) != NULL)
+                {
+                    LIST_REMOVE(cp, c_hash);
+                    LIST_INSERT_HEAD(&psNewTbl[cp->c_fileid & uNewMask], cp, c_hash);
+                }
+            }
+
+            hfs_free(hfsmp->hfs_cnodehashtbl);
+            hfsmp->hfs_cnodehashtbl = psNewTbl;
+            hfsmp->hfs_cnodehash = uNewMask;
+            hfsmp->hfs_chash_resizes++;
+        }
+    }
+
+    hfs_chash_unlock_all(hfsmp);
+}
+
+void
+hfs_chash_get_stats(struct hfsmount *hfsmp, HFSCNodeHashStats_s *psStats)
+{
+    bzero(psStats, sizeof(*psStats));
+
+    hfs_chash_lock_all(hfsmp);
+
+    psStats->uCnodes  = hfsmp->hfs_chash_cnodes;
+    psStats->uBuckets = hfsmp->hfs_cnodehash + 1;
+    psStats->uResizes = hfsmp->hfs_chash_resizes;
+    for (u_long u = 0; u < psStats->uBuckets; u++)
+    {
+        uint64_t uChainLength = 0;
+        struct cnode *cp;
+        LIST_FOREACH(cp, &hfsmp->hfs_cnodehashtbl[u], c_hash)
+        {
+            uChainLength++;
+        }
+        psStats->uMaxChainLength = MAX(psStats->uMaxChainLength, uChainLength);
+    }
+
+    hfs_chash_unlock_all(hfsmp);
+
+    psStats->uLookups   = __atomic_load_n(&hfsmp->hfs_chash_lookups,   __ATOMIC_RELAXED);
+    psStats->uContended = __atomic_load_n(&hfsmp->hfs_chash_contended, __ATOMIC_RELAXED);
+    psStats->uWaits     = __atomic_load_n(&hfsmp->hfs_chash_waits,     __ATOMIC_RELAXED);
 }
 
 void
 hfs_chashwakeup(struct hfsmount *hfsmp, struct cnode *cp, int hflags)
 {
-    hfs_chash_lock_spin(hfsmp);
+    hfs_chash_lock_spin(hfsmp, cp->c_fileid);
 
     CLR(cp->c_hflag, hflags);
 
@@ -85,7 +184,7 @@ hfs_chashwakeup(struct hfsmount *hfsmp, struct cnode *cp, int hflags)
         pthread_cond_broadcast(&cp->c_cacsh_cond);
     }
     
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(hfsmp, cp->c_fileid);
 }
 
 /*
@@ -94,11 +193,12 @@ hfs_chashwakeup(struct hfsmount *hfsmp, struct cnode *cp, int hflags)
 void
 hfs_chash_abort(struct hfsmount *hfsmp, struct cnode *cp)
 {
-    hfs_chash_lock_spin(hfsmp);
+    hfs_chash_lock_spin(hfsmp, cp->c_fileid);
 
     LIST_REMOVE(cp, c_hash);
     cp->c_hash.le_next = NULL;
     cp->c_hash.le_prev = NULL;
+    __atomic_fetch_sub(&hfsmp->hfs_chash_cnodes, 1, __ATOMIC_RELAXED);
 
     CLR(cp->c_hflag, H_ATTACH | H_ALLOC);
     if (ISSET(cp->c_hflag, H_WAITING))
@@ -106,7 +206,7 @@ hfs_chash_abort(struct hfsmount *hfsmp, struct cnode *cp)
         CLR(cp->c_hflag, H_WAITING);
         pthread_cond_broadcast(&cp->c_cacsh_cond);
     }
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(hfsmp, cp->c_fileid);
 }
 
 
@@ -114,17 +214,25 @@ hfs_chash_abort(struct hfsmount *hfsmp, struct cnode *cp)
 void
 hfs_chashinit_finish(struct hfsmount *hfsmp)
 {
-    lf_lck_mtx_init(&hfsmp->hfs_chash_mutex);
-    hfsmp->hfs_cnodehashtbl = hashinit(DESIRED_VNODES / 4, &hfsmp->hfs_cnodehash);
+    for (uint32_t u = 0; u < HFS_CHASH_NUM_LOCKS; u++)
+    {
+        lf_lck_mtx_init(&hfsmp->hfs_chash_mutex[u]);
+    }
+    hfsmp->hfs_cnodehashtbl = hashinit(MAX(DESIRED_VNODES / 4, HFS_CHASH_NUM_LOCKS), &hfsmp->hfs_cnodehash);
+    hfsmp->hfs_chash_cnodes     = 0;
+    hfsmp->hfs_chash_lookups    = 0;
+    hfsmp->hfs_chash_contended  = 0;
+    hfsmp->hfs_chash_waits      = 0;
+    hfsmp->hfs_chash_resizes    = 0;
 }
 
 void
 hfs_delete_chash(struct hfsmount *hfsmp)
 {
     struct cnode  *cp;
-    hfs_chash_lock_spin(hfsmp);
+    hfs_chash_lock_all(hfsmp);
     
-    for (ino_t inum = 0;  inum < (DESIRED_VNODES/4); inum++)
+    for (ino_t inum = 0;  inum <= hfsmp->hfs_cnodehash; inum++)
     {
         for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
             LFHFS_LOG(LEVEL_ERROR, "hfs_delete_chash: Cnode for file [%s], cnid: [%d] with open count [%d] left in the cache \n", cp->c_desc.cd_nameptr, cp->c_desc.cd_cnid, cp->uOpenLookupRefCount);
@@ -132,8 +240,11 @@ hfs_delete_chash(struct hfsmount *hfsmp)
     }
     
         
-    hfs_chash_unlock(hfsmp);
-    lf_lck_mtx_destroy(&hfsmp->hfs_chash_mutex);
+    hfs_chash_unlock_all(hfsmp);
+    for (uint32_t u = 0; u < HFS_CHASH_NUM_LOCKS; u++)
+    {
+        lf_lck_mtx_destroy(&hfsmp->hfs_chash_mutex[u]);
+    }
     hfs_free(hfsmp->hfs_cnodehashtbl);
 }
 
@@ -164,8 +275,9 @@ hfs_chash_getcnode(struct hfsmount *hfsmp, ino_t inum, struct vnode **vpp, int w
      * If a cnode is in the process of being cleaned out or being
      * allocated, wait for it to be finished and then try again.
      */
+    __atomic_fetch_add(&hfsmp->hfs_chash_lookups, 1, __ATOMIC_RELAXED);
 loop:
-    hfs_chash_lock_spin(hfsmp);
+    hfs_chash_lock_spin(hfsmp, inum);
 loop_with_lock:
     for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next)
     {
@@ -222,13 +334,13 @@ loop_with_lock:
                  * vnode_getwithvid().
                  */
                 SET(cp->c_hflag, H_GETTING);
-                hfs_chash_unlock(hfsmp);
+                hfs_chash_unlock(hfsmp, inum);
                 if (hfs_lock(cp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_ALLOW_NOEXISTS)) {
-                    hfs_chash_lock(hfsmp);
+                    hfs_chash_lock(hfsmp, inum);
                     CLR(cp->c_hflag, H_GETTING);
                     goto loop_with_lock;
                 }
-                hfs_chash_lock(hfsmp);
+                hfs_chash_lock(hfsmp, inum);
                 CLR(cp->c_hflag, H_GETTING);
             }
         }
@@ -278,7 +390,7 @@ loop_with_lock:
         }
         
         if (cp) hfs_chash_raise_OpenLookupCounter(cp);
-        hfs_chash_unlock(hfsmp);
+        hfs_chash_unlock(hfsmp, inum);
         *vpp = vp;
         return (cp);
     }
@@ -294,7 +406,7 @@ loop_with_lock:
 
     if (ncp == NULL)
     {
-        hfs_chash_unlock(hfsmp);
+        hfs_chash_unlock(hfsmp, inum);
         ncp = hfs_mallocz(sizeof(struct cnode));
         if (ncp == NULL)
         {
@@ -328,7 +440,13 @@ loop_with_lock:
     /* Insert the new cnode with it's H_ALLOC flag set */
     LIST_INSERT_HEAD(CNODEHASH(hfsmp, inum), ncp, c_hash);
     hfs_chash_raise_OpenLookupCounter(ncp);
-    hfs_chash_unlock(hfsmp);
+    u_int64_t uCnodes = __atomic_add_fetch(&hfsmp->hfs_chash_cnodes, 1, __ATOMIC_RELAXED);
+    hfs_chash_unlock(hfsmp, inum);
+
+    if (uCnodes > (hfsmp->hfs_cnodehash + 1) * CHASH_MAX_LOAD)
+    {
+        hfs_chash_grow(hfsmp);
+    }
     *vpp = NULL;
     return (ncp);
 }
@@ -349,8 +467,9 @@ hfs_chash_getvnode(struct hfsmount *hfsmp, ino_t inum, int wantrsrc, int skiploc
      * If a cnode is in the process of being cleaned out or being
      * allocated, wait for it to be finished and then try again.
      */
+    __atomic_fetch_add(&hfsmp->hfs_chash_lookups, 1, __ATOMIC_RELAXED);
 loop:
-    hfs_chash_lock_spin(hfsmp);
+    hfs_chash_lock_spin(hfsmp, inum);
 loop_with_lock:
     for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
         if (cp->c_fileid != inum)
@@ -376,13 +495,13 @@ loop_with_lock:
                  * on here.
                  */
                 SET(cp->c_hflag, H_GETTING);
-                hfs_chash_unlock(hfsmp);
+                hfs_chash_unlock(hfsmp, inum);
                 if (hfs_lock(cp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_ALLOW_NOEXISTS)) {
-                    hfs_chash_lock(hfsmp);
+                    hfs_chash_lock(hfsmp, inum);
                     CLR(cp->c_hflag, H_GETTING);
                     goto loop_with_lock;
                 }
-                hfs_chash_lock(hfsmp);
+                hfs_chash_lock(hfsmp, inum);
                 CLR(cp->c_hflag, H_GETTING);
             }
         }
@@ -408,7 +527,7 @@ loop_with_lock:
     }
 
 exit:
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(hfsmp, inum);
     return vp;
 }
 
@@ -424,7 +543,8 @@ hfs_chash_snoop(struct hfsmount *hfsmp, ino_t inum, int existence_only,
      * If a cnode is in the process of being cleaned out or being
      * allocated, wait for it to be finished and then try again.
      */
-    hfs_chash_lock(hfsmp);
+    __atomic_fetch_add(&hfsmp->hfs_chash_lookups, 1, __ATOMIC_RELAXED);
+    hfs_chash_lock(hfsmp, inum);
 
     for (cp = CNODEHASH(hfsmp, inum)->lh_first; cp; cp = cp->c_hash.le_next) {
         if (cp->c_fileid != inum)
@@ -461,7 +581,7 @@ hfs_chash_snoop(struct hfsmount *hfsmp, ino_t inum, int existence_only,
         }
         break;
     }
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(hfsmp, inum);
 
     return (result);
 }
@@ -507,7 +627,7 @@ hfs_chash_set_childlinkbit(struct hfsmount *hfsmp, cnid_t cnid)
     int retval = -1;
     struct cnode *cp;
 
-    hfs_chash_lock_spin(hfsmp);
+    hfs_chash_lock_spin(hfsmp, cnid);
 
     cp = hfs_chash_search_cnid(hfsmp, cnid);
     if (cp) {
@@ -519,7 +639,7 @@ hfs_chash_set_childlinkbit(struct hfsmount *hfsmp, cnid_t cnid)
         }
     }
 
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(hfsmp, cnid);
     return retval;
 }
 
@@ -530,23 +650,24 @@ hfs_chash_set_childlinkbit(struct hfsmount *hfsmp, cnid_t cnid)
 int
 hfs_chashremove(struct hfsmount *hfsmp, struct cnode *cp)
 {
-    hfs_chash_lock_spin(hfsmp);
+    hfs_chash_lock_spin(hfsmp, cp->c_fileid);
 
     /*
      * Check if a vnode is getting attached or if the cnode is in the middle
      * of a "get".
      */
     if (ISSET(cp->c_hflag, (H_ATTACH | H_GETTING))) {
-        hfs_chash_unlock(hfsmp);
+        hfs_chash_unlock(hfsmp, cp->c_fileid);
         return (EBUSY);
     }
     if (cp->c_hash.le_next || cp->c_hash.le_prev) {
         LIST_REMOVE(cp, c_hash);
         cp->c_hash.le_next = NULL;
         cp->c_hash.le_prev = NULL;
+        __atomic_fetch_sub(&hfsmp->hfs_chash_cnodes, 1, __ATOMIC_RELAXED);
     }
 
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(hfsmp, cp->c_fileid);
     return (0);
 }
 
@@ -556,7 +677,7 @@ hfs_chashremove(struct hfsmount *hfsmp, struct cnode *cp)
 void
 hfs_chash_mark_in_transit(struct hfsmount *hfsmp, struct cnode *cp)
 {
-    hfs_chash_lock_spin(hfsmp);
+    hfs_chash_lock_spin(hfsmp, cp->c_fileid);
     SET(cp->c_hflag, H_TRANSIT);
-    hfs_chash_unlock(hfsmp);
+    hfs_chash_unlock(hfsmp, cp->c_fileid);
 }
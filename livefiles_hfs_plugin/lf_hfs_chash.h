@@ -11,11 +11,20 @@
 #include "lf_hfs_common.h"
 #include "lf_hfs.h"
 
+typedef struct {
+    uint64_t uCnodes;
+    uint64_t uBuckets;
+    uint64_t uMaxChainLength;
+    uint64_t uLookups;
+    uint64_t uContended;    // Lookups that found their hash lock taken
+    uint64_t uWaits;        // Waits for a cnode being created, attached or reclaimed
+    uint64_t uResizes;
+} HFSCNodeHashStats_s;
+
 struct cnode* hfs_chash_getcnode(struct hfsmount *hfsmp, ino_t inum, struct vnode **vpp, int wantrsrc, int skiplock, int *out_flags, int *hflags);
-void hfs_chash_lock(struct hfsmount *hfsmp);
-void hfs_chash_lock_spin(struct hfsmount *hfsmp);
-void hfs_chash_lock_convert(struct hfsmount *hfsmp);
-void hfs_chash_unlock(struct hfsmount *hfsmp);
+void hfs_chash_lock(struct hfsmount *hfsmp, ino_t inum);
+void hfs_chash_lock_spin(struct hfsmount *hfsmp, ino_t inum);
+void hfs_chash_unlock(struct hfsmount *hfsmp, ino_t inum);
 void hfs_chashwakeup(struct hfsmount *hfsmp, struct cnode *cp, int hflags);
 void hfs_chash_abort(struct hfsmount *hfsmp, struct cnode *cp);
 struct vnode* hfs_chash_getvnode(struct hfsmount *hfsmp, ino_t inum, int wantrsrc, int skiplock, int allow_deleted);
@@ -25,5 +34,6 @@ int hfs_chashremove(struct hfsmount *hfsmp, struct cnode *cp);
 void hfs_chash_mark_in_transit(struct hfsmount *hfsmp, struct cnode *cp);
 void hfs_chash_lower_OpenLookupCounter(struct cnode *cp);
 void hfs_chash_raise_OpenLookupCounter(struct cnode *cp);
+void hfs_chash_get_stats(struct hfsmount *hfsmp, HFSCNodeHashStats_s *psStats);
 
 #endif /* lf_hfs_chash_h */
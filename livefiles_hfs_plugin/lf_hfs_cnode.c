@@ -21,6 +21,7 @@
 #include "lf_hfs_xattr.h"
 #include "lf_hfs_link.h"
 #include "lf_hfs_generic_buf.h"
+#include "lf_hfs_raw_read_write.h"
 
 static void
 hfs_reclaim_cnode(struct cnode *cp)
@@ -1934,6 +1935,8 @@ hfs_fork_release(struct cnode* cp, struct vnode *vp, bool bIsRsc, int* piErr)
             hfs_free(fp->ff_symlinkptr);
         }
         rl_remove_all(&fp->ff_invalidranges);
+        raw_readwrite_readahead_release(fp);
+        hfs_writeback_release(hfsmp, fp);
         hfs_free(fp);
     }
     
@@ -1955,6 +1958,11 @@ hfs_vnop_reclaim(struct vnode *vp)
     int reclaim_cnode = 0;
     int err = 0;
 
+    /* Write out appends still held in the write-back buffer */
+    if (vp == cp->c_vp) {
+        (void) hfs_writeback_flush(vp);
+    }
+
     /*
      * We don't take the truncate lock since by the time reclaim comes along,
      * all dirty pages have been synced and nobody should be competing
@@ -44,6 +44,9 @@ enum {
  * The filefork is used to represent an HFS file fork (data or resource).
  * Reading or writing any of these fields requires holding cnode lock.
  */
+struct raw_readahead;
+struct hfs_writeback;
+
 struct filefork {
     struct cnode    *ff_cp;                 /* cnode associated with this fork */
     struct rl_head  ff_invalidranges;       /* Areas of disk that should read back as zeroes */
@@ -52,6 +55,8 @@ struct filefork {
         char        *ffu_symlinkptr;        /* symbolic link pathname */
     } ff_union;
     struct cat_fork ff_data;                /* fork data (size, extents) */
+    struct raw_readahead *ff_readahead;     /* sequential read cache, see lf_hfs_raw_read_write.c */
+    struct hfs_writeback *ff_writeback;     /* buffered appends, see lf_hfs_readwrite_ops.c */
 };
 typedef struct filefork filefork_t;
 
@@ -393,42 +393,9 @@ int LFHFS_ScanIDs(UVFSFileNode psNode,
                  unsigned int iFileIDCount,
                  scanids_match_block_t fMatchCallback)
 {
-    int error = 0;
     LFHFS_LOG(LEVEL_DEBUG, "LFHFS_ScanIDs\n");
     VERIFY_NODE_IS_VALID(psNode);
     struct vnode* psVnode = (struct vnode*) psNode;
 
-    char* pcName = malloc(sizeof(char)*MAX_UTF8_NAME_LENGTH);
-    if (pcName == NULL)
-        return ENOMEM;
-
-    for (uint32_t uIDCounter = 0; uIDCounter < iFileIDCount; uIDCounter++)
-    {
-        memset(pcName,0,sizeof(char)*MAX_UTF8_NAME_LENGTH);
-        //if we got to the rootParentID just continue
-        if ((cnid_t)puFileIDArray[uIDCounter] == kHFSRootParentID)
-            continue;
-
-        UVFSFileAttributes sFileAttrs;
-        error = hfs_GetInfoByID(VTOHFS(psVnode), (cnid_t)puFileIDArray[uIDCounter], &sFileAttrs, pcName);
-        if (error == ENOENT) {
-            error = 0;
-            continue;
-        }
-
-        if (!error) {
-            if ((cnid_t)puFileIDArray[uIDCounter] == kHFSRootFolderID) {
-                sFileAttrs.fa_parentid = sFileAttrs.fa_fileid;
-            }
-            LFHFS_LOG(LEVEL_DEBUG, "scan found item %llu parent %llu",
-                      sFileAttrs.fa_parentid, sFileAttrs.fa_fileid);
-            fMatchCallback((int) uIDCounter, &sFileAttrs, pcName);
-        } else {
-            LFHFS_LOG(LEVEL_DEBUG, "LFHFS_ScanIDs: hfs_GetInfoByID failed with error %u\n",error);
-            break;
-        }
-    }
-
-    free(pcName);
-    return error;
+    return hfs_ScanIDs(VTOHFS(psVnode), puFileIDArray, iFileIDCount, fMatchCallback);
 }
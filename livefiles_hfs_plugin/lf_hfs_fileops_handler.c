@@ -68,8 +68,24 @@ int LFHFS_Read ( UVFSFileNode psNode, uint64_t uOffset, size_t iLength, void *pv
         iLength = filesize - uOffset;
     }
 
-    uint64_t uReadStartCluster;
-    retval = raw_readwrite_read( vp, uOffset, pvBuf, iLength, iActuallyRead, &uReadStartCluster );
+    // The tail of the file may still be in the write-back buffer
+    uint64_t uBufferedOffset = hfs_writeback_offset(fp);
+    size_t iDeviceLength = iLength;
+    if ( uOffset + iLength > uBufferedOffset )
+    {
+        iDeviceLength = (uOffset < uBufferedOffset) ? (uBufferedOffset - uOffset) : 0;
+    }
+
+    if ( iDeviceLength > 0 )
+    {
+        uint64_t uReadStartCluster;
+        retval = raw_readwrite_read( vp, uOffset, pvBuf, iDeviceLength, iActuallyRead, &uReadStartCluster );
+    }
+
+    if ( (retval == 0) && (*iActuallyRead == iDeviceLength) && (iDeviceLength < iLength) )
+    {
+        *iActuallyRead += hfs_writeback_read( vp, uOffset + iDeviceLength, iLength - iDeviceLength, (uint8_t*)pvBuf + iDeviceLength );
+    }
 
     cp->c_touch_acctime = TRUE;
 
@@ -141,6 +157,9 @@ int LFHFS_Write ( UVFSFileNode psNode, uint64_t uOffset, size_t iLength, const v
      *    old EOF and new EOF are in the same block, we still need to
      *    protect that range of bytes until they are written for the
      *    first time.
+     * 3. The file has data in the write-back buffer.  Any write that
+     *    doesn't append to it flushes it, and readers must not see the
+     *    buffer emptied before the data is on the device.
      *
      * If we had a shared lock with the above cases, we need to try to upgrade
      * to an exclusive lock.  If the upgrade fails, we will lose the shared
@@ -149,7 +168,8 @@ int LFHFS_Write ( UVFSFileNode psNode, uint64_t uOffset, size_t iLength, const v
      */
     if ((cp->c_truncatelockowner == HFS_SHARED_OWNER) &&
         ((fp->ff_unallocblocks != 0) ||
-         (writelimit > origFileSize)))
+         (writelimit > origFileSize) ||
+         hfs_writeback_pending(fp)))
     {
             lf_lck_rw_lock_shared_to_exclusive(&cp->c_truncatelock);
             /* Store the owner in the c_truncatelockowner field if we successfully upgrade */
@@ -161,6 +181,24 @@ int LFHFS_Write ( UVFSFileNode psNode, uint64_t uOffset, size_t iLength, const v
     }
     cnode_locked = 1;
 
+    /* Appends may be buffered and allocated later, anything else flushes the buffer first */
+    retval = hfs_writeback_write(vp, uOffset, iLength, pvBuf);
+    if (retval == 0)
+    {
+        *iActuallyWrite = iLength;
+        cp->c_flag |= C_MODIFIED;
+        cp->c_touch_chgtime = TRUE;
+        cp->c_touch_modtime = TRUE;
+        hfs_incr_gencount(cp);
+        hfsmp->vcbWrCnt++;
+        goto exit;
+    }
+    if (retval != EAGAIN)
+    {
+        goto exit;
+    }
+    retval = 0;
+
     filebytes = blk_to_bytes(fp->ff_blocks, hfsmp->blockSize);
 
     if ((off_t)uOffset > filebytes
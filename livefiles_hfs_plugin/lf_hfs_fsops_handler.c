@@ -23,6 +23,8 @@
 #include "lf_hfs_vfsops.h"
 #include "lf_hfs_mount.h"
 #include "lf_hfs_readwrite_ops.h"
+#include "lf_hfs_chash.h"
+#include "lf_hfs_lookup.h"
 
 #include "lf_hfs_vnops.h"
 
@@ -162,6 +164,12 @@ LFHFS_Init ( void )
         goto exit;
     }
 
+    iErr = raw_readwrite_readahead_init();
+    if ( iErr != 0 )
+    {
+        goto exit;
+    }
+
     hfs_chashinit();
 
     // Initializing Buffer cache
@@ -182,6 +190,8 @@ LFHFS_Fini ( void )
 
     raw_readwrite_zero_fill_de_init();
 
+    raw_readwrite_readahead_de_init();
+
     // De-Initializing Buffer cache
     lf_hfs_generic_buf_cache_deinit();
 }
@@ -276,6 +286,8 @@ LFHFS_Unmount ( UVFSFileNode psRootNode, UVFSUnmountHint hint )
     #if HFS_CRASH_TEST
         CRASH_ABORT(CRASH_ABORT_ON_UNMOUNT, psHfsMp, NULL);
     #endif
+
+    (void) hfs_writeback_flush_all(psHfsMp);
     
     hfs_vnop_reclaim(psRootVnode);
 
@@ -313,6 +325,36 @@ LFHFS_SetFSAttr ( UVFSFileNode psNode, const char *pcAttr, const UVFSFSAttribute
          return hfs_vnop_preallocate(psNode, psPreAllocReq, psPreAllocRes);
     }
 
+    if (strcmp(pcAttr, LFHFS_FSATTR_WRITEBACK_LIMIT) == 0)
+    {
+        if (uLen < sizeof (uint64_t))
+            return EINVAL;
+
+        struct hfsmount *psMount = ((vnode_t)psNode)->sFSParams.vnfs_mp->psHfsmount;
+        bool bNeedFlush;
+
+        lf_lck_mtx_lock(&psMount->hfs_writeback_mutex);
+        psMount->hfs_writeback_limit = psAttrVal->fsa_number;
+        bNeedFlush = (psMount->hfs_writeback_dirty > psMount->hfs_writeback_limit);
+        lf_lck_mtx_unlock(&psMount->hfs_writeback_mutex);
+
+        // Don't keep more buffered than the new limit allows
+        if (bNeedFlush)
+            return hfs_writeback_flush_all(psMount);
+
+        return 0;
+    }
+
+    if (strcmp(pcAttr, LFHFS_FSATTR_BTREAD_ENABLED) == 0)
+    {
+        if (uLen < sizeof (uint64_t))
+            return EINVAL;
+
+        struct hfsmount *psMount = ((vnode_t)psNode)->sFSParams.vnfs_mp->psHfsmount;
+        __atomic_store_n(&psMount->hfs_btread_disabled, (psAttrVal->fsa_number == 0), __ATOMIC_RELAXED);
+        return 0;
+    }
+
     return ENOTSUP;
 }
 
@@ -618,6 +660,127 @@ LFHFS_GetFSAttr ( UVFSFileNode psNode, const char *pcAttr, UVFSFSAttributeValue
         goto end;
     }
 
+    if (strncmp(pcAttr, LFHFS_FSATTR_CHASH_PREFIX, strlen(LFHFS_FSATTR_CHASH_PREFIX))==0)
+    {
+        // cnode hash statistics
+        HFSCNodeHashStats_s sStats;
+        *puRetLen = sizeof(uint64_t);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+
+        hfs_chash_get_stats(psMount, &sStats);
+        if (strcmp(pcAttr, LFHFS_FSATTR_CHASH_CNODES)==0)
+            psAttrVal->fsa_number = sStats.uCnodes;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_CHASH_BUCKETS)==0)
+            psAttrVal->fsa_number = sStats.uBuckets;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_CHASH_MAX_CHAIN)==0)
+            psAttrVal->fsa_number = sStats.uMaxChainLength;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_CHASH_LOOKUPS)==0)
+            psAttrVal->fsa_number = sStats.uLookups;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_CHASH_CONTENDED)==0)
+            psAttrVal->fsa_number = sStats.uContended;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_CHASH_WAITS)==0)
+            psAttrVal->fsa_number = sStats.uWaits;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_CHASH_RESIZES)==0)
+            psAttrVal->fsa_number = sStats.uResizes;
+        else
+            iError = ENOTSUP;
+        goto end;
+    }
+
+    if (strncmp(pcAttr, LFHFS_FSATTR_NCACHE_PREFIX, strlen(LFHFS_FSATTR_NCACHE_PREFIX))==0)
+    {
+        // name cache statistics
+        HFSNameCacheStats_s sStats;
+        *puRetLen = sizeof(uint64_t);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+
+        hfs_namecache_get_stats(psMount, &sStats);
+        if (strcmp(pcAttr, LFHFS_FSATTR_NCACHE_ENTRIES)==0)
+            psAttrVal->fsa_number = sStats.uEntries;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_NCACHE_HITS)==0)
+            psAttrVal->fsa_number = sStats.uHits;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_NCACHE_NEGATIVE_HITS)==0)
+            psAttrVal->fsa_number = sStats.uNegativeHits;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_NCACHE_MISSES)==0)
+            psAttrVal->fsa_number = sStats.uMisses;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_NCACHE_PURGES)==0)
+            psAttrVal->fsa_number = sStats.uPurges;
+        else
+            iError = ENOTSUP;
+        goto end;
+    }
+
+    if (strncmp(pcAttr, LFHFS_FSATTR_BTREAD_PREFIX, strlen(LFHFS_FSATTR_BTREAD_PREFIX))==0)
+    {
+        // catalog reads without the catalog lock
+        *puRetLen = sizeof(uint64_t);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+
+        if (strcmp(pcAttr, LFHFS_FSATTR_BTREAD_SECTIONS)==0)
+            psAttrVal->fsa_number = __atomic_load_n(&psMount->hfs_btread_sections, __ATOMIC_RELAXED);
+        else if (strcmp(pcAttr, LFHFS_FSATTR_BTREAD_CONFLICTS)==0)
+            psAttrVal->fsa_number = __atomic_load_n(&psMount->hfs_btread_conflicts, __ATOMIC_RELAXED);
+        else if (strcmp(pcAttr, LFHFS_FSATTR_BTREAD_FALLBACKS)==0)
+            psAttrVal->fsa_number = __atomic_load_n(&psMount->hfs_btread_fallbacks, __ATOMIC_RELAXED);
+        else if (strcmp(pcAttr, LFHFS_FSATTR_BTREAD_ENABLED)==0)
+            psAttrVal->fsa_number = !__atomic_load_n(&psMount->hfs_btread_disabled, __ATOMIC_RELAXED);
+        else
+            iError = ENOTSUP;
+        goto end;
+    }
+
+    if (strncmp(pcAttr, LFHFS_FSATTR_JOURNAL_PREFIX, strlen(LFHFS_FSATTR_JOURNAL_PREFIX))==0)
+    {
+        // journal write statistics, all zero on a volume without a journal
+        journal_stats sStats = {0};
+        *puRetLen = sizeof(uint64_t);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+
+        hfs_lock_global(psMount, HFS_SHARED_LOCK);
+        if (psMount->jnl)
+            journal_get_stats(psMount->jnl, &sStats);
+        hfs_unlock_global(psMount);
+
+        if (strcmp(pcAttr, LFHFS_FSATTR_JOURNAL_COMMITS)==0)
+            psAttrVal->fsa_number = sStats.commits;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_JOURNAL_IOS)==0)
+            psAttrVal->fsa_number = sStats.ios;
+        else if (strcmp(pcAttr, LFHFS_FSATTR_JOURNAL_UNBATCHED_IOS)==0)
+            psAttrVal->fsa_number = sStats.unbatched_ios;
+        else
+            iError = ENOTSUP;
+        goto end;
+    }
+
+    if (strcmp(pcAttr, LFHFS_FSATTR_WRITEBACK_LIMIT)==0 || strcmp(pcAttr, LFHFS_FSATTR_WRITEBACK_DIRTY)==0)
+    {
+        *puRetLen = sizeof(uint64_t);
+        if (uLen < *puRetLen)
+        {
+            return E2BIG;
+        }
+
+        lf_lck_mtx_lock(&psMount->hfs_writeback_mutex);
+        if (strcmp(pcAttr, LFHFS_FSATTR_WRITEBACK_LIMIT)==0)
+            psAttrVal->fsa_number = psMount->hfs_writeback_limit;
+        else
+            psAttrVal->fsa_number = psMount->hfs_writeback_dirty;
+        lf_lck_mtx_unlock(&psMount->hfs_writeback_mutex);
+        goto end;
+    }
+
     iError = ENOTSUP;
 end:
     return iError;
@@ -638,6 +801,9 @@ int LFHFS_Sync(UVFSFileNode psNode) {
     struct hfsmount *psMount = psVnode->sFSParams.vnfs_mp->psHfsmount;
     bool bNeedUnlock = false;
 
+    // Appends held in memory have to reach the media before the volume is marked clean
+    iErr = hfs_writeback_flush_all(psMount);
+
     lf_lck_mtx_lock(&psMount->sync_mutex);
     psMount->hfs_syncer_thread = pthread_self();
     
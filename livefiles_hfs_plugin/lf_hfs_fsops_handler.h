@@ -14,6 +14,42 @@
 
 #define PATH_TO_FSCK FS_BUNDLE_BIN_PATH "/fsck_hfs"
 
+// Cnode hash statistics, reported as number attributes by LFHFS_GetFSAttr
+#define LFHFS_FSATTR_CHASH_PREFIX       "_N_lfhfs_chash_"
+#define LFHFS_FSATTR_CHASH_CNODES       LFHFS_FSATTR_CHASH_PREFIX "cnodes"
+#define LFHFS_FSATTR_CHASH_BUCKETS      LFHFS_FSATTR_CHASH_PREFIX "buckets"
+#define LFHFS_FSATTR_CHASH_MAX_CHAIN    LFHFS_FSATTR_CHASH_PREFIX "max_chain"
+#define LFHFS_FSATTR_CHASH_LOOKUPS      LFHFS_FSATTR_CHASH_PREFIX "lookups"
+#define LFHFS_FSATTR_CHASH_CONTENDED    LFHFS_FSATTR_CHASH_PREFIX "contended"
+#define LFHFS_FSATTR_CHASH_WAITS        LFHFS_FSATTR_CHASH_PREFIX "waits"
+#define LFHFS_FSATTR_CHASH_RESIZES      LFHFS_FSATTR_CHASH_PREFIX "resizes"
+
+// Name cache statistics, reported as number attributes by LFHFS_GetFSAttr
+#define LFHFS_FSATTR_NCACHE_PREFIX          "_N_lfhfs_ncache_"
+#define LFHFS_FSATTR_NCACHE_ENTRIES         LFHFS_FSATTR_NCACHE_PREFIX "entries"
+#define LFHFS_FSATTR_NCACHE_HITS            LFHFS_FSATTR_NCACHE_PREFIX "hits"
+#define LFHFS_FSATTR_NCACHE_NEGATIVE_HITS   LFHFS_FSATTR_NCACHE_PREFIX "negative_hits"
+#define LFHFS_FSATTR_NCACHE_MISSES          LFHFS_FSATTR_NCACHE_PREFIX "misses"
+#define LFHFS_FSATTR_NCACHE_PURGES          LFHFS_FSATTR_NCACHE_PREFIX "purges"
+
+// Catalog reads without the catalog lock, reported as number attributes by LFHFS_GetFSAttr.
+// Setting enabled to 0 makes every catalog read take the lock.
+#define LFHFS_FSATTR_BTREAD_PREFIX          "_N_lfhfs_btread_"
+#define LFHFS_FSATTR_BTREAD_SECTIONS        LFHFS_FSATTR_BTREAD_PREFIX "sections"
+#define LFHFS_FSATTR_BTREAD_CONFLICTS       LFHFS_FSATTR_BTREAD_PREFIX "conflicts"
+#define LFHFS_FSATTR_BTREAD_FALLBACKS       LFHFS_FSATTR_BTREAD_PREFIX "fallbacks"
+#define LFHFS_FSATTR_BTREAD_ENABLED         LFHFS_FSATTR_BTREAD_PREFIX "enabled"
+
+// Journal write statistics, reported as number attributes by LFHFS_GetFSAttr
+#define LFHFS_FSATTR_JOURNAL_PREFIX         "_N_lfhfs_jnl_"
+#define LFHFS_FSATTR_JOURNAL_COMMITS        LFHFS_FSATTR_JOURNAL_PREFIX "commits"
+#define LFHFS_FSATTR_JOURNAL_IOS            LFHFS_FSATTR_JOURNAL_PREFIX "ios"
+#define LFHFS_FSATTR_JOURNAL_UNBATCHED_IOS  LFHFS_FSATTR_JOURNAL_PREFIX "unbatched_ios"
+
+// Write-back buffering of appends. Setting the limit (in bytes) to 0 disables it.
+#define LFHFS_FSATTR_WRITEBACK_LIMIT    "_N_lfhfs_writeback_limit"
+#define LFHFS_FSATTR_WRITEBACK_DIRTY    "_N_lfhfs_writeback_dirty"
+
 uint64_t FSOPS_GetOffsetFromClusterNum(vnode_t vp, uint64_t uClusterNum);
 int      LFHFS_Mount   (int iFd, UVFSVolumeId puVolId, __unused UVFSMountFlags puMountFlags,
 	__unused UVFSVolumeCredential *psVolumeCreds, UVFSFileNode *ppsRootNode);
@@ -17,39 +17,88 @@
 #define GEN_BUF_ALLOC_DEBUG 0
 
 TAILQ_HEAD(buf_cache_head, buf_cache_entry);
+LIST_HEAD(buf_cache_bucket, buf_cache_entry);
 
 struct buf_cache_entry {
-    TAILQ_ENTRY(buf_cache_entry) buf_cache_link;
+    TAILQ_ENTRY(buf_cache_entry) buf_cache_link;    // Shard LRU list, most recently used at the head
+    LIST_ENTRY(buf_cache_entry)  buf_hash_link;     // Shard hash chain, keyed by (iFD, uPhyCluster)
+    LIST_ENTRY(buf_cache_entry)  buf_vnode_link;    // Owning vnode list (psVnode->sBufCacheList)
     GenericLFBuf sBuf;
 };
 
-boolean_t buf_cache_state = false;
-struct buf_cache_head buf_cache_list;
-pthread_mutex_t buf_cache_mutex;      /* protects access to buffer cache data */
-
+// The buffer cache is split into shards by hashing (iFD, uPhyCluster).
+// Each shard has its own lock, LRU list and hash table, so lookups of
+// unrelated blocks do not serialize on a single mutex.
+typedef struct {
+    pthread_mutex_t          sMutex;        /* protects all the fields below */
+    struct buf_cache_head    sLRUList;
+    struct buf_cache_bucket *psBuckets;
+    uint64_t                 uBucketMask;
+    uint32_t                 uEntries;
+    uint64_t                 uDataSize;
+} BufCacheShard_s;
+
+#define BUF_CACHE_NUM_SHARDS                (16)
+#define BUF_CACHE_MIN_BUCKETS_PER_SHARD     (16)
+#define BUF_CACHE_MIN_ENTRIES_PER_SHARD     (8)
+#define BUF_CACHE_EVICT_SCAN_LIMIT          (32)    // Busy buffers skipped before eviction gives up
 
-#define BUF_CACHE_MAX_ENTRIES_UPPER_LIMIT   (140)
-#define BUF_CACHE_MAX_ENTRIES_LOWER_LIMIT   (128)
-#define BUF_CACHE_MAX_DATA_UPPER_LIMIT (1536*1024)
-#define BUF_CACHE_MAX_DATA_LOWER_LIMIT (1024*1024)
+boolean_t buf_cache_state = false;
+static BufCacheShard_s  buf_cache_shards[BUF_CACHE_NUM_SHARDS];
+static pthread_mutex_t  buf_cache_vnode_mutex[BUF_CACHE_NUM_SHARDS];   /* protects vnode->sBufCacheList */
+
+// Cache capacity. Recomputed by lf_hfs_generic_buf_cache_add_capacity/remove_capacity
+// from the sum of the mounted volumes' contributions.
+static uint32_t buf_cache_max_entries   = BUF_CACHE_DEFAULT_MAX_ENTRIES;
+static uint64_t buf_cache_max_data      = BUF_CACHE_DEFAULT_MAX_DATA;
+static uint64_t buf_cache_mounted_entries = 0;
+static uint64_t buf_cache_mounted_data    = 0;
+
+// Per shard limits. We evict down to the lower limit once the upper limit is hit.
+#define BUF_CACHE_SHARD_MAX_ENTRIES_UPPER_LIMIT   (MAX(buf_cache_max_entries / BUF_CACHE_NUM_SHARDS, BUF_CACHE_MIN_ENTRIES_PER_SHARD))
+#define BUF_CACHE_SHARD_MAX_ENTRIES_LOWER_LIMIT   (BUF_CACHE_SHARD_MAX_ENTRIES_UPPER_LIMIT - BUF_CACHE_SHARD_MAX_ENTRIES_UPPER_LIMIT / 8)
+#define BUF_CACHE_SHARD_MAX_DATA_UPPER_LIMIT      (buf_cache_max_data / BUF_CACHE_NUM_SHARDS)
+#define BUF_CACHE_SHARD_MAX_DATA_LOWER_LIMIT      (BUF_CACHE_SHARD_MAX_DATA_UPPER_LIMIT - BUF_CACHE_SHARD_MAX_DATA_UPPER_LIMIT / 3)
 
 CacheStats_S gCacheStat = {0};
 
+// gCacheStat is updated from several shards concurrently
+#define BUF_CACHE_STAT_INC(field)       __atomic_add_fetch(&gCacheStat.field, 1, __ATOMIC_RELAXED)
+#define BUF_CACHE_STAT_DEC(field)       __atomic_sub_fetch(&gCacheStat.field, 1, __ATOMIC_RELAXED)
+#define BUF_CACHE_STAT_ADD(field, val)  __atomic_add_fetch(&gCacheStat.field, (val), __ATOMIC_RELAXED)
+#define BUF_CACHE_STAT_SUB(field, val)  __atomic_sub_fetch(&gCacheStat.field, (val), __ATOMIC_RELAXED)
+
 #define IGNORE_MOUNT_FD         (INT_MAX)
 
 void lf_hfs_generic_buf_cache_init( void );
 void lf_hfs_generic_buf_cache_deinit( void );
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find( GenericLFBufPtr psBuf );
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(int iFD, uint64_t uPhyCluster, uint64_t uBlockSize);
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(GenericLFBufPtr psBuf);
-GenericLFBuf           *lf_hfs_generic_buf_cache_add( GenericLFBuf *psBuf );
+struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(BufCacheShard_s *psShard, int iFD, uint64_t uPhyCluster, uint64_t uBlockSize);
+struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(BufCacheShard_s *psShard, GenericLFBufPtr psBuf);
+GenericLFBuf           *lf_hfs_generic_buf_cache_add( BufCacheShard_s *psShard, GenericLFBuf *psBuf );
 void lf_hfs_generic_buf_cache_update( GenericLFBufPtr psBuf );
-void lf_hfs_generic_buf_cache_copy( struct buf_cache_entry *entry, GenericLFBufPtr psBuf );
-void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry );
+void lf_hfs_generic_buf_cache_remove( BufCacheShard_s *psShard, struct buf_cache_entry *entry );
 void lf_hfs_generic_buf_cache_remove_all( int iFD );
 void lf_hfs_generic_buf_ref(GenericLFBuf *psBuf);
 void lf_hfs_generic_buf_rele(GenericLFBuf *psBuf);
 
+static inline uint64_t lf_hfs_generic_buf_cache_hash(int iFD, uint64_t uPhyCluster) {
+    uint64_t uKey = (uPhyCluster ^ ((uint64_t)(uint32_t)iFD << 40)) * 0x9E3779B97F4A7C15ULL;
+    return (uKey ^ (uKey >> 29));
+}
+
+static inline BufCacheShard_s *lf_hfs_generic_buf_cache_shard(int iFD, uint64_t uPhyCluster) {
+    // Use the high bits for the shard and the low bits for the bucket
+    return (&buf_cache_shards[(lf_hfs_generic_buf_cache_hash(iFD, uPhyCluster) >> 32) % BUF_CACHE_NUM_SHARDS]);
+}
+
+static inline struct buf_cache_bucket *lf_hfs_generic_buf_cache_bucket(BufCacheShard_s *psShard, int iFD, uint64_t uPhyCluster) {
+    return (&psShard->psBuckets[lf_hfs_generic_buf_cache_hash(iFD, uPhyCluster) & psShard->uBucketMask]);
+}
+
+static inline pthread_mutex_t *lf_hfs_generic_buf_cache_vnode_mutex(vnode_t psVnode) {
+    return (&buf_cache_vnode_mutex[((uintptr_t)psVnode >> 6) % BUF_CACHE_NUM_SHARDS]);
+}
+
 // lf_hfs_generic_buf_take_ownership
 // Take ownership on this buff.
 // When the function returns zero, we own the buffer it is locked by our thread.
@@ -129,22 +178,33 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
                psVnode, uBlockN, uBlockSize, uFlags, uPhyCluster);
     #endif
 
-    // Check buffer cache, if a memory buffer already allocated for this physical block
+    sBuf.uBlockN       = uBlockN;
+    sBuf.uDataSize     = uBlockSize;
+    sBuf.psVnode       = psVnode;
+    sBuf.uPhyCluster   = uPhyCluster;
+    sBuf.uCacheFlags   = uFlags;
+    sBuf.uUseCnt       = 1;
+    sBuf.sOwnerThread = pthread_self();
+
     if ( buf_cache_state && !(uFlags & GEN_BUF_NON_CACHED)) {
+        int iFD = VNODE_TO_IFD(psVnode);
+        BufCacheShard_s *psShard = lf_hfs_generic_buf_cache_shard(iFD, uPhyCluster);
+
     retry:
-        lf_lck_mtx_lock(&buf_cache_mutex);
+        lf_lck_mtx_lock(&psShard->sMutex);
 
-        psCacheEntry = lf_hfs_generic_buf_cache_find_by_phy_cluster(VNODE_TO_IFD(psVnode), uPhyCluster, uBlockSize);
+        // Check buffer cache, if a memory buffer already allocated for this physical block
+        psCacheEntry = lf_hfs_generic_buf_cache_find_by_phy_cluster(psShard, iFD, uPhyCluster, uBlockSize);
         if (psCacheEntry) {
             // buffer exists, share.
-            TAILQ_REMOVE(&buf_cache_list, psCacheEntry, buf_cache_link);
-            TAILQ_INSERT_HEAD(&buf_cache_list, psCacheEntry, buf_cache_link);
+            TAILQ_REMOVE(&psShard->sLRUList, psCacheEntry, buf_cache_link);
+            TAILQ_INSERT_HEAD(&psShard->sLRUList, psCacheEntry, buf_cache_link);
 
             psBuf = &psCacheEntry->sBuf;
             #if GEN_BUF_ALLOC_DEBUG
                 printf("Already in cache: %p (UseCnt %u uCacheFlags 0x%llx)\n", psBuf, psBuf->uUseCnt, psBuf->uCacheFlags);
             #endif
-            int iRet = lf_hfs_generic_buf_take_ownership(psBuf, &buf_cache_mutex);
+            int iRet = lf_hfs_generic_buf_take_ownership(psBuf, &psShard->sMutex);
             if (iRet == EAGAIN) {
                 goto retry;
             } else if (iRet) {
@@ -152,32 +212,15 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
                 return(NULL);
             } 
             
+            BUF_CACHE_STAT_INC(buf_cache_hit);
             lf_hfs_generic_buf_unlock(psBuf);
-            lf_lck_mtx_unlock(&buf_cache_mutex);
+            lf_lck_mtx_unlock(&psShard->sMutex);
             return(psBuf);
         }
 
-        lf_lck_mtx_unlock(&buf_cache_mutex);
-    }
-
-    // Not found in cache, need to create a GenBuf
-    sBuf.uBlockN       = uBlockN;
-    sBuf.uDataSize     = uBlockSize;
-    sBuf.psVnode       = psVnode;
-    sBuf.uPhyCluster   = uPhyCluster;
-    sBuf.uCacheFlags   = uFlags;
-    sBuf.uUseCnt       = 1;
-    sBuf.sOwnerThread = pthread_self();
-
-    if ( buf_cache_state && !(uFlags & GEN_BUF_NON_CACHED)) {
-        
-        // Add to cache
-        lf_lck_mtx_lock(&buf_cache_mutex);
-        
-        GenericLFBufPtr psCachedBuf = lf_hfs_generic_buf_cache_add(&sBuf);
-        
-        lf_cond_init(&psCachedBuf->sOwnerCond);
-        lf_lck_mtx_init(&psCachedBuf->sLock);
+        // Not found in cache, add a new GenBuf while still holding the shard lock
+        BUF_CACHE_STAT_INC(buf_cache_miss);
+        GenericLFBufPtr psCachedBuf = lf_hfs_generic_buf_cache_add(psShard, &sBuf);
 
         if (psCachedBuf) {
             if (uFlags & (GEN_BUF_IS_UPTODATE | GEN_BUF_LITTLE_ENDIAN)) {
@@ -187,7 +230,7 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
             }
         }
         
-        lf_lck_mtx_unlock(&buf_cache_mutex);
+        lf_lck_mtx_unlock(&psShard->sMutex);
         #if GEN_BUF_ALLOC_DEBUG
             printf("Added to cache %p\n", psCachedBuf);
         #endif
@@ -208,9 +251,9 @@ GenericLFBufPtr lf_hfs_generic_buf_allocate( vnode_t psVnode, daddr64_t uBlockN,
         lf_cond_init(&psBuf->sOwnerCond);
         lf_lck_mtx_init(&psBuf->sLock);
 
-        gCacheStat.gen_buf_uncached++;
-        if (gCacheStat.gen_buf_uncached > gCacheStat.max_gen_buf_uncached) {
-            gCacheStat.max_gen_buf_uncached = gCacheStat.gen_buf_uncached;
+        uint32_t uUncached = BUF_CACHE_STAT_INC(gen_buf_uncached);
+        if (uUncached > gCacheStat.max_gen_buf_uncached) {
+            gCacheStat.max_gen_buf_uncached = uUncached;
         }
         if (uFlags & (GEN_BUF_IS_UPTODATE | GEN_BUF_LITTLE_ENDIAN)) {
             lf_hfs_generic_buf_lock(psBuf);
@@ -251,9 +294,7 @@ errno_t lf_hfs_generic_buf_read( GenericLFBufPtr psBuf )
     
     if ( buf_cache_state && !(psBuf->uCacheFlags & GEN_BUF_NON_CACHED))
     {
-        lf_lck_mtx_lock(&buf_cache_mutex);
         lf_hfs_generic_buf_cache_update(psBuf);
-        lf_lck_mtx_unlock(&buf_cache_mutex);
     }
 
     lf_hfs_generic_buf_lock(psBuf);
@@ -346,23 +387,27 @@ void lf_hfs_generic_buf_invalidate( GenericLFBuf *psBuf ) {
     // Check buffer cache, if a memory buffer already allocated for this physical block
     if ( buf_cache_state && !(psBuf->uCacheFlags & GEN_BUF_NON_CACHED)) {
         
-        lf_lck_mtx_lock(&buf_cache_mutex);
-        psCacheEntry = lf_hfs_generic_buf_cache_find_gen_buf(psBuf);
+        BufCacheShard_s *psShard = lf_hfs_generic_buf_cache_shard(VNODE_TO_IFD(psBuf->psVnode), psBuf->uPhyCluster);
+        lf_lck_mtx_lock(&psShard->sMutex);
+        psCacheEntry = lf_hfs_generic_buf_cache_find_gen_buf(psShard, psBuf);
 
         if (psCacheEntry) {
-            lf_hfs_generic_buf_cache_remove(psCacheEntry);
+            lf_hfs_generic_buf_cache_remove(psShard, psCacheEntry);
         } else {
             panic("A buffer is marked Cached, but was not found in Cache");
         }
         
-        lf_lck_mtx_unlock(&buf_cache_mutex);
+        lf_lck_mtx_unlock(&psShard->sMutex);
 
     } else {
         // This is a non-cached buffer
-        gCacheStat.gen_buf_uncached--;
+        BUF_CACHE_STAT_DEC(gen_buf_uncached);
         lf_hfs_generic_buf_unlock(psBuf);
         lf_cond_destroy(&psBuf->sOwnerCond);
         lf_lck_mtx_destroy(&psBuf->sLock);
+        if (psBuf->pvSearchCache) {
+            hfs_free(psBuf->pvSearchCache);
+        }
         hfs_free(psBuf->pvData);
         hfs_free(psBuf);
     }
@@ -436,31 +481,35 @@ void lf_hfs_generic_buf_clear_cache_flag(GenericLFBufPtr psBuf, uint64_t uCacheF
     lf_hfs_generic_buf_unlock(psBuf);
 }
 
-static void lf_hfs_buf_free_unused()
+// Called with the shard lock held
+static void lf_hfs_buf_free_unused(BufCacheShard_s *psShard)
 {
+    struct buf_cache_entry *entry, *prev;
+    uint32_t uSkipped = 0;
+
     //We want to free more then we actually need, so that we won't have to come here every new buf that we allocate
-    while ( gCacheStat.buf_cache_size > BUF_CACHE_MAX_ENTRIES_LOWER_LIMIT ||
-           gCacheStat.buf_total_allocated_size > BUF_CACHE_MAX_DATA_LOWER_LIMIT)
+    for (entry = TAILQ_LAST(&psShard->sLRUList, buf_cache_head); entry != NULL; entry = prev)
     {
-        struct buf_cache_entry *last;
-        
-        last = TAILQ_LAST(&buf_cache_list, buf_cache_head);
-        
-        if (!last) {
+        if ( psShard->uEntries  <= BUF_CACHE_SHARD_MAX_ENTRIES_LOWER_LIMIT &&
+             psShard->uDataSize <= BUF_CACHE_SHARD_MAX_DATA_LOWER_LIMIT ) {
             break;
         }
+
+        prev = TAILQ_PREV(entry, buf_cache_head, buf_cache_link);
+
+        lf_hfs_generic_buf_lock(&entry->sBuf);
         
-        lf_hfs_generic_buf_lock(&last->sBuf);
-        
-        if ((last->sBuf.uUseCnt) || (last->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
-            // Last buffer in buffer cache is in use.
-            // Nothing more to free
-            lf_hfs_generic_buf_unlock(&last->sBuf);
-            break;
+        if ((entry->sBuf.uUseCnt) || (entry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
+            // Buffer is in use or is part of a journal transaction, try the next least recently used one.
+            lf_hfs_generic_buf_unlock(&entry->sBuf);
+            if (++uSkipped == BUF_CACHE_EVICT_SCAN_LIMIT) {
+                break;
+            }
+            continue;
         }
         
-        ++gCacheStat.buf_cache_cleanup;
-        lf_hfs_generic_buf_cache_remove(last);
+        BUF_CACHE_STAT_INC(buf_cache_cleanup);
+        lf_hfs_generic_buf_cache_remove(psShard, entry);
     }
 }
 
@@ -475,137 +524,312 @@ void lf_hfs_generic_buf_release( GenericLFBufPtr psBuf )
         return;
     }
     
+    // Once released, a cached buffer may get evicted by another thread, so find its shard first
+    BufCacheShard_s *psShard = NULL;
+    if ( buf_cache_state && !(psBuf->uCacheFlags & GEN_BUF_NON_CACHED)) {
+        psShard = lf_hfs_generic_buf_cache_shard(VNODE_TO_IFD(psBuf->psVnode), psBuf->uPhyCluster);
+    }
+
     lf_hfs_generic_buf_rele(psBuf);
 
     // If Unused and UnCached, free.
     if ((psBuf->uCacheFlags & GEN_BUF_NON_CACHED) && (psBuf->uUseCnt == 0)) {
         // Buffer not in cache - free it
-        gCacheStat.gen_buf_uncached--;
+        BUF_CACHE_STAT_DEC(gen_buf_uncached);
         lf_cond_destroy(&psBuf->sOwnerCond);
         lf_lck_mtx_destroy(&psBuf->sLock);
+        if (psBuf->pvSearchCache) {
+            hfs_free(psBuf->pvSearchCache);
+        }
         hfs_free(psBuf->pvData);
         hfs_free(psBuf);
         return;
     }
 
+    if (!psShard) {
+        return;
+    }
+
     // Cleanup unused entries in the cache
-    int iTry = lf_lck_mtx_try_lock(&buf_cache_mutex);
+    int iTry = lf_lck_mtx_try_lock(&psShard->sMutex);
     if (iTry) {
         return;
     }
 
-    //We want to free more then we actually need, so that we won't have to come here every new buf that we allocate
-    lf_hfs_buf_free_unused();
-    lf_lck_mtx_unlock(&buf_cache_mutex);
+    if ( psShard->uEntries  > BUF_CACHE_SHARD_MAX_ENTRIES_LOWER_LIMIT ||
+         psShard->uDataSize > BUF_CACHE_SHARD_MAX_DATA_LOWER_LIMIT ) {
+        lf_hfs_buf_free_unused(psShard);
+    }
+    lf_lck_mtx_unlock(&psShard->sMutex);
 }
 
 //  Buffer Cache functions
 
+static errno_t lf_hfs_generic_buf_cache_alloc_buckets(BufCacheShard_s *psShard, uint64_t uNumOfBuckets) {
+
+    struct buf_cache_bucket *psBuckets = hfs_malloc(uNumOfBuckets * sizeof(*psBuckets));
+    if (!psBuckets) {
+        return(ENOMEM);
+    }
+    for (uint64_t uBucket = 0; uBucket < uNumOfBuckets; uBucket++) {
+        LIST_INIT(&psBuckets[uBucket]);
+    }
+
+    // Rehash existing entries into the new table
+    struct buf_cache_entry *entry;
+    TAILQ_FOREACH(entry, &psShard->sLRUList, buf_cache_link) {
+        LIST_REMOVE(entry, buf_hash_link);
+        uint64_t uHash = lf_hfs_generic_buf_cache_hash(VNODE_TO_IFD(entry->sBuf.psVnode), entry->sBuf.uPhyCluster);
+        LIST_INSERT_HEAD(&psBuckets[uHash & (uNumOfBuckets - 1)], entry, buf_hash_link);
+    }
+
+    if (psShard->psBuckets) {
+        hfs_free(psShard->psBuckets);
+    }
+    psShard->psBuckets   = psBuckets;
+    psShard->uBucketMask = uNumOfBuckets - 1;
+    return(0);
+}
+
 void lf_hfs_generic_buf_cache_init( void ) {
     gCacheStat.buf_cache_size       = 0;
     gCacheStat.max_gen_buf_uncached = 0;
     gCacheStat.gen_buf_uncached     = 0;
-    lf_lck_mtx_init(&buf_cache_mutex);
-    TAILQ_INIT(&buf_cache_list);
+    gCacheStat.buf_cache_hit        = 0;
+    gCacheStat.buf_cache_miss       = 0;
+    buf_cache_max_entries           = BUF_CACHE_DEFAULT_MAX_ENTRIES;
+    buf_cache_max_data              = BUF_CACHE_DEFAULT_MAX_DATA;
+
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_NUM_SHARDS; uShard++) {
+        BufCacheShard_s *psShard = &buf_cache_shards[uShard];
+        memset(psShard, 0, sizeof(*psShard));
+        lf_lck_mtx_init(&psShard->sMutex);
+        TAILQ_INIT(&psShard->sLRUList);
+        if (lf_hfs_generic_buf_cache_alloc_buckets(psShard, BUF_CACHE_MIN_BUCKETS_PER_SHARD)) {
+            // Without a cache all buffers are allocated as non-cached
+            LFHFS_LOG(LEVEL_ERROR, "lf_hfs_generic_buf_cache_init: failed to allocate hash buckets, buffer cache is disabled\n");
+            for (uint32_t uPrev = 0; uPrev <= uShard; uPrev++) {
+                if (buf_cache_shards[uPrev].psBuckets) {
+                    hfs_free(buf_cache_shards[uPrev].psBuckets);
+                    buf_cache_shards[uPrev].psBuckets = NULL;
+                }
+                lf_lck_mtx_destroy(&buf_cache_shards[uPrev].sMutex);
+            }
+            return;
+        }
+    }
+    for (uint32_t uStripe = 0; uStripe < BUF_CACHE_NUM_SHARDS; uStripe++) {
+        lf_lck_mtx_init(&buf_cache_vnode_mutex[uStripe]);
+    }
     buf_cache_state = true;
 }
 
 void lf_hfs_generic_buf_cache_deinit( void )
 {
+    if (!buf_cache_state) {
+        return;
+    }
+
     lf_hfs_generic_buf_cache_remove_all(IGNORE_MOUNT_FD);
 
     assert(gCacheStat.buf_cache_size   == 0);
     assert(gCacheStat.gen_buf_uncached == 0);
 
     buf_cache_state = false;
-    lf_lck_mtx_destroy(&buf_cache_mutex);
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_NUM_SHARDS; uShard++) {
+        hfs_free(buf_cache_shards[uShard].psBuckets);
+        buf_cache_shards[uShard].psBuckets = NULL;
+        lf_lck_mtx_destroy(&buf_cache_shards[uShard].sMutex);
+        lf_lck_mtx_destroy(&buf_cache_vnode_mutex[uShard]);
+    }
 }
 
-void lf_hfs_generic_buf_cache_clear_by_iFD( int iFD )
+// Called with all shard locks held
+static void lf_hfs_generic_buf_cache_update_capacity( void )
 {
-    lf_hfs_generic_buf_cache_remove_all(iFD);
+    buf_cache_max_entries = (uint32_t)MIN(MAX(buf_cache_mounted_entries, BUF_CACHE_DEFAULT_MAX_ENTRIES), BUF_CACHE_MAX_ENTRIES_HARD_LIMIT);
+    buf_cache_max_data    = MIN(MAX(buf_cache_mounted_data, BUF_CACHE_DEFAULT_MAX_DATA), BUF_CACHE_MAX_DATA_HARD_LIMIT);
 }
 
-boolean_t lf_hfs_generic_buf_match_range( struct buf_cache_entry *entry, GenericLFBufPtr psBuf )
+// Add a mount's B-tree metadata to the cache capacity. Called at mount time.
+void lf_hfs_generic_buf_cache_add_capacity( uint32_t uEntries, uint64_t uDataSize )
 {
-    if ( VTOF(entry->sBuf.psVnode) != VTOF(psBuf->psVnode) )
-    {
-        return false;
+    if (!buf_cache_state) {
+        return;
     }
 
-    uint64_t size_1     = entry->sBuf.uDataSize;
-    uint64_t start_1    = entry->sBuf.uBlockN * size_1;
-    uint64_t end_1      = start_1 + size_1 - 1;
-    uint64_t size_2     = psBuf->uDataSize;
-    uint64_t start_2    = psBuf->uBlockN * size_2;
-    uint64_t end_2      = start_2 + size_2 - 1;
+    lf_hfs_generic_buf_cache_LockBufCache();
 
-    enum rl_overlaptype overlap;
-    struct rl_entry entry_range = {.rl_start = start_1, .rl_end = end_1};
+    buf_cache_mounted_entries += uEntries;
+    buf_cache_mounted_data    += uDataSize;
+    lf_hfs_generic_buf_cache_update_capacity();
 
-    overlap = rl_overlap(&entry_range, start_2, end_2);
+    // Keep the hash chains short: one bucket per entry the shard may hold
+    uint64_t uNumOfBuckets = BUF_CACHE_MIN_BUCKETS_PER_SHARD;
+    while (uNumOfBuckets < BUF_CACHE_SHARD_MAX_ENTRIES_UPPER_LIMIT) {
+        uNumOfBuckets <<= 1;
+    }
 
-    switch (overlap)
-    {
-        case RL_MATCHINGOVERLAP:
-            return true;
-        case RL_OVERLAPCONTAINSRANGE:
-            // Make sure we have same start though
-            assert(start_1 == start_2);
-            return true;
-        case RL_NOOVERLAP:
-        case RL_OVERLAPISCONTAINED:
-            return false;
-        case RL_OVERLAPSTARTSBEFORE:
-        case RL_OVERLAPENDSAFTER:
-            LFHFS_LOG(LEVEL_ERROR, " lf_hfs_generic_buf_match_range : cache overlap [%d]", overlap);
-            assert(0);
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_NUM_SHARDS; uShard++) {
+        BufCacheShard_s *psShard = &buf_cache_shards[uShard];
+        if (psShard->uBucketMask + 1 < uNumOfBuckets) {
+            if (lf_hfs_generic_buf_cache_alloc_buckets(psShard, uNumOfBuckets)) {
+                // Keep the current table, lookups are still correct, just slower.
+                LFHFS_LOG(LEVEL_ERROR, "lf_hfs_generic_buf_cache_add_capacity: failed to grow hash table to %llu buckets\n", uNumOfBuckets);
+            }
+        }
     }
+
+    lf_hfs_generic_buf_cache_UnLockBufCache();
 }
 
-struct buf_cache_entry * lf_hfs_generic_buf_cache_find( GenericLFBufPtr psBuf )
+// Give back a mount's contribution at unmount. The lower limits apply from the next
+// insert, which evicts down to them. The hash tables are kept at their current size.
+void lf_hfs_generic_buf_cache_remove_capacity( uint32_t uEntries, uint64_t uDataSize )
 {
-    struct buf_cache_entry *entry, *entry_next;
+    if (!buf_cache_state) {
+        return;
+    }
 
-    TAILQ_FOREACH_SAFE(entry, &buf_cache_list, buf_cache_link, entry_next)
-    {
-        if ( lf_hfs_generic_buf_match_range(entry, psBuf) )
-        {
+    lf_hfs_generic_buf_cache_LockBufCache();
+
+    assert(buf_cache_mounted_entries >= uEntries && buf_cache_mounted_data >= uDataSize);
+    buf_cache_mounted_entries -= uEntries;
+    buf_cache_mounted_data    -= uDataSize;
+    lf_hfs_generic_buf_cache_update_capacity();
+
+    lf_hfs_generic_buf_cache_UnLockBufCache();
+}
+
+void lf_hfs_generic_buf_cache_clear_by_iFD( int iFD )
+{
+    lf_hfs_generic_buf_cache_remove_all(iFD);
+}
+
+typedef struct {
+    GenericLFBuf *psBuf;
+    uint64_t      uPhyCluster;
+} BufIterateItem_s;
+
+// Take a reference on a buffer collected by lf_hfs_generic_buf_write_iterate.
+// The vnode lock was dropped since, so look the buffer up again under its shard lock.
+// Returns NULL if the buffer got evicted meanwhile.
+static GenericLFBuf *lf_hfs_generic_buf_iterate_ref(vnode_t psVnode, BufIterateItem_s *psItem) {
+
+    int iFD = VNODE_TO_IFD(psVnode);
+    BufCacheShard_s *psShard = lf_hfs_generic_buf_cache_shard(iFD, psItem->uPhyCluster);
+    struct buf_cache_entry *psCacheEntry;
+    GenericLFBuf *psBuf = psItem->psBuf;
+
+retry:
+    lf_lck_mtx_lock(&psShard->sMutex);
+
+    LIST_FOREACH(psCacheEntry, lf_hfs_generic_buf_cache_bucket(psShard, iFD, psItem->uPhyCluster), buf_hash_link) {
+        if ( (&psCacheEntry->sBuf            == psBuf              ) &&
+             (psCacheEntry->sBuf.psVnode     == psVnode            ) &&
+             (psCacheEntry->sBuf.uPhyCluster == psItem->uPhyCluster)  ) {
             break;
         }
     }
+    if (!psCacheEntry) {
+        lf_lck_mtx_unlock(&psShard->sMutex);
+        return(NULL);
+    }
+
+    lf_hfs_generic_buf_lock(psBuf);
+    if ((psBuf->uUseCnt) && (psBuf->sOwnerThread == pthread_self())) {
+        // We already own this buffer, just add a reference
+        psBuf->uUseCnt++;
+        lf_hfs_generic_buf_unlock(psBuf);
+        lf_lck_mtx_unlock(&psShard->sMutex);
+        return(psBuf);
+    }
+    lf_hfs_generic_buf_unlock(psBuf);
 
-    return entry;
+    int iRet = lf_hfs_generic_buf_take_ownership(psBuf, &psShard->sMutex);
+    if (iRet == EAGAIN) {
+        goto retry;
+    } else if (iRet) {
+        LFHFS_LOG(LEVEL_ERROR, "lf_hfs_generic_buf_iterate_ref: lf_hfs_generic_buf_take_ownership returned %d.\n", iRet);
+        lf_lck_mtx_unlock(&psBuf->sLock);
+        return(NULL);
+    }
+
+    lf_hfs_generic_buf_unlock(psBuf);
+    lf_lck_mtx_unlock(&psShard->sMutex);
+    return(psBuf);
+}
+
+static bool lf_hfs_generic_buf_iterate_match(GenericLFBuf *psBuf, uint32_t uFlags) {
+    if ((uFlags & BUF_SKIP_LOCKED) && (psBuf->uCacheFlags & GEN_BUF_WRITE_LOCK)) {
+        return(false);
+    }
+    if ((uFlags & BUF_SKIP_NONLOCKED) && !(psBuf->uCacheFlags & GEN_BUF_WRITE_LOCK)) {
+        return(false);
+    }
+    return(true);
 }
 
 // Run the function pfCallback on all buffers that belongs to node psVnode.
+// Each buffer is referenced for the duration of the callback, so it cannot be evicted
+// under it. A callback that hands the buffer over (ie to journal_kill_block) must take
+// its own reference.
 int lf_hfs_generic_buf_write_iterate(vnode_t psVnode, IterateCallback pfCallback, uint32_t uFlags, void *pvArgs) {
    
-    struct buf_cache_entry *psCacheEntry, *psNextCacheEntry;
-    int iFD = VNODE_TO_IFD(psVnode);
+    struct buf_cache_entry *psCacheEntry;
+    pthread_mutex_t *psVnodeMutex = lf_hfs_generic_buf_cache_vnode_mutex(psVnode);
+    BufIterateItem_s *psItems = NULL;
+    uint32_t uNumOfBufs = 0;
+    uint32_t uMaxBufs   = 0;
+
+    // The buffer lock ranks above the vnode lock, so collect the matching buffers
+    // under the vnode lock and reference them one by one after dropping it.
+    lf_lck_mtx_lock(psVnodeMutex);
+    LIST_FOREACH(psCacheEntry, &psVnode->sBufCacheList, buf_vnode_link) {
+        uMaxBufs++;
+    }
+    if (uMaxBufs) {
+        psItems = hfs_malloc(uMaxBufs * sizeof(*psItems));
+        if (!psItems) {
+            lf_lck_mtx_unlock(psVnodeMutex);
+            return(ENOMEM);
+        }
+    }
+    LIST_FOREACH(psCacheEntry, &psVnode->sBufCacheList, buf_vnode_link) {
+        if (!lf_hfs_generic_buf_iterate_match(&psCacheEntry->sBuf, uFlags)) {
+            continue;
+        }
+        psItems[uNumOfBufs].psBuf       = &psCacheEntry->sBuf;
+        psItems[uNumOfBufs].uPhyCluster = psCacheEntry->sBuf.uPhyCluster;
+        uNumOfBufs++;
+    }
+    lf_lck_mtx_unlock(psVnodeMutex);
 
-    TAILQ_FOREACH_SAFE(psCacheEntry, &buf_cache_list, buf_cache_link, psNextCacheEntry) {
-        int iEntryFD = VNODE_TO_IFD(psCacheEntry->sBuf.psVnode);
-        
-        if ( (iFD == iEntryFD) && (psCacheEntry->sBuf.psVnode == psVnode)) {
-            if ((uFlags & BUF_SKIP_LOCKED) && (psCacheEntry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
-                continue;
-            }
-            if ((uFlags & BUF_SKIP_NONLOCKED) && !(psCacheEntry->sBuf.uCacheFlags & GEN_BUF_WRITE_LOCK)) {
-                continue;
-            }
-            pfCallback(&psCacheEntry->sBuf, pvArgs);
+    for (uint32_t uBuf = 0; uBuf < uNumOfBufs; uBuf++) {
+        GenericLFBuf *psBuf = lf_hfs_generic_buf_iterate_ref(psVnode, &psItems[uBuf]);
+        if (!psBuf) {
+            continue;
+        }
+        // The flags may have changed while the vnode lock was dropped
+        if (lf_hfs_generic_buf_iterate_match(psBuf, uFlags)) {
+            pfCallback(psBuf, pvArgs);
         }
+        lf_hfs_generic_buf_release(psBuf);
+    }
+
+    if (psItems) {
+        hfs_free(psItems);
     }
     return(0);
 }
 
 
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(int iFD, uint64_t uPhyCluster, uint64_t uBlockSize) {
+// Called with the shard lock held
+struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(BufCacheShard_s *psShard, int iFD, uint64_t uPhyCluster, uint64_t uBlockSize) {
 
-    struct buf_cache_entry *psCacheEntry, *psNextCacheEntry;
+    struct buf_cache_entry *psCacheEntry;
     
-    TAILQ_FOREACH_SAFE(psCacheEntry, &buf_cache_list, buf_cache_link, psNextCacheEntry) {
+    LIST_FOREACH(psCacheEntry, lf_hfs_generic_buf_cache_bucket(psShard, iFD, uPhyCluster), buf_hash_link) {
         if (psCacheEntry->sBuf.psVnode)
         {
             int iEntryFD = VNODE_TO_IFD(psCacheEntry->sBuf.psVnode);
@@ -625,11 +849,12 @@ struct buf_cache_entry *lf_hfs_generic_buf_cache_find_by_phy_cluster(int iFD, ui
     return psCacheEntry;
 }
 
-struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(GenericLFBufPtr psBuf) {
+// Called with the shard lock held
+struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(BufCacheShard_s *psShard, GenericLFBufPtr psBuf) {
     
-    struct buf_cache_entry *psCacheEntry, *psNextCacheEntry;
+    struct buf_cache_entry *psCacheEntry;
     
-    TAILQ_FOREACH_SAFE(psCacheEntry, &buf_cache_list, buf_cache_link, psNextCacheEntry) {
+    LIST_FOREACH(psCacheEntry, lf_hfs_generic_buf_cache_bucket(psShard, VNODE_TO_IFD(psBuf->psVnode), psBuf->uPhyCluster), buf_hash_link) {
         if ( &psCacheEntry->sBuf == psBuf ) {
             break;
         }
@@ -637,15 +862,17 @@ struct buf_cache_entry *lf_hfs_generic_buf_cache_find_gen_buf(GenericLFBufPtr ps
     return psCacheEntry;
 }
 
-GenericLFBufPtr lf_hfs_generic_buf_cache_add( GenericLFBufPtr psBuf )
+// Called with the shard lock held
+GenericLFBufPtr lf_hfs_generic_buf_cache_add( BufCacheShard_s *psShard, GenericLFBufPtr psBuf )
 {
     struct buf_cache_entry *entry;
+    vnode_t psVnode = psBuf->psVnode;
 
     //Check if we have enough space to alloc this buffer, unless need to evict something
-    if (gCacheStat.buf_total_allocated_size + psBuf->uDataSize > BUF_CACHE_MAX_DATA_UPPER_LIMIT ||
-        gCacheStat.buf_cache_size + 1 == BUF_CACHE_MAX_ENTRIES_UPPER_LIMIT)
+    if (psShard->uDataSize + psBuf->uDataSize > BUF_CACHE_SHARD_MAX_DATA_UPPER_LIMIT ||
+        psShard->uEntries + 1 >= BUF_CACHE_SHARD_MAX_ENTRIES_UPPER_LIMIT)
     {
-        lf_hfs_buf_free_unused();
+        lf_hfs_buf_free_unused(psShard);
     }
 
     entry = hfs_mallocz(sizeof(*entry));
@@ -661,13 +888,25 @@ GenericLFBufPtr lf_hfs_generic_buf_cache_add( GenericLFBufPtr psBuf )
         goto error;
     }
 
-    TAILQ_INSERT_HEAD(&buf_cache_list, entry, buf_cache_link);
+    lf_cond_init(&entry->sBuf.sOwnerCond);
+    lf_lck_mtx_init(&entry->sBuf.sLock);
+
+    TAILQ_INSERT_HEAD(&psShard->sLRUList, entry, buf_cache_link);
+    LIST_INSERT_HEAD(lf_hfs_generic_buf_cache_bucket(psShard, VNODE_TO_IFD(psVnode), psBuf->uPhyCluster), entry, buf_hash_link);
+
+    pthread_mutex_t *psVnodeMutex = lf_hfs_generic_buf_cache_vnode_mutex(psVnode);
+    lf_lck_mtx_lock(psVnodeMutex);
+    LIST_INSERT_HEAD(&psVnode->sBufCacheList, entry, buf_vnode_link);
+    lf_lck_mtx_unlock(psVnodeMutex);
 
-    gCacheStat.buf_cache_size++;
-    gCacheStat.buf_total_allocated_size+=psBuf->uDataSize;
+    psShard->uEntries++;
+    psShard->uDataSize += psBuf->uDataSize;
+
+    uint32_t uCacheSize = BUF_CACHE_STAT_INC(buf_cache_size);
+    BUF_CACHE_STAT_ADD(buf_total_allocated_size, psBuf->uDataSize);
     
-    if (gCacheStat.buf_cache_size > gCacheStat.max_buf_cache_size) {
-        gCacheStat.max_buf_cache_size = gCacheStat.buf_cache_size;
+    if (uCacheSize > gCacheStat.max_buf_cache_size) {
+        gCacheStat.max_buf_cache_size = uCacheSize;
     }
 
     return(&entry->sBuf);
@@ -690,27 +929,21 @@ void lf_hfs_generic_buf_cache_update( GenericLFBufPtr psBuf )
         printf("lf_hfs_generic_buf_cache_update: psBuf %p\n", psBuf);
     #endif
 
+    BufCacheShard_s *psShard = lf_hfs_generic_buf_cache_shard(VNODE_TO_IFD(psBuf->psVnode), psBuf->uPhyCluster);
+    lf_lck_mtx_lock(&psShard->sMutex);
+
     // Check that cache entry still exists and hasn't thrown away
-    entry = lf_hfs_generic_buf_cache_find(psBuf);
-    if (!entry) {
-        return;
+    entry = lf_hfs_generic_buf_cache_find_gen_buf(psShard, psBuf);
+    if (entry) {
+        TAILQ_REMOVE(&psShard->sLRUList, entry, buf_cache_link);
+        TAILQ_INSERT_HEAD(&psShard->sLRUList, entry, buf_cache_link);
     }
 
-    TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-    TAILQ_INSERT_HEAD(&buf_cache_list, entry, buf_cache_link);
+    lf_lck_mtx_unlock(&psShard->sMutex);
 }
 
-void lf_hfs_generic_buf_cache_copy( struct buf_cache_entry *entry, __unused GenericLFBufPtr psBuf )
-{
-    #if GEN_BUF_ALLOC_DEBUG
-        printf("lf_hfs_generic_buf_cache_copy: psBuf %p\n", psBuf);
-    #endif
-
-    TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-    TAILQ_INSERT_HEAD(&buf_cache_list, entry, buf_cache_link);
-}
-
-void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry ) {
+// Called with the shard lock and the buffer lock held
+void lf_hfs_generic_buf_cache_remove( BufCacheShard_s *psShard, struct buf_cache_entry *entry ) {
     
     if (entry->sBuf.uUseCnt != 0) {
         LFHFS_LOG(LEVEL_ERROR, "lf_hfs_generic_buf_cache_remove: remove buffer %p with uUseCnt %u", &entry->sBuf, entry->sBuf.uUseCnt);
@@ -722,10 +955,19 @@ void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry ) {
                psBuf, psBuf->psVnode, psBuf->uBlockN, psBuf->uDataSize, psBuf->uCacheFlags, psBuf->uPhyCluster, psBuf->uUseCnt);
     #endif
     
-    TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-    --gCacheStat.buf_cache_size;
-    ++gCacheStat.buf_cache_remove;
-    gCacheStat.buf_total_allocated_size -= entry->sBuf.uDataSize;
+    TAILQ_REMOVE(&psShard->sLRUList, entry, buf_cache_link);
+    LIST_REMOVE(entry, buf_hash_link);
+
+    pthread_mutex_t *psVnodeMutex = lf_hfs_generic_buf_cache_vnode_mutex(entry->sBuf.psVnode);
+    lf_lck_mtx_lock(psVnodeMutex);
+    LIST_REMOVE(entry, buf_vnode_link);
+    lf_lck_mtx_unlock(psVnodeMutex);
+
+    psShard->uEntries--;
+    psShard->uDataSize -= entry->sBuf.uDataSize;
+    BUF_CACHE_STAT_DEC(buf_cache_size);
+    BUF_CACHE_STAT_INC(buf_cache_remove);
+    BUF_CACHE_STAT_SUB(buf_total_allocated_size, entry->sBuf.uDataSize);
 
     assert(entry->sBuf.uLockCnt == 1);
     
@@ -733,6 +975,9 @@ void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry ) {
     lf_cond_destroy(&entry->sBuf.sOwnerCond);
     lf_lck_mtx_destroy(&entry->sBuf.sLock);
     
+    if (entry->sBuf.pvSearchCache) {
+        hfs_free(entry->sBuf.pvSearchCache);
+    }
     hfs_free(entry->sBuf.pvData);
     hfs_free(entry);
 }
@@ -740,29 +985,37 @@ void lf_hfs_generic_buf_cache_remove( struct buf_cache_entry *entry ) {
 void lf_hfs_generic_buf_cache_remove_all( int iFD ) {
     struct buf_cache_entry *entry, *entry_next;
 
-    lf_lck_mtx_lock(&buf_cache_mutex);
+    lf_hfs_generic_buf_cache_LockBufCache();
 
-    TAILQ_FOREACH_SAFE(entry, &buf_cache_list, buf_cache_link, entry_next)
-    {
-        if ( (iFD == IGNORE_MOUNT_FD) || ( VNODE_TO_IFD(entry->sBuf.psVnode) == iFD ) )
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_NUM_SHARDS; uShard++) {
+        BufCacheShard_s *psShard = &buf_cache_shards[uShard];
+
+        TAILQ_FOREACH_SAFE(entry, &psShard->sLRUList, buf_cache_link, entry_next)
         {
-            if (iFD == IGNORE_MOUNT_FD) {
-                // Media no longer available, force remove all
-                TAILQ_REMOVE(&buf_cache_list, entry, buf_cache_link);
-                --gCacheStat.buf_cache_size;
-                ++gCacheStat.buf_cache_remove;
-                gCacheStat.buf_total_allocated_size -= entry->sBuf.uDataSize;
-            } else {
-                lf_hfs_generic_buf_lock(&entry->sBuf);
-                lf_hfs_generic_buf_cache_remove(entry);
+            if ( (iFD == IGNORE_MOUNT_FD) || ( VNODE_TO_IFD(entry->sBuf.psVnode) == iFD ) )
+            {
+                if (iFD == IGNORE_MOUNT_FD) {
+                    // Media no longer available, force remove all.
+                    // The owning vnode may already be gone, so leave its list alone.
+                    TAILQ_REMOVE(&psShard->sLRUList, entry, buf_cache_link);
+                    LIST_REMOVE(entry, buf_hash_link);
+                    psShard->uEntries--;
+                    psShard->uDataSize -= entry->sBuf.uDataSize;
+                    BUF_CACHE_STAT_DEC(buf_cache_size);
+                    BUF_CACHE_STAT_INC(buf_cache_remove);
+                    BUF_CACHE_STAT_SUB(buf_total_allocated_size, entry->sBuf.uDataSize);
+                } else {
+                    lf_hfs_generic_buf_lock(&entry->sBuf);
+                    lf_hfs_generic_buf_cache_remove(psShard, entry);
+                }
             }
         }
     }
 
-    lf_lck_mtx_unlock(&buf_cache_mutex);
+    lf_hfs_generic_buf_cache_UnLockBufCache();
 }
 
-/* buf_cache_mutex Should get locked from the caller using lf_hfs_generic_buf_cache_LockBufCache*/
+/* The buffer cache Should get locked from the caller using lf_hfs_generic_buf_cache_LockBufCache*/
 void lf_hfs_generic_buf_cache_remove_vnode(vnode_t vp) {
 
     struct buf_cache_entry *entry, *entry_next;
@@ -771,17 +1024,15 @@ void lf_hfs_generic_buf_cache_remove_vnode(vnode_t vp) {
         printf("lf_hfs_generic_buf_cache_remove_vnode: vp %p: ", vp);
     #endif
     
-    TAILQ_FOREACH_SAFE(entry, &buf_cache_list, buf_cache_link, entry_next) {
+    // All shards are locked, so no one else can add or remove buffers of this vnode
+    LIST_FOREACH_SAFE(entry, &vp->sBufCacheList, buf_vnode_link, entry_next) {
         
-        if ( entry->sBuf.psVnode == vp ) {
-            
-            #if GEN_BUF_ALLOC_DEBUG
-                printf("&sBuf %p, ", &entry->sBuf);
-            #endif
-            
-            lf_hfs_generic_buf_lock(&entry->sBuf);
-            lf_hfs_generic_buf_cache_remove(entry);
-        }
+        #if GEN_BUF_ALLOC_DEBUG
+            printf("&sBuf %p, ", &entry->sBuf);
+        #endif
+        
+        lf_hfs_generic_buf_lock(&entry->sBuf);
+        lf_hfs_generic_buf_cache_remove(lf_hfs_generic_buf_cache_shard(VNODE_TO_IFD(vp), entry->sBuf.uPhyCluster), entry);
     }
 
     #if GEN_BUF_ALLOC_DEBUG
@@ -789,12 +1040,23 @@ void lf_hfs_generic_buf_cache_remove_vnode(vnode_t vp) {
     #endif
 }
 
+// Lock the whole cache. Shards are always taken in ascending order.
 void lf_hfs_generic_buf_cache_LockBufCache(void)
 {
-    lf_lck_mtx_lock(&buf_cache_mutex);
+    if (!buf_cache_state) {
+        return;
+    }
+    for (uint32_t uShard = 0; uShard < BUF_CACHE_NUM_SHARDS; uShard++) {
+        lf_lck_mtx_lock(&buf_cache_shards[uShard].sMutex);
+    }
 }
 
 void lf_hfs_generic_buf_cache_UnLockBufCache(void)
 {
-    lf_lck_mtx_unlock(&buf_cache_mutex);
+    if (!buf_cache_state) {
+        return;
+    }
+    for (uint32_t uShard = BUF_CACHE_NUM_SHARDS; uShard > 0; uShard--) {
+        lf_lck_mtx_unlock(&buf_cache_shards[uShard - 1].sMutex);
+    }
 }
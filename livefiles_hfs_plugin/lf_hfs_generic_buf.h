@@ -23,6 +23,13 @@
 #define    GEN_BUF_PHY_BLOCK       0x00008000 // Indicates that the uBlockN field contains a physical block number
 #define    GEN_BUF_LITTLE_ENDIAN   0x00010000 // When set, the data in the buffer contains small-endian data and should not be written to media
 
+// Buffer cache capacity. The cache holds the larger of the defaults and the sum of
+// the mounted volumes' B-tree metadata, capped by the hard limits.
+#define BUF_CACHE_DEFAULT_MAX_ENTRIES       (140)
+#define BUF_CACHE_DEFAULT_MAX_DATA          (1536*1024)
+#define BUF_CACHE_MAX_ENTRIES_HARD_LIMIT    (256*1024)
+#define BUF_CACHE_MAX_DATA_HARD_LIMIT       (512*1024*1024ULL)
+
 typedef struct GenericBuffer {
     
     uint64_t        uCacheFlags;
@@ -41,6 +48,8 @@ typedef struct GenericBuffer {
     uint64_t        uPhyCluster;
     void           (*pfFunc)(struct GenericBuffer *psBuf, void *pvArg); // A function to be called at the last minute before disk-write
     void            *pvCallbackArgs;                                    // pfFunc args
+    void            *pvSearchCache;     // B-tree node search accelerator, managed by lf_hfs_btrees_io.c and freed with the buffer
+    uint32_t        uSearchCacheFlags;  // B-tree node search accelerator state
 } GenericLFBuf, *GenericLFBufPtr;
 
 typedef struct {
@@ -52,6 +61,8 @@ typedef struct {
     uint32_t buf_cache_cleanup;
 
     uint64_t buf_total_allocated_size;
+    uint64_t buf_cache_hit;
+    uint64_t buf_cache_miss;
 } CacheStats_S;
 
 extern CacheStats_S gCacheStat;
@@ -66,6 +77,7 @@ errno_t             lf_hfs_generic_buf_read( GenericLFBufPtr psBuf );
 errno_t             lf_hfs_generic_buf_write( GenericLFBufPtr psBuf );
 void                lf_hfs_generic_buf_invalidate( GenericLFBufPtr psBuf );
 void                lf_hfs_generic_buf_release( GenericLFBufPtr psBuf );
+void                lf_hfs_generic_buf_ref(GenericLFBufPtr psBuf);
 void                lf_hfs_generic_buf_clear( GenericLFBufPtr psBuf );
 void                lf_hfs_generic_buf_set_cache_flag(GenericLFBufPtr psBuf, uint64_t uCacheFlags);
 void                lf_hfs_generic_buf_clear_cache_flag(GenericLFBufPtr psBuf, uint64_t uCacheFlags);
@@ -74,6 +86,8 @@ void                lf_hfs_generic_buf_lock(GenericLFBufPtr psBuf);
 void                lf_hfs_generic_buf_unlock(GenericLFBufPtr psBuf);
 void                lf_hfs_generic_buf_cache_init( void );
 void                lf_hfs_generic_buf_cache_deinit( void );
+void                lf_hfs_generic_buf_cache_add_capacity( uint32_t uEntries, uint64_t uDataSize );
+void                lf_hfs_generic_buf_cache_remove_capacity( uint32_t uEntries, uint64_t uDataSize );
 void                lf_hfs_generic_buf_cache_clear_by_iFD( int iFD );
 void                lf_hfs_generic_buf_cache_update( GenericLFBufPtr psBuf );
 void                lf_hfs_generic_buf_cache_remove_vnode(vnode_t vp);
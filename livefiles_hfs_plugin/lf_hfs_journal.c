@@ -50,6 +50,7 @@
 #include <mach/mach.h>
 #include <sys/disk.h>
 #include <sys/kdebug.h>
+#include <sys/uio.h>
 #include "lf_hfs_locks.h"
 #include "lf_hfs_journal.h"
 #include "lf_hfs_vfsutils.h"
@@ -57,6 +58,7 @@
 #include "lf_hfs_generic_buf.h"
 #include "lf_hfs_logger.h"
 #include "lf_hfs_vfsops.h"
+#include "lf_hfs_utils.h"
 
 // ************************** Function Definitions ***********************
 // number of bytes to checksum in a block_list_header
@@ -137,16 +139,40 @@
 #define JNL_READ     0x0002
 #define JNL_HEADER   0x8000
 
+// max # of adjacent blocks checkpointed with a single write
+#define JNL_CHECKPOINT_BATCH  64
+
 #define BLHDR_CHECKSUM_SIZE 32
 #define MAX_JOURNAL_SIZE 0x80000000U
 
-#define STARTING_BUCKETS 256
-typedef struct bucket {
+// journal replay
+#define JNL_REPLAY_READ_SIZE        (4*1024*1024)   // streaming read size while scanning the journal
+#define JNL_REPLAY_STAGE_SIZE       (8*1024*1024)   // journal data staged per round of fs block writes
+#define JNL_REPLAY_MAX_THREADS      4
+#define JNL_REPLAY_MIN_PER_THREAD   64              // segments per writer thread
+
+#define STARTING_EXTENTS 256
+typedef struct replay_extent {
     off_t     block_num;
-    uint32_t  jnl_offset;
+    off_t     jnl_offset;
     uint32_t  block_size;
-    int32_t   cksum;
-} bucket;
+    uint32_t  seq;          // journal order, the newest copy of a block wins
+    char     *data;         // staged journal data, while writing
+} replay_extent;
+
+typedef struct replay_window {
+    char     *data;
+    off_t     start;        // journal offset of data[0]
+    size_t    len;
+} replay_window;
+
+typedef struct replay_write_range_t {
+    journal        *jnl;
+    replay_extent **segs;
+    struct iovec   *iov;
+    int             count;
+    int             error;
+} replay_write_range_t;
 
 static int     replay_journal(journal *jnl);
 static void    free_old_stuff(journal *jnl);
@@ -169,6 +195,11 @@ static void   unlock_condition(journal *jnl, ConditionalFlag_S *psCondFlag);
 static int    write_journal_header(journal *jnl, int updating_start, uint32_t sequence_num);
 static size_t read_journal_data(journal *jnl, off_t *offset, void *data, size_t len);
 static size_t write_journal_data(journal *jnl, off_t *offset, void *data, size_t len);
+static size_t write_journal_datav(journal *jnl, off_t *offset, const struct iovec *iov, int iovcnt);
+static void   write_checkpoint_batch(transaction *tr, GenericLFBuf **bparray, int count);
+static void   start_group_commit(journal *jnl);
+static void   stop_group_commit(journal *jnl);
+static void   group_commit_add(journal *jnl, boolean_t commit_now);
         
 
 static __inline__ void lock_oldstart(journal *jnl) {
@@ -218,6 +249,18 @@ enum {
 
 unsigned int jnl_trim_flush_limit = JOURNAL_FLUSH_TRIM_EXTENTS;
 
+// Group commit. Transactions sealed into cur_tr are committed by the
+// group commit thread at most JOURNAL_GROUP_COMMIT_LATENCY_USEC after the
+// first of them was sealed. A full cur_tr is handed to the thread as well,
+// unless it has grown past JOURNAL_GROUP_COMMIT_MAX_BLHDRS block lists, in
+// which case the caller commits it.
+enum {
+    JOURNAL_GROUP_COMMIT_LATENCY_USEC = 100 * 1000,
+    JOURNAL_GROUP_COMMIT_MAX_BLHDRS   = 8
+};
+
+unsigned int jnl_group_commit_latency_usec = JOURNAL_GROUP_COMMIT_LATENCY_USEC;
+
 // tbuffer
 #define DEFAULT_TRANSACTION_BUFFER_SIZE  (128*1024)
 #define MAX_TRANSACTION_BUFFER_SIZE      (3072*1024)
@@ -486,6 +529,8 @@ journal *journal_open(struct vnode *jvp,
     lf_lck_mtx_init(&jnl->flock);
     lf_lck_rw_init(&jnl->trim_lock);
     
+    start_group_commit(jnl);
+    
     goto journal_open_complete;
     
 bad_journal:
@@ -638,6 +683,8 @@ journal *journal_create(struct vnode *jvp,
         goto bad_write;
     }
     
+    start_group_commit(jnl);
+    
     goto journal_create_complete;
     
     
@@ -698,6 +745,8 @@ bool is_journaled(UVFSFileNode *psRootNode) {
 
 // Media no longer available, clear all memory occupied by the journal
 void journal_release(journal *jnl) {
+    stop_group_commit(jnl);
+    
     if (jnl->owner != pthread_self()) {
         journal_lock(jnl);
     }
@@ -719,6 +768,7 @@ void journal_release(journal *jnl) {
     lf_lck_mtx_destroy(&jnl->old_start_lock);
     lf_lck_mtx_destroy(&jnl->jlock);
     lf_lck_mtx_destroy(&jnl->flock);
+    lf_cond_destroy(&jnl->group_commit_cond);
     hfs_free(jnl);
 }
 
@@ -734,6 +784,9 @@ void journal_close(journal *jnl) {
     //
     jnl->flags |= JOURNAL_CLOSE_PENDING;
     
+    // whatever is left in cur_tr is committed below
+    stop_group_commit(jnl);
+    
     if (jnl->owner != pthread_self()) {
         journal_lock(jnl);
     }
@@ -823,6 +876,7 @@ void journal_close(journal *jnl) {
     lf_lck_mtx_destroy(&jnl->old_start_lock);
     lf_lck_mtx_destroy(&jnl->jlock);
     lf_lck_mtx_destroy(&jnl->flock);
+    lf_cond_destroy(&jnl->group_commit_cond);
     hfs_free(jnl);
 }
 
@@ -1322,317 +1376,344 @@ int journal_flush(journal *jnl, journal_flush_options_t options) {
 
 
 // ************************** Local Functions ***********************
-static int update_fs_block(journal *jnl, void *block_ptr, off_t fs_block, size_t bsize) {
 
-    int            iRet    = 0;
-    GenericLFBuf *psGenBuf = NULL;
-    
-    // first read the block we want.
-    psGenBuf = lf_hfs_generic_buf_allocate(jnl->fsmount->psHfsmount->hfs_devvp,
-                                           fs_block,
-                                           (uint32_t)bsize,
-                                           GEN_BUF_PHY_BLOCK | GEN_BUF_NON_CACHED);
-    if (!psGenBuf) {
-        LFHFS_LOG(LEVEL_ERROR, "jnl: update_fs_block: error allocating fs block # %lld!\n", fs_block);
-        iRet = -1;
-        goto exit;
+// Reads journal data through a large window. The replay scan walks the
+// journal front to back, so the block list headers and the blocks whose
+// checksums we verify are almost always served from the window instead
+// of costing an i/o each.
+static size_t replay_read(journal *jnl, replay_window *win, off_t *offset, void *data, size_t len) {
+    uint64_t phyblksize = jnl->fsmount->psHfsmount->hfs_physical_block_size;
+    uint64_t actually_read = 0;
+    size_t   fill_len;
+
+    if (*offset == jnl->jhdr->size) {
+        *offset = jnl->jhdr->jhdr_size;
     }
-    
-    iRet = lf_hfs_generic_buf_read(psGenBuf);
-    if (iRet) {
-        LFHFS_LOG(LEVEL_ERROR, "jnl: update_fs_block: error reading fs block # %lld!\n", fs_block);
-        goto exit;
+
+    // the rare read that wraps around the end of the journal goes the slow way
+    if (*offset + (off_t)len > jnl->jhdr->size || len > JNL_REPLAY_READ_SIZE) {
+        return read_journal_data(jnl, offset, data, len);
     }
-    
-    // copy the journal data over top of it
-    memcpy(psGenBuf->pvData, block_ptr, bsize);
-    
-    iRet = lf_hfs_generic_buf_write(psGenBuf);
-    if (iRet) {
-        LFHFS_LOG(LEVEL_ERROR, "jnl: update_fs_block: failed to write block %lld (ret %d)\n", fs_block, iRet);
-        goto exit;
+
+    if (win->len == 0 || *offset < win->start || *offset + (off_t)len > win->start + (off_t)win->len) {
+        fill_len = (size_t)MIN((off_t)JNL_REPLAY_READ_SIZE, jnl->jhdr->size - *offset);
+
+        win->len = 0;
+        if (raw_readwrite_read_mount(jnl->jdev, jnl->jdev_blknum + (*offset)/phyblksize, phyblksize,
+                                     win->data, fill_len, &actually_read, NULL) != 0 || actually_read != fill_len) {
+            return 0;
+        }
+        win->start = *offset;
+        win->len   = fill_len;
     }
 
-exit:
-    if (psGenBuf) {
-       lf_hfs_generic_buf_release(psGenBuf);
+    memcpy(data, win->data + (*offset - win->start), len);
+    *offset += len;
+
+    return len;
+}
+
+static void replay_add_extent(replay_extent **extents, int *num_extents, int *max_extents, off_t block_num, size_t size, off_t offset) {
+    if (*num_extents == *max_extents) {
+        replay_extent *new_extents = hfs_malloc(2 * (*max_extents) * sizeof(replay_extent));
+
+        memcpy(new_extents, *extents, (*num_extents) * sizeof(replay_extent));
+        hfs_free(*extents);
+        *extents = new_extents;
+        *max_extents *= 2;
     }
-    
-    return iRet;
+
+    (*extents)[*num_extents].block_num  = block_num;
+    (*extents)[*num_extents].jnl_offset = offset;
+    (*extents)[*num_extents].block_size = (uint32_t)size;
+    (*extents)[*num_extents].seq        = (uint32_t)*num_extents;
+    (*extents)[*num_extents].data       = NULL;
+    (*num_extents)++;
 }
 
+static int replay_extent_block_cmp(const void *a, const void *b) {
+    const replay_extent *ea = (const replay_extent *)a;
+    const replay_extent *eb = (const replay_extent *)b;
 
-static int grow_table(struct bucket **buf_ptr, int num_buckets, int new_size) {
-    struct bucket *newBuf;
-    int current_size = num_buckets, i;
-    
-    // return if newsize is less than the current size
-    if (new_size < num_buckets) {
-        return current_size;
+    if (ea->block_num != eb->block_num) {
+        return (ea->block_num < eb->block_num) ? -1 : 1;
     }
-    
-    newBuf = hfs_malloc(new_size*sizeof(struct bucket));
-    
-    //  printf("jnl: lookup_bucket: expanded co_buf to %d elems\n", new_size);
-    
-    // copy existing elements
-    bcopy(*buf_ptr, newBuf, num_buckets*sizeof(struct bucket));
-    
-    // initialize the new ones
-    for(i = num_buckets; i < new_size; i++) {
-        newBuf[i].block_num = (off_t)-1;
+    return (ea->seq < eb->seq) ? -1 : (ea->seq > eb->seq);
+}
+
+static int replay_extent_journal_cmp(const void *a, const void *b) {
+    const replay_extent *ea = (const replay_extent *)a;
+    const replay_extent *eb = (const replay_extent *)b;
+
+    // extents were added in journal order, and the pieces of one extent
+    // sit in the journal in block order
+    if (ea->seq != eb->seq) {
+        return (ea->seq < eb->seq) ? -1 : 1;
     }
-    
-    // free the old container
-    hfs_free(*buf_ptr);
-    
-    // reset the buf_ptr
-    *buf_ptr = newBuf;
-    
-    return new_size;
+    return (ea->block_num < eb->block_num) ? -1 : (ea->block_num > eb->block_num);
 }
 
+static int replay_extent_ptr_block_cmp(const void *a, const void *b) {
+    return replay_extent_block_cmp(*(replay_extent * const *)a, *(replay_extent * const *)b);
+}
 
-static int insert_block(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr, int overwriting) {
-    
-    if (!overwriting) {
-        // grow the table if we're out of space - we may index the table
-        // with *num_full_ptr (lookup_bucket() can return a maximum value ==
-        // *num_full_ptr), so we need to grow when we hit (*num_buckets_ptr - 1)
-        // to prevent out-of-bounds indexing
-        if (*num_full_ptr >= (*num_buckets_ptr - 1)) {
-            int new_size = *num_buckets_ptr * 2;
-            int grow_size = grow_table(buf_ptr, *num_buckets_ptr, new_size);
-            
-            if (grow_size < new_size) {
-                LFHFS_LOG(LEVEL_ERROR, "jnl: add_block: grow_table returned an error!\n");
-                return -1;
-            }
-            
-            *num_buckets_ptr = grow_size; //update num_buckets to reflect the new size
+static int replay_off_cmp(const void *a, const void *b) {
+    off_t oa = *(const off_t *)a, ob = *(const off_t *)b;
+
+    return (oa < ob) ? -1 : (oa > ob);
+}
+
+// max-heap of extent indexes, ordered by seq
+static void replay_heap_push(replay_extent *extents, int *heap, int *heap_len, int index) {
+    int i = (*heap_len)++;
+
+    while (i > 0 && extents[heap[(i - 1) / 2]].seq < extents[index].seq) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = index;
+}
+
+static void replay_heap_pop(replay_extent *extents, int *heap, int *heap_len) {
+    int last = heap[--(*heap_len)];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < *heap_len) {
+        if (child + 1 < *heap_len && extents[heap[child + 1]].seq > extents[heap[child]].seq) {
+            child++;
         }
-        
-        // if we're not inserting at the end, we need to bcopy
-        if (blk_index != *num_full_ptr) {
-            bcopy( (*buf_ptr)+(blk_index), (*buf_ptr)+(blk_index+1), (*num_full_ptr-blk_index)*sizeof(struct bucket) );
+        if (extents[heap[child]].seq <= extents[last].seq) {
+            break;
         }
-        
-        (*num_full_ptr)++; // increment only if we're not overwriting
-    }
-    
-    // sanity check the values we're about to add
-    if ((off_t)offset >= jnl->jhdr->size) {
-        offset = jnl->jhdr->jhdr_size + (offset - jnl->jhdr->size);
-    }
-    if (size <= 0) {
-        panic("jnl: insert_block: bad size in insert_block (%zd)\n", size);
+        heap[i] = heap[child];
+        i = child;
     }
-    
-    (*buf_ptr)[blk_index].block_num = num;
-    (*buf_ptr)[blk_index].block_size = (uint32_t)size;
-    (*buf_ptr)[blk_index].jnl_offset = (uint32_t)offset;
-    (*buf_ptr)[blk_index].cksum = cksum;
-    
-    return blk_index;
+    heap[i] = last;
 }
 
-static int do_overlap(journal *jnl, struct bucket **buf_ptr, int blk_index, off_t block_num, size_t size, __unused size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr) {
-    
-    int     num_to_remove, index, i, overwrite, err;
-    size_t  jhdr_size = jnl->jhdr->jhdr_size, new_offset;
-    off_t   overlap, block_start, block_end;
-    
-    block_start = block_num*jhdr_size;
-    block_end = block_start + size;
-    overwrite = (block_num == (*buf_ptr)[blk_index].block_num && size >= (*buf_ptr)[blk_index].block_size);
-    
-    // first, eliminate any overlap with the previous entry
-    if (blk_index != 0 && !overwrite) {
-        off_t prev_block_start = (*buf_ptr)[blk_index-1].block_num*jhdr_size;
-        off_t prev_block_end = prev_block_start + (*buf_ptr)[blk_index-1].block_size;
-        overlap = prev_block_end - block_start;
-        if (overlap > 0) {
-            if (overlap % jhdr_size != 0) {
-                panic("jnl: do_overlap: overlap with previous entry not a multiple of %zd\n", jhdr_size);
-            }
-            
-            // if the previous entry completely overlaps this one, we need to break it into two pieces.
-            if (prev_block_end > block_end) {
-                off_t new_num = block_end / jhdr_size;
-                size_t new_size = prev_block_end - block_end;
-                
-                new_offset = (*buf_ptr)[blk_index-1].jnl_offset + (block_end - prev_block_start);
-                
-                err = insert_block(jnl, buf_ptr, blk_index, new_num, new_size, new_offset, cksum, num_buckets_ptr, num_full_ptr, 0);
-                if (err < 0) {
-                    panic("jnl: do_overlap: error inserting during pre-overlap\n");
-                }
-            }
-            
-            // Regardless, we need to truncate the previous entry to the beginning of the overlap
-            (*buf_ptr)[blk_index-1].block_size = (uint32_t)(block_start - prev_block_start);
-            (*buf_ptr)[blk_index-1].cksum = 0;   // have to blow it away because there's no way to check it
-        }
+// PR-3105942: Coalesce writes to the same block in journal replay
+// Every block found in the journal is logged as an extent, in journal order.
+// Once the whole journal has been scanned, the extents are sorted by fs block
+// and swept over every extent boundary with a heap of the extents that cover
+// the current position. The newest one (highest seq) owns the range, so the
+// result is a sorted list of non-overlapping segments, each pointing at the
+// most recent copy of its data in the journal. Partially overwritten blocks
+// simply become shorter segments.
+static replay_extent *replay_resolve_extents(journal *jnl, replay_extent *extents, int num_extents, int *num_segs_ptr) {
+    size_t         jhdr_size = jnl->jhdr->jhdr_size;
+    off_t         *bounds;
+    int           *heap;
+    replay_extent *segs;
+    int            num_bounds = 0, heap_len = 0, num_segs = 0, next = 0, i, k;
+
+    *num_segs_ptr = 0;
+    if (num_extents == 0) {
+        return NULL;
     }
-    
-    // then, bail out fast if there's no overlap with the entries that follow
-    if (!overwrite && block_end <= (off_t)((*buf_ptr)[blk_index].block_num*jhdr_size)) {
-        return 0; // no overlap, no overwrite
-    } else if (overwrite && (blk_index + 1 >= *num_full_ptr || block_end <= (off_t)((*buf_ptr)[blk_index+1].block_num*jhdr_size))) {
-        
-        (*buf_ptr)[blk_index].cksum = cksum;   // update this
-        return 1; // simple overwrite
+
+    qsort(extents, num_extents, sizeof(replay_extent), replay_extent_block_cmp);
+
+    bounds = hfs_malloc(2 * num_extents * sizeof(off_t));
+    heap   = hfs_malloc(num_extents * sizeof(int));
+    segs   = hfs_malloc(2 * num_extents * sizeof(replay_extent));
+
+    for (i = 0; i < num_extents; i++) {
+        bounds[num_bounds++] = extents[i].block_num * jhdr_size;
+        bounds[num_bounds++] = extents[i].block_num * jhdr_size + extents[i].block_size;
     }
-    
-    // Otherwise, find all cases of total and partial overlap. We use the special
-    // block_num of -2 to designate entries that are completely overlapped and must
-    // be eliminated. The block_num, size, and jnl_offset of partially overlapped
-    // entries must be adjusted to keep the array consistent.
-    index = blk_index;
-    num_to_remove = 0;
-    while (index < *num_full_ptr && block_end > (off_t)((*buf_ptr)[index].block_num*jhdr_size)) {
-        if (block_end >= (off_t)(((*buf_ptr)[index].block_num*jhdr_size + (*buf_ptr)[index].block_size))) {
-            (*buf_ptr)[index].block_num = -2; // mark this for deletion
-            num_to_remove++;
-        } else {
-            overlap = block_end - (*buf_ptr)[index].block_num*jhdr_size;
-            if (overlap > 0) {
-                if (overlap % jhdr_size != 0) {
-                    panic("jnl: do_overlap: overlap of %lld is not multiple of %zd\n", overlap, jhdr_size);
-                }
-                
-                // if we partially overlap this entry, adjust its block number, jnl offset, and size
-                (*buf_ptr)[index].block_num += (overlap / jhdr_size); // make sure overlap is multiple of jhdr_size, or round up
-                (*buf_ptr)[index].cksum = 0;
-                
-                new_offset = (*buf_ptr)[index].jnl_offset + overlap; // check for wrap-around
-                if ((off_t)new_offset >= jnl->jhdr->size) {
-                    new_offset = jhdr_size + (new_offset - jnl->jhdr->size);
-                }
-                (*buf_ptr)[index].jnl_offset = (uint32_t)new_offset;
-                
-                (*buf_ptr)[index].block_size -= overlap; // sanity check for negative value
-                if ((*buf_ptr)[index].block_size <= 0) {
-                    panic("jnl: do_overlap: after overlap, new block size is invalid (%u)\n", (*buf_ptr)[index].block_size);
-                    // return -1; // if above panic is removed, return -1 for error
-                }
-            }
-            
+    qsort(bounds, num_bounds, sizeof(off_t), replay_off_cmp);
+
+    for (i = 1, k = 1; i < num_bounds; i++) {
+        if (bounds[i] != bounds[k - 1]) {
+            bounds[k++] = bounds[i];
         }
-        
-        index++;
     }
-    
-    // bcopy over any completely overlapped entries, starting at the right (where the above loop broke out)
-    index--; // start with the last index used within the above loop
-    while (index >= blk_index) {
-        if ((*buf_ptr)[index].block_num == -2) {
-            if (index == *num_full_ptr-1) {
-                (*buf_ptr)[index].block_num = -1; // it's the last item in the table... just mark as free
-            } else {
-                bcopy( (*buf_ptr)+(index+1), (*buf_ptr)+(index), (*num_full_ptr - (index + 1)) * sizeof(struct bucket) );
-            }
-            (*num_full_ptr)--;
+    num_bounds = k;
+
+    for (k = 0; k < num_bounds - 1; k++) {
+        off_t pos = bounds[k];
+        off_t len = bounds[k + 1] - pos;
+        off_t owner_start, jnl_offset;
+        replay_extent *owner;
+
+        while (next < num_extents && extents[next].block_num * (off_t)jhdr_size <= pos) {
+            replay_heap_push(extents, heap, &heap_len, next++);
         }
-        index--;
-    }
-    
-    // eliminate any stale entries at the end of the table
-    for(i = *num_full_ptr; i < (*num_full_ptr + num_to_remove); i++) {
-        (*buf_ptr)[i].block_num = -1;
+        // drop the extents that ended before this range
+        while (heap_len > 0 && extents[heap[0]].block_num * (off_t)jhdr_size + extents[heap[0]].block_size <= pos) {
+            replay_heap_pop(extents, heap, &heap_len);
+        }
+        if (heap_len == 0) {
+            continue;
+        }
+
+        owner = &extents[heap[0]];
+        owner_start = owner->block_num * jhdr_size;
+
+        if ((pos - owner_start) % jhdr_size != 0) {
+            panic("jnl: replay_resolve_extents: overlap of %lld is not multiple of %zd\n", pos - owner_start, jhdr_size);
+        }
+
+        // extend the previous segment if it came from the same extent
+        if (num_segs > 0 && segs[num_segs - 1].seq == owner->seq
+            && segs[num_segs - 1].block_num * (off_t)jhdr_size + segs[num_segs - 1].block_size == pos) {
+            segs[num_segs - 1].block_size += (uint32_t)len;
+            continue;
+        }
+
+        jnl_offset = owner->jnl_offset + (pos - owner_start); // check for wrap-around
+        if (jnl_offset >= jnl->jhdr->size) {
+            jnl_offset = jhdr_size + (jnl_offset - jnl->jhdr->size);
+        }
+
+        segs[num_segs].block_num  = pos / jhdr_size;
+        segs[num_segs].jnl_offset = jnl_offset;
+        segs[num_segs].block_size = (uint32_t)len;
+        segs[num_segs].seq        = owner->seq;
+        segs[num_segs].data       = NULL;
+        num_segs++;
     }
-    
-    return 0; // if we got this far, we need to insert the entry into the table (rather than overwrite)
+
+    hfs_free(heap);
+    hfs_free(bounds);
+
+    *num_segs_ptr = num_segs;
+    return segs;
 }
 
+// Writes a block sorted range of staged segments, coalescing the ones
+// that are adjacent on disk into a single pwritev.
+static void replay_write_range(replay_write_range_t *range) {
+    journal       *jnl        = range->jnl;
+    struct vnode  *devvp      = jnl->fsmount->psHfsmount->hfs_devvp;
+    uint64_t       phyblksize = jnl->fsmount->psHfsmount->hfs_physical_block_size;
+    size_t         jhdr_size  = jnl->jhdr->jhdr_size;
+    int            i = 0;
+
+    while (i < range->count) {
+        replay_extent *first = range->segs[i];
+        off_t          next_start;
+        int            iovcnt = 0;
+        errno_t        err;
+
+        do {
+            range->iov[iovcnt].iov_base = range->segs[i]->data;
+            range->iov[iovcnt].iov_len  = range->segs[i]->block_size;
+            next_start = range->segs[i]->block_num * jhdr_size + range->segs[i]->block_size;
+            iovcnt++;
+            i++;
+        } while (i < range->count && range->segs[i]->block_num * (off_t)jhdr_size == next_start);
 
-static int lookup_bucket(struct bucket **buf_ptr, off_t block_num, int num_full) {
-    int lo, hi, index, matches, i;
-    
-    if (num_full == 0) {
-        return 0; // table is empty, so insert at index=0
+        err = raw_readwrite_writev_mount(devvp, first->block_num, phyblksize, range->iov, iovcnt, NULL, NULL);
+        if (err) {
+            LFHFS_LOG(LEVEL_ERROR, "jnl: replay_write_range: failed to write %d blocks @ %lld (ret %d)\n", iovcnt, first->block_num, err);
+            range->error = err;
+            return;
+        }
     }
-    
-    lo = 0;
-    hi = num_full - 1;
-    index = -1;
-    
-    // perform binary search for block_num
-    do {
-        int mid = (hi - lo)/2 + lo;
-        off_t this_num = (*buf_ptr)[mid].block_num;
-        
-        if (block_num == this_num) {
-            index = mid;
-            break;
+}
+
+static void *replay_write_thread(void *arg) {
+    replay_write_range((replay_write_range_t *)arg);
+    return NULL;
+}
+
+// Stages the journal data of a group of segments (they are in journal order,
+// so the reads stream through the window), then writes the group sorted by
+// fs block, split across up to JNL_REPLAY_MAX_THREADS writers.
+static int replay_write_group(journal *jnl, replay_window *win, replay_extent *segs, int count, char *stage, replay_extent **sorted, struct iovec *iov) {
+    replay_write_range_t ranges[JNL_REPLAY_MAX_THREADS];
+    pthread_t            threads[JNL_REPLAY_MAX_THREADS];
+    bool                 started[JNL_REPLAY_MAX_THREADS] = {false};
+    int                  num_threads, per_thread, i, error = 0;
+    size_t               staged = 0;
+
+    for (i = 0; i < count; i++) {
+        off_t jnl_offset = segs[i].jnl_offset;
+
+        segs[i].data = stage + staged;
+        if (replay_read(jnl, win, &jnl_offset, segs[i].data, segs[i].block_size) != segs[i].block_size) {
+            LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: Could not read journal entry data @ offset 0x%llx!\n", segs[i].jnl_offset);
+            return EIO;
         }
-        
-        if (block_num < this_num) {
-            hi = mid;
-            continue;
+        staged += segs[i].block_size;
+        sorted[i] = &segs[i];
+    }
+
+    qsort(sorted, count, sizeof(replay_extent *), replay_extent_ptr_block_cmp);
+
+    num_threads = MIN(JNL_REPLAY_MAX_THREADS, (count + JNL_REPLAY_MIN_PER_THREAD - 1) / JNL_REPLAY_MIN_PER_THREAD);
+    per_thread  = (count + num_threads - 1) / num_threads;
+
+    for (i = 0; i < num_threads; i++) {
+        int first = MIN(i * per_thread, count);
+
+        ranges[i].jnl   = jnl;
+        ranges[i].segs  = &sorted[first];
+        ranges[i].iov   = &iov[first];
+        ranges[i].count = MIN(per_thread, count - first);
+        ranges[i].error = 0;
+
+        // The first range runs on the calling thread
+        if (i > 0 && pthread_create(&threads[i], NULL, replay_write_thread, &ranges[i]) == 0) {
+            started[i] = true;
         }
-        
-        if (block_num > this_num) {
-            lo = mid + 1;
-            continue;
+    }
+
+    replay_write_range(&ranges[0]);
+    for (i = 1; i < num_threads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            replay_write_range(&ranges[i]);
         }
-    } while (lo < hi);
-    
-    // check if lo and hi converged on the match
-    if (block_num == (*buf_ptr)[hi].block_num) {
-        index = hi;
     }
-    
-    // if no existing entry found, find index for new one
-    if (index == -1) {
-        index = (block_num < (*buf_ptr)[hi].block_num) ? hi : hi + 1;
-    } else {
-        // make sure that we return the right-most index in the case of multiple matches
-        matches = 0;
-        i = index + 1;
-        while (i < num_full && block_num == (*buf_ptr)[i].block_num) {
-            matches++;
-            i++;
+
+    for (i = 0; i < num_threads; i++) {
+        if (ranges[i].error) {
+            error = ranges[i].error;
         }
-        
-        index += matches;
     }
-    
-    return index;
+
+    return error;
 }
 
-// PR-3105942: Coalesce writes to the same block in journal replay
-// We coalesce writes by maintaining a dynamic sorted array of physical disk blocks
-// to be replayed and the corresponding location in the journal which contains
-// the most recent data for those blocks. The array is "played" once the all the
-// blocks in the journal have been coalesced. The code for the case of conflicting/
-// overlapping writes to a single block is the most dense. Because coalescing can
-// disrupt the existing time-ordering of blocks in the journal playback, care
-// is taken to catch any overlaps and keep the array consistent.
-static int add_block(journal *jnl, struct bucket **buf_ptr, off_t block_num, size_t size, size_t offset, int32_t cksum, int *num_buckets_ptr, int *num_full_ptr) {
-    int    blk_index, overwriting;
-    
-    // on return from lookup_bucket(), blk_index is the index into the table where block_num should be
-    // inserted (or the index of the elem to overwrite).
-    blk_index = lookup_bucket( buf_ptr, block_num, *num_full_ptr);
-    
-    // check if the index is within bounds (if we're adding this block to the end of
-    // the table, blk_index will be equal to num_full)
-    if (blk_index < 0 || blk_index > *num_full_ptr) {
-        //printf("jnl: add_block: trouble adding block to co_buf\n");
-        return -1;
-    } // else printf("jnl: add_block: adding block 0x%llx at i=%d\n", block_num, blk_index);
-    
-    // Determine whether we're overwriting an existing entry by checking for overlap
-    overwriting = do_overlap(jnl, buf_ptr, blk_index, block_num, size, offset, cksum, num_buckets_ptr, num_full_ptr);
-    if (overwriting < 0) {
-        return -1; // if we got an error, pass it along
+static int replay_write_segments(journal *jnl, replay_window *win, replay_extent *segs, int num_segs) {
+    size_t          stage_size = JNL_REPLAY_STAGE_SIZE;
+    char           *stage;
+    replay_extent **sorted;
+    struct iovec   *iov;
+    int             first = 0, i, error = 0;
+
+    for (i = 0; i < num_segs; i++) {
+        if (segs[i].block_size > stage_size) {
+            stage_size = segs[i].block_size;
+        }
     }
-    
-    // returns the index, or -1 on error
-    blk_index = insert_block(jnl, buf_ptr, blk_index, block_num, size, offset, cksum, num_buckets_ptr, num_full_ptr, overwriting);
-    
-    return blk_index;
+
+    // read the journal data front to back
+    qsort(segs, num_segs, sizeof(replay_extent), replay_extent_journal_cmp);
+
+    stage  = hfs_malloc(stage_size);
+    sorted = hfs_malloc(num_segs * sizeof(replay_extent *));
+    iov    = hfs_malloc(num_segs * sizeof(struct iovec));
+
+    while (first < num_segs && error == 0) {
+        size_t staged = 0;
+
+        for (i = first; i < num_segs && staged + segs[i].block_size <= stage_size; i++) {
+            staged += segs[i].block_size;
+        }
+
+        error = replay_write_group(jnl, win, &segs[first], i - first, stage, sorted, iov);
+        first = i;
+    }
+
+    hfs_free(iov);
+    hfs_free(sorted);
+    hfs_free(stage);
+
+    return error;
 }
 
 static void swap_block_list_header(journal *jnl, block_list_header *blhdr) {
@@ -1664,8 +1745,9 @@ static int replay_journal(journal *jnl) {
     block_list_header *blhdr;
     off_t          offset, txn_start_offset=0, blhdr_offset, orig_jnl_start;
     char          *buff, *block_ptr=NULL;
-    struct bucket *co_buf;
-    int           num_buckets = STARTING_BUCKETS, num_full, check_past_jnl_end = 1, in_uncharted_territory = 0;
+    replay_extent *extents, *segs = NULL;
+    replay_window  win = {0};
+    int           max_extents = STARTING_EXTENTS, num_extents, num_segs, check_past_jnl_end = 1, in_uncharted_territory = 0;
     uint32_t      last_sequence_num = 0;
     int           replay_retry_count = 0;
     
@@ -1690,21 +1772,18 @@ static int replay_journal(journal *jnl) {
     // allocate memory for the header_block.  we'll read each blhdr into this
     buff = hfs_malloc(jnl->jhdr->blhdr_size);
     
-    // allocate memory for the coalesce buffer
-    co_buf = hfs_malloc(num_buckets*sizeof(struct bucket));
+    // allocate memory for the extent log and the read window
+    extents = hfs_malloc(max_extents*sizeof(replay_extent));
+    win.data = hfs_malloc(JNL_REPLAY_READ_SIZE);
     
 restart_replay:
     
-    // initialize entries
-    for(i = 0; i < num_buckets; i++) {
-        co_buf[i].block_num = -1;
-    }
-    num_full = 0; // empty at first
+    num_extents = 0; // empty at first
     
     
     while (check_past_jnl_end || jnl->jhdr->start != jnl->jhdr->end) {
         offset = blhdr_offset = jnl->jhdr->start;
-        ret = read_journal_data(jnl, &offset, buff, jnl->jhdr->blhdr_size);
+        ret = replay_read(jnl, &win, &offset, buff, jnl->jhdr->blhdr_size);
         if (ret != (size_t)jnl->jhdr->blhdr_size) {
             LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: Could not read block list header block @ 0x%llx!\n", offset);
             goto bad_txn_handling;
@@ -1817,11 +1896,11 @@ restart_replay:
             txn_start_offset = blhdr_offset;
         }
         
-        //printf("jnl: replay_journal: adding %d blocks in journal entry @ 0x%llx to co_buf\n",
+        //printf("jnl: replay_journal: adding %d blocks in journal entry @ 0x%llx to the extent log\n",
         //       blhdr->num_blocks-1, jnl->jhdr->start);
         bad_blocks = 0;
         for (i = 1; i < blhdr->num_blocks; i++) {
-            int size, ret_val;
+            int size;
             off_t number;
             
             size = blhdr->binfo[i].u.bi.bsize;
@@ -1839,7 +1918,7 @@ restart_replay:
                     block_offset = offset;
                     
                     // read the block so we can check the checksum
-                    ret = read_journal_data(jnl, &block_offset, block_ptr, size);
+                    ret = replay_read(jnl, &win, &block_offset, block_ptr, size);
                     if (ret != (size_t)size) {
                         LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: Could not read journal entry data @ offset 0x%llx!\n", offset);
                         goto bad_txn_handling;
@@ -1861,14 +1940,13 @@ restart_replay:
                 }
                 
                 
-                // add this bucket to co_buf, coalescing where possible
+                // log this block, overlaps get resolved once the whole journal was scanned
                 // printf("jnl: replay_journal: adding block 0x%llx\n", number);
-                ret_val = add_block(jnl, &co_buf, number, size, (size_t) offset, blhdr->binfo[i].u.bi.b.cksum, &num_buckets, &num_full);
-                
-                if (ret_val == -1) {
-                    LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: trouble adding block to co_buf\n");
-                    goto bad_replay;
-                } // else printf("jnl: replay_journal: added block 0x%llx at i=%d\n", number);
+                if (size <= 0) {
+                    LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: bad size %d for block 0x%llx\n", size, number);
+                    goto bad_txn_handling;
+                }
+                replay_add_extent(&extents, &num_extents, &max_extents, number, size, offset);
             }
             
             // increment offset
@@ -1933,54 +2011,13 @@ restart_replay:
         jnl->jhdr->end = jnl->jhdr->start;
     }
     
-    //printf("jnl: replay_journal: replaying %d blocks\n", num_full);
-    
-    /*
-     * make sure it's at least one page in size, so
-     * start max_bsize at PAGE_SIZE
-     */
-    for (i = 0, max_bsize = PAGE_SIZE; i < num_full; i++) {
-        
-        if (co_buf[i].block_num == (off_t)-1)
-            continue;
-        
-        if (co_buf[i].block_size > max_bsize)
-            max_bsize = co_buf[i].block_size;
-    }
-    /*
-     * round max_bsize up to the nearest PAGE_SIZE multiple
-     */
-    if (max_bsize & (PAGE_SIZE - 1)) {
-        max_bsize = (max_bsize + PAGE_SIZE) & ~(PAGE_SIZE - 1);
-    }
+    // coalesce the logged blocks, keeping the most recent copy of each
+    segs = replay_resolve_extents(jnl, extents, num_extents, &num_segs);
     
-    block_ptr = hfs_malloc(max_bsize);
+    //printf("jnl: replay_journal: replaying %d segments (%d blocks)\n", num_segs, num_extents);
     
-    // Replay the coalesced entries in the co-buf
-    for(i = 0; i < num_full; i++) {
-        size_t size = co_buf[i].block_size;
-        off_t jnl_offset = (off_t) co_buf[i].jnl_offset;
-        off_t number = co_buf[i].block_num;
-        
-        
-        // printf("replaying co_buf[%d]: block 0x%llx, size 0x%x, jnl_offset 0x%llx\n", i, co_buf[i].block_num,
-        //      co_buf[i].block_size, co_buf[i].jnl_offset);
-        
-        if (number == (off_t)-1) {
-            // printf("jnl: replay_journal: skipping killed fs block\n");
-        } else {
-            
-            // do journal read, and set the phys. block
-            ret = read_journal_data(jnl, &jnl_offset, block_ptr, size);
-            if (ret != size) {
-                LFHFS_LOG(LEVEL_ERROR, "jnl: replay_journal: Could not read journal entry data @ offset 0x%llx!\n", jnl_offset);
-                goto bad_replay;
-            }
-            
-            if (update_fs_block(jnl, block_ptr, number, size) != 0) {
-                goto bad_replay;
-            }
-        }
+    if (num_segs > 0 && replay_write_segments(jnl, &win, segs, num_segs) != 0) {
+        goto bad_replay;
     }
     
     
@@ -1989,15 +2026,10 @@ restart_replay:
         goto bad_replay;
     }
     
-    // free block_ptr
-    if (block_ptr) {
-        hfs_free(block_ptr);
-        block_ptr = NULL;
-    }
-    
-    // free the coalesce buffer
-    hfs_free(co_buf);
-    co_buf = NULL;
+    // free the extent log and the read window
+    hfs_free(segs);
+    hfs_free(extents);
+    hfs_free(win.data);
     
     hfs_free(buff);
     
@@ -2007,7 +2039,9 @@ success:
     
 bad_replay:
     hfs_free(block_ptr);
-    hfs_free(co_buf);
+    hfs_free(segs);
+    hfs_free(extents);
+    hfs_free(win.data);
     hfs_free(buff);
     
     LFHFS_LOG(LEVEL_ERROR, "replay_journal: error.\n");
@@ -2190,6 +2224,56 @@ static size_t write_journal_data(journal *jnl, off_t *offset, void *data, size_t
     return do_journal_io(jnl, offset, data, len, JNL_WRITE);
 }
 
+// Write a list of buffers to consecutive journal locations, with as few
+// device writes as the journal wrap-around and max_write_size allow.
+static size_t write_journal_datav(journal *jnl, off_t *offset, const struct iovec *iov, int iovcnt) {
+    struct iovec  batch[JNL_CHECKPOINT_BATCH];
+    uint64_t      phyblksize = jnl->fsmount->psHfsmount->hfs_physical_block_size;
+    size_t        consumed   = 0;     // bytes of iov[0] already written
+    size_t        io_sz      = 0;
+    
+    if (*offset < 0 || *offset > jnl->jhdr->size) {
+        panic("jnl: write_journal_datav: bad offset 0x%llx (max 0x%llx)\n", *offset, jnl->jhdr->size);
+    }
+    
+    while (iovcnt > 0) {
+        if (*offset >= jnl->jhdr->size) {
+            *offset = jnl->jhdr->jhdr_size;
+        }
+        
+        off_t  room = MIN(jnl->jhdr->size - *offset, jnl->max_write_size);
+        size_t len  = 0;
+        int    cnt  = 0;
+        
+        while (iovcnt > 0 && cnt < JNL_CHECKPOINT_BATCH && (off_t)len < room) {
+            size_t chunk = MIN(iov->iov_len - consumed, (size_t)(room - len));
+            
+            batch[cnt].iov_base = (char *)iov->iov_base + consumed;
+            batch[cnt].iov_len  = chunk;
+            cnt++;
+            len      += chunk;
+            consumed += chunk;
+            
+            if (consumed == iov->iov_len) {
+                iov++;
+                iovcnt--;
+                consumed = 0;
+            }
+        }
+        
+        uint64_t written = 0;
+        errno_t  err     = raw_readwrite_writev_mount(jnl->jdev, jnl->jdev_blknum + (*offset)/phyblksize, phyblksize,
+                                                      batch, cnt, &written, &jnl->stats.ios);
+        *offset += written;
+        io_sz   += written;
+        if (err) {
+            break;
+        }
+    }
+    
+    return io_sz;
+}
+
 static size_t read_journal_data(journal *jnl, off_t *offset, void *data, size_t len) {
     return do_journal_io(jnl, offset, data, len, JNL_READ);
 }
@@ -2355,18 +2439,49 @@ static int journal_binfo_cmp(const void *a, const void *b) {
         return -1;
     }
     
-    // don't have to worry about negative block
-    // numbers so this is ok to do.
-    GenericLFBuf *psGenBufA, *psGenBufB;
-    psGenBufA = (void*)bi_a->u.bp;
-    psGenBufB = (void*)bi_b->u.bp;
-    res = psGenBufA->uBlockN - psGenBufB->uBlockN;
+    // bnum holds the physical block number by now, sorting
+    // on it lets adjacent blocks go out as a single write.
+    res = bi_a->bnum - bi_b->bnum;
     
-    return (int)res;
+    return (res < 0) ? -1 : ((res > 0) ? 1 : 0);
 }
 
 // finish_end_transaction:
 
+// Write a run of blocks that are adjacent on the device to their home
+// location with a single write, then complete them as buffer_written.
+static void write_checkpoint_batch(transaction *tr, GenericLFBuf **bparray, int count) {
+    journal      *jnl = tr->jnl;
+    struct iovec  iov[JNL_CHECKPOINT_BATCH];
+    errno_t       ret_val;
+    int           i;
+    
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = bparray[i]->pvData;
+        iov[i].iov_len  = bparray[i]->uDataSize;
+    }
+    
+    ret_val = raw_readwrite_writev_mount(bparray[0]->psVnode, bparray[0]->uPhyCluster,
+                                         jnl->fsmount->psHfsmount->hfs_physical_block_size,
+                                         iov, count, NULL, &jnl->stats.ios);
+    jnl->stats.unbatched_ios += count;
+    
+    #if HFS_CRASH_TEST
+        CRASH_ABORT(CRASH_ABORT_JOURNAL_IN_BLOCK_DATA, jnl->fsmount->psHfsmount, NULL);
+    #endif
+    
+    if (ret_val) {
+        LFHFS_LOG(LEVEL_ERROR, "jnl: raw_readwrite_writev_mount inside finish_end_transaction returned %d.\n", ret_val);
+    }
+    
+    for (i = 0; i < count; i++) {
+        buffer_written(tr, bparray[i]);
+        
+        lf_hfs_generic_buf_unlock(bparray[i]);
+        lf_hfs_generic_buf_release(bparray[i]);
+    }
+}
+
 static int finish_end_transaction(transaction *tr, errno_t (*callback)(void*), void *callback_arg) {
     int                i;
     size_t             amt;
@@ -2374,14 +2489,31 @@ static int finish_end_transaction(transaction *tr, errno_t (*callback)(void*), v
     off_t              end;
     journal           *jnl = tr->jnl;
     GenericLFBuf       *bp = NULL, **bparray = NULL;
+    GenericLFBuf      ***bparrays = NULL;
+    GenericLFBuf       *batch[JNL_CHECKPOINT_BATCH];
+    int                batch_cnt = 0;
+    off_t              batch_end = 0;
     block_list_header *blhdr=NULL, *next=NULL;
+    struct iovec      *iov = NULL;
+    int                num_blhdrs = 0, blhdr_idx;
     size_t             tbuffer_offset;
     int                bufs_written = 0;
     int                ret_val = 0;
+    uint64_t           phyblksize = jnl->fsmount->psHfsmount->hfs_physical_block_size;
     
     end  = jnl->jhdr->end;
+    amt  = 0;
     
     for (blhdr = tr->blhdr; blhdr; blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum)) {
+        num_blhdrs++;
+    }
+    
+    // each block list header is followed by its blocks, both in memory and
+    // in the journal, so the whole transaction goes out as one vectored write
+    iov      = hfs_malloc(num_blhdrs * sizeof(struct iovec));
+    bparrays = hfs_mallocz(num_blhdrs * sizeof(GenericLFBuf **));
+    
+    for (blhdr = tr->blhdr, blhdr_idx = 0; blhdr; blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum), blhdr_idx++) {
         
         blhdr->binfo[0].u.bi.b.sequence_num = tr->sequence_num;
         
@@ -2389,6 +2521,7 @@ static int finish_end_transaction(transaction *tr, errno_t (*callback)(void*), v
         blhdr->checksum = calc_checksum((char *)blhdr, BLHDR_CHECKSUM_SIZE);
         
         bparray = hfs_malloc(blhdr->num_blocks * sizeof(buf_t));
+        bparrays[blhdr_idx] = bparray;
         tbuffer_offset = jnl->jhdr->blhdr_size;
         size_t total_block_size = 0;
         
@@ -2421,58 +2554,56 @@ static int finish_end_transaction(transaction *tr, errno_t (*callback)(void*), v
             total_block_size += bsize;
         }
 
-        /*
-         * if we fired off the journal_write_header asynchronously in
-         * 'end_transaction', we need to wait for its completion
-         * before writing the actual journal data
-         */
-        wait_condition(jnl, &jnl->writing_header, "finish_end_transaction");
-        
-        size_t used_blhdr_size_in_bytes = sizeof(blhdr) + (blhdr->num_blocks-1) * sizeof(blhdr->binfo); // blhdr includes binfo[0]
-        size_t phy_blk_size = jnl->fsmount->psHfsmount->hfs_physical_block_size;
-        size_t blhdr_write_size = ((used_blhdr_size_in_bytes+phy_blk_size-1)/phy_blk_size) * phy_blk_size; // Ceiling to block boundary
+        // the unused part of the block list header was filled when it was allocated
+        iov[blhdr_idx].iov_base = blhdr;
+        iov[blhdr_idx].iov_len  = jnl->jhdr->blhdr_size + total_block_size;
+        amt += iov[blhdr_idx].iov_len;
         
-        if (blhdr_write_size > jnl->jhdr->blhdr_size) {
-            panic("blhdr_write_size should never be larger than jnl->jhdr->blhdr_size)");
-        }
-
-        if (jnl->write_header_failed == FALSE) {
-            ret  = write_journal_data(jnl, &end, blhdr, blhdr_write_size);
+        // without batching: the used part of the header and the blocks
+        jnl->stats.unbatched_ios += 2;
+    }
 
-            // Skip uninitialized (no need to write)
-            end += jnl->jhdr->blhdr_size - blhdr_write_size;
-            if (end >= jnl->jhdr->size) {
-                end -= (jnl->jhdr->size - jnl->jhdr->jhdr_size); // Wrap around to the begining of the buffer
-            }
-            ret += write_journal_data(jnl, &end, (void*)blhdr + jnl->jhdr->blhdr_size, total_block_size);
-        } else {
-            ret_val = -1;
-        }
+    /*
+     * if we fired off the journal_write_header asynchronously in
+     * 'end_transaction', we need to wait for its completion
+     * before writing the actual journal data
+     */
+    wait_condition(jnl, &jnl->writing_header, "finish_end_transaction");
+    
+    if (jnl->write_header_failed == FALSE) {
+        ret = write_journal_datav(jnl, &end, iov, num_blhdrs);
+        jnl->stats.commits++;
+    } else {
+        ret_val = -1;
+    }
 
-        #if HFS_CRASH_TEST
-            CRASH_ABORT(CRASH_ABORT_JOURNAL_AFTER_JOURNAL_DATA, jnl->fsmount->psHfsmount, NULL);
-        #endif
+    #if HFS_CRASH_TEST
+        CRASH_ABORT(CRASH_ABORT_JOURNAL_AFTER_JOURNAL_DATA, jnl->fsmount->psHfsmount, NULL);
+    #endif
 
-        /*
-         * put the bp pointers back so that we can
-         * make the final pass on them
-         */
+    /*
+     * put the bp pointers back so that we can
+     * make the final pass on them
+     */
+    for (blhdr = tr->blhdr, blhdr_idx = 0; blhdr; blhdr = (block_list_header *)((long)blhdr->binfo[0].bnum), blhdr_idx++) {
+        bparray = bparrays[blhdr_idx];
         for (i = 1; i < blhdr->num_blocks; i++)
             blhdr->binfo[i].u.bp = (void*)bparray[i];
         
         hfs_free(bparray);
+    }
+    hfs_free(bparrays);
+    hfs_free(iov);
+    
+    if (ret_val == -1)
+        goto bad_journal;
+    
+    if (ret != amt) {
+        LFHFS_LOG(LEVEL_ERROR, "jnl: end_transaction: only wrote %zu of %zu bytes to the journal!\n",
+               ret, amt);
         
-        if (ret_val == -1)
-            goto bad_journal;
-        
-        amt = blhdr_write_size + total_block_size;
-        if (ret != amt) {
-            LFHFS_LOG(LEVEL_ERROR, "jnl: end_transaction: only wrote %zu of %zu bytes to the journal!\n",
-                   ret, amt);
-            
-            ret_val = -1;
-            goto bad_journal;
-        }
+        ret_val = -1;
+        goto bad_journal;
     }
     jnl->jhdr->end  = end;    // update where the journal now ends
     tr->journal_end = end;    // the transaction ends here too
@@ -2546,32 +2677,34 @@ static int finish_end_transaction(transaction *tr, errno_t (*callback)(void*), v
             
             if ((bp = (void*)blhdr->binfo[i].u.bp)) {
 
-                errno_t ret_val = 0;
-
                 #if JOURNAL_DEBUG
                     printf("journal write physical: bp %p, psVnode %p, uBlockN %llu, uPhyCluster %llu uLockCnt %u\n",
                            bp, bp->psVnode, bp->uBlockN, bp->uPhyCluster, bp->uLockCnt);
                 #endif
                 
                 lf_hfs_generic_buf_clear_cache_flag(bp, GEN_BUF_WRITE_LOCK);
-                ret_val = lf_hfs_generic_buf_write(bp);
-
-                #if HFS_CRASH_TEST
-                    CRASH_ABORT(CRASH_ABORT_JOURNAL_IN_BLOCK_DATA, jnl->fsmount->psHfsmount, NULL);
-                #endif
-
-                if (ret_val) {
-                    LFHFS_LOG(LEVEL_ERROR, "jnl: raw_readwrite_write_mount inside finish_end_transaction returned %d.\n", ret_val);
+                
+                // blocks are sorted, so only the previous one can be adjacent
+                if (batch_cnt && (batch_cnt == JNL_CHECKPOINT_BATCH || (off_t)(bp->uPhyCluster * phyblksize) != batch_end)) {
+                    write_checkpoint_batch(tr, batch, batch_cnt);
+                    batch_cnt = 0;
                 }
-
-                buffer_written(tr, bp);
                 
-                lf_hfs_generic_buf_unlock(bp);
-                lf_hfs_generic_buf_release(bp);
+                batch[batch_cnt++] = bp;
+                batch_end = (off_t)(bp->uPhyCluster * phyblksize) + bp->uDataSize;
                 
                 bufs_written++;
             }
         }
+        
+        /*
+         * don't carry a batch over to the next blhdr, once its
+         * last block is written blhdr may be gone
+         */
+        if (batch_cnt) {
+            write_checkpoint_batch(tr, batch, batch_cnt);
+            batch_cnt = 0;
+        }
     }
     #if HFS_CRASH_TEST
         CRASH_ABORT(CRASH_ABORT_JOURNAL_AFTER_BLOCK_DATA, jnl->fsmount->psHfsmount, NULL);
@@ -2886,9 +3019,29 @@ static int end_transaction(transaction *tr, int force_it, errno_t (*callback)(vo
         && (!(jnl->flags & JOURNAL_USE_UNMAP) || (tr->trim.extent_count < jnl_trim_flush_limit))) {
 
         jnl->cur_tr = tr;
+        group_commit_add(jnl, FALSE);
+        goto done;
+    }
+    
+    // the transaction buffer is full.  if there is a group commit
+    // thread, let it do the commit so that the caller doesn't have
+    // to wait for the journal i/o.  the next transactions keep adding
+    // to cur_tr until the thread gets to it, so once cur_tr has grown
+    // too big the caller commits it as before.
+    if (   force_it == 0
+        && (jnl->group_commit_flags & JOURNAL_GC_RUNNING)
+        && tr->num_blhdrs < JOURNAL_GROUP_COMMIT_MAX_BLHDRS
+        && tr->total_bytes <= (jnl->jhdr->size - jnl->jhdr->jhdr_size) / 4) {
+        
+        jnl->cur_tr = tr;
+        group_commit_add(jnl, TRUE);
         goto done;
     }
     
+    // cur_tr is being committed now
+    jnl->group_commit_count  = 0;
+    jnl->group_commit_flags &= ~JOURNAL_GC_COMMIT_NOW;
+    
     lock_condition(jnl, &jnl->flushing, "end_transaction");
     
     /*
@@ -3036,6 +3189,135 @@ done:
     return (ret_val);
 }
 
+static uint64_t group_commit_uptime_usec(void) {
+    struct timeval tv;
+    
+    microuptime(&tv);
+    return ((uint64_t)tv.tv_sec * 1000000ULL + tv.tv_usec);
+}
+
+// Called with the journal lock held after a transaction was sealed into cur_tr.
+static void group_commit_add(journal *jnl, boolean_t commit_now) {
+    
+    if (!(jnl->group_commit_flags & JOURNAL_GC_RUNNING))
+        return;
+    
+    if (jnl->group_commit_count++ == 0) {
+        jnl->group_commit_start = group_commit_uptime_usec();
+        lf_cond_wakeup(&jnl->group_commit_cond);
+    }
+    
+    if (commit_now && !(jnl->group_commit_flags & JOURNAL_GC_COMMIT_NOW)) {
+        jnl->group_commit_flags |= JOURNAL_GC_COMMIT_NOW;
+        lf_cond_wakeup(&jnl->group_commit_cond);
+    }
+}
+
+// Sleep on group_commit_cond, giving up the journal lock meanwhile.
+// A zero timeout waits until woken up.
+static void group_commit_wait(journal *jnl, uint64_t timeout_usec) {
+    
+    jnl->owner = NULL;
+    
+    if (timeout_usec) {
+        struct timespec sWaitTime = {
+            .tv_sec  = (time_t)(timeout_usec / 1000000ULL),
+            .tv_nsec = (long)((timeout_usec % 1000000ULL) * 1000)
+        };
+        lf_cond_wait_relative(&jnl->group_commit_cond, &jnl->jlock, &sWaitTime);
+    } else {
+        pthread_cond_wait(&jnl->group_commit_cond, &jnl->jlock);
+    }
+    
+    jnl->owner = pthread_self();
+}
+
+// The group commit thread. It holds the journal lock except while sleeping,
+// so it only ever looks at cur_tr in between transactions.
+static void *group_commit_thread(void *arg) {
+    journal *jnl = arg;
+    
+    journal_lock(jnl);
+    
+    while (!(jnl->group_commit_flags & JOURNAL_GC_STOP)) {
+        transaction *tr = jnl->cur_tr;
+        
+        if (tr == NULL || jnl->group_commit_count == 0 || jnl->active_tr != NULL || (jnl->flags & JOURNAL_INVALID)) {
+            group_commit_wait(jnl, 0);
+            continue;
+        }
+        
+        if (!(jnl->group_commit_flags & JOURNAL_GC_COMMIT_NOW)) {
+            uint64_t now      = group_commit_uptime_usec();
+            uint64_t deadline = jnl->group_commit_start + jnl_group_commit_latency_usec;
+            
+            if (now < deadline) {
+                group_commit_wait(jnl, deadline - now);
+                continue;
+            }
+        }
+        
+        free_old_stuff(jnl);
+        
+        jnl->cur_tr = NULL;
+        
+        // same as journal_flush, the commit changes the meta data content (endianity)
+        int lockflags = hfs_systemfile_lock(jnl->fsmount->psHfsmount, SFL_CATALOG | SFL_ATTRIBUTE | SFL_EXTENTS | SFL_BITMAP, HFS_EXCLUSIVE_LOCK);
+        
+        end_transaction(tr, 1, NULL, NULL, FALSE);
+        
+        hfs_systemfile_unlock(jnl->fsmount->psHfsmount, lockflags);
+    }
+    
+    journal_unlock(jnl);
+    
+    return NULL;
+}
+
+static void start_group_commit(journal *jnl) {
+    
+    lf_cond_init(&jnl->group_commit_cond);
+    jnl->group_commit_flags = 0;
+    jnl->group_commit_count = 0;
+    
+    if (jnl->flags & JOURNAL_NO_GROUP_COMMIT)
+        return;
+    
+    int iErr = pthread_create(&jnl->group_commit_thread, NULL, group_commit_thread, jnl);
+    if (iErr) {
+        // not fatal, transactions get committed by the callers
+        LFHFS_LOG(LEVEL_ERROR, "jnl: start_group_commit: pthread_create failed [%d]\n", iErr);
+        return;
+    }
+    
+    jnl->group_commit_flags |= JOURNAL_GC_RUNNING;
+}
+
+static void stop_group_commit(journal *jnl) {
+    boolean_t owner = (jnl->owner == pthread_self());
+    
+    if (!(jnl->group_commit_flags & JOURNAL_GC_RUNNING))
+        return;
+    
+    if (!owner) {
+        journal_lock(jnl);
+    }
+    
+    jnl->group_commit_flags |= JOURNAL_GC_STOP;
+    lf_cond_wakeup(&jnl->group_commit_cond);
+    
+    // the thread needs the journal lock to exit
+    journal_unlock(jnl);
+    pthread_join(jnl->group_commit_thread, NULL);
+    
+    if (owner) {
+        journal_lock(jnl);
+    }
+    
+    jnl->group_commit_flags = 0;
+    jnl->group_commit_count = 0;
+}
+
 static void abort_transaction(journal *jnl, transaction *tr) {
 
     block_list_header *blhdr, *next;
@@ -3168,6 +3450,8 @@ again:
         raw_readwrite_read_mount(jnl->jdev, uBlkNum, phyblksize, data, curlen, NULL, NULL);
     } else if (direction & JNL_WRITE) {
         raw_readwrite_write_mount(jnl->jdev, uBlkNum, phyblksize, data, curlen, NULL, NULL);
+        jnl->stats.ios++;
+        jnl->stats.unbatched_ios++;
     }
 
     // Move to the next section
@@ -3508,3 +3792,9 @@ uint32_t journal_current_txn(journal *jnl) {
     return jnl->sequence_num + (jnl->active_tr || jnl->cur_tr ? 0 : 1);
 }
 
+void journal_get_stats(journal *jnl, journal_stats *stats) {
+    lock_flush(jnl);
+    *stats = jnl->stats;
+    unlock_flush(jnl);
+}
+
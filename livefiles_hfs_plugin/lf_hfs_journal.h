@@ -105,6 +105,17 @@ typedef struct {
     uint32_t       uFlag;
 } ConditionalFlag_S;
 
+/*
+ * Write accounting.  unbatched_ios is what the same commits take when
+ * every block list header, journal block and checkpointed block goes
+ * out as its own write.
+ */
+typedef struct journal_stats {
+    uint64_t commits;       // transactions written to the journal
+    uint64_t ios;           // device writes issued by the journal
+    uint64_t unbatched_ios; // device writes without batching
+} journal_stats;
+
 /*
  * In memory structure about the journal.
  */
@@ -160,8 +171,21 @@ typedef struct journal {
     
     int                 last_flush_err;    // last error from flushing the cache
     uint32_t            flush_counter;     // a monotonically increasing value assigned on track cache flush
+
+    pthread_t           group_commit_thread; // commits cur_tr in the background
+    pthread_cond_t      group_commit_cond;   // wakes up group_commit_thread, protected by jlock
+    uint32_t            group_commit_flags;
+    uint32_t            group_commit_count;  // # of transactions sealed into cur_tr
+    uint64_t            group_commit_start;  // uptime (usec) at which the first of them was sealed
+
+    journal_stats       stats;             // updated while holding the flushing condition
 } journal;
 
+/* group_commit_flags */
+#define JOURNAL_GC_RUNNING        0x00000001   // group_commit_thread is running
+#define JOURNAL_GC_COMMIT_NOW     0x00000002   // cur_tr is full, commit it without waiting
+#define JOURNAL_GC_STOP           0x00000004   // group_commit_thread should exit
+
 /* internal-only journal flags (top 16 bits) */
 #define JOURNAL_CLOSE_PENDING     0x00010000
 #define JOURNAL_INVALID           0x00020000
@@ -348,6 +372,7 @@ int   journal_uses_fua(journal *jnl);
 void  journal_lock(journal *jnl);
 void  journal_unlock(journal *jnl);
 uint32_t journal_current_txn(journal *jnl);
+void  journal_get_stats(journal *jnl, journal_stats *stats);
 
 
 /*
@@ -10,6 +10,335 @@
 #include "lf_hfs_cnode.h"
 #include "lf_hfs_vfsutils.h"
 #include "lf_hfs_link.h"
+#include "lf_hfs_logger.h"
+#include "lf_hfs_chash.h"
+#include "lf_hfs_sbunicode.h"
+#include "lf_hfs_unicode_wrappers.h"
+
+/*
+ * Name cache
+ *
+ * Remembers what a (parent cnid, name) lookup found: the cnid of the item, or
+ * that nothing is there (a negative entry), so repeated lookups of the same
+ * names don't walk the catalog.  Names are decomposed to UTF-16 the way
+ * buildkey does it, and case folded unless the volume is case sensitive, so
+ * every spelling the catalog would match shares one entry.
+ *
+ * The cache is split into stripes by hash, each with its own lock, buckets and
+ * LRU list, and holds at most HFS_NCACHE_MAX_ENTRIES entries per mount.
+ *
+ * cat_create, cat_delete and cat_rename purge the names they touch, and an
+ * entry is ignored once the parent's uDirVersion has moved on.  A positive
+ * entry only saves the catalog walk while the cnode is in the cnode hash, and
+ * is checked against the cnode's own descriptor before it is used.
+ */
+#define HFS_NCACHE_NUM_STRIPES          (16)
+#define HFS_NCACHE_STRIPE_BUCKETS       (256)
+#define HFS_NCACHE_MAX_ENTRIES          (8192)
+#define HFS_NCACHE_STRIPE_MAX_ENTRIES   (HFS_NCACHE_MAX_ENTRIES / HFS_NCACHE_NUM_STRIPES)
+
+struct hfs_ncache_entry {
+    LIST_ENTRY(hfs_ncache_entry)    nce_hash;
+    TAILQ_ENTRY(hfs_ncache_entry)   nce_lru;
+    cnid_t                          nce_parentcnid;
+    cnid_t                          nce_cnid;           /* 0 for a negative entry */
+    u_int64_t                       nce_dirversion;     /* parent's uDirVersion when entered */
+    u_int32_t                       nce_hashval;
+    u_int16_t                       nce_keylen;         /* UniChars in nce_key */
+    u_int16_t                       nce_namelen;        /* bytes of catalog name after the key */
+    UniChar                         nce_key[];
+};
+
+#define NCE_NAME(ncp)   ((u_int8_t *)&(ncp)->nce_key[(ncp)->nce_keylen])
+
+struct hfs_ncache_stripe {
+    pthread_mutex_t                         ncs_lock;
+    LIST_HEAD(, hfs_ncache_entry)           ncs_buckets[HFS_NCACHE_STRIPE_BUCKETS];
+    TAILQ_HEAD(hfs_ncache_lru, hfs_ncache_entry) ncs_lru;   /* most recently used at the head */
+    u_int32_t                               ncs_entries;
+};
+
+struct hfs_name_cache {
+    struct hfs_ncache_stripe    nc_stripes[HFS_NCACHE_NUM_STRIPES];
+    u_int64_t                   nc_hits;                /* statistics, updated atomically */
+    u_int64_t                   nc_negative_hits;
+    u_int64_t                   nc_misses;
+    u_int64_t                   nc_purges;
+};
+
+/* A name in the form the catalog compares it */
+struct hfs_ncache_key {
+    cnid_t      parentcnid;
+    u_int32_t   hashval;
+    ItemCount   length;
+    UniChar     name[kHFSPlusMaxFileNameChars];
+};
+
+#define NCACHE_STRIPE(ncp, hashval)     (&(ncp)->nc_stripes[(hashval) % HFS_NCACHE_NUM_STRIPES])
+#define NCACHE_BUCKET(ncsp, hashval)    (&(ncsp)->ncs_buckets[((hashval) / HFS_NCACHE_NUM_STRIPES) % HFS_NCACHE_STRIPE_BUCKETS])
+
+void
+hfs_namecache_init(struct hfsmount *hfsmp)
+{
+    struct hfs_name_cache *ncp = hfs_mallocz(sizeof(*ncp));
+    if (ncp == NULL) {
+        LFHFS_LOG(LEVEL_ERROR, "hfs_namecache_init: failed to allocate the name cache\n");
+        return;
+    }
+
+    for (int i = 0; i < HFS_NCACHE_NUM_STRIPES; i++) {
+        struct hfs_ncache_stripe *ncsp = &ncp->nc_stripes[i];
+
+        lf_lck_mtx_init(&ncsp->ncs_lock);
+        for (int j = 0; j < HFS_NCACHE_STRIPE_BUCKETS; j++) {
+            LIST_INIT(&ncsp->ncs_buckets[j]);
+        }
+        TAILQ_INIT(&ncsp->ncs_lru);
+    }
+
+    hfsmp->hfs_name_cache = ncp;
+}
+
+void
+hfs_namecache_destroy(struct hfsmount *hfsmp)
+{
+    struct hfs_name_cache *ncp = hfsmp->hfs_name_cache;
+    struct hfs_ncache_entry *ncep, *next;
+
+    if (ncp == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < HFS_NCACHE_NUM_STRIPES; i++) {
+        struct hfs_ncache_stripe *ncsp = &ncp->nc_stripes[i];
+
+        TAILQ_FOREACH_SAFE(ncep, &ncsp->ncs_lru, nce_lru, next) {
+            hfs_free(ncep);
+        }
+        lf_lck_mtx_destroy(&ncsp->ncs_lock);
+    }
+
+    hfs_free(ncp);
+    hfsmp->hfs_name_cache = NULL;
+}
+
+void
+hfs_namecache_get_stats(struct hfsmount *hfsmp, HFSNameCacheStats_s *psStats)
+{
+    struct hfs_name_cache *ncp = hfsmp->hfs_name_cache;
+
+    memset(psStats, 0, sizeof(*psStats));
+    if (ncp == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < HFS_NCACHE_NUM_STRIPES; i++) {
+        lf_lck_mtx_lock(&ncp->nc_stripes[i].ncs_lock);
+        psStats->uEntries += ncp->nc_stripes[i].ncs_entries;
+        lf_lck_mtx_unlock(&ncp->nc_stripes[i].ncs_lock);
+    }
+    psStats->uHits          = __atomic_load_n(&ncp->nc_hits, __ATOMIC_RELAXED);
+    psStats->uNegativeHits  = __atomic_load_n(&ncp->nc_negative_hits, __ATOMIC_RELAXED);
+    psStats->uMisses        = __atomic_load_n(&ncp->nc_misses, __ATOMIC_RELAXED);
+    psStats->uPurges        = __atomic_load_n(&ncp->nc_purges, __ATOMIC_RELAXED);
+}
+
+static int
+hfs_ncache_makekey(struct hfsmount *hfsmp, cnid_t parentcnid, const u_int8_t *nameptr, size_t namelen, struct hfs_ncache_key *key)
+{
+    UniChar unicode[kHFSPlusMaxFileNameChars];
+    size_t unicodeBytes = 0;
+    Boolean complete;
+
+    if (namelen == 0 ||
+        utf8_decodestr(nameptr, namelen, unicode, &unicodeBytes, sizeof(unicode), ':', UTF_ESCAPE_ILLEGAL | UTF_DECOMPOSED) != 0) {
+        return (EINVAL);
+    }
+
+    key->parentcnid = parentcnid;
+    if (hfsmp->hfs_flags & HFS_CASE_SENSITIVE) {
+        key->length = unicodeBytes / sizeof(UniChar);
+        memcpy(key->name, unicode, unicodeBytes);
+    } else {
+        key->length = FastUnicodeFoldPrefix(unicode, unicodeBytes / sizeof(UniChar), key->name, kHFSPlusMaxFileNameChars, &complete);
+    }
+
+    /* FNV-1a over the parent and the name */
+    u_int32_t hashval = 2166136261U;
+    hashval = (hashval ^ parentcnid) * 16777619U;
+    for (ItemCount i = 0; i < key->length; i++) {
+        hashval = (hashval ^ key->name[i]) * 16777619U;
+    }
+    key->hashval = hashval;
+
+    return (0);
+}
+
+/* Called with the stripe lock held */
+static struct hfs_ncache_entry *
+hfs_ncache_find(struct hfs_ncache_stripe *ncsp, struct hfs_ncache_key *key)
+{
+    struct hfs_ncache_entry *ncep;
+
+    LIST_FOREACH(ncep, NCACHE_BUCKET(ncsp, key->hashval), nce_hash) {
+        if (ncep->nce_hashval == key->hashval &&
+            ncep->nce_parentcnid == key->parentcnid &&
+            ncep->nce_keylen == key->length &&
+            memcmp(ncep->nce_key, key->name, key->length * sizeof(UniChar)) == 0) {
+            return (ncep);
+        }
+    }
+    return (NULL);
+}
+
+/* Called with the stripe lock held */
+static void
+hfs_ncache_remove(struct hfs_ncache_stripe *ncsp, struct hfs_ncache_entry *ncep)
+{
+    LIST_REMOVE(ncep, nce_hash);
+    TAILQ_REMOVE(&ncsp->ncs_lru, ncep, nce_lru);
+    ncsp->ncs_entries--;
+    hfs_free(ncep);
+}
+
+/*
+ * Look a name up in the cache.
+ *
+ * Returns 0 with *cnidp and the catalog name filled in for a positive entry,
+ * ENOENT for a negative entry and -1 when the cache doesn't know.
+ */
+static int
+hfs_ncache_lookup(struct hfsmount *hfsmp, struct hfs_ncache_key *key, u_int64_t dirversion,
+                  cnid_t *cnidp, u_int8_t *namebuf, size_t *namelenp)
+{
+    struct hfs_name_cache *ncp = hfsmp->hfs_name_cache;
+    struct hfs_ncache_stripe *ncsp = NCACHE_STRIPE(ncp, key->hashval);
+    struct hfs_ncache_entry *ncep;
+    int result = -1;
+
+    lf_lck_mtx_lock(&ncsp->ncs_lock);
+
+    ncep = hfs_ncache_find(ncsp, key);
+    if (ncep != NULL) {
+        if (ncep->nce_dirversion != dirversion) {
+            /* The directory changed since the entry was made */
+            hfs_ncache_remove(ncsp, ncep);
+        } else {
+            TAILQ_REMOVE(&ncsp->ncs_lru, ncep, nce_lru);
+            TAILQ_INSERT_HEAD(&ncsp->ncs_lru, ncep, nce_lru);
+
+            if (ncep->nce_cnid == 0) {
+                result = ENOENT;
+            } else {
+                *cnidp = ncep->nce_cnid;
+                *namelenp = ncep->nce_namelen;
+                memcpy(namebuf, NCE_NAME(ncep), ncep->nce_namelen);
+                result = 0;
+            }
+        }
+    }
+
+    lf_lck_mtx_unlock(&ncsp->ncs_lock);
+    return (result);
+}
+
+/* Enter a name, replacing any entry already there.  A cnid of 0 makes a negative entry. */
+static void
+hfs_ncache_enter(struct hfsmount *hfsmp, struct hfs_ncache_key *key, u_int64_t dirversion,
+                 cnid_t cnid, const u_int8_t *nameptr, size_t namelen)
+{
+    struct hfs_name_cache *ncp = hfsmp->hfs_name_cache;
+    struct hfs_ncache_stripe *ncsp = NCACHE_STRIPE(ncp, key->hashval);
+    struct hfs_ncache_entry *ncep, *oldp;
+
+    if (cnid == 0) {
+        namelen = 0;
+    }
+
+    ncep = hfs_malloc(sizeof(*ncep) + key->length * sizeof(UniChar) + namelen);
+    if (ncep == NULL) {
+        return;
+    }
+    ncep->nce_parentcnid = key->parentcnid;
+    ncep->nce_cnid = cnid;
+    ncep->nce_dirversion = dirversion;
+    ncep->nce_hashval = key->hashval;
+    ncep->nce_keylen = key->length;
+    ncep->nce_namelen = namelen;
+    memcpy(ncep->nce_key, key->name, key->length * sizeof(UniChar));
+    memcpy(NCE_NAME(ncep), nameptr, namelen);
+
+    lf_lck_mtx_lock(&ncsp->ncs_lock);
+
+    if ((oldp = hfs_ncache_find(ncsp, key)) != NULL) {
+        hfs_ncache_remove(ncsp, oldp);
+    } else if (ncsp->ncs_entries >= HFS_NCACHE_STRIPE_MAX_ENTRIES) {
+        hfs_ncache_remove(ncsp, TAILQ_LAST(&ncsp->ncs_lru, hfs_ncache_lru));
+    }
+
+    LIST_INSERT_HEAD(NCACHE_BUCKET(ncsp, key->hashval), ncep, nce_hash);
+    TAILQ_INSERT_HEAD(&ncsp->ncs_lru, ncep, nce_lru);
+    ncsp->ncs_entries++;
+
+    lf_lck_mtx_unlock(&ncsp->ncs_lock);
+}
+
+/*
+ * Forget whatever the cache knows about a name.  Called by the catalog code
+ * for every name it creates, deletes or renames.
+ */
+void
+hfs_namecache_purge(struct hfsmount *hfsmp, cnid_t parentcnid, const u_int8_t *nameptr, size_t namelen)
+{
+    struct hfs_name_cache *ncp = hfsmp->hfs_name_cache;
+    struct hfs_ncache_stripe *ncsp;
+    struct hfs_ncache_entry *ncep;
+    struct hfs_ncache_key key;
+
+    if (ncp == NULL || hfs_ncache_makekey(hfsmp, parentcnid, nameptr, namelen, &key) != 0) {
+        return;
+    }
+
+    ncsp = NCACHE_STRIPE(ncp, key.hashval);
+    lf_lck_mtx_lock(&ncsp->ncs_lock);
+    if ((ncep = hfs_ncache_find(ncsp, &key)) != NULL) {
+        hfs_ncache_remove(ncsp, ncep);
+        __atomic_add_fetch(&ncp->nc_purges, 1, __ATOMIC_RELAXED);
+    }
+    lf_lck_mtx_unlock(&ncsp->ncs_lock);
+}
+
+/*
+ * Try to satisfy a lookup from a positive name cache entry.  Returns the
+ * locked vnode, or NULL if the cnode isn't in memory or no longer has the
+ * name.
+ */
+static struct vnode *
+hfs_ncache_getvnode(struct hfsmount *hfsmp, struct vnode *dvp, cnid_t cnid, const u_int8_t *nameptr, size_t namelen, int flags)
+{
+    struct vnode *vp;
+    struct cnode *cp;
+    int type;
+
+    vp = hfs_chash_getvnode(hfsmp, cnid, 0, 0, 0);
+    if (vp == NULL) {
+        return (NULL);
+    }
+    cp = VTOC(vp);
+    type = cp->c_attr.ca_mode & S_IFMT;
+
+    if (cp->c_parentcnid != VTOC(dvp)->c_fileid ||
+        cp->c_desc.cd_namelen != namelen ||
+        bcmp(cp->c_desc.cd_nameptr, nameptr, namelen) != 0 ||
+        ISSET(cp->c_flag, C_HARDLINK) ||
+        (!(flags & ISLASTCN) && (type != S_IFDIR) && (type != S_IFLNK))) {
+        hfs_chash_lower_OpenLookupCounter(cp);
+        hfs_unlock(cp);
+        return (NULL);
+    }
+
+    return (vp);
+}
 
 static int
 hfs_lookup(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp, int *cnode_locked)
@@ -25,8 +354,21 @@ hfs_lookup(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp, int
     struct cat_attr attr;
     struct cat_fork fork;
     int lockflags;
+    BTReadSection btsection;
+    int tries;
     int newvnode_flags = 0;
-    
+    struct hfs_ncache_key *nckey = NULL;
+    u_int64_t dirversion = 0;
+
+    /* The name cache is only used for plain lookups */
+    if (VTOHFS(dvp)->hfs_name_cache && cnp->cn_nameiop == LOOKUP) {
+        nckey = hfs_malloc(sizeof(*nckey));
+        if (nckey && hfs_ncache_makekey(VTOHFS(dvp), VTOC(dvp)->c_fileid, (const u_int8_t *)cnp->cn_nameptr, cnp->cn_namelen, nckey) != 0) {
+            hfs_free(nckey);
+            nckey = NULL;
+        }
+    }
+
 retry:
     newvnode_flags = 0;
     dcp = NULL;
@@ -53,6 +395,48 @@ retry:
         goto retry;
     }
 
+    /* Try the name cache before the catalog */
+    if (nckey) {
+        u_int8_t catname[kHFSPlusMaxFileNameChars * 3 + 1];
+        size_t catnamelen = 0;
+        cnid_t cnid = 0;
+
+        dirversion = dvp->sExtraData.sDirData.uDirVersion;
+
+        retval = hfs_ncache_lookup(hfsmp, nckey, dirversion, &cnid, catname, &catnamelen);
+        if (retval == ENOENT) {
+            __atomic_add_fetch(&hfsmp->hfs_name_cache->nc_negative_hits, 1, __ATOMIC_RELAXED);
+            goto exit;
+        }
+        if (retval == 0) {
+            hfs_unlock(dcp);
+            dcp = NULL;
+
+            tvp = hfs_ncache_getvnode(hfsmp, dvp, cnid, catname, catnamelen, flags);
+            if (tvp) {
+                __atomic_add_fetch(&hfsmp->hfs_name_cache->nc_hits, 1, __ATOMIC_RELAXED);
+                *cnode_locked = 1;
+                *vpp = tvp;
+                goto exit;
+            }
+
+            /* The cnode is gone or changed, go to the catalog */
+            if (hfs_lock(VTOC(dvp), HFS_EXCLUSIVE_LOCK, HFS_LOCK_DEFAULT) != 0) {
+                retval = ENOENT;
+                goto exit;
+            }
+            dcp = VTOC(dvp);
+            if (dcp->c_flag & C_DIR_MODIFICATION) {
+                hfs_unlock(dcp);
+                usleep( 1000 );
+                goto retry;
+            }
+            dirversion = dvp->sExtraData.sDirData.uDirVersion;
+        }
+        retval = 0;
+        __atomic_add_fetch(&hfsmp->hfs_name_cache->nc_misses, 1, __ATOMIC_RELAXED);
+    }
+
     /*
      * We shouldn't need to go to the catalog if there are no children.
      * However, in the face of a minor disk corruption where the valence of
@@ -68,18 +452,35 @@ retry:
     cndesc.cd_parentcnid = dcp->c_fileid;
     cndesc.cd_hint = dcp->c_childhint;
 
-    lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
-    retval = cat_lookup(hfsmp, &cndesc, 0, &desc, &attr, &fork, NULL);
-    hfs_systemfile_unlock(hfsmp, lockflags);
+    /*
+     * Try the catalog without its lock first, so lookups don't queue up
+     * behind creates and deletes.  A read that raced one is tried again,
+     * and after HFS_BTREAD_TRIES done under the lock.  A name it didn't
+     * find isn't there.
+     */
+    for (tries = 0; tries < HFS_BTREAD_TRIES; tries++) {
+        retval = hfs_systemfile_read_begin(hfsmp, SFL_CATALOG, &btsection);
+        if (retval == EAGAIN)
+            continue;
+        if (retval != 0)
+            break;
+
+        retval = cat_lookup(hfsmp, &cndesc, 0, &desc, &attr, &fork, NULL);
+        if (hfs_systemfile_read_end(hfsmp, SFL_CATALOG, &btsection) == 0)
+            break;
+        if (retval == 0)
+            cat_releasedesc(&desc);
+        retval = EAGAIN;
+    }
+    if (retval == EAGAIN || retval == ENOTSUP) {
+        __atomic_add_fetch(&hfsmp->hfs_btread_fallbacks, 1, __ATOMIC_RELAXED);
+        lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
+        retval = cat_lookup(hfsmp, &cndesc, 0, &desc, &attr, &fork, NULL);
+        hfs_systemfile_unlock(hfsmp, lockflags);
+    }
 
     if (retval == 0) {
         dcp->c_childhint = desc.cd_hint;
-        /*
-         * Note: We must drop the parent lock here before calling
-         * hfs_getnewvnode (which takes the child lock).
-         */
-        hfs_unlock(dcp);
-        dcp = NULL;
 
         /* Verify that the item just looked up isn't one of the hidden directories. */
         if (desc.cd_cnid == hfsmp->hfs_private_desc[FILE_HARDLINKS].cd_cnid ||
@@ -87,9 +488,34 @@ retry:
             retval = ENOENT;
             goto exit;
         }
+
+        /*
+         * Remember the name while the parent is still locked.  Hardlinks, and
+         * names that only matched through mangling, are left out.
+         */
+        if (nckey && desc.cd_cnid == attr.ca_fileid &&
+            !(attr.ca_recflags & kHFSHasLinkChainMask) &&
+            cnp->cn_namelen == (int)desc.cd_namelen) {
+            hfs_ncache_enter(hfsmp, nckey, dirversion, desc.cd_cnid, desc.cd_nameptr, desc.cd_namelen);
+        }
+
+        /*
+         * Note: We must drop the parent lock here before calling
+         * hfs_getnewvnode (which takes the child lock).
+         */
+        hfs_unlock(dcp);
+        dcp = NULL;
         goto found;
     }
 
+    /*
+     * Remember that the name isn't there.  Mangled names (name#cnid) are
+     * resolved by cnid, so they are left to the catalog.
+     */
+    if (retval == ENOENT && nckey && memchr(cnp->cn_nameptr, '#', cnp->cn_namelen) == NULL) {
+        hfs_ncache_enter(hfsmp, nckey, dirversion, 0, NULL, 0);
+    }
+
     if (retval == HFS_ERESERVEDNAME) {
         /*
          * We found the name in the catalog, but it is unavailable
@@ -234,6 +660,9 @@ exit:
         hfs_unlock(dcp);
     }
     cat_releasedesc(&desc);
+    if (nckey) {
+        hfs_free(nckey);
+    }
 
     return (retval);
 }
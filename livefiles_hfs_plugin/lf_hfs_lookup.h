@@ -11,6 +11,19 @@
 #include "lf_hfs_vnode.h"
 #include "lf_hfs_vnops.h"
 
+typedef struct {
+    uint64_t uEntries;
+    uint64_t uHits;
+    uint64_t uNegativeHits;
+    uint64_t uMisses;
+    uint64_t uPurges;
+} HFSNameCacheStats_s;
+
 int hfs_vnop_lookup(struct vnode *dvp, struct vnode **vpp, struct componentname *cnp);
 
+void hfs_namecache_init(struct hfsmount *hfsmp);
+void hfs_namecache_destroy(struct hfsmount *hfsmp);
+void hfs_namecache_purge(struct hfsmount *hfsmp, cnid_t parentcnid, const u_int8_t *nameptr, size_t namelen);
+void hfs_namecache_get_stats(struct hfsmount *hfsmp, HFSNameCacheStats_s *psStats);
+
 #endif /* lf_hfs_lookup_h */
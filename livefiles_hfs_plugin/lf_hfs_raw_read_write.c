@@ -13,6 +13,9 @@
 #include "lf_hfs_file_extent_mapping.h"
 #include "lf_hfs_vfsutils.h"
 #include <UserFS/UserVFS.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 #define MAX_READ_WRITE_LENGTH (0x7ffff000)
 
@@ -97,8 +100,504 @@ errno_t raw_readwrite_write_mount( vnode_t psMountVnode, uint64_t uBlockN, uint6
     return iErr;
 }
 
-errno_t
-raw_readwrite_read( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, size_t *piActuallyRead, uint64_t* puReadStartCluster )
+// Write a list of buffers that are contiguous on the device, starting at uBlockN.
+// puIOCount (optional) is incremented by the number of device writes issued.
+errno_t raw_readwrite_writev_mount( vnode_t psMountVnode, uint64_t uBlockN, uint64_t uClusterSize, const struct iovec* psIov, int iIovCnt, uint64_t *piActuallyWritten, uint64_t* puIOCount ) {
+    int iErr                   = 0;
+    int iFD                    = VNODE_TO_IFD(psMountVnode);
+    uint64_t uWantedOffset     = uBlockN * uClusterSize;
+    uint64_t uTotalWritten     = 0;
+
+    while ( iIovCnt > 0 )
+    {
+        int      iCnt          = MIN( iIovCnt, IOV_MAX );
+        uint64_t uBatchLength  = 0;
+
+        for ( int i = 0; i < iCnt; i++ )
+        {
+            uBatchLength += psIov[i].iov_len;
+        }
+
+        ssize_t uActuallyWritten = pwritev( iFD, psIov, iCnt, uWantedOffset + uTotalWritten );
+        if ( puIOCount )
+            (*puIOCount)++;
+
+        if ( uActuallyWritten != (ssize_t)uBatchLength ) {
+            iErr = ( (uActuallyWritten < 0) ? errno : EIO );
+            HFSLogLevel_e eLogLevel = (VNODE_TO_UNMOUNT_HINT(psMountVnode)==UVFSUnmountHintForce)?LEVEL_DEBUG:LEVEL_ERROR;
+            LFHFS_LOG( eLogLevel, "raw_readwrite_writev_mount failed [%d]\n", iErr );
+            if ( uActuallyWritten > 0 )
+                uTotalWritten += uActuallyWritten;
+            break;
+        }
+
+        uTotalWritten += uBatchLength;
+        psIov         += iCnt;
+        iIovCnt       -= iCnt;
+    }
+
+    if (piActuallyWritten)
+        *piActuallyWritten = uTotalWritten;
+
+    return iErr;
+}
+
+/*
+ * Sequential readahead.
+ *
+ * Every regular fork that is read through raw_readwrite_read gets a small read
+ * cache of RA_NUM_WINDOWS windows. A read that is not covered by a window fills
+ * one with a single sector aligned pread, which also absorbs the unaligned head
+ * and tail of the request. Once a fork has been read sequentially a few times,
+ * the window following the current one is prefetched by the readahead thread,
+ * and the window size is doubled up to RA_MAX_WINDOW.
+ *
+ * Any change to the fork content or layout bumps uGeneration and drops the
+ * cached windows. A prefetch issued under an older generation is discarded
+ * when it completes.
+ */
+#define RA_NUM_WINDOWS      (2)
+#define RA_MIN_WINDOW       (128*1024)
+#define RA_MAX_WINDOW       (1024*1024)
+#define RA_SEQ_THRESHOLD    (2)         // Sequential reads before we start prefetching
+
+typedef enum {
+    RA_WINDOW_EMPTY,
+    RA_WINDOW_VALID,
+    RA_WINDOW_PENDING,                  // Being filled by the readahead thread
+} ReadAheadWindowState_e;
+
+typedef struct ReadAheadWindow {
+    ReadAheadWindowState_e          eState;
+    uint8_t*                        puData;
+    uint64_t                        uBufSize;
+    uint64_t                        uOffset;        // File offset of puData, sector aligned
+    uint64_t                        uLength;        // Valid bytes in puData
+    uint64_t                        uPhyOffset;     // Device offset to prefetch from
+    uint64_t                        uGeneration;    // Fork generation the prefetch was issued under
+    int                             iFD;
+    struct raw_readahead*           psRA;
+    TAILQ_ENTRY(ReadAheadWindow)    sQueueLink;
+} ReadAheadWindow_s;
+
+struct raw_readahead {
+    pthread_mutex_t     sLock;
+    pthread_cond_t      sCond;                      // Broadcast when a pending window completes
+    uint64_t            uGeneration;
+    uint64_t            uNextSeqOffset;             // Where a sequential reader would continue
+    uint32_t            uSeqCount;
+    uint64_t            uWindowSize;
+    ReadAheadWindow_s   sWindows[RA_NUM_WINDOWS];
+};
+
+static pthread_mutex_t  gsReadAheadQueueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   gsReadAheadQueueCond = PTHREAD_COND_INITIALIZER;
+static pthread_t        gsReadAheadThread;
+static bool             gbReadAheadRunning   = false;
+static bool             gbReadAheadStop      = false;
+static TAILQ_HEAD(, ReadAheadWindow) gsReadAheadQueue = TAILQ_HEAD_INITIALIZER(gsReadAheadQueue);
+
+static void*
+raw_readwrite_readahead_thread( __unused void* pvArgs )
+{
+    lf_lck_mtx_lock( &gsReadAheadQueueLock );
+    while ( true )
+    {
+        while ( !gbReadAheadStop && TAILQ_EMPTY(&gsReadAheadQueue) )
+        {
+            pthread_cond_wait( &gsReadAheadQueueCond, &gsReadAheadQueueLock );
+        }
+
+        // Drain the queue before stopping, so no fork is left waiting on a pending window
+        ReadAheadWindow_s* psWin = TAILQ_FIRST( &gsReadAheadQueue );
+        if ( psWin == NULL )
+        {
+            break;
+        }
+        TAILQ_REMOVE( &gsReadAheadQueue, psWin, sQueueLink );
+        lf_lck_mtx_unlock( &gsReadAheadQueueLock );
+
+        // A pending window is owned by this thread until its state changes
+        ssize_t iReadBytes = pread( psWin->iFD, psWin->puData, psWin->uLength, psWin->uPhyOffset );
+
+        struct raw_readahead* psRA = psWin->psRA;
+        lf_lck_mtx_lock( &psRA->sLock );
+        if ( (iReadBytes == (ssize_t)psWin->uLength) && (psWin->uGeneration == psRA->uGeneration) )
+        {
+            psWin->eState = RA_WINDOW_VALID;
+        }
+        else
+        {
+            psWin->eState = RA_WINDOW_EMPTY;
+        }
+        pthread_cond_broadcast( &psRA->sCond );
+        lf_lck_mtx_unlock( &psRA->sLock );
+
+        lf_lck_mtx_lock( &gsReadAheadQueueLock );
+    }
+    lf_lck_mtx_unlock( &gsReadAheadQueueLock );
+
+    return NULL;
+}
+
+int
+raw_readwrite_readahead_init( void )
+{
+    int iErr = 0;
+
+    lf_lck_mtx_lock( &gsReadAheadQueueLock );
+    if ( !gbReadAheadRunning )
+    {
+        gbReadAheadStop = false;
+        iErr = pthread_create( &gsReadAheadThread, NULL, raw_readwrite_readahead_thread, NULL );
+        if ( iErr != 0 )
+        {
+            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_readahead_init: pthread_create failed [%d]\n", iErr );
+        }
+        else
+        {
+            gbReadAheadRunning = true;
+        }
+    }
+    lf_lck_mtx_unlock( &gsReadAheadQueueLock );
+
+    return iErr;
+}
+
+void
+raw_readwrite_readahead_de_init( void )
+{
+    lf_lck_mtx_lock( &gsReadAheadQueueLock );
+    if ( !gbReadAheadRunning )
+    {
+        lf_lck_mtx_unlock( &gsReadAheadQueueLock );
+        return;
+    }
+    gbReadAheadRunning = false;
+    gbReadAheadStop    = true;
+    pthread_cond_signal( &gsReadAheadQueueCond );
+    lf_lck_mtx_unlock( &gsReadAheadQueueLock );
+
+    pthread_join( gsReadAheadThread, NULL );
+}
+
+static struct raw_readahead*
+raw_readwrite_readahead_get( struct filefork* psFork )
+{
+    struct raw_readahead* psRA = __atomic_load_n( &psFork->ff_readahead, __ATOMIC_ACQUIRE );
+    if ( psRA != NULL )
+    {
+        return psRA;
+    }
+
+    psRA = hfs_mallocz( sizeof(struct raw_readahead) );
+    if ( psRA == NULL )
+    {
+        return NULL;
+    }
+    lf_lck_mtx_init( &psRA->sLock );
+    lf_cond_init( &psRA->sCond );
+    psRA->uWindowSize = RA_MIN_WINDOW;
+    for ( uint32_t u = 0; u < RA_NUM_WINDOWS; u++ )
+    {
+        psRA->sWindows[u].psRA = psRA;
+    }
+
+    // Readers only hold the truncate lock shared, so two of them may race to set up the context
+    struct raw_readahead* psExisting = NULL;
+    if ( !__atomic_compare_exchange_n( &psFork->ff_readahead, &psExisting, psRA, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) )
+    {
+        lf_cond_destroy( &psRA->sCond );
+        lf_lck_mtx_destroy( &psRA->sLock );
+        hfs_free( psRA );
+        psRA = psExisting;
+    }
+
+    return psRA;
+}
+
+static ReadAheadWindow_s*
+raw_readwrite_readahead_lookup( struct raw_readahead* psRA, uint64_t uOffset )
+{
+    for ( uint32_t u = 0; u < RA_NUM_WINDOWS; u++ )
+    {
+        ReadAheadWindow_s* psWin = &psRA->sWindows[u];
+        if ( (psWin->eState != RA_WINDOW_EMPTY) && (uOffset >= psWin->uOffset) && (uOffset < psWin->uOffset + psWin->uLength) )
+        {
+            return psWin;
+        }
+    }
+
+    return NULL;
+}
+
+// Pick a window to refill: never a pending one or psKeep, prefer empty ones, then the lowest offset.
+static ReadAheadWindow_s*
+raw_readwrite_readahead_victim( struct raw_readahead* psRA, ReadAheadWindow_s* psKeep )
+{
+    ReadAheadWindow_s* psVictim = NULL;
+
+    for ( uint32_t u = 0; u < RA_NUM_WINDOWS; u++ )
+    {
+        ReadAheadWindow_s* psWin = &psRA->sWindows[u];
+        if ( (psWin == psKeep) || (psWin->eState == RA_WINDOW_PENDING) )
+        {
+            continue;
+        }
+        if ( psWin->eState == RA_WINDOW_EMPTY )
+        {
+            return psWin;
+        }
+        if ( (psVictim == NULL) || (psWin->uOffset < psVictim->uOffset) )
+        {
+            psVictim = psWin;
+        }
+    }
+
+    return psVictim;
+}
+
+static bool
+raw_readwrite_readahead_has_pending( struct raw_readahead* psRA )
+{
+    for ( uint32_t u = 0; u < RA_NUM_WINDOWS; u++ )
+    {
+        if ( psRA->sWindows[u].eState == RA_WINDOW_PENDING )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static errno_t
+raw_readwrite_readahead_reserve( ReadAheadWindow_s* psWin, uint64_t uSize )
+{
+    if ( psWin->uBufSize >= uSize )
+    {
+        return 0;
+    }
+
+    uSize = ROUND_UP( uSize, RA_MIN_WINDOW );
+    uint8_t* puData = hfs_malloc( uSize );
+    if ( puData == NULL )
+    {
+        return ENOMEM;
+    }
+
+    if ( psWin->puData )
+    {
+        hfs_free( psWin->puData );
+    }
+    psWin->puData   = puData;
+    psWin->uBufSize = uSize;
+
+    return 0;
+}
+
+/*
+ * Map a sector aligned file offset to its device offset, and clip *puLength to
+ * the contiguous part of the extent and to the sector holding the end of file.
+ */
+static errno_t
+raw_readwrite_readahead_map( vnode_t psVnode, uint64_t uOffset, uint64_t* puLength, uint64_t* puPhyOffset )
+{
+    struct hfsmount *hfsmp          = VTOHFS(psVnode);
+    struct filefork *fp             = VTOF(psVnode);
+    uint64_t uClusterSize           = hfsmp->blockSize;
+    uint64_t uSectorSize            = hfsmp->hfs_logical_block_size;
+    uint64_t uEndOffset             = MIN( fp->ff_data.cf_blocks * uClusterSize, ROUND_UP(fp->ff_size, uSectorSize) );
+    uint64_t uCluster               = 0;
+    uint64_t uContigousClustersInBytes = 0;
+
+    if ( uOffset >= uEndOffset )
+    {
+        *puLength = 0;
+        return 0;
+    }
+
+    int iErr = raw_readwrite_get_cluster_from_offset( psVnode, uOffset, &uCluster, NULL, &uContigousClustersInBytes );
+    if ( iErr != 0 )
+    {
+        *puLength = 0;
+        return iErr;
+    }
+
+    *puLength    = MIN( *puLength, MIN(uContigousClustersInBytes, uEndOffset - uOffset) );
+    *puPhyOffset = FSOPS_GetOffsetFromClusterNum( psVnode, uCluster ) + ( uOffset % uClusterSize );
+
+    return 0;
+}
+
+// Synchronously fill a window with [uOffset, uOffset+uLength). Called with the readahead lock held.
+static errno_t
+raw_readwrite_readahead_fill( vnode_t psVnode, struct raw_readahead* psRA, uint64_t uOffset, uint64_t uLength )
+{
+    uint64_t uPhyOffset = 0;
+
+    ReadAheadWindow_s* psWin = raw_readwrite_readahead_victim( psRA, NULL );
+    if ( psWin == NULL )
+    {
+        return EAGAIN;
+    }
+
+    errno_t iErr = raw_readwrite_readahead_map( psVnode, uOffset, &uLength, &uPhyOffset );
+    if ( (iErr != 0) || (uLength == 0) )
+    {
+        return iErr;
+    }
+
+    iErr = raw_readwrite_readahead_reserve( psWin, uLength );
+    if ( iErr != 0 )
+    {
+        return iErr;
+    }
+
+    psWin->eState = RA_WINDOW_EMPTY;
+    ssize_t iReadBytes = pread( VNODE_TO_IFD(psVnode), psWin->puData, uLength, uPhyOffset );
+    if ( iReadBytes != (ssize_t)uLength )
+    {
+        iErr = ((iReadBytes < 0) ? errno : EIO);
+        LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read: pread failed to read wanted length\n" );
+        return iErr;
+    }
+
+    psWin->uOffset = uOffset;
+    psWin->uLength = uLength;
+    psWin->eState  = RA_WINDOW_VALID;
+
+    return 0;
+}
+
+// Queue a prefetch of the window following the one the reader is in. Called with the readahead lock held.
+static void
+raw_readwrite_readahead_schedule( vnode_t psVnode, struct raw_readahead* psRA )
+{
+    uint64_t uSectorSize    = VTOHFS(psVnode)->hfs_logical_block_size;
+    uint64_t uPhyOffset     = 0;
+    uint64_t uLength        = psRA->uWindowSize;
+
+    // One prefetch at a time per fork
+    if ( raw_readwrite_readahead_has_pending(psRA) )
+    {
+        return;
+    }
+
+    uint64_t uPrefetchOffset = ROUND_DOWN( psRA->uNextSeqOffset, uSectorSize );
+    ReadAheadWindow_s* psKeep = raw_readwrite_readahead_lookup( psRA, uPrefetchOffset );
+    if ( psKeep != NULL )
+    {
+        uPrefetchOffset = psKeep->uOffset + psKeep->uLength;
+    }
+
+    // Next window is already cached
+    if ( raw_readwrite_readahead_lookup(psRA, uPrefetchOffset) != NULL )
+    {
+        return;
+    }
+
+    ReadAheadWindow_s* psWin = raw_readwrite_readahead_victim( psRA, psKeep );
+    if ( psWin == NULL )
+    {
+        return;
+    }
+
+    if ( (raw_readwrite_readahead_map(psVnode, uPrefetchOffset, &uLength, &uPhyOffset) != 0) || (uLength == 0) )
+    {
+        return;
+    }
+
+    if ( raw_readwrite_readahead_reserve(psWin, uLength) != 0 )
+    {
+        return;
+    }
+
+    psWin->eState       = RA_WINDOW_PENDING;
+    psWin->uOffset      = uPrefetchOffset;
+    psWin->uLength      = uLength;
+    psWin->uPhyOffset   = uPhyOffset;
+    psWin->uGeneration  = psRA->uGeneration;
+    psWin->iFD          = VNODE_TO_IFD(psVnode);
+
+    lf_lck_mtx_lock( &gsReadAheadQueueLock );
+    if ( gbReadAheadRunning )
+    {
+        TAILQ_INSERT_TAIL( &gsReadAheadQueue, psWin, sQueueLink );
+        pthread_cond_signal( &gsReadAheadQueueCond );
+    }
+    else
+    {
+        psWin->eState = RA_WINDOW_EMPTY;
+    }
+    lf_lck_mtx_unlock( &gsReadAheadQueueLock );
+
+    psRA->uWindowSize = MIN( psRA->uWindowSize * 2, RA_MAX_WINDOW );
+}
+
+void
+raw_readwrite_readahead_invalidate( vnode_t psVnode )
+{
+    struct filefork* psFork = VTOF(psVnode);
+    if ( psFork == NULL )
+    {
+        return;
+    }
+
+    struct raw_readahead* psRA = __atomic_load_n( &psFork->ff_readahead, __ATOMIC_ACQUIRE );
+    if ( psRA == NULL )
+    {
+        return;
+    }
+
+    lf_lck_mtx_lock( &psRA->sLock );
+    psRA->uGeneration++;
+    for ( uint32_t u = 0; u < RA_NUM_WINDOWS; u++ )
+    {
+        // Pending windows are dropped by the readahead thread on the generation mismatch
+        if ( psRA->sWindows[u].eState == RA_WINDOW_VALID )
+        {
+            psRA->sWindows[u].eState = RA_WINDOW_EMPTY;
+        }
+    }
+    psRA->uSeqCount   = 0;
+    psRA->uWindowSize = RA_MIN_WINDOW;
+    lf_lck_mtx_unlock( &psRA->sLock );
+}
+
+void
+raw_readwrite_readahead_release( struct filefork* psFork )
+{
+    struct raw_readahead* psRA = psFork->ff_readahead;
+    if ( psRA == NULL )
+    {
+        return;
+    }
+    psFork->ff_readahead = NULL;
+
+    // Wait for the readahead thread to let go of our windows
+    lf_lck_mtx_lock( &psRA->sLock );
+    while ( raw_readwrite_readahead_has_pending(psRA) )
+    {
+        pthread_cond_wait( &psRA->sCond, &psRA->sLock );
+    }
+    lf_lck_mtx_unlock( &psRA->sLock );
+
+    for ( uint32_t u = 0; u < RA_NUM_WINDOWS; u++ )
+    {
+        if ( psRA->sWindows[u].puData )
+        {
+            hfs_free( psRA->sWindows[u].puData );
+        }
+    }
+
+    lf_cond_destroy( &psRA->sCond );
+    lf_lck_mtx_destroy( &psRA->sLock );
+    hfs_free( psRA );
+}
+
+static errno_t
+raw_readwrite_read_direct( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, size_t *piActuallyRead, uint64_t* puReadStartCluster )
 {
     errno_t iErr                    = 0;
     uint64_t uClusterSize           = psVnode->sFSParams.vnfs_mp->psHfsmount->blockSize;
@@ -155,6 +654,122 @@ raw_readwrite_read( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLe
     return iErr;
 }
 
+errno_t
+raw_readwrite_read( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, size_t *piActuallyRead, uint64_t* puReadStartCluster )
+{
+    errno_t iErr                    = 0;
+    uint64_t uSectorSize            = VTOHFS(psVnode)->hfs_logical_block_size;
+    uint8_t* puBuf                  = pvBuf;
+    struct raw_readahead* psRA      = NULL;
+
+    if ( (uLength != 0) && !vnode_issystem(psVnode) )
+    {
+        psRA = raw_readwrite_readahead_get( VTOF(psVnode) );
+    }
+
+    // No read cache for this fork, go straight to the device
+    if ( psRA == NULL )
+    {
+        return raw_readwrite_read_direct( psVnode, uOffset, pvBuf, uLength, piActuallyRead, puReadStartCluster );
+    }
+
+    if ( puReadStartCluster )
+    {
+        iErr = raw_readwrite_get_cluster_from_offset( psVnode, uOffset, puReadStartCluster, NULL, NULL );
+        if ( iErr != 0 )
+        {
+            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read: raw_readwrite_get_cluster_from_offset failed [%d]\n", iErr );
+            return iErr;
+        }
+    }
+
+    *piActuallyRead = 0;
+
+    lf_lck_mtx_lock( &psRA->sLock );
+
+    bool bSequential = ( uOffset == psRA->uNextSeqOffset );
+    if ( bSequential )
+    {
+        psRA->uSeqCount++;
+    }
+    else
+    {
+        psRA->uSeqCount   = 0;
+        psRA->uWindowSize = RA_MIN_WINDOW;
+    }
+
+    while ( *piActuallyRead < uLength )
+    {
+        uint64_t uCurOffset = uOffset + *piActuallyRead;
+        uint64_t uRemaining = uLength - *piActuallyRead;
+
+        ReadAheadWindow_s* psWin = raw_readwrite_readahead_lookup( psRA, uCurOffset );
+        if ( psWin != NULL )
+        {
+            // The readahead thread is already bringing this in
+            if ( psWin->eState == RA_WINDOW_PENDING )
+            {
+                pthread_cond_wait( &psRA->sCond, &psRA->sLock );
+                continue;
+            }
+
+            uint64_t uBytesToCopy = MIN( uRemaining, psWin->uOffset + psWin->uLength - uCurOffset );
+            memcpy( puBuf + *piActuallyRead, psWin->puData + (uCurOffset - psWin->uOffset), uBytesToCopy );
+            *piActuallyRead += uBytesToCopy;
+            continue;
+        }
+
+        // Large aligned reads go straight into the caller's buffer
+        if ( ((uCurOffset % uSectorSize) == 0) && (uRemaining >= RA_MAX_WINDOW) )
+        {
+            size_t uDirectRead = 0;
+
+            lf_lck_mtx_unlock( &psRA->sLock );
+            iErr = raw_readwrite_read_direct( psVnode, uCurOffset, puBuf + *piActuallyRead, ROUND_DOWN(uRemaining, uSectorSize), &uDirectRead, NULL );
+            lf_lck_mtx_lock( &psRA->sLock );
+
+            *piActuallyRead += uDirectRead;
+            if ( (iErr != 0) || (uDirectRead == 0) )
+            {
+                break;
+            }
+            continue;
+        }
+
+        // Read the unaligned head/tail together with the rest of the window in a single pread
+        uint64_t uFillOffset = ROUND_DOWN( uCurOffset, uSectorSize );
+        uint64_t uFillLength = ROUND_UP( uCurOffset + uRemaining, uSectorSize ) - uFillOffset;
+        if ( bSequential )
+        {
+            uFillLength = MAX( uFillLength, psRA->uWindowSize );
+        }
+        uFillLength = MIN( uFillLength, RA_MAX_WINDOW );
+
+        iErr = raw_readwrite_readahead_fill( psVnode, psRA, uFillOffset, uFillLength );
+        if ( iErr != 0 )
+        {
+            LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read: raw_readwrite_readahead_fill failed [%d]\n", iErr );
+            break;
+        }
+
+        // Nothing more is allocated to the file
+        if ( raw_readwrite_readahead_lookup(psRA, uCurOffset) == NULL )
+        {
+            break;
+        }
+    }
+
+    psRA->uNextSeqOffset = uOffset + *piActuallyRead;
+    if ( (iErr == 0) && (psRA->uSeqCount >= RA_SEQ_THRESHOLD) )
+    {
+        raw_readwrite_readahead_schedule( psVnode, psRA );
+    }
+
+    lf_lck_mtx_unlock( &psRA->sLock );
+
+    return iErr;
+}
+
 errno_t
 raw_readwrite_read_internal( vnode_t psVnode, uint64_t uCluster, uint64_t uContigousClustersInBytes,
                             uint64_t uOffset, uint64_t uBytesToRead, void* pvBuf, uint64_t *piActuallyRead )
@@ -265,7 +880,7 @@ raw_readwrite_write( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uL
         if ( iErr != 0 )
         {
             LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_write: raw_readwrite_get_cluster_from_offset failed [%d]\n", iErr );
-            return iErr;
+            break;
         }
 
         // Stop writing if we've reached the end of the file
@@ -285,7 +900,7 @@ raw_readwrite_write( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uL
         if ( iErr != 0 )
         {
             LFHFS_LOG( LEVEL_ERROR, "raw_readwrite_read_internal: raw_readwrite_read_internal failed [%d]\n", iErr );
-            return iErr;
+            break;
         }
 
         // Update the amount of bytes alreay written
@@ -296,6 +911,9 @@ raw_readwrite_write( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uL
         pvBuf = (uint8_t*)pvBuf + uActuallyWritten;
     }
 
+    // Whatever made it to the device is newer than the read cache
+    raw_readwrite_readahead_invalidate( psVnode );
+
     return iErr;
 }
 
@@ -532,6 +1150,8 @@ exit:
     if ( puClusterData )
         hfs_free( puClusterData );
 
+    raw_readwrite_readahead_invalidate( psVnode );
+
     return iErr;
 }
 
@@ -9,11 +9,13 @@
 #ifndef lf_hfs_raw_read_write_h
 #define lf_hfs_raw_read_write_h
 
+#include <sys/uio.h>
 #include "lf_hfs_vnode.h"
 #include "lf_hfs.h"
 
 errno_t  raw_readwrite_read_mount( vnode_t psMountVnode, uint64_t uBlockN, uint64_t uClusterSize, void* pvBuf, uint64_t uBufLen, uint64_t *piActuallyRead, uint64_t* puReadStartCluster );
 errno_t  raw_readwrite_write_mount( vnode_t psMountVnode, uint64_t uBlockN, uint64_t uClusterSize, void* pvBuf, uint64_t uBufLen, uint64_t *piActuallyWritten, uint64_t* puWrittenStartCluster );
+errno_t  raw_readwrite_writev_mount( vnode_t psMountVnode, uint64_t uBlockN, uint64_t uClusterSize, const struct iovec* psIov, int iIovCnt, uint64_t *piActuallyWritten, uint64_t* puIOCount );
 
 int      raw_readwrite_get_cluster_from_offset( vnode_t psVnode, uint64_t uWantedOffset, uint64_t* puStartCluster, uint64_t* puInClusterOffset, uint64_t* puContigousClustersInBytes );
 errno_t  raw_readwrite_write( vnode_t psVnode, uint64_t uOffset, void* pvBuf, uint64_t uLength, uint64_t *piActuallyWritten );
@@ -28,5 +30,10 @@ void        raw_readwrite_zero_fill_de_init( void );
 int         raw_readwrite_zero_fill_fill( hfsmount_t* psMount, uint64_t uOffset, uint32_t uLength );
 errno_t     raw_readwrite_zero_fill_last_block_suffix( vnode_t psVnode );
 
+int         raw_readwrite_readahead_init( void );
+void        raw_readwrite_readahead_de_init( void );
+void        raw_readwrite_readahead_invalidate( vnode_t psVnode );
+void        raw_readwrite_readahead_release( struct filefork* psFork );
+
 
 #endif /* lf_hfs_raw_read_write_h */
@@ -15,6 +15,8 @@
 #include "lf_hfs_utils.h"
 #include "lf_hfs_vnops.h"
 #include "lf_hfs_raw_read_write.h"
+#include "lf_hfs_chash.h"
+#include "lf_hfs_logger.h"
 
 #include <assert.h>
 
@@ -691,10 +693,6 @@ hfs_truncate(struct vnode *vp, off_t length, int flags, int truncateflags)
         return (EISDIR);
     }
 
-    blksize = hfsmp->blockSize;
-    fileblocks = fp->ff_blocks;
-    filebytes = (off_t)fileblocks * (off_t)blksize;
-
     bool caller_has_cnode_lock = (cp->c_lockowner == pthread_self());
 
     if (!caller_has_cnode_lock) {
@@ -703,6 +701,19 @@ hfs_truncate(struct vnode *vp, off_t length, int flags, int truncateflags)
             return error;
     }
 
+    /* Buffered data past the new EOF is dropped, the rest is written out first */
+    if (fp->ff_writeback != NULL) {
+        if (length <= hfs_writeback_offset(fp)) {
+            hfs_writeback_release(hfsmp, fp);
+        } else if ((error = hfs_writeback_flush_locked(vp)) != 0) {
+            goto exit;
+        }
+    }
+
+    blksize = hfsmp->blockSize;
+    fileblocks = fp->ff_blocks;
+    filebytes = (off_t)fileblocks * (off_t)blksize;
+
     if (vnode_islnk(vp) && cp->c_datafork->ff_symlinkptr) {
         hfs_free(cp->c_datafork->ff_symlinkptr);
         cp->c_datafork->ff_symlinkptr = NULL;
@@ -748,6 +759,10 @@ hfs_truncate(struct vnode *vp, off_t length, int flags, int truncateflags)
         error = do_hfs_truncate(vp, length, flags, truncateflags);
     }
 
+    /* Blocks may have been released or zero filled under the read cache */
+    raw_readwrite_readahead_invalidate(vp);
+
+exit:
     if (!caller_has_cnode_lock)
         hfs_unlock(cp);
 
@@ -905,3 +920,370 @@ err_exit:
     hfs_unlock(cp);
     return (retval);
 }
+
+/*
+ * Write-back of appended file data.
+ *
+ * When the mount has a write-back limit, writes that append to a regular
+ * file are copied into a per-fork buffer instead of going to the device.
+ * Space for them is borrowed the same way ExtendFileC does for deferred
+ * allocations (ff_unallocblocks / loanedBlocks), so ENOSPC is still reported
+ * at write time.  The borrowed blocks are allocated in one go, the data is
+ * written and the catalog record is updated only when the buffer is flushed:
+ * on sync, when the limit is reached, before any other kind of write or
+ * truncate, and on reclaim.
+ *
+ * The buffered range is always the tail of the file, [wb_offset, ff_size).
+ * It is only modified or flushed with both the truncate lock and the cnode
+ * lock held exclusive, so readers holding the truncate lock shared can copy
+ * from it directly.  hfs_prepare_fork_for_update keeps the catalog size at
+ * wb_offset until the data has reached the device.
+ */
+#define HFS_WRITEBACK_MIN_CAPACITY  (64 * 1024)
+
+struct hfs_writeback {
+    TAILQ_ENTRY(hfs_writeback) wb_link;     /* on hfs_writeback_list while dirty */
+    cnid_t      wb_fileid;
+    off_t       wb_offset;                  /* file offset of the first buffered byte */
+    size_t      wb_length;
+    size_t      wb_capacity;
+    u_int8_t    *wb_data;
+};
+
+static void
+hfs_writeback_clear(struct hfsmount *hfsmp, struct hfs_writeback *wb)
+{
+    if (wb->wb_length == 0)
+        return;
+
+    lf_lck_mtx_lock(&hfsmp->hfs_writeback_mutex);
+    TAILQ_REMOVE(&hfsmp->hfs_writeback_list, wb, wb_link);
+    hfsmp->hfs_writeback_dirty -= wb->wb_length;
+    lf_lck_mtx_unlock(&hfsmp->hfs_writeback_mutex);
+
+    wb->wb_length = 0;
+}
+
+/*
+ * Does the fork have data in its write-back buffer?  Data is only added
+ * under the truncate lock exclusive, so the answer holds for as long as
+ * the caller keeps the truncate lock shared.
+ */
+bool
+hfs_writeback_pending(struct filefork *fp)
+{
+    struct hfs_writeback *wb = fp->ff_writeback;
+
+    return (wb != NULL && wb->wb_length != 0);
+}
+
+off_t
+hfs_writeback_offset(struct filefork *fp)
+{
+    struct hfs_writeback *wb = fp->ff_writeback;
+
+    if (wb == NULL || wb->wb_length == 0)
+        return fp->ff_size;
+
+    return wb->wb_offset;
+}
+
+/*
+ * Copy the part of [offset, offset + length) that is held in the write-back
+ * buffer to the matching position in data.  Returns the number of bytes
+ * copied.  Caller holds the truncate lock.
+ */
+size_t
+hfs_writeback_read(struct vnode *vp, off_t offset, size_t length, void *data)
+{
+    struct filefork *fp = VTOF(vp);
+    struct hfs_writeback *wb = fp->ff_writeback;
+
+    if (wb == NULL || wb->wb_length == 0 || offset + (off_t)length <= wb->wb_offset)
+        return 0;
+
+    off_t start = MAX(offset, wb->wb_offset);
+    off_t end   = MIN(offset + (off_t)length, wb->wb_offset + (off_t)wb->wb_length);
+    if (end <= start)
+        return 0;
+
+    memcpy((u_int8_t *)data + (start - offset), wb->wb_data + (start - wb->wb_offset), end - start);
+    return (size_t)(end - start);
+}
+
+/*
+ * Write the buffered data to the device.
+ * Caller holds the truncate lock and the cnode lock exclusive.  Readers
+ * only take the truncate lock, so it must be exclusive for them not to see
+ * the buffer emptied while they copy from it.
+ */
+int
+hfs_writeback_flush_locked(struct vnode *vp)
+{
+    struct cnode *cp = VTOC(vp);
+    struct filefork *fp = VTOF(vp);
+    struct hfsmount *hfsmp = VTOHFS(vp);
+    struct hfs_writeback *wb = fp->ff_writeback;
+    int64_t actbytes = 0;
+    u_int64_t written = 0;
+    int lockflags;
+    int retval = 0;
+
+    if (wb == NULL || wb->wb_length == 0)
+        return 0;
+
+    /* The storage is gone, nothing to write to */
+    if (cp->c_flag & C_NOEXISTS) {
+        hfs_writeback_clear(hfsmp, wb);
+        return 0;
+    }
+
+    /*
+     * Turn the borrowed blocks into real ones.  ExtendFileC gives back
+     * all the loaned blocks and allocates them with a single request.
+     */
+    if (fp->ff_unallocblocks != 0) {
+        u_int32_t loanedBlocks = fp->ff_unallocblocks;
+
+        if (hfs_start_transaction(hfsmp) != 0)
+            return EINVAL;
+
+        lockflags = hfs_systemfile_lock(hfsmp, SFL_EXTENTS | SFL_BITMAP, HFS_EXCLUSIVE_LOCK);
+        retval = MacToVFSError(ExtendFileC(hfsmp, (FCB*)fp, 0, 0,
+                                           kEFAllMask | kEFNoClumpMask, &actbytes));
+        if (retval) {
+            fp->ff_unallocblocks = loanedBlocks;
+            cp->c_blocks += loanedBlocks;
+            fp->ff_blocks += loanedBlocks;
+
+            hfs_lock_mount (hfsmp);
+            hfsmp->loanedBlocks += loanedBlocks;
+            hfs_unlock_mount (hfsmp);
+        }
+        hfs_systemfile_unlock(hfsmp, lockflags);
+
+        cp->c_flag |= C_MODIFIED;
+        (void) hfs_update(vp, 0);
+        (void) hfs_volupdate(hfsmp, VOL_UPDATE, 0);
+        hfs_end_transaction(hfsmp);
+
+        if (retval)
+            return retval;
+    }
+
+    off_t offset = wb->wb_offset;
+    retval = raw_readwrite_write(vp, offset, wb->wb_data, wb->wb_length, &written);
+    if (retval == 0 && written != wb->wb_length)
+        retval = EIO;
+
+    hfs_writeback_clear(hfsmp, wb);
+
+    if (retval) {
+        /* Don't leave a tail of never written blocks behind */
+        LFHFS_LOG(LEVEL_ERROR, "hfs_writeback_flush_locked: failed to write buffered data for cnid %u [%d]\n", cp->c_fileid, retval);
+        (void) hfs_truncate(vp, offset, IO_SYNC, 0);
+        return retval;
+    }
+
+    cp->c_flag |= C_MODIFIED;
+    return hfs_update(vp, 0);
+}
+
+int
+hfs_writeback_flush(struct vnode *vp)
+{
+    struct cnode *cp = VTOC(vp);
+    struct hfs_writeback *wb = VTOF(vp)->ff_writeback;
+    int retval;
+
+    if (wb == NULL || wb->wb_length == 0)
+        return 0;
+
+    hfs_lock_truncate(cp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_DEFAULT);
+    hfs_lock(cp, HFS_EXCLUSIVE_LOCK, HFS_LOCK_ALLOW_NOEXISTS);
+
+    retval = hfs_writeback_flush_locked(vp);
+
+    hfs_unlock(cp);
+    hfs_unlock_truncate(cp, HFS_LOCK_DEFAULT);
+
+    return retval;
+}
+
+/*
+ * Flush every buffered file on the mount.
+ */
+int
+hfs_writeback_flush_all(struct hfsmount *hfsmp)
+{
+    struct hfs_writeback *wb;
+    cnid_t *fileids = NULL;
+    u_int32_t count = 0;
+    u_int32_t i = 0;
+    int retval = 0;
+
+    lf_lck_mtx_lock(&hfsmp->hfs_writeback_mutex);
+    TAILQ_FOREACH(wb, &hfsmp->hfs_writeback_list, wb_link) {
+        count++;
+    }
+    if (count) {
+        fileids = hfs_malloc(sizeof(cnid_t) * count);
+        if (fileids) {
+            TAILQ_FOREACH(wb, &hfsmp->hfs_writeback_list, wb_link) {
+                fileids[i++] = wb->wb_fileid;
+            }
+        }
+    }
+    lf_lck_mtx_unlock(&hfsmp->hfs_writeback_mutex);
+
+    if (count && fileids == NULL)
+        return ENOMEM;
+
+    /*
+     * The buffers may go away as soon as the list lock is dropped, so look
+     * the files up again.  The lookup reference keeps the vnode around while
+     * we flush, and is dropped with hfs_vnop_reclaim as in hfs_GetInfoByID.
+     */
+    for (i = 0; i < count; i++) {
+        struct vnode *vp = hfs_chash_getvnode(hfsmp, fileids[i], 0, 1, 1);
+        if (vp == NULL)
+            continue;
+
+        int error = hfs_writeback_flush(vp);
+        if (error && retval == 0)
+            retval = error;
+
+        hfs_vnop_reclaim(vp);
+    }
+
+    if (fileids)
+        hfs_free(fileids);
+
+    return retval;
+}
+
+/*
+ * Buffer an appending write.
+ *
+ * Caller holds the truncate lock and the cnode lock exclusive.  Returns
+ * EAGAIN, with nothing left in the buffer, when the write has to go
+ * through the regular path.
+ */
+int
+hfs_writeback_write(struct vnode *vp, off_t offset, size_t length, const void *data)
+{
+    struct cnode *cp = VTOC(vp);
+    struct filefork *fp = VTOF(vp);
+    struct hfsmount *hfsmp = VTOHFS(vp);
+    struct hfs_writeback *wb = fp->ff_writeback;
+    u_int64_t limit = hfsmp->hfs_writeback_limit;
+    int retval;
+
+    if (limit == 0 || length == 0 || length > limit ||
+        fp != cp->c_datafork || vnode_issystem(vp) ||
+        (cp->c_flag & (C_NOEXISTS | C_DELETED)) ||
+        offset != fp->ff_size) {
+        goto flush;
+    }
+
+    /* Keep the mount below its limit, starting with our own data */
+    if (hfsmp->hfs_writeback_dirty + length > limit) {
+        if ((retval = hfs_writeback_flush_locked(vp)) != 0)
+            return retval;
+        if (hfsmp->hfs_writeback_dirty + length > limit)
+            return EAGAIN;
+    }
+
+    if (wb == NULL) {
+        wb = hfs_mallocz(sizeof(*wb));
+        if (wb == NULL)
+            return EAGAIN;
+        wb->wb_fileid = cp->c_fileid;
+        fp->ff_writeback = wb;
+    }
+
+    if (wb->wb_length + length > wb->wb_capacity) {
+        size_t capacity = MAX(wb->wb_capacity, HFS_WRITEBACK_MIN_CAPACITY);
+        while (capacity < wb->wb_length + length)
+            capacity *= 2;
+        capacity = MIN(capacity, limit);
+
+        u_int8_t *newdata = hfs_malloc(capacity);
+        if (newdata == NULL)
+            goto flush;
+        if (wb->wb_length)
+            memcpy(newdata, wb->wb_data, wb->wb_length);
+        if (wb->wb_data)
+            hfs_free(wb->wb_data);
+        wb->wb_data = newdata;
+        wb->wb_capacity = capacity;
+    }
+
+    /*
+     * Borrow the blocks past the current allocation.  This is the
+     * kEFDeferMask path of ExtendFileC, except that it never falls back
+     * to a real allocation, which would need a transaction.
+     */
+    off_t filebytes = blk_to_bytes(fp->ff_blocks, hfsmp->blockSize);
+    off_t writelimit = offset + length;
+    if (writelimit > filebytes) {
+        u_int32_t blocks = (u_int32_t)howmany(writelimit - filebytes, hfsmp->blockSize);
+        bool borrowed = false;
+
+        hfs_lock_mount(hfsmp);
+        if (blocks < hfs_freeblks(hfsmp, 1)) {
+            hfsmp->loanedBlocks += blocks;
+            borrowed = true;
+        }
+        hfs_unlock_mount(hfsmp);
+
+        /* Let the regular path report ENOSPC or do a partial write */
+        if (!borrowed)
+            goto flush;
+
+        fp->ff_unallocblocks += blocks;
+        cp->c_blocks         += blocks;
+        fp->ff_blocks        += blocks;
+        cp->c_flag |= C_MINOR_MOD;
+    }
+
+    if (wb->wb_length == 0) {
+        wb->wb_offset = offset;
+        lf_lck_mtx_lock(&hfsmp->hfs_writeback_mutex);
+        TAILQ_INSERT_TAIL(&hfsmp->hfs_writeback_list, wb, wb_link);
+        lf_lck_mtx_unlock(&hfsmp->hfs_writeback_mutex);
+    }
+    memcpy(wb->wb_data + wb->wb_length, data, length);
+    wb->wb_length += length;
+
+    lf_lck_mtx_lock(&hfsmp->hfs_writeback_mutex);
+    hfsmp->hfs_writeback_dirty += length;
+    lf_lck_mtx_unlock(&hfsmp->hfs_writeback_mutex);
+
+    fp->ff_size = writelimit;
+    return 0;
+
+flush:
+    if ((retval = hfs_writeback_flush_locked(vp)) != 0)
+        return retval;
+    return EAGAIN;
+}
+
+/*
+ * Free the write-back state of a fork that is going away.
+ * Any data still buffered is dropped.
+ */
+void
+hfs_writeback_release(struct hfsmount *hfsmp, struct filefork *fp)
+{
+    struct hfs_writeback *wb = fp->ff_writeback;
+
+    if (wb == NULL)
+        return;
+
+    hfs_writeback_clear(hfsmp, wb);
+    if (wb->wb_data)
+        hfs_free(wb->wb_data);
+    hfs_free(wb);
+    fp->ff_writeback = NULL;
+}
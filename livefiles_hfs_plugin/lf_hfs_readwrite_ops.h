@@ -30,4 +30,13 @@ int hfs_release_storage (struct hfsmount *hfsmp, struct filefork *datafork, stru
 int hfs_truncate(struct vnode *vp, off_t length, int flags, int truncateflags);
 int hfs_vnop_preallocate(struct vnode * vp, LIFilePreallocateArgs_t* psPreAllocReq, LIFilePreallocateArgs_t* psPreAllocRes);
 
+int    hfs_writeback_write(struct vnode *vp, off_t offset, size_t length, const void *data);
+size_t hfs_writeback_read(struct vnode *vp, off_t offset, size_t length, void *data);
+off_t  hfs_writeback_offset(struct filefork *fp);
+bool   hfs_writeback_pending(struct filefork *fp);
+int    hfs_writeback_flush_locked(struct vnode *vp);
+int    hfs_writeback_flush(struct vnode *vp);
+int    hfs_writeback_flush_all(struct hfsmount *hfsmp);
+void   hfs_writeback_release(struct hfsmount *hfsmp, struct filefork *fp);
+
 #endif /* lf_hfs_readwrite_ops_h */
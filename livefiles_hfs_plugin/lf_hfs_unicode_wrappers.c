@@ -5,6 +5,8 @@
 //  Created by Yakov Ben Zaken on 22/03/2018.
 //
 
+#include <string.h>
+
 #include "lf_hfs_unicode_wrappers.h"
 #include "lf_hfs_ucs_string_cmp_data.h"
 #include "lf_hfs_sbunicode.h"
@@ -34,6 +36,11 @@ static u_int32_t
 HexStringToInteger( u_int32_t length, const u_int8_t *hexStr );
 
 
+static Boolean
+FastLatinCompare( ConstUniCharArrayPtr *str1, ItemCount *length1,
+                  ConstUniCharArrayPtr *str2, ItemCount *length2, int32_t *result );
+
+
 /*
  * Get filename extension (if any) as a C string
  */
@@ -143,9 +150,24 @@ GetFilenameExtension(ItemCount length, ConstUniCharArrayPtr unicodeStr, char * e
 //        else
 //            return 1;
 //
+//    Before any of that, FastLatinCompare walks the common Latin-1 part of both
+//    strings several characters at a time; FastUnicodeCompareScalar is the table
+//    walk on its own.
+//
+
+int32_t FastUnicodeCompare ( ConstUniCharArrayPtr str1, ItemCount length1,
+                            ConstUniCharArrayPtr str2, ItemCount length2)
+{
+    int32_t result;
+
+    if (FastLatinCompare(&str1, &length1, &str2, &length2, &result))
+        return result;
+
+    return FastUnicodeCompareScalar(str1, length1, str2, length2);
+}
 
-int32_t FastUnicodeCompare ( register ConstUniCharArrayPtr str1, register ItemCount length1,
-                            register ConstUniCharArrayPtr str2, register ItemCount length2)
+int32_t FastUnicodeCompareScalar ( register ConstUniCharArrayPtr str1, register ItemCount length1,
+                                  register ConstUniCharArrayPtr str2, register ItemCount length2)
 {
     register u_int16_t     c1,c2;
     register u_int16_t     temp;
@@ -201,6 +223,161 @@ int32_t FastUnicodeCompare ( register ConstUniCharArrayPtr str1, register ItemCo
 }
 
 
+/*
+ * Latin-1 fast path for FastUnicodeCompare
+ *
+ * Characters below 0x100 are never ignorable and fold one-to-one through
+ * gLatinCaseFold, so as long as both strings stay in that range they can be
+ * compared position by position.  Code units are loaded four to a 64-bit word
+ * and compared eight at a time.  ASCII letters are folded with word-wide
+ * arithmetic (bit 15 of each lane catches the borrow of the range checks), so
+ * only a word that differs after folding, or that holds a Latin-1 supplement
+ * character, needs the table.
+ *
+ * Identical code units are skipped whatever they are, since an equal prefix
+ * cannot change the result; this also steps over equal runs of non-Latin text.
+ *
+ * Returns true with *result set once a difference is found.  Otherwise both
+ * strings are advanced past what was compared and the table walk finishes.
+ */
+#define kLatinWordUnits         4
+#define kLatinWordHighBytes     0xFF00FF00FF00FF00ULL
+#define kLatinWordSupplement    0x0080008000800080ULL
+#define kLatinWordLaneTop       0x8000800080008000ULL
+#define kLatinWordLaneOnes      0x0001000100010001ULL
+#define kLatinWordNotLatin      2
+
+static inline u_int64_t
+LatinLoadWord( ConstUniCharArrayPtr str )
+{
+    u_int64_t word;
+
+    memcpy(&word, str, sizeof(word));
+    return word;
+}
+
+/* Fold 'A'..'Z' in every lane of a word of ASCII characters */
+static inline u_int64_t
+LatinFoldASCIIWord( u_int64_t word )
+{
+    u_int64_t biased    = word | kLatinWordLaneTop;
+    u_int64_t atLeastA  = biased - 0x41 * kLatinWordLaneOnes;
+    u_int64_t pastZ     = biased - 0x5B * kLatinWordLaneOnes;
+
+    return word + (((atLeastA & ~pastZ) & kLatinWordLaneTop) >> 10);
+}
+
+/* Compare one word of each string: 0, -1 or 1 like FastUnicodeCompare, or kLatinWordNotLatin */
+static inline int32_t
+LatinCompareWord( ConstUniCharArrayPtr str1, ConstUniCharArrayPtr str2 )
+{
+    u_int64_t word1 = LatinLoadWord(str1);
+    u_int64_t word2 = LatinLoadWord(str2);
+    u_int16_t c1, c2;
+
+    if (word1 == word2)
+        return 0;
+
+    if ((word1 | word2) & kLatinWordHighBytes)
+        return kLatinWordNotLatin;
+
+    if (((word1 | word2) & kLatinWordSupplement) == 0 &&
+        LatinFoldASCIIWord(word1) == LatinFoldASCIIWord(word2))
+        return 0;
+
+    for (int i = 0; i < kLatinWordUnits; ++i) {
+        c1 = gLatinCaseFold[str1[i]];
+        c2 = gLatinCaseFold[str2[i]];
+        if (c1 != c2)
+            return (c1 < c2) ? -1 : 1;
+    }
+    return 0;
+}
+
+static Boolean
+FastLatinCompare( ConstUniCharArrayPtr *str1, ItemCount *length1,
+                  ConstUniCharArrayPtr *str2, ItemCount *length2, int32_t *result )
+{
+    ConstUniCharArrayPtr s1 = *str1;
+    ConstUniCharArrayPtr s2 = *str2;
+    ItemCount length = (*length1 < *length2) ? *length1 : *length2;
+    ItemCount done = 0;
+    int32_t cmp = 0;
+
+    while (length - done >= 2 * kLatinWordUnits) {
+        if ((cmp = LatinCompareWord(s1 + done, s2 + done)) != 0)
+            break;
+        if ((cmp = LatinCompareWord(s1 + done + kLatinWordUnits, s2 + done + kLatinWordUnits)) != 0) {
+            done += kLatinWordUnits;
+            break;
+        }
+        done += 2 * kLatinWordUnits;
+    }
+
+    if (cmp == 0) {
+        while (length - done >= kLatinWordUnits) {
+            if ((cmp = LatinCompareWord(s1 + done, s2 + done)) != 0)
+                break;
+            done += kLatinWordUnits;
+        }
+    }
+
+    if (cmp != 0 && cmp != kLatinWordNotLatin) {
+        *result = cmp;
+        return true;
+    }
+
+    *str1 = s1 + done;
+    *str2 = s2 + done;
+    *length1 -= done;
+    *length2 -= done;
+    return false;
+}
+
+
+/*
+ * FastUnicodeFoldPrefix
+ *
+ * Case fold the start of a string the way FastUnicodeCompare sees it: ignorable
+ * characters are dropped and the rest go through the same tables.  Comparing
+ * two folded strings unit by unit, with the shorter one padded with zeros,
+ * orders them exactly like FastUnicodeCompare.
+ *
+ * Up to maxFolded units are stored in folded.  Returns the number stored, and
+ * *complete tells whether that is all of the string.
+ */
+ItemCount FastUnicodeFoldPrefix ( ConstUniCharArrayPtr str, ItemCount length,
+                                  u_int16_t *folded, ItemCount maxFolded, Boolean *complete )
+{
+    u_int16_t   c;
+    u_int16_t   temp;
+    u_int16_t*  lowerCaseTable = (u_int16_t*) gLowerCaseTable;
+    ItemCount   count = 0;
+
+    while (length) {
+        c = *(str++);
+        --length;
+
+        if (c < 0x0100) {
+            c = gLatinCaseFold[c];
+        } else if ((temp = lowerCaseTable[c>>8]) != 0) {
+            c = lowerCaseTable[temp + (c & 0x00FF)];
+            if (c == 0)
+                continue;   /* ignorable */
+        }
+
+        if (count == maxFolded) {
+            *complete = false;
+            return count;
+        }
+        folded[count++] = c;
+    }
+
+    *complete = true;
+    return count;
+}
+
+
 /*
  * UnicodeBinaryCompare
  * Compare two UTF-16 strings and perform case-sensitive (binary) matching against them.
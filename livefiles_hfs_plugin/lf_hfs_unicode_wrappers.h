@@ -13,6 +13,8 @@
 #include "lf_hfs_file_mgr_internal.h"
 
 int32_t FastUnicodeCompare      ( register ConstUniCharArrayPtr str1, register ItemCount len1, register ConstUniCharArrayPtr str2, register ItemCount len2);
+int32_t FastUnicodeCompareScalar( register ConstUniCharArrayPtr str1, register ItemCount len1, register ConstUniCharArrayPtr str2, register ItemCount len2);
+ItemCount FastUnicodeFoldPrefix ( ConstUniCharArrayPtr str, ItemCount length, u_int16_t *folded, ItemCount maxFolded, Boolean *complete );
 
 int32_t UnicodeBinaryCompare    ( register ConstUniCharArrayPtr str1, register ItemCount len1, register ConstUniCharArrayPtr str2, register ItemCount len2 );
 
@@ -31,6 +31,7 @@
 #include "lf_hfs_volume_allocation.h"
 #include "lf_hfs_catalog.h"
 #include "lf_hfs_link.h"
+#include "lf_hfs_lookup.h"
 #include "lf_hfs_vnops.h"
 #include "lf_hfs_generic_buf.h"
 #include "lf_hfs_fsops_handler.h"
@@ -43,6 +44,7 @@
 #define kPreDefinedBlockCount 4096
 
 static void hfs_locks_destroy(struct hfsmount *hfsmp);
+static void hfs_set_buf_cache_capacity(struct hfsmount *hfsmp);
 static int  hfs_mountfs(struct vnode *devvp, struct mount *mp, struct hfs_mount_args *args);
 
 
@@ -442,6 +444,9 @@ static int hfs_InitialMount(struct vnode *devvp, struct mount *mp, struct hfs_mo
     /* Init the ID lookup hashtable */
     hfs_idhash_init (*hfsmp);
 
+    /* Init the name cache, lookups go to the catalog if this fails */
+    hfs_namecache_init(*hfsmp);
+
     /*
      * See if the disk supports unmap (trim).
      *
@@ -466,6 +471,8 @@ static int hfs_InitialMount(struct vnode *devvp, struct mount *mp, struct hfs_mo
      */
     lf_lck_mtx_init(&(*hfsmp)->hfs_mutex);
     lf_lck_mtx_init(&(*hfsmp)->sync_mutex);
+    lf_lck_mtx_init(&(*hfsmp)->hfs_writeback_mutex);
+    TAILQ_INIT(&(*hfsmp)->hfs_writeback_list);
     lf_lck_rw_init(&(*hfsmp)->hfs_global_lock);
     lf_lck_spin_init(&(*hfsmp)->vcbFreeExtLock);
 
@@ -752,6 +759,7 @@ error_exit:
         hfs_locks_destroy(*hfsmp);
         hfs_delete_chash(*hfsmp);
         hfs_idhash_destroy (*hfsmp);
+        hfs_namecache_destroy(*hfsmp);
 
         hfs_free(*hfsmp);
         *hfsmp = NULL;
@@ -820,6 +828,7 @@ int hfs_ScanVolGetVolName(int iFd, char* pcVolumeName)
         hfs_locks_destroy(hfsmp);
         hfs_delete_chash(hfsmp);
         hfs_idhash_destroy (hfsmp);
+        hfs_namecache_destroy(hfsmp);
         
         hfs_free(hfsmp);
         hfsmp = NULL;
@@ -878,6 +887,9 @@ hfs_mountfs(struct vnode *devvp, struct mount *mp, struct hfs_mount_args *args)
         goto error_exit;
     }
 
+    // Size the buffer cache to hold the B-tree metadata of this volume
+    hfs_set_buf_cache_capacity(hfsmp);
+
     LFHFS_LOG(LEVEL_DEFAULT, "hfs_mountfs: mounted %s on device %s\n", (hfsmp->vcbVN[0] ? (const char*) hfsmp->vcbVN : "unknown"), "unknown device");
 
     hfs_flushvolumeheader(hfsmp, 0);
@@ -894,6 +906,7 @@ error_exit:
         hfs_locks_destroy(hfsmp);
         hfs_delete_chash(hfsmp);
         hfs_idhash_destroy (hfsmp);
+        hfs_namecache_destroy(hfsmp);
 
         hfs_free(hfsmp);
         hfsmp = NULL;
@@ -901,6 +914,31 @@ error_exit:
     return (retval);
 }
 
+/*
+ * Add the catalog, extents and attributes B-trees of this volume to the
+ * buffer cache capacity. The contribution is saved in the hfsmount and
+ * given back by hfs_unmount.
+ */
+static void
+hfs_set_buf_cache_capacity(struct hfsmount *hfsmp)
+{
+    uint64_t uMetadataSize = 0;
+
+    if (hfsmp->hfs_catalog_vp)
+        uMetadataSize += VTOF(hfsmp->hfs_catalog_vp)->ff_size;
+    if (hfsmp->hfs_extents_vp)
+        uMetadataSize += VTOF(hfsmp->hfs_extents_vp)->ff_size;
+    if (hfsmp->hfs_attribute_vp)
+        uMetadataSize += VTOF(hfsmp->hfs_attribute_vp)->ff_size;
+
+    // Most cached buffers are B-tree nodes, so size the entry count by the smallest node size
+    uint64_t uMaxEntries = uMetadataSize / kHFSPlusCatalogMinNodeSize;
+
+    hfsmp->hfs_buf_cache_entries = (u_int32_t)MIN(uMaxEntries, BUF_CACHE_MAX_ENTRIES_HARD_LIMIT);
+    hfsmp->hfs_buf_cache_data    = MIN(uMetadataSize, BUF_CACHE_MAX_DATA_HARD_LIMIT);
+    lf_hfs_generic_buf_cache_add_capacity(hfsmp->hfs_buf_cache_entries, hfsmp->hfs_buf_cache_data);
+}
+
 /*
  * Destroy all locks, mutexes and spinlocks in hfsmp on unmount or failed mount
  */
@@ -910,6 +948,7 @@ hfs_locks_destroy(struct hfsmount *hfsmp)
 
     lf_lck_mtx_destroy(&hfsmp->hfs_mutex);
     lf_lck_mtx_destroy(&hfsmp->sync_mutex);
+    lf_lck_mtx_destroy(&hfsmp->hfs_writeback_mutex);
     lf_lck_rw_destroy(&hfsmp->hfs_global_lock);
     lf_lck_spin_destroy(&hfsmp->vcbFreeExtLock);
 
@@ -1686,10 +1725,34 @@ hfs_vget(struct hfsmount *hfsmp, cnid_t cnid, struct vnode **vpp, int skiplock,
         int lockflags;
         cnid_t pid;
         const char *nameptr;
+        BTReadSection btsection;
+        int tries;
+
+        /* Without the catalog lock first, see hfs_lookup */
+        for (tries = 0; tries < HFS_BTREAD_TRIES; tries++) {
+            error = hfs_systemfile_read_begin(hfsmp, SFL_CATALOG, &btsection);
+            if (error == EAGAIN)
+                continue;
+            if (error != 0)
+                break;
 
-        lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
-        error = cat_idlookup(hfsmp, cnid, 0, 0, &cndesc, &cnattr, &cnfork);
-        hfs_systemfile_unlock(hfsmp, lockflags);
+            error = cat_idlookup(hfsmp, cnid, 0, 0, &cndesc, &cnattr, &cnfork);
+            if (hfs_systemfile_read_end(hfsmp, SFL_CATALOG, &btsection) == 0)
+                break;
+            if (error == 0)
+                cat_releasedesc(&cndesc);
+            error = EAGAIN;
+        }
+        if (error == EAGAIN || error == ENOTSUP) {
+            __atomic_add_fetch(&hfsmp->hfs_btread_fallbacks, 1, __ATOMIC_RELAXED);
+            bzero(&cndesc, sizeof(cndesc));
+            bzero(&cnattr, sizeof(cnattr));
+            bzero(&cnfork, sizeof(cnfork));
+
+            lockflags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
+            error = cat_idlookup(hfsmp, cnid, 0, 0, &cndesc, &cnattr, &cnfork);
+            hfs_systemfile_unlock(hfsmp, lockflags);
+        }
 
         if (error) {
             *vpp = NULL;
@@ -1828,6 +1891,286 @@ hfs_GetInfoByID(struct hfsmount *hfsmp, cnid_t cnid, UVFSFileAttributes *file_at
     return (error);
 }
 
+/*
+ * Bulk ID resolution.
+ *
+ * The requested IDs are sorted, so that consecutive thread records (keyed by
+ * cnid) and file records (keyed by parent id) are usually found in the leaf
+ * node of the previous lookup. Attributes are built straight from the catalog
+ * record without instantiating a cnode. IDs whose attributes depend on more
+ * than the catalog record (in-core cnodes, hard links, compressed files), or
+ * which could not be resolved, go through hfs_GetInfoByID.
+ *
+ * Large requests are split into contiguous ranges resolved in parallel, each
+ * holding the catalog lock shared for one batch at a time.
+ */
+#define SCANIDS_BATCH_SIZE          (64)
+#define SCANIDS_PARALLEL_MIN_IDS    (4096)
+#define SCANIDS_MAX_THREADS         (4)
+
+typedef struct {
+    cnid_t      uCnid;
+    uint32_t    uIndex;     // Position in the caller's ID array
+} ScanIDsEntry_s;
+
+typedef struct {
+    UVFSFileAttributes  sAttrs;
+    char                pcName[MAX_UTF8_NAME_LENGTH];
+    int                 iErr;
+} ScanIDsResult_s;
+
+typedef struct {
+    struct hfsmount*        psHfsmp;
+    ScanIDsEntry_s*         psEntries;
+    uint32_t                uCount;
+    scanids_match_block_t   fMatchCallback;
+    pthread_mutex_t*        psCallbackLock;
+    int*                    piError;        // First error hit by any range
+} ScanIDsRange_s;
+
+static int
+hfs_ScanIDsCompare(const void *pvA, const void *pvB)
+{
+    const ScanIDsEntry_s* psA = pvA;
+    const ScanIDsEntry_s* psB = pvB;
+
+    if (psA->uCnid != psB->uCnid)
+        return (psA->uCnid < psB->uCnid) ? -1 : 1;
+    return (psA->uIndex < psB->uIndex) ? -1 : (psA->uIndex > psB->uIndex);
+}
+
+/*
+ * Fill psAttrs and pcName for cnid from its catalog record.
+ * Returns EAGAIN when the ID has to be resolved through hfs_GetInfoByID.
+ * The catalog lock must be held.
+ */
+static int
+hfs_GetInfoByIDFromCatalog(struct hfsmount *hfsmp, cnid_t cnid, u_int32_t *puThreadHint, u_int32_t *puRecordHint,
+                           UVFSFileAttributes *psAttrs, char pcName[MAX_UTF8_NAME_LENGTH])
+{
+    struct cat_desc sDesc;
+    struct cat_attr sAttr;
+    struct cat_fork sFork;
+    int iErr = 0;
+
+    /* IDs hfs_vget would refuse, let it report them */
+    if ((cnid < kHFSFirstUserCatalogNodeID && cnid != kHFSRootFolderID) ||
+        cnid == hfsmp->hfs_private_desc[FILE_HARDLINKS].cd_cnid ||
+        cnid == hfsmp->hfs_private_desc[DIR_HARDLINKS].cd_cnid)
+    {
+        return EAGAIN;
+    }
+
+    /* An in-core cnode may be newer than its catalog record */
+    if (hfs_chash_snoop(hfsmp, cnid, 1, NULL, NULL) == 0)
+    {
+        return EAGAIN;
+    }
+
+    bzero(&sDesc, sizeof(sDesc));
+    bzero(&sAttr, sizeof(sAttr));
+    bzero(&sFork, sizeof(sFork));
+
+    if (cat_idlookup_withhints(hfsmp, cnid, 0, 0, puThreadHint, puRecordHint, &sDesc, &sAttr, &sFork) != 0)
+    {
+        return EAGAIN;
+    }
+
+    enum vtype eType = IFTOVT(sAttr.ca_mode);
+    if ((eType == VBAD) ||
+        (sAttr.ca_bsdflags & UF_COMPRESSED) ||
+        (sDesc.cd_cnid != sAttr.ca_fileid) ||
+        (sAttr.ca_recflags & kHFSHasLinkChainMask) ||
+        (sDesc.cd_parentcnid == hfsmp->hfs_private_desc[FILE_HARDLINKS].cd_cnid) ||
+        (sDesc.cd_parentcnid == hfsmp->hfs_private_desc[DIR_HARDLINKS].cd_cnid) ||
+        (eType != VDIR && ((sAttr.ca_blocks < sFork.cf_blocks) || (howmany((uint64_t)sFork.cf_size, hfsmp->blockSize) > sFork.cf_blocks))))
+    {
+        iErr = EAGAIN;
+        goto exit;
+    }
+
+    /* Same as vnode_GetAttrInternal */
+    memset(psAttrs, 0, sizeof(UVFSFileAttributes));
+    psAttrs->fa_validmask           = VALID_OUT_ATTR_MASK;
+    psAttrs->fa_gid                 = sAttr.ca_gid;
+    psAttrs->fa_uid                 = sAttr.ca_uid;
+    psAttrs->fa_mode                = sAttr.ca_mode & ALL_UVFS_MODES;
+    psAttrs->fa_type                = VTOUVFS(eType);
+    psAttrs->fa_atime.tv_sec        = sAttr.ca_atime;
+    psAttrs->fa_ctime.tv_sec        = sAttr.ca_ctime;
+    psAttrs->fa_mtime.tv_sec        = sAttr.ca_mtime;
+    psAttrs->fa_birthtime.tv_sec    = sAttr.ca_itime;
+    psAttrs->fa_fileid              = sAttr.ca_fileid;
+    psAttrs->fa_parentid            = sDesc.cd_parentcnid;
+    psAttrs->fa_bsd_flags           = sAttr.ca_bsdflags;
+
+    if (eType == VDIR)
+    {
+        psAttrs->fa_allocsize   = 0;
+        psAttrs->fa_size        = (sAttr.ca_entries + 2) * AVERAGE_HFSDIRENTRY_SIZE;
+        psAttrs->fa_nlink       = sAttr.ca_entries + 2;
+    }
+    else
+    {
+        psAttrs->fa_allocsize   = sFork.cf_blocks * hfsmp->blockSize;
+        psAttrs->fa_size        = sFork.cf_size;
+        psAttrs->fa_nlink       = 1;
+    }
+
+    if (cnid == kHFSRootFolderID)
+        pcName[0] = 0;
+    else if (sDesc.cd_nameptr != NULL)
+        strlcpy(pcName, (const char*) sDesc.cd_nameptr, MAX_UTF8_NAME_LENGTH);
+    else
+        iErr = EAGAIN;
+
+exit:
+    cat_releasedesc(&sDesc);
+    return iErr;
+}
+
+static void
+hfs_ScanIDsRange(ScanIDsRange_s *psRange)
+{
+    struct hfsmount* hfsmp = psRange->psHfsmp;
+    u_int32_t uThreadHint = 0;
+    u_int32_t uRecordHint = 0;
+
+    ScanIDsResult_s* psResults = hfs_malloc(sizeof(ScanIDsResult_s) * SCANIDS_BATCH_SIZE);
+    if (psResults == NULL)
+    {
+        lf_lck_mtx_lock(psRange->psCallbackLock);
+        if (*psRange->piError == 0)
+            *psRange->piError = ENOMEM;
+        lf_lck_mtx_unlock(psRange->psCallbackLock);
+        return;
+    }
+
+    for (uint32_t uStart = 0; uStart < psRange->uCount; uStart += SCANIDS_BATCH_SIZE)
+    {
+        uint32_t uBatch = MIN(SCANIDS_BATCH_SIZE, psRange->uCount - uStart);
+        ScanIDsEntry_s* psEntries = &psRange->psEntries[uStart];
+
+        if (__atomic_load_n(psRange->piError, __ATOMIC_RELAXED) != 0)
+            break;
+
+        int iLockFlags = hfs_systemfile_lock(hfsmp, SFL_CATALOG, HFS_SHARED_LOCK);
+        for (uint32_t u = 0; u < uBatch; u++)
+        {
+            psResults[u].iErr = hfs_GetInfoByIDFromCatalog(hfsmp, psEntries[u].uCnid, &uThreadHint, &uRecordHint,
+                                                           &psResults[u].sAttrs, psResults[u].pcName);
+        }
+        hfs_systemfile_unlock(hfsmp, iLockFlags);
+
+        for (uint32_t u = 0; u < uBatch; u++)
+        {
+            int iErr = psResults[u].iErr;
+            if (iErr == EAGAIN)
+            {
+                memset(psResults[u].pcName, 0, MAX_UTF8_NAME_LENGTH);
+                iErr = hfs_GetInfoByID(hfsmp, psEntries[u].uCnid, &psResults[u].sAttrs, psResults[u].pcName);
+                if (iErr == ENOENT)
+                    continue;
+            }
+
+            lf_lck_mtx_lock(psRange->psCallbackLock);
+            if (*psRange->piError == 0)
+            {
+                if (iErr == 0)
+                {
+                    if (psEntries[u].uCnid == kHFSRootFolderID) {
+                        psResults[u].sAttrs.fa_parentid = psResults[u].sAttrs.fa_fileid;
+                    }
+                    LFHFS_LOG(LEVEL_DEBUG, "scan found item %llu parent %llu",
+                              psResults[u].sAttrs.fa_parentid, psResults[u].sAttrs.fa_fileid);
+                    psRange->fMatchCallback((int) psEntries[u].uIndex, &psResults[u].sAttrs, psResults[u].pcName);
+                }
+                else
+                {
+                    LFHFS_LOG(LEVEL_DEBUG, "hfs_ScanIDs: hfs_GetInfoByID failed with error %u\n", iErr);
+                    __atomic_store_n(psRange->piError, iErr, __ATOMIC_RELAXED);
+                }
+            }
+            lf_lck_mtx_unlock(psRange->psCallbackLock);
+
+            if (iErr != 0)
+                break;
+        }
+    }
+
+    hfs_free(psResults);
+}
+
+static void*
+hfs_ScanIDsThread(void *pvArg)
+{
+    hfs_ScanIDsRange((ScanIDsRange_s*) pvArg);
+    return NULL;
+}
+
+int
+hfs_ScanIDs(struct hfsmount *hfsmp, const uint64_t* puFileIDArray, unsigned int uFileIDCount, scanids_match_block_t fMatchCallback)
+{
+    int iErr = 0;
+    uint32_t uCount = 0;
+    pthread_mutex_t sCallbackLock;
+
+    ScanIDsEntry_s* psEntries = hfs_malloc(sizeof(ScanIDsEntry_s) * MAX(uFileIDCount, 1));
+    if (psEntries == NULL)
+        return ENOMEM;
+
+    for (uint32_t uIDCounter = 0; uIDCounter < uFileIDCount; uIDCounter++)
+    {
+        //if we got to the rootParentID just continue
+        if ((cnid_t)puFileIDArray[uIDCounter] == kHFSRootParentID)
+            continue;
+
+        psEntries[uCount].uCnid  = (cnid_t)puFileIDArray[uIDCounter];
+        psEntries[uCount].uIndex = uIDCounter;
+        uCount++;
+    }
+    qsort(psEntries, uCount, sizeof(ScanIDsEntry_s), hfs_ScanIDsCompare);
+
+    lf_lck_mtx_init(&sCallbackLock);
+
+    uint32_t uThreads = 1;
+    if (uCount >= SCANIDS_PARALLEL_MIN_IDS)
+        uThreads = MIN(SCANIDS_MAX_THREADS, uCount / (SCANIDS_PARALLEL_MIN_IDS / SCANIDS_MAX_THREADS));
+
+    ScanIDsRange_s psRanges[SCANIDS_MAX_THREADS];
+    pthread_t      psThreads[SCANIDS_MAX_THREADS];
+    bool           pbStarted[SCANIDS_MAX_THREADS] = {false};
+    uint32_t       uPerThread = (uCount + uThreads - 1) / uThreads;
+
+    for (uint32_t u = 0; u < uThreads; u++)
+    {
+        uint32_t uFirst = u * uPerThread;
+        psRanges[u].psHfsmp         = hfsmp;
+        psRanges[u].psEntries       = &psEntries[MIN(uFirst, uCount)];
+        psRanges[u].uCount          = (uFirst < uCount) ? MIN(uPerThread, uCount - uFirst) : 0;
+        psRanges[u].fMatchCallback  = fMatchCallback;
+        psRanges[u].psCallbackLock  = &sCallbackLock;
+        psRanges[u].piError         = &iErr;
+
+        // The first range runs on the calling thread
+        if (u > 0 && pthread_create(&psThreads[u], NULL, hfs_ScanIDsThread, &psRanges[u]) == 0)
+            pbStarted[u] = true;
+    }
+
+    hfs_ScanIDsRange(&psRanges[0]);
+    for (uint32_t u = 1; u < uThreads; u++)
+    {
+        if (pbStarted[u])
+            pthread_join(psThreads[u], NULL);
+        else
+            hfs_ScanIDsRange(&psRanges[u]);
+    }
+
+    lf_lck_mtx_destroy(&sCallbackLock);
+    hfs_free(psEntries);
+    return iErr;
+}
+
 /*
  * Return the root of a filesystem.
  */
@@ -1867,6 +2210,11 @@ int hfs_unmount(struct mount *mp)
         }
     }
 
+    if (hfsmp->hfs_free_index)
+    {
+        hfs_free_extent_index_release(hfsmp);
+    }
+
     /*
      *    Invalidate our caches and release metadata vnodes
      */
@@ -1879,12 +2227,14 @@ int hfs_unmount(struct mount *mp)
     int iFD = hfsmp->hfs_devvp->psFSRecord->iFD;
     // Remove Buffer cache entries realted to the mount
     lf_hfs_generic_buf_cache_clear_by_iFD(iFD);
+    lf_hfs_generic_buf_cache_remove_capacity(hfsmp->hfs_buf_cache_entries, hfsmp->hfs_buf_cache_data);
     
     vnode_rele(hfsmp->hfs_devvp);
     
     hfs_locks_destroy(hfsmp);
     hfs_delete_chash(hfsmp);
     hfs_idhash_destroy(hfsmp);
+    hfs_namecache_destroy(hfsmp);
 
     hfs_assert(TAILQ_EMPTY(&hfsmp->hfs_reserved_ranges[HFS_TENTATIVE_BLOCKS]) && TAILQ_EMPTY(&hfsmp->hfs_reserved_ranges[HFS_LOCKED_BLOCKS]));
     hfs_assert(!hfsmp->lockedBlocks);
@@ -40,5 +40,6 @@ void    hfs_setencodingbits(struct hfsmount *hfsmp, u_int32_t encoding);
 int     hfs_volupdate(struct hfsmount *hfsmp, enum volop op, int inroot);
 int     hfs_vget(struct hfsmount *hfsmp, cnid_t cnid, struct vnode **vpp, int skiplock, int allow_deleted);
 int     hfs_GetInfoByID(struct hfsmount *hfsmp, cnid_t cnid, UVFSFileAttributes *file_attrs, char pcName[MAX_UTF8_NAME_LENGTH]);
+int     hfs_ScanIDs(struct hfsmount *hfsmp, const uint64_t* puFileIDArray, unsigned int uFileIDCount, scanids_match_block_t fMatchCallback);
 int     fsck_hfs(int fd, check_flags_t how);
 #endif /* lf_hfs_vfsops_h */
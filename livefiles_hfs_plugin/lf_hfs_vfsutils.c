@@ -1489,6 +1489,77 @@ hfs_systemfile_unlock(struct hfsmount *hfsmp, int flags)
     }
 }
 
+/*
+ * Read a system file b-tree without its lock.
+ *
+ * Until hfs_systemfile_read_end, b-tree searches of the one system file
+ * in @flags (SFL_CATALOG or SFL_ATTRIBUTE) made by this thread don't need
+ * hfs_systemfile_lock.  Nothing read may be used until
+ * hfs_systemfile_read_end returns 0; if it fails, the reads must be done
+ * again, see HFS_BTREAD_TRIES.
+ *
+ * Returns EAGAIN while a writer is changing the tree structure or several
+ * records that go together (see BTBeginUpdateGroup), so try again.
+ * Returns ENOTSUP when a lockless read isn't possible: the b-tree has
+ * overflow extents (their lookups need the extents lock), the thread
+ * already holds the b-tree lock exclusive, or lockless reads were turned
+ * off (LFHFS_FSATTR_BTREAD_ENABLED).  Take the lock instead.
+ */
+int
+hfs_systemfile_read_begin(struct hfsmount *hfsmp, int flags, BTReadSection *section)
+{
+    struct vnode *vp;
+    struct cnode *cp;
+    OSStatus err;
+
+    if (flags == SFL_CATALOG) {
+        vp = hfsmp->hfs_catalog_vp;
+        cp = hfsmp->hfs_catalog_cp;
+    } else if (flags == SFL_ATTRIBUTE) {
+        vp = hfsmp->hfs_attribute_vp;
+        cp = hfsmp->hfs_attribute_cp;
+    } else {
+        return (ENOTSUP);
+    }
+
+    if (vp == NULL || cp == NULL || cp->c_lockowner == pthread_self() ||
+        overflow_extents(VTOF(vp)) ||
+        __atomic_load_n(&hfsmp->hfs_btread_disabled, __ATOMIC_RELAXED)) {
+        return (ENOTSUP);
+    }
+
+    err = BTBeginReadSection(VTOF(vp), section);
+    if (err == fsBTReadConflictErr) {
+        return (EAGAIN);
+    }
+    if (err != noErr) {
+        return (ENOTSUP);
+    }
+
+    __atomic_add_fetch(&hfsmp->hfs_btread_sections, 1, __ATOMIC_RELAXED);
+    return (0);
+}
+
+/*
+ * End a read started by hfs_systemfile_read_begin.
+ *
+ * Returns 0 if everything read since hfs_systemfile_read_begin is good,
+ * a failed search included, or EAGAIN if a node it read changed since,
+ * so it must be read again.
+ */
+int
+hfs_systemfile_read_end(struct hfsmount *hfsmp, int flags, BTReadSection *section)
+{
+    struct vnode *vp = (flags == SFL_CATALOG) ? hfsmp->hfs_catalog_vp : hfsmp->hfs_attribute_vp;
+
+    if (!BTEndReadSection(VTOF(vp), section)) {
+        __atomic_add_fetch(&hfsmp->hfs_btread_conflicts, 1, __ATOMIC_RELAXED);
+        return (EAGAIN);
+    }
+
+    return (0);
+}
+
 u_int32_t
 hfs_freeblks(struct hfsmount * hfsmp, int wantreserve)
 {
@@ -1574,6 +1645,9 @@ short MacToVFSError(OSErr err)
         case fsBTBadNodeSize:
             return ENXIO;
 
+        case fsBTReadConflictErr:
+            return EAGAIN;
+
         default:
             return EIO;        /*   +5 */
     }
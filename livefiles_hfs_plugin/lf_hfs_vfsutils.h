@@ -10,6 +10,10 @@
 #define lf_hfs_vfsutils_h
 
 #include "lf_hfs.h"
+#include "lf_hfs_btrees_internal.h"
+
+/* Lockless reads that raced a writer are tried this many times, then done under the lock */
+#define HFS_BTREAD_TRIES    (3)
 
 u_int32_t   BestBlockSizeFit(u_int32_t allocationBlockSize, u_int32_t blockSizeLimit, u_int32_t baseMultiple);
 int         hfs_MountHFSPlusVolume(struct hfsmount *hfsmp, HFSPlusVolumeHeader *vhp, off_t embeddedOffset, u_int64_t disksize, bool bFailForDirty);
@@ -25,6 +29,8 @@ void        hfs_lock_mount(struct hfsmount *hfsmp);
 void        hfs_unlock_mount(struct hfsmount *hfsmp);
 int         hfs_systemfile_lock(struct hfsmount *hfsmp, int flags, enum hfs_locktype locktype);
 void        hfs_systemfile_unlock(struct hfsmount *hfsmp, int flags);
+int         hfs_systemfile_read_begin(struct hfsmount *hfsmp, int flags, BTReadSection *section);
+int         hfs_systemfile_read_end(struct hfsmount *hfsmp, int flags, BTReadSection *section);
 u_int32_t   hfs_freeblks(struct hfsmount * hfsmp, int wantreserve);
 short       MacToVFSError(OSErr err);
 
@@ -10,6 +10,7 @@
 #define lf_hfs_vnode_h
 
 #include <sys/_types/_guid_t.h>
+#include <sys/queue.h>
 
 #include "lf_hfs_common.h"
 #include <System/sys/vnode.h>
@@ -81,6 +82,8 @@ typedef struct vnode
         DirData_s sDirData;
     } sExtraData;
 
+    LIST_HEAD(, buf_cache_entry) sBufCacheList;     /* cached buffers of this vnode */
+
     uint32_t uValidNodeMagic2;
 
 } *vnode_t;
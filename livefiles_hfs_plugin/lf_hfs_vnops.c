@@ -1758,6 +1758,10 @@ hfs_prepare_fork_for_update(filefork_t *ff, const struct cat_fork *cf, struct ca
         cf_buf = &ff->ff_data;
 
     off_t max_size = ff->ff_size;
+
+    // Appends still in the write-back buffer are not on disk yet
+    if (ff->ff_writeback)
+        max_size = hfs_writeback_offset(ff);
    
     if (!ff->ff_unallocblocks && ff->ff_size <= max_size)
         return cf; // Nothing to do
@@ -3198,6 +3202,8 @@ out:
 
 int hfs_removefile_callback(GenericLFBuf *psBuff, void *pvArgs) {
     
+    // journal_kill_block consumes a reference, lf_hfs_generic_buf_write_iterate keeps its own
+    lf_hfs_generic_buf_ref(psBuff);
     journal_kill_block(((struct hfsmount *)pvArgs)->jnl, psBuff);
     
     return (0);
@@ -182,6 +182,41 @@ static void remove_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBloc
 static Boolean add_free_extent_cache(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount);
 static void sanity_check_free_ext(struct hfsmount *hfsmp, int check_allocated);
 
+/* Free extent index, see the comment above free_extent_index_update */
+#define HFS_FREE_INDEX_MAX_EXTENTS  (1 << 20)
+
+struct free_extent_node {
+    u_int32_t   startBlock;
+    u_int32_t   blockCount;
+    u_int32_t   priority;
+    u_int32_t   maxCount;       /* largest blockCount in the by-start subtree */
+    struct free_extent_node *startLeft;
+    struct free_extent_node *startRight;
+    struct free_extent_node *lengthLeft;
+    struct free_extent_node *lengthRight;
+};
+
+struct hfs_free_extent_index {
+    struct free_extent_node *byStart;
+    struct free_extent_node *byLength;
+    struct free_extent_node *freeNodes;     /* recycled nodes */
+    u_int32_t   extentCount;
+    u_int32_t   seed;
+};
+
+#define FREE_EXTENT_END(n)      ((u_int64_t)(n)->startBlock + (n)->blockCount)
+#define FREE_EXTENT_LENKEY(n)   (((u_int64_t)(n)->blockCount << 32) | (n)->startBlock)
+
+static void free_extent_index_add(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount);
+static void free_extent_index_remove(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount);
+static OSErr free_extent_index_find_contig(struct hfsmount *hfsmp, u_int32_t startingBlock, u_int32_t endingBlock,
+                                           u_int32_t minBlocks, u_int32_t maxBlocks, Boolean useMetaZone,
+                                           hfs_block_alloc_flags_t flags, u_int32_t *actualStartBlock,
+                                           u_int32_t *actualNumBlocks);
+static OSErr free_extent_index_find_best(struct hfsmount *hfsmp, u_int32_t minBlocks, u_int32_t maxBlocks,
+                                         hfs_block_alloc_flags_t flags, u_int32_t *actualStartBlock,
+                                         u_int32_t *actualNumBlocks);
+
 static void hfs_release_reserved(hfsmount_t *hfsmp, struct rl_entry *range, int list);
 
 
@@ -424,6 +459,17 @@ u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp)
         trimlist.extent_count = 0;
     }
 
+    /*
+     * Build the free extent index as we go; hfs_alloc_scan_range feeds it
+     * every free run it finds.  Read-only mounts never allocate.
+     */
+    if ((hfsmp->hfs_flags & HFS_READ_ONLY) == 0 && hfsmp->hfs_free_index == NULL) {
+        hfsmp->hfs_free_index = hfs_mallocz(sizeof(struct hfs_free_extent_index));
+        if (hfsmp->hfs_free_index) {
+            hfsmp->hfs_free_index->seed = (u_int32_t)random() | 1;
+        }
+    }
+
     while ((blocks_scanned < hfsmp->totalBlocks) && (error == 0)){
 
         error = hfs_alloc_scan_range (hfsmp, blocks_scanned, &blocks_scanned, &trimlist);
@@ -442,6 +488,11 @@ u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp)
             hfs_free(trimlist.extents);
         }
     }
+
+    /* A partial index would hand out allocated blocks */
+    if (error && hfsmp->hfs_free_index) {
+        hfs_free_extent_index_release(hfsmp);
+    }
     
     /*
      * This is in an #if block because hfs_validate_summary prototype and function body
@@ -1615,6 +1666,12 @@ static OSErr hfs_alloc_try_hard(hfsmount_t *hfsmp,
             return err;
     }
 
+    /* Best fit from the free extent index, if we have one */
+    if (hfsmp->hfs_free_index) {
+        return free_extent_index_find_best(hfsmp, min_blocks, max_blocks, flags,
+                                           &extent->startBlock, &extent->blockCount);
+    }
+
     err = BlockFindKnown(hfsmp, max_blocks, &extent->startBlock,
                          &extent->blockCount);
 
@@ -1801,7 +1858,7 @@ static OSErr BlockFindAny(
     OSErr err;
 
     hfsmp = (struct hfsmount*)vcb;
-    if (hfsmp->hfs_flags & HFS_SUMMARY_TABLE) {
+    if ((hfsmp->hfs_flags & HFS_SUMMARY_TABLE) && hfsmp->hfs_free_index == NULL) {
         uint32_t suggested_start;
 
         /*
@@ -1891,6 +1948,17 @@ static OSErr BlockFindAnyBitmap(
         maxBlocks = endingBlock - startingBlock;
     }
 
+    //    The free extent index knows where the first free block is
+    if (hfsmp->hfs_free_index) {
+        err = free_extent_index_find_contig(hfsmp, startingBlock, endingBlock, 1, maxBlocks, useMetaZone,
+                                            flags & ~HFS_ALLOC_TRY_HARD, actualStartBlock, actualNumBlocks);
+        if (err != noErr) {
+            *actualStartBlock = 0;
+            *actualNumBlocks = 0;
+        }
+        return err;
+    }
+
     //
     //    Pre-read the first bitmap block
     //
@@ -2225,6 +2293,8 @@ OSErr BlockMarkAllocatedInternal (
     GenericLFBufPtr  blockRef = NULL;
     u_int32_t        bitsPerBlock;
     u_int32_t        wordsPerBlock;
+    u_int32_t        firstBlock = startingBlock;    //    startingBlock/numBlocks are consumed below
+    u_int32_t        blockCount = numBlocks;
     // XXXdbg
     struct hfsmount *hfsmp = VCBTOHFS(vcb);
 
@@ -2408,6 +2478,14 @@ Exit:
     if (buffer)
         (void)ReleaseBitmapBlock(vcb, blockRef, true);
 
+    //    Reservations leave the bitmap alone, so they leave the index alone too
+    if (err != noErr) {
+        if (hfsmp->hfs_free_index)
+            hfs_free_extent_index_release(hfsmp);
+    } else if (!ISSET(flags, HFS_ALLOC_LOCKED | HFS_ALLOC_TENTATIVE)) {
+        free_extent_index_remove(hfsmp, firstBlock, blockCount);
+    }
+
     return err;
 }
 
@@ -2765,6 +2843,11 @@ Exit:
 
     if (buffer)
         (void)ReleaseBitmapBlock(vcb, blockRef, true);
+
+    if (err == noErr)
+        free_extent_index_add(hfsmp, startingBlock_in, numBlocks_in);
+    else if (hfsmp->hfs_free_index)
+        hfs_free_extent_index_release(hfsmp);
     return err;
 
 Corruption:
@@ -2863,6 +2946,14 @@ static OSErr BlockFindContiguous(
         goto DiskFull;
     }
 
+    if (hfsmp->hfs_free_index) {
+        err = free_extent_index_find_contig(hfsmp, startingBlock, endingBlock, minBlocks, maxBlocks,
+                                            useMetaZone, flags, actualStartBlock, actualNumBlocks);
+        if (err != noErr)
+            goto ErrorExit;
+        return noErr;
+    }
+
     stopBlock = endingBlock - minBlocks + 1;
     currentBlock = startingBlock;
     firstBlock = 0;
@@ -4232,6 +4323,7 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
                         hfs_track_unmap_blocks (hfsmp, free_offset, size, list);
                     }
                     add_free_extent_cache (hfsmp, free_offset, size);
+                    free_extent_index_add (hfsmp, free_offset, size);
                     size = 0;
                     free_offset = 0;
                 }
@@ -4301,6 +4393,7 @@ static int hfs_alloc_scan_range(struct hfsmount *hfsmp, u_int32_t startbit,
             hfs_track_unmap_blocks (hfsmp, free_offset, size, list);
         }
         add_free_extent_cache (hfsmp, free_offset, size);
+        free_extent_index_add (hfsmp, free_offset, size);
     }
 
     /*
@@ -4788,3 +4881,519 @@ static void sanity_check_free_ext(struct hfsmount *hfsmp, int check_allocated)
     }
     lf_lck_spin_unlock(&hfsmp->vcbFreeExtLock);
 }
+
+/*
+ * Free extent index
+ *
+ * An in-memory copy of every free extent on the volume, built while
+ * ScanUnmapBlocks walks the bitmap at mount time and kept in sync by
+ * BlockMarkAllocatedInternal and BlockMarkFreeInternal.  Each extent sits
+ * in two treaps: one ordered by starting block (augmented with the largest
+ * extent in each subtree) and one ordered by (blockCount, startBlock).
+ * That lets BlockFindContiguous and BlockFindAnyBitmap answer first-fit
+ * questions, and hfs_alloc_try_hard answer best-fit questions, without
+ * reading the bitmap.
+ *
+ * The index only describes the bitmap itself; reservations and the
+ * metadata zone are applied when a candidate extent is handed out, the
+ * same way ReadBitmapBlock applies them to a bitmap buffer.
+ *
+ * All operations require the bitmap file lock.  If the index can no longer
+ * be trusted (an allocation failed part way through, or we ran out of
+ * memory), it is torn down and the allocator goes back to the bitmap.
+ */
+
+static void free_extent_index_update(struct free_extent_node *node)
+{
+    u_int32_t maxCount = node->blockCount;
+
+    if (node->startLeft && node->startLeft->maxCount > maxCount)
+        maxCount = node->startLeft->maxCount;
+    if (node->startRight && node->startRight->maxCount > maxCount)
+        maxCount = node->startRight->maxCount;
+    node->maxCount = maxCount;
+}
+
+/* Split the by-start treap into nodes starting before @key and the rest. */
+static void free_extent_index_split_start(struct free_extent_node *root, u_int64_t key,
+                                          struct free_extent_node **left, struct free_extent_node **right)
+{
+    if (root == NULL) {
+        *left = *right = NULL;
+    } else if (root->startBlock < key) {
+        free_extent_index_split_start(root->startRight, key, &root->startRight, right);
+        free_extent_index_update(root);
+        *left = root;
+    } else {
+        free_extent_index_split_start(root->startLeft, key, left, &root->startLeft);
+        free_extent_index_update(root);
+        *right = root;
+    }
+}
+
+static struct free_extent_node *free_extent_index_merge_start(struct free_extent_node *left,
+                                                              struct free_extent_node *right)
+{
+    if (left == NULL)
+        return right;
+    if (right == NULL)
+        return left;
+
+    if (left->priority > right->priority) {
+        left->startRight = free_extent_index_merge_start(left->startRight, right);
+        free_extent_index_update(left);
+        return left;
+    }
+    right->startLeft = free_extent_index_merge_start(left, right->startLeft);
+    free_extent_index_update(right);
+    return right;
+}
+
+/* Split the by-length treap into nodes whose key is below @key and the rest. */
+static void free_extent_index_split_length(struct free_extent_node *root, u_int64_t key,
+                                           struct free_extent_node **left, struct free_extent_node **right)
+{
+    if (root == NULL) {
+        *left = *right = NULL;
+    } else if (FREE_EXTENT_LENKEY(root) < key) {
+        free_extent_index_split_length(root->lengthRight, key, &root->lengthRight, right);
+        *left = root;
+    } else {
+        free_extent_index_split_length(root->lengthLeft, key, left, &root->lengthLeft);
+        *right = root;
+    }
+}
+
+static struct free_extent_node *free_extent_index_merge_length(struct free_extent_node *left,
+                                                               struct free_extent_node *right)
+{
+    if (left == NULL)
+        return right;
+    if (right == NULL)
+        return left;
+
+    if (left->priority > right->priority) {
+        left->lengthRight = free_extent_index_merge_length(left->lengthRight, right);
+        return left;
+    }
+    right->lengthLeft = free_extent_index_merge_length(left, right->lengthLeft);
+    return right;
+}
+
+static void free_extent_index_link(struct hfs_free_extent_index *index, struct free_extent_node *node)
+{
+    struct free_extent_node *left, *right;
+
+    node->startLeft = node->startRight = NULL;
+    node->lengthLeft = node->lengthRight = NULL;
+    node->maxCount = node->blockCount;
+
+    free_extent_index_split_start(index->byStart, node->startBlock, &left, &right);
+    index->byStart = free_extent_index_merge_start(free_extent_index_merge_start(left, node), right);
+
+    free_extent_index_split_length(index->byLength, FREE_EXTENT_LENKEY(node), &left, &right);
+    index->byLength = free_extent_index_merge_length(free_extent_index_merge_length(left, node), right);
+
+    index->extentCount++;
+}
+
+static void free_extent_index_unlink(struct hfs_free_extent_index *index, struct free_extent_node *node)
+{
+    struct free_extent_node *left, *middle, *right;
+
+    free_extent_index_split_start(index->byStart, node->startBlock, &left, &right);
+    free_extent_index_split_start(right, (u_int64_t)node->startBlock + 1, &middle, &right);
+    hfs_assert(middle == node);
+    index->byStart = free_extent_index_merge_start(left, right);
+
+    free_extent_index_split_length(index->byLength, FREE_EXTENT_LENKEY(node), &left, &right);
+    free_extent_index_split_length(right, FREE_EXTENT_LENKEY(node) + 1, &middle, &right);
+    hfs_assert(middle == node);
+    index->byLength = free_extent_index_merge_length(left, right);
+
+    index->extentCount--;
+}
+
+static struct free_extent_node *free_extent_index_new_node(struct hfs_free_extent_index *index,
+                                                           u_int32_t startBlock, u_int32_t blockCount)
+{
+    struct free_extent_node *node = index->freeNodes;
+
+    if (node) {
+        index->freeNodes = node->startRight;
+    } else {
+        if (index->extentCount >= HFS_FREE_INDEX_MAX_EXTENTS)
+            return NULL;
+        node = hfs_malloc(sizeof(*node));
+        if (node == NULL)
+            return NULL;
+    }
+
+    /* xorshift32; the treaps only need the priorities to be well spread */
+    index->seed ^= index->seed << 13;
+    index->seed ^= index->seed >> 17;
+    index->seed ^= index->seed << 5;
+
+    node->startBlock = startBlock;
+    node->blockCount = blockCount;
+    node->priority = index->seed;
+    return node;
+}
+
+static void free_extent_index_put_node(struct hfs_free_extent_index *index, struct free_extent_node *node)
+{
+    node->startRight = index->freeNodes;
+    index->freeNodes = node;
+}
+
+/* The extent with the highest startBlock that is <= @block, if any. */
+static struct free_extent_node *free_extent_index_find_le(struct hfs_free_extent_index *index, u_int64_t block)
+{
+    struct free_extent_node *node = index->byStart;
+    struct free_extent_node *found = NULL;
+
+    while (node) {
+        if (node->startBlock <= block) {
+            found = node;
+            node = node->startRight;
+        } else {
+            node = node->startLeft;
+        }
+    }
+    return found;
+}
+
+/* The lowest-addressed extent starting at or after @block with at least @minBlocks. */
+static struct free_extent_node *free_extent_index_first_fit(struct free_extent_node *node,
+                                                            u_int32_t block, u_int32_t minBlocks)
+{
+    struct free_extent_node *found;
+
+    while (node && node->maxCount >= minBlocks) {
+        if (node->startBlock < block) {
+            node = node->startRight;
+            continue;
+        }
+        found = free_extent_index_first_fit(node->startLeft, block, minBlocks);
+        if (found)
+            return found;
+        if (node->blockCount >= minBlocks)
+            return node;
+        node = node->startRight;
+    }
+    return NULL;
+}
+
+/* The by-length neighbours of @key: the smallest node >= @key, or the largest node < @key. */
+static struct free_extent_node *free_extent_index_ceiling(struct hfs_free_extent_index *index, u_int64_t key)
+{
+    struct free_extent_node *node = index->byLength;
+    struct free_extent_node *found = NULL;
+
+    while (node) {
+        if (FREE_EXTENT_LENKEY(node) >= key) {
+            found = node;
+            node = node->lengthLeft;
+        } else {
+            node = node->lengthRight;
+        }
+    }
+    return found;
+}
+
+static struct free_extent_node *free_extent_index_lower(struct hfs_free_extent_index *index, u_int64_t key)
+{
+    struct free_extent_node *node = index->byLength;
+    struct free_extent_node *found = NULL;
+
+    while (node) {
+        if (FREE_EXTENT_LENKEY(node) < key) {
+            found = node;
+            node = node->lengthRight;
+        } else {
+            node = node->lengthLeft;
+        }
+    }
+    return found;
+}
+
+/*
+ * Add [startBlock, startBlock + blockCount) to the index, merging it with
+ * any extents it overlaps or touches.
+ */
+static void free_extent_index_add(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount)
+{
+    struct hfs_free_extent_index *index = hfsmp->hfs_free_index;
+    struct free_extent_node *node;
+    u_int64_t start = startBlock;
+    u_int64_t end = (u_int64_t)startBlock + blockCount;
+
+    if (index == NULL || blockCount == 0)
+        return;
+
+    while ((node = free_extent_index_find_le(index, end)) != NULL && FREE_EXTENT_END(node) >= start) {
+        if (node->startBlock < start)
+            start = node->startBlock;
+        if (FREE_EXTENT_END(node) > end)
+            end = FREE_EXTENT_END(node);
+        free_extent_index_unlink(index, node);
+        free_extent_index_put_node(index, node);
+    }
+
+    node = free_extent_index_new_node(index, (u_int32_t)start, (u_int32_t)(end - start));
+    if (node == NULL) {
+        LFHFS_LOG(LEVEL_DEBUG, "free_extent_index_add: dropping free extent index on %s (%u extents)\n",
+                  hfsmp->vcbVN, index->extentCount);
+        hfs_free_extent_index_release(hfsmp);
+        return;
+    }
+    free_extent_index_link(index, node);
+}
+
+/* Remove [startBlock, startBlock + blockCount) from the index, splitting extents as needed. */
+static void free_extent_index_remove(struct hfsmount *hfsmp, u_int32_t startBlock, u_int32_t blockCount)
+{
+    struct hfs_free_extent_index *index = hfsmp->hfs_free_index;
+    struct free_extent_node *node, *tail;
+    u_int64_t start = startBlock;
+    u_int64_t end = (u_int64_t)startBlock + blockCount;
+
+    if (index == NULL || blockCount == 0)
+        return;
+
+    while ((node = free_extent_index_find_le(index, end - 1)) != NULL && FREE_EXTENT_END(node) > start) {
+        u_int64_t nodeEnd = FREE_EXTENT_END(node);
+
+        free_extent_index_unlink(index, node);
+
+        if (nodeEnd > end) {
+            tail = free_extent_index_new_node(index, (u_int32_t)end, (u_int32_t)(nodeEnd - end));
+            if (tail == NULL) {
+                free_extent_index_put_node(index, node);
+                LFHFS_LOG(LEVEL_DEBUG, "free_extent_index_remove: dropping free extent index on %s (%u extents)\n",
+                          hfsmp->vcbVN, index->extentCount);
+                hfs_free_extent_index_release(hfsmp);
+                return;
+            }
+            free_extent_index_link(index, tail);
+        }
+
+        if (node->startBlock < start) {
+            node->blockCount = (u_int32_t)(start - node->startBlock);
+            free_extent_index_link(index, node);
+        } else {
+            free_extent_index_put_node(index, node);
+        }
+    }
+}
+
+/*
+ * Find the first part of [*pieceStart, endBlock) that is not reserved and
+ * (if @useMetaZone is false) not in the metadata zone.  Returns false if
+ * nothing in the range may be handed out.
+ */
+static bool free_extent_index_next_piece(struct hfsmount *hfsmp, hfs_block_alloc_flags_t flags,
+                                         Boolean useMetaZone, u_int64_t *pieceStart,
+                                         u_int64_t endBlock, u_int64_t *pieceEnd)
+{
+    u_int64_t start = *pieceStart;
+
+    while (start < endBlock) {
+        u_int64_t holeStart = endBlock;
+        u_int64_t holeEnd = endBlock;
+
+        if (!useMetaZone && (hfsmp->hfs_flags & HFS_METADATA_ZONE) &&
+            hfsmp->hfs_metazone_end >= start && hfsmp->hfs_metazone_start < endBlock) {
+            holeStart = hfsmp->hfs_metazone_start;
+            holeEnd = (u_int64_t)hfsmp->hfs_metazone_end + 1;
+        }
+
+        if (!ISSET(flags, HFS_ALLOC_IGNORE_RESERVED)) {
+            for (int i = (ISSET(flags, HFS_ALLOC_IGNORE_TENTATIVE)
+                          ? HFS_LOCKED_BLOCKS : HFS_TENTATIVE_BLOCKS); i < 2; ++i) {
+                struct rl_entry *range;
+                TAILQ_FOREACH(range, &hfsmp->hfs_reserved_ranges[i], rl_link) {
+                    if ((u_int64_t)range->rl_end < start || (u_int64_t)range->rl_start >= endBlock)
+                        continue;
+                    if ((u_int64_t)range->rl_start < holeStart) {
+                        holeStart = range->rl_start;
+                        holeEnd = (u_int64_t)range->rl_end + 1;
+                    }
+                }
+            }
+        }
+
+        if (holeStart > start) {
+            *pieceStart = start;
+            *pieceEnd = holeStart;
+            return true;
+        }
+        start = holeEnd;
+    }
+
+    return false;
+}
+
+/*
+ * Largest piece of @node that falls within [startingBlock, endingBlock),
+ * once reservations and the metadata zone have been cut out.
+ */
+static u_int32_t free_extent_index_best_piece(struct hfsmount *hfsmp, struct free_extent_node *node,
+                                              u_int32_t startingBlock, u_int32_t endingBlock,
+                                              Boolean useMetaZone, hfs_block_alloc_flags_t flags,
+                                              u_int32_t *pieceStartBlock)
+{
+    u_int64_t start = MAX(node->startBlock, startingBlock);
+    u_int64_t end = MIN(FREE_EXTENT_END(node), endingBlock);
+    u_int64_t pieceEnd;
+    u_int32_t best = 0;
+
+    while (start < end && free_extent_index_next_piece(hfsmp, flags, useMetaZone, &start, end, &pieceEnd)) {
+        if (pieceEnd - start > best) {
+            best = (u_int32_t)(pieceEnd - start);
+            *pieceStartBlock = (u_int32_t)start;
+        }
+        start = pieceEnd;
+    }
+    return best;
+}
+
+/*
+ * The index equivalent of BlockFindContiguous: the lowest-addressed run of
+ * at least @minBlocks free blocks in [startingBlock, endingBlock), capped at
+ * @maxBlocks.  With HFS_ALLOC_TRY_HARD the first run of @maxBlocks wins and
+ * otherwise the largest run of at least @minBlocks is returned.
+ */
+static OSErr free_extent_index_find_contig(struct hfsmount *hfsmp,
+                                           u_int32_t startingBlock,
+                                           u_int32_t endingBlock,
+                                           u_int32_t minBlocks,
+                                           u_int32_t maxBlocks,
+                                           Boolean useMetaZone,
+                                           hfs_block_alloc_flags_t flags,
+                                           u_int32_t *actualStartBlock,
+                                           u_int32_t *actualNumBlocks)
+{
+    struct hfs_free_extent_index *index = hfsmp->hfs_free_index;
+    u_int32_t wanted = ISSET(flags, HFS_ALLOC_TRY_HARD) ? maxBlocks : minBlocks;
+    u_int64_t current = startingBlock;
+
+    if (minBlocks == 0 || startingBlock >= endingBlock || endingBlock - startingBlock < minBlocks)
+        return dskFulErr;
+    if (wanted > endingBlock - startingBlock)
+        wanted = endingBlock - startingBlock;
+
+    while (current < endingBlock) {
+        struct free_extent_node *node = free_extent_index_find_le(index, current);
+        u_int64_t start, end, pieceEnd;
+
+        if (node == NULL || FREE_EXTENT_END(node) < current + wanted)
+            node = free_extent_index_first_fit(index->byStart, (u_int32_t)current, wanted);
+        if (node == NULL)
+            break;
+
+        start = MAX(node->startBlock, current);
+        end = MIN(FREE_EXTENT_END(node), endingBlock);
+        if (start >= end || end - start < wanted)
+            break;
+
+        while (free_extent_index_next_piece(hfsmp, flags, useMetaZone, &start, end, &pieceEnd)) {
+            if (pieceEnd - start >= wanted) {
+                *actualStartBlock = (u_int32_t)start;
+                *actualNumBlocks = (u_int32_t)MIN(pieceEnd - start, maxBlocks);
+                return noErr;
+            }
+            start = pieceEnd;
+        }
+        current = end;
+    }
+
+    if (ISSET(flags, HFS_ALLOC_TRY_HARD) && minBlocks < wanted) {
+        /* Nothing big enough; walk down from the largest extent for the best we can do. */
+        struct free_extent_node *node = free_extent_index_lower(index, UINT64_MAX);
+        u_int32_t best = 0, bestStart = 0;
+
+        while (node && node->blockCount > best) {
+            u_int32_t pieceStart = 0;
+            u_int32_t piece = free_extent_index_best_piece(hfsmp, node, startingBlock, endingBlock,
+                                                           useMetaZone, flags, &pieceStart);
+            if (piece > best) {
+                best = piece;
+                bestStart = pieceStart;
+            }
+            node = free_extent_index_lower(index, FREE_EXTENT_LENKEY(node));
+        }
+
+        if (best >= minBlocks) {
+            *actualStartBlock = bestStart;
+            *actualNumBlocks = MIN(best, maxBlocks);
+            return noErr;
+        }
+    }
+
+    return dskFulErr;
+}
+
+/*
+ * Best fit: the smallest free extent that can hold @maxBlocks, or failing
+ * that the largest one that holds at least @minBlocks.  Used by
+ * hfs_alloc_try_hard in place of the free extent cache and an exhaustive
+ * bitmap scan.
+ */
+static OSErr free_extent_index_find_best(struct hfsmount *hfsmp,
+                                         u_int32_t minBlocks,
+                                         u_int32_t maxBlocks,
+                                         hfs_block_alloc_flags_t flags,
+                                         u_int32_t *actualStartBlock,
+                                         u_int32_t *actualNumBlocks)
+{
+    struct hfs_free_extent_index *index = hfsmp->hfs_free_index;
+    struct free_extent_node *node;
+
+    for (node = free_extent_index_ceiling(index, (u_int64_t)maxBlocks << 32); node != NULL;
+         node = free_extent_index_ceiling(index, FREE_EXTENT_LENKEY(node) + 1)) {
+        u_int32_t pieceStart = 0;
+
+        if (free_extent_index_best_piece(hfsmp, node, 1, hfsmp->allocLimit, true, flags, &pieceStart) >= maxBlocks) {
+            *actualStartBlock = pieceStart;
+            *actualNumBlocks = maxBlocks;
+            return noErr;
+        }
+    }
+
+    return free_extent_index_find_contig(hfsmp, 1, hfsmp->allocLimit, minBlocks, maxBlocks, true,
+                                         flags | HFS_ALLOC_TRY_HARD, actualStartBlock, actualNumBlocks);
+}
+
+static void free_extent_index_free_tree(struct free_extent_node *node)
+{
+    while (node) {
+        struct free_extent_node *right = node->startRight;
+        free_extent_index_free_tree(node->startLeft);
+        hfs_free(node);
+        node = right;
+    }
+}
+
+/*
+ * Throw the free extent index away.  Called at unmount, and whenever the
+ * index may have drifted from the bitmap; allocations fall back to
+ * scanning the bitmap from then on.
+ */
+void hfs_free_extent_index_release(struct hfsmount *hfsmp)
+{
+    struct hfs_free_extent_index *index = hfsmp->hfs_free_index;
+
+    if (index == NULL)
+        return;
+
+    hfsmp->hfs_free_index = NULL;
+
+    free_extent_index_free_tree(index->byStart);
+    while (index->freeNodes) {
+        struct free_extent_node *node = index->freeNodes;
+        index->freeNodes = node->startRight;
+        hfs_free(node);
+    }
+    hfs_free(index);
+}
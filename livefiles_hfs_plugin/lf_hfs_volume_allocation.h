@@ -14,5 +14,6 @@
 int hfs_init_summary (struct hfsmount *hfsmp);
 u_int32_t ScanUnmapBlocks (struct hfsmount *hfsmp);
 int hfs_isallocated(struct hfsmount *hfsmp, u_int32_t startingBlock, u_int32_t numBlocks);
+void hfs_free_extent_index_release(struct hfsmount *hfsmp);
 
 #endif /* lf_hfs_volume_allocation_h */
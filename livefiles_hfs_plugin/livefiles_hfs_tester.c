@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <mach/mach_time.h>
 #include "livefiles_hfs_tester.h"
 #include "lf_hfs_fsops_handler.h"
@@ -19,6 +20,7 @@
 #include "lf_hfs_generic_buf.h"
 #include "lf_hfs_vfsutils.h"
 #include "lf_hfs_raw_read_write.h"
+#include "lf_hfs_unicode_wrappers.h"
 
 #define DEFAULT_SYNCER_PERIOD     100 // mS
 #define MAX_UTF8_NAME_LENGTH (NAME_MAX*3+1)
@@ -95,6 +97,7 @@ CrashReport_S gsCrashReport;
 #endif
 
 int giFD = 0;
+uint64_t guMountUSec = 0; // Duration of the last mount, including any journal replay
 
 // Multi-thread read-write test
 #if 1 // Quick Regression
@@ -210,13 +213,15 @@ unistr255ToLowerCase( struct unistr255* psUnistr255 )
 }
 
 void HFSTest_PrintCacheStats(void) {
-    printf("Cache Statistics: buf_cache_size %u, max_buf_cache_size %u, buf_cache_cleanup %u, buf_cache_remove %u, max_gen_buf_uncached %u, gen_buf_uncached %u.\n",
+    printf("Cache Statistics: buf_cache_size %u, max_buf_cache_size %u, buf_cache_cleanup %u, buf_cache_remove %u, max_gen_buf_uncached %u, gen_buf_uncached %u, buf_cache_hit %llu, buf_cache_miss %llu.\n",
            gCacheStat.buf_cache_size,
            gCacheStat.max_buf_cache_size,
            gCacheStat.buf_cache_cleanup,
            gCacheStat.buf_cache_remove,
            gCacheStat.max_gen_buf_uncached,
-           gCacheStat.gen_buf_uncached);
+           gCacheStat.gen_buf_uncached,
+           gCacheStat.buf_cache_hit,
+           gCacheStat.buf_cache_miss);
 }
 
 __unused static long long int timestamp()
@@ -1564,6 +1569,68 @@ int HFSTest_CrashAbort(void *pvTestData, CrashAbort_E eAbort, int iFD, UVFSFileN
 exit:
     return(iErr);
 }
+
+#define REPLAY_BENCH_FOLDERS    (4096)
+#define REPLAY_BENCH_FILES      (16)
+
+// Keeps the journal busy with catalog and bitmap updates until the crash hook fires,
+// so the saved image is left with as many transactions as possible to replay.
+static int HFSTest_FillJournal(UVFSFileNode RootNode ) {
+    int iErr = 0;
+    char pcName[256];
+    UVFSFileNode psBenchFolder = NULL;
+
+    printf("HFSTest_FillJournal:\n");
+
+    iErr = CreateNewFolder( RootNode, &psBenchFolder, "ReplayBench" );
+    if (iErr) {
+        return iErr;
+    }
+
+    for (uint32_t uFolder = 0; uFolder < REPLAY_BENCH_FOLDERS && !gsCrashReport.uCrashCount; uFolder++) {
+        UVFSFileNode psFolder = NULL;
+        sprintf(pcName, "ReplayBench_%u", uFolder);
+        iErr = CreateNewFolder( psBenchFolder, &psFolder, pcName );
+        if (iErr) {
+            break;
+        }
+
+        for (uint32_t uFile = 0; uFile < REPLAY_BENCH_FILES && !gsCrashReport.uCrashCount; uFile++) {
+            UVFSFileNode psFile = NULL;
+            sprintf(pcName, "ReplayBench_%u_%u", uFolder, uFile);
+            iErr = CreateNewFile( psFolder, &psFile, pcName, 4096 * (uFile + 1) );
+            if (iErr) {
+                break;
+            }
+            HFS_fsOps.fsops_reclaim( psFile, 0 );
+        }
+
+        HFS_fsOps.fsops_reclaim( psFolder, 0 );
+        if (iErr) {
+            break;
+        }
+    }
+
+    HFS_fsOps.fsops_reclaim( psBenchFolder, 0 );
+
+    printf("HFSTest_FillJournal: crash count %u, err %d\n", gsCrashReport.uCrashCount, iErr);
+    return(iErr);
+}
+
+// Runs on the image saved by HFSTest_FillJournal, the mount of which replayed the journal.
+static int HFSTest_ReplayJournalBench(UVFSFileNode RootNode ) {
+    bool bFound = false;
+
+    printf("HFSTest_ReplayJournalBench: mount with journal replay took %llu usec\n", guMountUSec);
+
+    read_directory_and_search_for_name( RootNode, "ReplayBench", &bFound, NULL, 0 );
+    if (!bFound) {
+        printf("Error: Can not find replayed dir! (ReplayBench)\n");
+        return -1;
+    }
+
+    return 0;
+}
 #endif
 
 static int
@@ -1788,6 +1855,99 @@ exit:
     return iErr;
 }
 
+static int
+ScanSingleID( UVFSFileNode RootNode, uint64_t uFileID, uint64_t* puParentID, char* pcName )
+{
+    __block uint64_t uScanID = uFileID;
+    __block bool bFound = false;
+
+    int iErr = HFS_fsOps.fsops_scanids(RootNode, 0, &uScanID, 1,
+    ^(__unused unsigned int fileid_index, const UVFSFileAttributes *file_attrs, const char *file_name) {
+        *puParentID = file_attrs->fa_parentid;
+        strlcpy(pcName, file_name, MAX_UTF8_NAME_LENGTH);
+        bFound = true;
+    });
+    if (iErr == 0 && !bFound)
+        iErr = ENOENT;
+
+    return iErr;
+}
+
+static int
+HFSTest_ScanIDAfterRename( UVFSFileNode RootNode )
+{
+    int iErr = 0;
+    uint64_t uParentID = 0;
+    char* pcName = malloc(MAX_UTF8_NAME_LENGTH);
+    UVFSFileNode psDirA = NULL;
+    UVFSFileNode psDirB = NULL;
+    UVFSFileNode psFile = NULL;
+    LIFileAttributes_t sDirAAttr, sDirBAttr, sFileAttr;
+
+    printf("HFSTest_ScanIDAfterRename\n");
+    assert( pcName );
+
+    iErr = CreateNewFolder( RootNode, &psDirA, "IDCacheA");
+    if (iErr) goto exit;
+    iErr = CreateNewFolder( RootNode, &psDirB, "IDCacheB");
+    if (iErr) goto exit;
+    iErr = CreateNewFile( psDirA, &psFile, "Before.txt", 512);
+    if (iErr) goto exit;
+
+    iErr = HFS_fsOps.fsops_getattr( psDirA, &sDirAAttr );
+    if (!iErr) iErr = HFS_fsOps.fsops_getattr( psDirB, &sDirBAttr );
+    if (!iErr) iErr = HFS_fsOps.fsops_getattr( psFile, &sFileAttr );
+    HFS_fsOps.fsops_reclaim( psFile, 0 );
+    if (iErr) goto exit;
+
+    // Resolve the id a few times, later lookups are served from the cnid cache
+    for ( int i=0; i<3; i++ )
+    {
+        iErr = ScanSingleID( RootNode, sFileAttr.fa_fileid, &uParentID, pcName );
+        if (iErr) goto exit;
+        if ( uParentID != sDirAAttr.fa_fileid || strcmp(pcName, "Before.txt") )
+        {
+            printf("ScanID returned [%s] in %llu, expected [Before.txt] in %llu\n", pcName, uParentID, sDirAAttr.fa_fileid);
+            iErr = EFAULT;
+            goto exit;
+        }
+    }
+
+    // Moving the file must be seen by the next id lookup
+    iErr = HFS_fsOps.fsops_lookup( psDirA, "Before.txt", &psFile );
+    if (iErr) goto exit;
+    iErr = RenameFile( psDirA, psFile, "Before.txt", psDirB, NULL, "After.txt" );
+    HFS_fsOps.fsops_reclaim( psFile, 0 );
+    if (iErr) goto exit;
+
+    iErr = ScanSingleID( RootNode, sFileAttr.fa_fileid, &uParentID, pcName );
+    if (iErr) goto exit;
+    if ( uParentID != sDirBAttr.fa_fileid || strcmp(pcName, "After.txt") )
+    {
+        printf("ScanID returned [%s] in %llu after rename, expected [After.txt] in %llu\n", pcName, uParentID, sDirBAttr.fa_fileid);
+        iErr = EFAULT;
+        goto exit;
+    }
+
+    // And removing it must make the id unknown
+    iErr = RemoveFile( psDirB, "After.txt" );
+    if (iErr) goto exit;
+    if ( ScanSingleID( RootNode, sFileAttr.fa_fileid, &uParentID, pcName ) != ENOENT )
+    {
+        printf("ScanID found removed file id %llu\n", sFileAttr.fa_fileid);
+        iErr = EFAULT;
+        goto exit;
+    }
+
+exit:
+    if (psDirA) HFS_fsOps.fsops_reclaim( psDirA, 0 );
+    if (psDirB) HFS_fsOps.fsops_reclaim( psDirB, 0 );
+    if (!iErr) iErr = RemoveFolder( RootNode, "IDCacheA" );
+    if (!iErr) iErr = RemoveFolder( RootNode, "IDCacheB" );
+    free(pcName);
+    return iErr;
+}
+
 static int
 HFSTest_Create( UVFSFileNode RootNode )
 {
@@ -1917,6 +2077,512 @@ exit:
 }
 
 
+// Punch holes in the free space and fill them again, making sure no file's blocks are handed out twice.
+static int HFSTest_FragmentedFreeSpace(UVFSFileNode RootNode) {
+    #define FFS_NUM_OF_FILES    512
+    #define FFS_FILE_SIZE       4096
+    #define FFS_FILENAME        "FragFile"
+    #define FFS_FILL_FILENAME   "FillFile"
+
+    int iErr = 0;
+    char pcName[100] = {0};
+    UVFSFileNode psNode = NULL;
+    size_t iActually = 0;
+    uint8_t puOutBuf[FFS_FILE_SIZE];
+    uint8_t puInBuf[FFS_FILE_SIZE];
+
+    // Create many small files, each filled with its own number
+    for ( uint32_t i=0; i<FFS_NUM_OF_FILES; i++ ) {
+        sprintf(pcName, "%s_%u.txt", FFS_FILENAME, i);
+        if ( (iErr = CreateNewFile(RootNode, &psNode, pcName, 0)) != 0 ) {
+            printf("Failed to create file [%s]\n", pcName);
+            goto exit;
+        }
+        memset(puOutBuf, (uint8_t)i, FFS_FILE_SIZE);
+        iErr = HFS_fsOps.fsops_write(psNode, 0, FFS_FILE_SIZE, puOutBuf, &iActually);
+        HFS_fsOps.fsops_reclaim(psNode, 0);
+        if ( iErr ) {
+            printf("Failed to write file [%s] %d\n", pcName, iErr);
+            goto exit;
+        }
+    }
+
+    // Delete every other file
+    for ( uint32_t i=0; i<FFS_NUM_OF_FILES; i+=2 ) {
+        sprintf(pcName, "%s_%u.txt", FFS_FILENAME, i);
+        if ( (iErr = RemoveFile(RootNode, pcName)) != 0 ) {
+            printf("Failed to remove file [%s]\n", pcName);
+            goto exit;
+        }
+    }
+
+    // Fill the holes again with files of a different pattern
+    for ( uint32_t i=0; i<FFS_NUM_OF_FILES; i+=2 ) {
+        sprintf(pcName, "%s_%u.txt", FFS_FILL_FILENAME, i);
+        if ( (iErr = CreateNewFile(RootNode, &psNode, pcName, 0)) != 0 ) {
+            printf("Failed to create file [%s]\n", pcName);
+            goto exit;
+        }
+        memset(puOutBuf, (uint8_t)~i, FFS_FILE_SIZE);
+        iErr = HFS_fsOps.fsops_write(psNode, 0, FFS_FILE_SIZE, puOutBuf, &iActually);
+        HFS_fsOps.fsops_reclaim(psNode, 0);
+        if ( iErr ) {
+            printf("Failed to write file [%s] %d\n", pcName, iErr);
+            goto exit;
+        }
+    }
+
+    // Every file should still hold its own data
+    for ( uint32_t i=0; i<FFS_NUM_OF_FILES; i++ ) {
+        bool bFill = ((i % 2) == 0);
+        sprintf(pcName, "%s_%u.txt", bFill ? FFS_FILL_FILENAME : FFS_FILENAME, i);
+        if ( (iErr = HFS_fsOps.fsops_lookup(RootNode, pcName, &psNode)) != 0 ) {
+            printf("Failed to lookup file [%s]\n", pcName);
+            goto exit;
+        }
+        memset(puOutBuf, bFill ? (uint8_t)~i : (uint8_t)i, FFS_FILE_SIZE);
+        iErr = HFS_fsOps.fsops_read(psNode, 0, FFS_FILE_SIZE, puInBuf, &iActually);
+        HFS_fsOps.fsops_reclaim(psNode, 0);
+        if ( iErr || iActually != FFS_FILE_SIZE || memcmp(puInBuf, puOutBuf, FFS_FILE_SIZE) ) {
+            printf("File [%s] was overwritten (err %d, read %zu)\n", pcName, iErr, iActually);
+            iErr = iErr ? iErr : EIO;
+            goto exit;
+        }
+    }
+
+exit:
+    return iErr;
+}
+
+
+static int HFSTest_LookupInLargeDir(UVFSFileNode RootNode) {
+    #define LLD_NUM_OF_FILES    600
+    #define LLD_DIRNAME         "LookupDir"
+    // Names longer than the folded prefix kept per key, some of them Latin-1
+    #define LLD_NAME(pcBuf, i)  sprintf(pcBuf, ((i) % 3) ? "Quarterly Report %u - Draft.docx" : "R\xC3\xA9sum\xC3\xA9 %u.pages", (i))
+
+    int iErr = 0;
+    char pcName[100] = {0};
+    UVFSFileNode psDir = NULL;
+    UVFSFileNode psNode = NULL;
+
+    if ( (iErr = CreateNewFolder(RootNode, &psDir, LLD_DIRNAME)) != 0 ) {
+        printf("Failed to create folder [%s]\n", LLD_DIRNAME);
+        return iErr;
+    }
+
+    for ( uint32_t i=0; i<LLD_NUM_OF_FILES; i++ ) {
+        LLD_NAME(pcName, i);
+        if ( (iErr = CreateNewFile(psDir, &psNode, pcName, 0)) != 0 ) {
+            printf("Failed to create file [%s]\n", pcName);
+            goto exit;
+        }
+        HFS_fsOps.fsops_reclaim(psNode, 0);
+    }
+
+    // Look every name up a few times, so the catalog nodes get searched repeatedly
+    for ( uint32_t uPass=0; uPass<3; uPass++ ) {
+        for ( uint32_t i=0; i<LLD_NUM_OF_FILES; i++ ) {
+            LLD_NAME(pcName, i);
+            if ( (iErr = HFS_fsOps.fsops_lookup(psDir, pcName, &psNode)) != 0 ) {
+                printf("Failed to lookup file [%s] %d\n", pcName, iErr);
+                goto exit;
+            }
+            HFS_fsOps.fsops_reclaim(psNode, 0);
+
+            LLD_NAME(pcName, i + LLD_NUM_OF_FILES);
+            if ( HFS_fsOps.fsops_lookup(psDir, pcName, &psNode) != ENOENT ) {
+                printf("Lookup of missing file [%s] didn't fail\n", pcName);
+                iErr = EEXIST;
+                goto exit;
+            }
+        }
+    }
+
+    // Remove half of the files, changing the nodes searched above
+    for ( uint32_t i=0; i<LLD_NUM_OF_FILES; i+=2 ) {
+        LLD_NAME(pcName, i);
+        if ( (iErr = RemoveFile(psDir, pcName)) != 0 ) {
+            printf("Failed to remove file [%s]\n", pcName);
+            goto exit;
+        }
+    }
+
+    for ( uint32_t i=0; i<LLD_NUM_OF_FILES; i++ ) {
+        LLD_NAME(pcName, i);
+        iErr = HFS_fsOps.fsops_lookup(psDir, pcName, &psNode);
+        if ( (i % 2) == 0 ) {
+            if ( iErr != ENOENT ) {
+                printf("Lookup of removed file [%s] returned %d\n", pcName, iErr);
+                iErr = iErr ? iErr : EEXIST;
+                goto exit;
+            }
+            iErr = 0;
+        } else {
+            if ( iErr ) {
+                printf("Failed to lookup file [%s] %d\n", pcName, iErr);
+                goto exit;
+            }
+            HFS_fsOps.fsops_reclaim(psNode, 0);
+        }
+    }
+
+    for ( uint32_t i=1; i<LLD_NUM_OF_FILES; i+=2 ) {
+        LLD_NAME(pcName, i);
+        if ( (iErr = RemoveFile(psDir, pcName)) != 0 ) {
+            printf("Failed to remove file [%s]\n", pcName);
+            goto exit;
+        }
+    }
+
+exit:
+    HFS_fsOps.fsops_reclaim(psDir, 0);
+    if ( iErr == 0 ) {
+        iErr = RemoveFolder(RootNode, LLD_DIRNAME);
+    }
+    return iErr;
+}
+
+static uint64_t GetFSAttrNumber(UVFSFileNode RootNode, const char* pcAttr) {
+    UVFSFSAttributeValue sAttrVal = {0};
+    size_t uRetLen = 0;
+
+    if ( HFS_fsOps.fsops_getfsattr(RootNode, pcAttr, &sAttrVal, sizeof(sAttrVal), &uRetLen) != 0 ) {
+        return 0;
+    }
+    return sAttrVal.fsa_number;
+}
+
+static int HFSTest_NameCache(UVFSFileNode RootNode) {
+    #define NC_DEPTH            8
+    #define NC_STORM_PASSES     200
+
+    int iErr = 0;
+    char pcName[64] = {0};
+    UVFSFileNode psDirs[NC_DEPTH + 1] = {RootNode};
+    UVFSFileNode psNode = NULL;
+    UVFSFileNode psFile = NULL;
+    uint32_t uLevels = 0;
+
+    // A deep path, with the directories held open the way a walk keeps them
+    for ( uLevels=0; uLevels<NC_DEPTH; uLevels++ ) {
+        sprintf(pcName, "NameCache_Level_%u", uLevels);
+        if ( (iErr = CreateNewFolder(psDirs[uLevels], &psDirs[uLevels + 1], pcName)) != 0 ) {
+            printf("Failed to create folder [%s]\n", pcName);
+            goto exit;
+        }
+    }
+    if ( (iErr = CreateNewFile(psDirs[NC_DEPTH], &psFile, "Leaf.txt", 0)) != 0 ) {
+        printf("Failed to create file [Leaf.txt]\n");
+        goto exit;
+    }
+    HFS_fsOps.fsops_reclaim(psFile, 0);
+
+    uint64_t uHits = GetFSAttrNumber(RootNode, LFHFS_FSATTR_NCACHE_HITS);
+    uint64_t uNegativeHits = GetFSAttrNumber(RootNode, LFHFS_FSATTR_NCACHE_NEGATIVE_HITS);
+
+    // Walk the path over and over, probing for names that aren't there on the way
+    for ( uint32_t uPass=0; uPass<NC_STORM_PASSES; uPass++ ) {
+        for ( uint32_t i=0; i<NC_DEPTH; i++ ) {
+            // Case insensitive volume, the cache must fold names the same way the catalog does
+            sprintf(pcName, (uPass % 2) ? "NameCache_Level_%u" : "NAMECACHE_level_%u", i);
+            if ( (iErr = HFS_fsOps.fsops_lookup(psDirs[i], pcName, &psNode)) != 0 ) {
+                printf("Failed to lookup folder [%s] %d\n", pcName, iErr);
+                goto exit;
+            }
+            if ( psNode != psDirs[i + 1] ) {
+                printf("Lookup of [%s] returned another node\n", pcName);
+                HFS_fsOps.fsops_reclaim(psNode, 0);
+                iErr = EINVAL;
+                goto exit;
+            }
+            HFS_fsOps.fsops_reclaim(psNode, 0);
+
+            if ( HFS_fsOps.fsops_lookup(psDirs[i], ".DS_Store", &psNode) != ENOENT ) {
+                printf("Lookup of missing file [.DS_Store] didn't fail\n");
+                iErr = EEXIST;
+                goto exit;
+            }
+        }
+    }
+
+    if ( GetFSAttrNumber(RootNode, LFHFS_FSATTR_NCACHE_HITS) == uHits ||
+         GetFSAttrNumber(RootNode, LFHFS_FSATTR_NCACHE_NEGATIVE_HITS) == uNegativeHits ) {
+        printf("Name cache wasn't used\n");
+        iErr = EINVAL;
+        goto exit;
+    }
+
+    // Creating a name that was cached as missing must make it visible
+    if ( (iErr = CreateNewFile(psDirs[NC_DEPTH / 2], &psFile, ".DS_Store", 0)) != 0 ) {
+        printf("Failed to create file [.DS_Store]\n");
+        goto exit;
+    }
+    HFS_fsOps.fsops_reclaim(psFile, 0);
+    if ( (iErr = HFS_fsOps.fsops_lookup(psDirs[NC_DEPTH / 2], ".ds_store", &psNode)) != 0 ) {
+        printf("Failed to lookup created file [.ds_store] %d\n", iErr);
+        goto exit;
+    }
+
+    // Renaming must hide the old name and show the new one
+    iErr = RenameFile(psDirs[NC_DEPTH / 2], psNode, ".DS_Store", psDirs[NC_DEPTH / 2], NULL, "Renamed.txt");
+    HFS_fsOps.fsops_reclaim(psNode, 0);
+    if ( iErr ) {
+        printf("Failed to rename [.DS_Store] %d\n", iErr);
+        goto exit;
+    }
+    if ( HFS_fsOps.fsops_lookup(psDirs[NC_DEPTH / 2], ".DS_Store", &psNode) != ENOENT ) {
+        printf("Renamed file [.DS_Store] is still found\n");
+        iErr = EEXIST;
+        goto exit;
+    }
+    if ( (iErr = HFS_fsOps.fsops_lookup(psDirs[NC_DEPTH / 2], "Renamed.txt", &psNode)) != 0 ) {
+        printf("Failed to lookup renamed file [Renamed.txt] %d\n", iErr);
+        goto exit;
+    }
+    HFS_fsOps.fsops_reclaim(psNode, 0);
+
+    // And removing must hide it again
+    if ( (iErr = RemoveFile(psDirs[NC_DEPTH / 2], "Renamed.txt")) != 0 ) {
+        printf("Failed to remove file [Renamed.txt]\n");
+        goto exit;
+    }
+    if ( HFS_fsOps.fsops_lookup(psDirs[NC_DEPTH / 2], "Renamed.txt", &psNode) != ENOENT ) {
+        printf("Removed file [Renamed.txt] is still found\n");
+        iErr = EEXIST;
+        goto exit;
+    }
+
+    if ( (iErr = RemoveFile(psDirs[NC_DEPTH], "Leaf.txt")) != 0 ) {
+        printf("Failed to remove file [Leaf.txt]\n");
+        goto exit;
+    }
+
+exit:
+    for ( uint32_t i=uLevels; i>0; i-- ) {
+        HFS_fsOps.fsops_reclaim(psDirs[i], 0);
+        if ( iErr == 0 ) {
+            sprintf(pcName, "NameCache_Level_%u", i - 1);
+            iErr = RemoveFolder(psDirs[i - 1], pcName);
+        }
+    }
+    return iErr;
+}
+
+#define LDC_DIRNAME             "LookupDuringCreates"
+#define LDC_NUM_OF_EXISTING     (500)
+#define LDC_MAX_LOOKUP_THREADS  (8)
+#define LDC_CREATE_THREADS      (2)
+#define LDC_CREATES_PER_THREAD  (500)
+
+static const uint32_t guLDCLookupThreads[] = { 1, 2, 4, 8 };
+
+typedef struct {
+    UVFSFileNode    psDirNode;
+    uint32_t        uThreadNum;
+    uint64_t        uLookups;
+    volatile bool*  pbCreatesDone;
+    int             iRetVal;
+} LookupDuringCreatesThreadData_S;
+
+static void *LookupDuringCreates_LookupThread(void *pvArg) {
+    LookupDuringCreatesThreadData_S* psThrdData = pvArg;
+    char pcName[64] = {0};
+    UVFSFileNode psNode = NULL;
+    uint32_t uSeed = psThrdData->uThreadNum;
+
+    // Creates in the same directory keep the name cache cold, so these go to the catalog
+    while ( !__atomic_load_n(psThrdData->pbCreatesDone, __ATOMIC_ACQUIRE) ) {
+        sprintf(pcName, "Existing_%u", rand_r(&uSeed) % LDC_NUM_OF_EXISTING);
+        int iErr = HFS_fsOps.fsops_lookup(psThrdData->psDirNode, pcName, &psNode);
+        if ( iErr ) {
+            printf("Failed to lookup [%s] while creating %d\n", pcName, iErr);
+            psThrdData->iRetVal = iErr;
+            break;
+        }
+        HFS_fsOps.fsops_reclaim(psNode, 0);
+        psThrdData->uLookups++;
+    }
+    return psThrdData;
+}
+
+static void *LookupDuringCreates_CreateThread(void *pvArg) {
+    LookupDuringCreatesThreadData_S* psThrdData = pvArg;
+    char pcName[64] = {0};
+    UVFSFileNode psNode = NULL;
+
+    for ( uint32_t u=0; u<LDC_CREATES_PER_THREAD; u++ ) {
+        sprintf(pcName, "Created_%u_%u", psThrdData->uThreadNum, u);
+        int iErr = CreateNewFile(psThrdData->psDirNode, &psNode, pcName, 0);
+        if ( iErr ) {
+            printf("Failed to create [%s] %d\n", pcName, iErr);
+            psThrdData->iRetVal = iErr;
+            break;
+        }
+        HFS_fsOps.fsops_reclaim(psNode, 0);
+    }
+    return psThrdData;
+}
+
+static int
+HFSTest_SetBTReadEnabled( UVFSFileNode RootNode, bool bEnabled )
+{
+    UVFSFSAttributeValue sAttrVal;
+    UVFSFSAttributeValue sOutAttrVal;
+
+    sAttrVal.fsa_number = bEnabled;
+    return HFS_fsOps.fsops_setfsattr( RootNode, LFHFS_FSATTR_BTREAD_ENABLED, &sAttrVal, sizeof(sAttrVal), &sOutAttrVal, sizeof(sOutAttrVal) );
+}
+
+// One timed run: uNumOfLookupThreads look up existing files while the create threads add files
+static int LookupDuringCreates_Run(UVFSFileNode RootNode, UVFSFileNode psDirNode, uint32_t uNumOfLookupThreads, bool bLockless) {
+    int iErr = 0;
+    char pcName[64] = {0};
+    UVFSFileNode psNode = NULL;
+    volatile bool bCreatesDone = false;
+    pthread_t psLookupThread[LDC_MAX_LOOKUP_THREADS];
+    pthread_t psCreateThread[LDC_CREATE_THREADS];
+    LookupDuringCreatesThreadData_S psLookupData[LDC_MAX_LOOKUP_THREADS] = {{0}};
+    LookupDuringCreatesThreadData_S psCreateData[LDC_CREATE_THREADS] = {{0}};
+    uint32_t uLookupThreads = 0;
+    uint32_t uCreateThreads = 0;
+    static mach_timebase_info_data_t sTimebaseInfo;
+    mach_timebase_info(&sTimebaseInfo);
+
+    if ( (iErr = HFSTest_SetBTReadEnabled(RootNode, bLockless)) != 0 ) {
+        printf("Failed to %s lockless catalog reads %d\n", bLockless ? "enable" : "disable", iErr);
+        return iErr;
+    }
+
+    uint64_t uSections  = GetFSAttrNumber(RootNode, LFHFS_FSATTR_BTREAD_SECTIONS);
+    uint64_t uConflicts = GetFSAttrNumber(RootNode, LFHFS_FSATTR_BTREAD_CONFLICTS);
+    uint64_t uFallbacks = GetFSAttrNumber(RootNode, LFHFS_FSATTR_BTREAD_FALLBACKS);
+    uint64_t uStart     = mach_absolute_time();
+
+    for ( ; uLookupThreads<uNumOfLookupThreads; uLookupThreads++ ) {
+        psLookupData[uLookupThreads].psDirNode     = psDirNode;
+        psLookupData[uLookupThreads].uThreadNum    = uLookupThreads;
+        psLookupData[uLookupThreads].pbCreatesDone = &bCreatesDone;
+        if ( (iErr = pthread_create(&psLookupThread[uLookupThreads], NULL, LookupDuringCreates_LookupThread, &psLookupData[uLookupThreads])) != 0 ) {
+            printf("can't pthread_create\n");
+            break;
+        }
+    }
+    for ( ; iErr == 0 && uCreateThreads<LDC_CREATE_THREADS; uCreateThreads++ ) {
+        psCreateData[uCreateThreads].psDirNode  = psDirNode;
+        psCreateData[uCreateThreads].uThreadNum = uCreateThreads;
+        if ( (iErr = pthread_create(&psCreateThread[uCreateThreads], NULL, LookupDuringCreates_CreateThread, &psCreateData[uCreateThreads])) != 0 ) {
+            printf("can't pthread_create\n");
+            break;
+        }
+    }
+
+    for ( uint32_t u=0; u<uCreateThreads; u++ ) {
+        pthread_join(psCreateThread[u], NULL);
+        if ( iErr == 0 ) iErr = psCreateData[u].iRetVal;
+    }
+    __atomic_store_n(&bCreatesDone, true, __ATOMIC_RELEASE);
+
+    uint64_t uLookups = 0;
+    for ( uint32_t u=0; u<uLookupThreads; u++ ) {
+        pthread_join(psLookupThread[u], NULL);
+        if ( iErr == 0 ) iErr = psLookupData[u].iRetVal;
+        uLookups += psLookupData[u].uLookups;
+    }
+
+    uint64_t uElapsedNano = (mach_absolute_time() - uStart) * sTimebaseInfo.numer / sTimebaseInfo.denom;
+    uint64_t uElapsedUSec = (uElapsedNano / 1000) ? (uElapsedNano / 1000) : 1;
+    uSections  = GetFSAttrNumber(RootNode, LFHFS_FSATTR_BTREAD_SECTIONS) - uSections;
+    uConflicts = GetFSAttrNumber(RootNode, LFHFS_FSATTR_BTREAD_CONFLICTS) - uConflicts;
+    uFallbacks = GetFSAttrNumber(RootNode, LFHFS_FSATTR_BTREAD_FALLBACKS) - uFallbacks;
+
+    // Every catalog read either passed validation without the lock or fell back to it
+    uint64_t uCatalogReads = (uSections - uConflicts) + uFallbacks;
+    printf("%s, %u lookup threads: %llu lookups during %u creates in %llu usec, %llu lookups/s, "
+           "%llu of %llu catalog reads fell back to the lock (%llu%%), %llu conflicts\n",
+           bLockless ? "lockless" : "locked", uLookupThreads, uLookups, LDC_CREATE_THREADS * LDC_CREATES_PER_THREAD,
+           uElapsedUSec, uLookups * 1000000 / uElapsedUSec, uFallbacks, uCatalogReads,
+           uCatalogReads ? uFallbacks * 100 / uCatalogReads : 0, uConflicts);
+    if ( iErr ) {
+        return iErr;
+    }
+    if ( bLockless && uLookups && uSections == 0 ) {
+        printf("Catalog lookups never skipped the catalog lock\n");
+        return EINVAL;
+    }
+    if ( !bLockless && uSections != 0 ) {
+        printf("Catalog lookups skipped the catalog lock while it was disabled\n");
+        return EINVAL;
+    }
+
+    // Everything created while the lookups ran must be there
+    for ( uint32_t t=0; t<LDC_CREATE_THREADS; t++ ) {
+        for ( uint32_t u=0; u<LDC_CREATES_PER_THREAD; u++ ) {
+            sprintf(pcName, "Created_%u_%u", t, u);
+            if ( (iErr = HFS_fsOps.fsops_lookup(psDirNode, pcName, &psNode)) != 0 ) {
+                printf("Failed to lookup created file [%s] %d\n", pcName, iErr);
+                return iErr;
+            }
+            HFS_fsOps.fsops_reclaim(psNode, 0);
+            if ( (iErr = RemoveFile(psDirNode, pcName)) != 0 ) {
+                printf("Failed to remove file [%s]\n", pcName);
+                return iErr;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Lookup throughput while files are created in the same directory, with and without lockless catalog reads
+static int HFSTest_LookupDuringCreates(UVFSFileNode RootNode) {
+    int iErr = 0;
+    char pcName[64] = {0};
+    UVFSFileNode psDirNode = NULL;
+    UVFSFileNode psNode = NULL;
+
+    if ( (iErr = CreateNewFolder(RootNode, &psDirNode, LDC_DIRNAME)) != 0 ) {
+        printf("Failed to create folder [%s]\n", LDC_DIRNAME);
+        return iErr;
+    }
+    for ( uint32_t u=0; u<LDC_NUM_OF_EXISTING; u++ ) {
+        sprintf(pcName, "Existing_%u", u);
+        if ( (iErr = CreateNewFile(psDirNode, &psNode, pcName, 0)) != 0 ) {
+            printf("Failed to create file [%s]\n", pcName);
+            goto exit;
+        }
+        HFS_fsOps.fsops_reclaim(psNode, 0);
+    }
+
+    for ( uint32_t i=0; iErr == 0 && i<sizeof(guLDCLookupThreads)/sizeof(guLDCLookupThreads[0]); i++ ) {
+        iErr = LookupDuringCreates_Run(RootNode, psDirNode, guLDCLookupThreads[i], true);
+        if ( iErr == 0 ) {
+            iErr = LookupDuringCreates_Run(RootNode, psDirNode, guLDCLookupThreads[i], false);
+        }
+    }
+
+    int iEnableErr = HFSTest_SetBTReadEnabled(RootNode, true);
+    if ( iErr == 0 ) iErr = iEnableErr;
+    if ( iErr ) {
+        goto exit;
+    }
+
+    for ( uint32_t u=0; u<LDC_NUM_OF_EXISTING; u++ ) {
+        sprintf(pcName, "Existing_%u", u);
+        if ( (iErr = RemoveFile(psDirNode, pcName)) != 0 ) {
+            printf("Failed to remove file [%s]\n", pcName);
+            goto exit;
+        }
+    }
+
+exit:
+    HFS_fsOps.fsops_reclaim(psDirNode, 0);
+    if ( iErr == 0 ) {
+        iErr = RemoveFolder(RootNode, LDC_DIRNAME);
+    }
+    return iErr;
+}
+
 static void *ReadWriteThread(void *pvArgs) {
     int iErr = 0;
     
@@ -3467,7 +4133,28 @@ static char* gpcFSAttrs [] = {
     UVFS_FSATTR_CAPS_FORMAT,
     UVFS_FSATTR_CAPS_INTERFACES,
     UVFS_FSATTR_LAST_MTIME,
-    UVFS_FSATTR_MOUNT_TIME
+    UVFS_FSATTR_MOUNT_TIME,
+    LFHFS_FSATTR_CHASH_CNODES,
+    LFHFS_FSATTR_CHASH_BUCKETS,
+    LFHFS_FSATTR_CHASH_MAX_CHAIN,
+    LFHFS_FSATTR_CHASH_LOOKUPS,
+    LFHFS_FSATTR_CHASH_CONTENDED,
+    LFHFS_FSATTR_CHASH_WAITS,
+    LFHFS_FSATTR_CHASH_RESIZES,
+    LFHFS_FSATTR_NCACHE_ENTRIES,
+    LFHFS_FSATTR_NCACHE_HITS,
+    LFHFS_FSATTR_NCACHE_NEGATIVE_HITS,
+    LFHFS_FSATTR_NCACHE_MISSES,
+    LFHFS_FSATTR_NCACHE_PURGES,
+    LFHFS_FSATTR_BTREAD_SECTIONS,
+    LFHFS_FSATTR_BTREAD_CONFLICTS,
+    LFHFS_FSATTR_BTREAD_FALLBACKS,
+    LFHFS_FSATTR_BTREAD_ENABLED,
+    LFHFS_FSATTR_WRITEBACK_LIMIT,
+    LFHFS_FSATTR_WRITEBACK_DIRTY,
+    LFHFS_FSATTR_JOURNAL_COMMITS,
+    LFHFS_FSATTR_JOURNAL_IOS,
+    LFHFS_FSATTR_JOURNAL_UNBATCHED_IOS
 };
 
 static int
@@ -3654,6 +4341,308 @@ HFSTest_RandomIO( UVFSFileNode RootNode )
     return 0;
 }
 
+static int
+HFSTest_SequentialRead( UVFSFileNode RootNode )
+{
+#define SEQ_READ_FILE_SIZE  (32*1024*1024)
+#define SEQ_READ_CHUNK_SIZE (1024*1024)
+#define SEQ_READ_IO_SIZE    (4096+123)  // Deliberately not sector aligned
+
+    int iErr = 0;
+    UVFSFileNode psFile = NULL;
+    size_t iActuallyWrite;
+    size_t iActuallyRead;
+    static mach_timebase_info_data_t sTimebaseInfo;
+    mach_timebase_info(&sTimebaseInfo);
+
+    uint8_t* puWriteBuf = malloc(SEQ_READ_CHUNK_SIZE);
+    uint8_t* puReadBuf  = malloc(SEQ_READ_IO_SIZE);
+    assert(puWriteBuf && puReadBuf);
+
+    iErr = CreateNewFile( RootNode, &psFile, "SequentialReadFile", 0 );
+    assert(iErr == 0);
+
+    // Each byte is a function of its file offset, so any chunk can be validated
+    for ( uint64_t uOffset = 0; uOffset < SEQ_READ_FILE_SIZE; uOffset += SEQ_READ_CHUNK_SIZE )
+    {
+        for ( uint64_t uIdx = 0; uIdx < SEQ_READ_CHUNK_SIZE; uIdx++ )
+        {
+            puWriteBuf[uIdx] = (uint8_t)((uOffset + uIdx) % 251);
+        }
+        iErr = HFS_fsOps.fsops_write( psFile, uOffset, SEQ_READ_CHUNK_SIZE, puWriteBuf, &iActuallyWrite );
+        assert(iErr == 0 && iActuallyWrite == SEQ_READ_CHUNK_SIZE);
+    }
+
+    // Stream the file, then read the same chunks in a shuffled order for reference
+    for ( uint32_t uPass = 0; uPass < 2; uPass++ )
+    {
+        bool bSequential = (uPass == 0);
+        uint64_t uNumIOs = SEQ_READ_FILE_SIZE / SEQ_READ_IO_SIZE;
+        uint64_t uStart  = mach_absolute_time();
+
+        for ( uint64_t uIO = 0; uIO < uNumIOs; uIO++ )
+        {
+            uint64_t uChunk  = bSequential ? uIO : ((uIO * 7919) % uNumIOs);
+            uint64_t uOffset = uChunk * SEQ_READ_IO_SIZE;
+
+            iErr = HFS_fsOps.fsops_read( psFile, uOffset, SEQ_READ_IO_SIZE, puReadBuf, &iActuallyRead );
+            assert(iErr == 0 && iActuallyRead == SEQ_READ_IO_SIZE);
+
+            for ( uint64_t uIdx = 0; uIdx < SEQ_READ_IO_SIZE; uIdx++ )
+            {
+                assert( puReadBuf[uIdx] == (uint8_t)((uOffset + uIdx) % 251) );
+            }
+        }
+
+        uint64_t uElapsedNano = (mach_absolute_time() - uStart) * sTimebaseInfo.numer / sTimebaseInfo.denom;
+        uint64_t uElapsedUSec = (uElapsedNano / 1000) ? (uElapsedNano / 1000) : 1;
+        printf("%s read: %llu IOs of %u bytes in %llu usec, %llu MB/s\n", bSequential ? "Sequential" : "Shuffled",
+               uNumIOs, SEQ_READ_IO_SIZE, uElapsedUSec, (uNumIOs * SEQ_READ_IO_SIZE) / uElapsedUSec);
+    }
+
+    free(puReadBuf);
+    free(puWriteBuf);
+
+    HFS_fsOps.fsops_reclaim(psFile, 0);
+
+    iErr = RemoveFile( RootNode, "SequentialReadFile" );
+
+    return iErr;
+}
+
+#define UC_MAX_NAME_LEN         (64)
+#define UC_FUZZ_ITERATIONS      (2000000)
+#define UC_BENCH_NAMES          (4096)
+#define UC_BENCH_ROUNDS         (64)
+
+// Mostly filename characters, with some Latin-1 supplement, NUL, ignorable and non-Latin characters
+static UniChar UnicodeCompareRandomChar(void) {
+    static const char *pcNameChars = "abcxyzABCXYZ0189 ._-()";
+    static const UniChar puIgnorable[] = { 0x200B, 0x200C, 0x200D, 0x200E, 0x200F, 0xFEFF };
+    uint32_t uPick = rand() % 100;
+
+    if (uPick < 70) return (UniChar) pcNameChars[rand() % strlen(pcNameChars)];
+    if (uPick < 82) return (UniChar) (0x80 + rand() % 0x80);
+    if (uPick < 85) return 0;
+    if (uPick < 90) return puIgnorable[rand() % (sizeof(puIgnorable) / sizeof(puIgnorable[0]))];
+    if (uPick < 95) return (UniChar) (0x100 + rand() % 0x500);
+    return (UniChar) rand();
+}
+
+static int HFSTest_UnicodeCompare( __unused UVFSFileNode RootNode ) {
+    int iErr = 0;
+    UniChar puName1[UC_MAX_NAME_LEN];
+    UniChar puName2[UC_MAX_NAME_LEN + 4];
+    static mach_timebase_info_data_t sTimebaseInfo;
+    mach_timebase_info(&sTimebaseInfo);
+
+    // The Latin-1 fast path has to agree with the plain table walk on everything
+    for ( uint32_t uIter = 0; uIter < UC_FUZZ_ITERATIONS; uIter++ ) {
+        ItemCount uLen1 = rand() % UC_MAX_NAME_LEN;
+        ItemCount uLen2 = uLen1;
+
+        for ( ItemCount uIdx = 0; uIdx < uLen1; uIdx++ ) {
+            puName1[uIdx] = UnicodeCompareRandomChar();
+        }
+        memcpy(puName2, puName1, uLen1 * sizeof(UniChar));
+
+        switch ( rand() % 4 ) {
+            case 0: // Same name with the case of some letters flipped
+                for ( ItemCount uIdx = 0; uIdx < uLen2; uIdx++ ) {
+                    if ( (puName2[uIdx] < 0x80) && isalpha(puName2[uIdx]) && (rand() % 2) ) {
+                        puName2[uIdx] ^= 0x20;
+                    }
+                }
+                break;
+            case 1: // One character replaced
+                if ( uLen2 ) {
+                    puName2[rand() % uLen2] = UnicodeCompareRandomChar();
+                }
+                break;
+            case 2: // Longer name with the same prefix
+                for ( uint32_t uExtra = 1 + rand() % 4; uExtra; uExtra-- ) {
+                    puName2[uLen2++] = UnicodeCompareRandomChar();
+                }
+                break;
+            default: // Unrelated name
+                uLen2 = rand() % UC_MAX_NAME_LEN;
+                for ( ItemCount uIdx = 0; uIdx < uLen2; uIdx++ ) {
+                    puName2[uIdx] = UnicodeCompareRandomChar();
+                }
+                break;
+        }
+
+        int32_t iFast   = FastUnicodeCompare( puName1, uLen1, puName2, uLen2 );
+        int32_t iScalar = FastUnicodeCompareScalar( puName1, uLen1, puName2, uLen2 );
+        int32_t iSwap   = FastUnicodeCompare( puName2, uLen2, puName1, uLen1 );
+        if ( (iFast != iScalar) || (iSwap != -iScalar) ) {
+            printf("Error: FastUnicodeCompare mismatch on iteration %u: fast %d, scalar %d, swapped %d\n", uIter, iFast, iScalar, iSwap);
+            return EINVAL;
+        }
+    }
+
+    // Compare realistic names against their neighbours and against a differently cased copy, like a lookup does
+    UniChar (*ppuNames)[UC_MAX_NAME_LEN] = malloc(UC_BENCH_NAMES * sizeof(*ppuNames));
+    UniChar (*ppuCased)[UC_MAX_NAME_LEN] = malloc(UC_BENCH_NAMES * sizeof(*ppuCased));
+    ItemCount *puLens = malloc(UC_BENCH_NAMES * sizeof(ItemCount));
+    assert( ppuNames && ppuCased && puLens );
+
+    for ( uint32_t uName = 0; uName < UC_BENCH_NAMES; uName++ ) {
+        char pcName[UC_MAX_NAME_LEN];
+        ItemCount uLen = 0;
+
+        switch ( uName % 5 ) {
+            case 0:  snprintf(pcName, sizeof(pcName), "IMG_%04u.JPG", uName); break;
+            case 1:  snprintf(pcName, sizeof(pcName), "Screen Shot 2018-%02u-%02u at %u.%02u PM.png", uName % 12 + 1, uName % 28 + 1, uName % 12 + 1, uName % 60); break;
+            case 2:  snprintf(pcName, sizeof(pcName), "libSystem.B.%u.dylib", uName); break;
+            case 3:  snprintf(pcName, sizeof(pcName), "R\xE9sum\xE9 \xC6sop %u.pages", uName); break; // Latin-1
+            default: snprintf(pcName, sizeof(pcName), "Report %u.docx", uName);
+                     ppuNames[uName][uLen++] = 0x30D5; // Non-Latin prefix takes the table walk
+                     ppuNames[uName][uLen++] = 0x30A1;
+                     break;
+        }
+        for ( char *pc = pcName; *pc && uLen < UC_MAX_NAME_LEN; pc++ ) {
+            ppuNames[uName][uLen++] = (uint8_t) *pc;
+        }
+        puLens[uName] = uLen;
+
+        for ( ItemCount uIdx = 0; uIdx < uLen; uIdx++ ) {
+            UniChar c = ppuNames[uName][uIdx];
+            ppuCased[uName][uIdx] = (c < 0x80 && isalpha(c)) ? (c ^ 0x20) : c;
+        }
+    }
+
+    for ( uint32_t uPass = 0; uPass < 2; uPass++ ) {
+        bool bFast = (uPass == 1);
+        int64_t iSum = 0;
+        uint64_t uCompares = 0;
+        uint64_t uStart = mach_absolute_time();
+
+        for ( uint32_t uRound = 0; uRound < UC_BENCH_ROUNDS; uRound++ ) {
+            for ( uint32_t uName = 0; uName + 1 < UC_BENCH_NAMES; uName++ ) {
+                if ( bFast ) {
+                    iSum += FastUnicodeCompare( ppuNames[uName], puLens[uName], ppuNames[uName + 1], puLens[uName + 1] );
+                    iSum += FastUnicodeCompare( ppuNames[uName], puLens[uName], ppuCased[uName], puLens[uName] );
+                } else {
+                    iSum += FastUnicodeCompareScalar( ppuNames[uName], puLens[uName], ppuNames[uName + 1], puLens[uName + 1] );
+                    iSum += FastUnicodeCompareScalar( ppuNames[uName], puLens[uName], ppuCased[uName], puLens[uName] );
+                }
+                uCompares += 2;
+            }
+        }
+
+        uint64_t uElapsedNano = (mach_absolute_time() - uStart) * sTimebaseInfo.numer / sTimebaseInfo.denom;
+        printf("%s compare: %llu compares in %llu usec, %llu ns per compare (sum %lld)\n", bFast ? "Latin-1 fast path" : "Table walk",
+               uCompares, uElapsedNano / 1000, uElapsedNano / uCompares, iSum);
+    }
+
+    free(puLens);
+    free(ppuCased);
+    free(ppuNames);
+
+    return iErr;
+}
+
+static int
+HFSTest_SetWriteBackLimit( UVFSFileNode RootNode, uint64_t uLimit )
+{
+    UVFSFSAttributeValue sAttrVal;
+    UVFSFSAttributeValue sOutAttrVal;
+
+    sAttrVal.fsa_number = uLimit;
+    return HFS_fsOps.fsops_setfsattr( RootNode, LFHFS_FSATTR_WRITEBACK_LIMIT, &sAttrVal, sizeof(sAttrVal), &sOutAttrVal, sizeof(sOutAttrVal) );
+}
+
+static int
+HFSTest_WriteBack( UVFSFileNode RootNode )
+{
+#define WRITE_BACK_FILE_SIZE    (16*1024*1024)
+#define WRITE_BACK_IO_SIZE      (4096+123)  // Deliberately not block aligned
+#define WRITE_BACK_LIMIT        (4*1024*1024)
+
+    int iErr = 0;
+    size_t iActuallyWrite;
+    size_t iActuallyRead;
+    static mach_timebase_info_data_t sTimebaseInfo;
+    mach_timebase_info(&sTimebaseInfo);
+
+    uint8_t* puWriteBuf = malloc(WRITE_BACK_IO_SIZE);
+    uint8_t* puReadBuf  = malloc(2*WRITE_BACK_IO_SIZE);
+    assert(puWriteBuf && puReadBuf);
+
+    // Append the same file with write-back disabled and enabled
+    for ( uint32_t uPass = 0; uPass < 2; uPass++ )
+    {
+        bool bWriteBack = (uPass == 1);
+        UVFSFileNode psFile = NULL;
+
+        iErr = HFSTest_SetWriteBackLimit( RootNode, bWriteBack ? WRITE_BACK_LIMIT : 0 );
+        assert(iErr == 0);
+
+        iErr = CreateNewFile( RootNode, &psFile, "WriteBackFile", 0 );
+        assert(iErr == 0);
+
+        uint64_t uStart = mach_absolute_time();
+        uint64_t uOffset;
+        for ( uOffset = 0; uOffset + WRITE_BACK_IO_SIZE <= WRITE_BACK_FILE_SIZE; uOffset += WRITE_BACK_IO_SIZE )
+        {
+            for ( uint64_t uIdx = 0; uIdx < WRITE_BACK_IO_SIZE; uIdx++ )
+            {
+                puWriteBuf[uIdx] = (uint8_t)((uOffset + uIdx) % 251);
+            }
+            iErr = HFS_fsOps.fsops_write( psFile, uOffset, WRITE_BACK_IO_SIZE, puWriteBuf, &iActuallyWrite );
+            assert(iErr == 0 && iActuallyWrite == WRITE_BACK_IO_SIZE);
+
+            // Read back across the previous write and the one just buffered
+            if ( uOffset >= WRITE_BACK_IO_SIZE && (uOffset / WRITE_BACK_IO_SIZE) % 64 == 0 )
+            {
+                uint64_t uReadOffset = uOffset - WRITE_BACK_IO_SIZE;
+                iErr = HFS_fsOps.fsops_read( psFile, uReadOffset, 2*WRITE_BACK_IO_SIZE, puReadBuf, &iActuallyRead );
+                assert(iErr == 0 && iActuallyRead == 2*WRITE_BACK_IO_SIZE);
+                for ( uint64_t uIdx = 0; uIdx < 2*WRITE_BACK_IO_SIZE; uIdx++ )
+                {
+                    assert( puReadBuf[uIdx] == (uint8_t)((uReadOffset + uIdx) % 251) );
+                }
+            }
+        }
+
+        UVFSFileAttributes sOutAttrs;
+        iErr = HFS_fsOps.fsops_getattr( psFile, &sOutAttrs );
+        assert(iErr == 0 && sOutAttrs.fa_size == uOffset);
+
+        iErr = HFS_fsOps.fsops_sync( psFile );
+        assert(iErr == 0);
+
+        uint64_t uElapsedNano = (mach_absolute_time() - uStart) * sTimebaseInfo.numer / sTimebaseInfo.denom;
+        uint64_t uElapsedUSec = (uElapsedNano / 1000) ? (uElapsedNano / 1000) : 1;
+        printf("Write-back %s: %llu bytes appended in %llu usec, %llu MB/s\n", bWriteBack ? "enabled" : "disabled",
+               uOffset, uElapsedUSec, uOffset / uElapsedUSec);
+
+        // Everything has to be on the media after the sync
+        for ( uint64_t uReadOffset = 0; uReadOffset < uOffset; uReadOffset += WRITE_BACK_IO_SIZE )
+        {
+            iErr = HFS_fsOps.fsops_read( psFile, uReadOffset, WRITE_BACK_IO_SIZE, puReadBuf, &iActuallyRead );
+            assert(iErr == 0 && iActuallyRead == WRITE_BACK_IO_SIZE);
+            for ( uint64_t uIdx = 0; uIdx < WRITE_BACK_IO_SIZE; uIdx++ )
+            {
+                assert( puReadBuf[uIdx] == (uint8_t)((uReadOffset + uIdx) % 251) );
+            }
+        }
+
+        HFS_fsOps.fsops_reclaim(psFile, 0);
+
+        iErr = RemoveFile( RootNode, "WriteBackFile" );
+        assert(iErr == 0);
+    }
+
+    iErr = HFSTest_SetWriteBackLimit( RootNode, 0 );
+
+    free(puReadBuf);
+    free(puWriteBuf);
+
+    return iErr;
+}
+
 static int
 HFSTest_HardLink( UVFSFileNode RootNode )
 {
@@ -4236,6 +5225,9 @@ TestData_S  gsTestsData[] = {
     ADD_TEST( "HFSTest_Rename",                  "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_Rename ),
     ADD_TEST( "HFSTest_WriteRead",               "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_WriteRead ),
     ADD_TEST( "HFSTest_RandomIO",                "/Volumes/SSD_Shared/FS_DMGs/HFS100MB.dmg",         &HFSTest_RandomIO ),
+    ADD_TEST( "HFSTest_SequentialRead",          "/Volumes/SSD_Shared/FS_DMGs/HFS100MB.dmg",         &HFSTest_SequentialRead ),
+    ADD_TEST( "HFSTest_UnicodeCompare",          "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_UnicodeCompare ),
+    ADD_TEST( "HFSTest_WriteBack",               "/Volumes/SSD_Shared/FS_DMGs/HFS100MB.dmg",         &HFSTest_WriteBack ),
     ADD_TEST( "HFSTest_Create1000Files",         "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_Create1000Files ),
     ADD_TEST( "HFSTest_HardLink",                "/Volumes/SSD_Shared/FS_DMGs/HFSHardLink.dmg",      &HFSTest_HardLink ),
     ADD_TEST( "HFSTest_CreateHardLink",          "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_CreateHardLink ),
@@ -4247,6 +5239,7 @@ TestData_S  gsTestsData[] = {
     ADD_TEST( "HFSTest_MultiThreadedRW",         CREATE_HFS_DMG,                                     &HFSTest_MultiThreadedRW_wJournal ),
     ADD_TEST_NO_SYNC( "HFSTest_ValidateUnmount", "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_ValidateUnmount ),
     ADD_TEST( "HFSTest_ScanID",                  "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_ScanID ),
+    ADD_TEST( "HFSTest_ScanIDAfterRename",       "/Volumes/SSD_Shared/FS_DMGs/HFSEmpty.dmg",         &HFSTest_ScanIDAfterRename ),
 #endif
 #if 1 // Enbale journal-tests
     ADD_TEST( "HFSTest_OpenJournal",                 "/Volumes/SSD_Shared/FS_DMGs/HFSJ-Empty.dmg",           &HFSTest_OpenJournal ),
@@ -4267,12 +5260,18 @@ TestData_S  gsTestsData[] = {
     ADD_TEST( "HFSTest_Rename_wJournal",             "/Volumes/SSD_Shared/FS_DMGs/HFSJ-Empty.dmg",           &HFSTest_Rename ),
     ADD_TEST( "HFSTest_WriteRead_wJournal",          "/Volumes/SSD_Shared/FS_DMGs/HFSJ-Empty.dmg",           &HFSTest_WriteRead ),
     ADD_TEST( "HFSTest_RandomIO_wJournal",           "/Volumes/SSD_Shared/FS_DMGs/HFSJ-144MB.dmg",           &HFSTest_RandomIO ),
+    ADD_TEST( "HFSTest_SequentialRead_wJournal",     "/Volumes/SSD_Shared/FS_DMGs/HFSJ-144MB.dmg",           &HFSTest_SequentialRead ),
+    ADD_TEST( "HFSTest_WriteBack_wJournal",          "/Volumes/SSD_Shared/FS_DMGs/HFSJ-144MB.dmg",           &HFSTest_WriteBack ),
     ADD_TEST( "HFSTest_Create1000Files_wJournal",    "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg",      &HFSTest_Create1000Files ),
     ADD_TEST( "HFSTest_HardLink_wJournal",           "/Volumes/SSD_Shared/FS_DMGs/HFSJ-HardLink.dmg",        &HFSTest_HardLink ),
     ADD_TEST( "HFSTest_CreateHardLink_wJournal",     "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg",      &HFSTest_CreateHardLink ),
     ADD_TEST( "HFSTest_RootFillUp_wJournal",         "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg",      &HFSTest_RootFillUp ),
     ADD_TEST( "HFSTest_MultiThreadedRW_wJournal",                "",                                         &HFSTest_MultiThreadedRW_wJournal ),
     ADD_TEST( "HFSTest_DeleteAHugeDefragmentedFile_wJournal",    "",                                         &HFSTest_DeleteAHugeDefragmentedFile_wJournal ),
+    ADD_TEST( "HFSTest_FragmentedFreeSpace_wJournal",            "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg", &HFSTest_FragmentedFreeSpace ),
+    ADD_TEST( "HFSTest_LookupInLargeDir_wJournal",               "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg", &HFSTest_LookupInLargeDir ),
+    ADD_TEST( "HFSTest_NameCache_wJournal",                      "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg", &HFSTest_NameCache ),
+    ADD_TEST( "HFSTest_LookupDuringCreates_wJournal",            "/Volumes/SSD_Shared/FS_DMGs/HFSJ-EmptyLarge.dmg", &HFSTest_LookupDuringCreates ),
     ADD_TEST( "HFSTest_CreateJournal_Sparse",                CREATE_SPARSE_VOLUME,                           &HFSTest_OpenJournal ),
     ADD_TEST( "HFSTest_MakeDirAndKeep_Sparse",               CREATE_SPARSE_VOLUME,                           &HFSTest_MakeDirAndKeep ),
     ADD_TEST( "HFSTest_CreateAndWriteToJournal_Sparse",      CREATE_SPARSE_VOLUME,                           &HFSTest_WriteToJournal ),
@@ -4324,6 +5323,11 @@ TestData_S  gsTestsData[] = {
     ADD_TEST_WITH_CRASH_ABORT("HFSTest_MakeDirAndKeep_wCrashAfterJournalHeader_Sparse", CREATE_SPARSE_VOLUME,
                               &HFSTest_MakeDirAndKeep, CRASH_ABORT_JOURNAL_AFTER_JOURNAL_HEADER, HFSTest_CrashAbortOnMkDir, 1),
     ADD_TEST( "HFSTest_ConfirmTestFolderExists", TEMP_DMG_BKUP_SPARSE, &HFSTest_ConfirmTestFolderExists ),
+
+    // The following 2 tests time the replay of a journal left full of transactions by a crash
+    ADD_TEST_WITH_CRASH_ABORT("HFSTest_FillJournal_wCrashAfterJournalHeader", "/Volumes/SSD_Shared/FS_DMGs/HFSJ-144MB.dmg",
+                              &HFSTest_FillJournal, CRASH_ABORT_JOURNAL_AFTER_JOURNAL_HEADER, HFSTest_SaveDMG, 64),
+    ADD_TEST( "HFSTest_ReplayJournalBench", TEMP_DMG_BKUP, &HFSTest_ReplayJournalBench ),
 #endif
 
 };
@@ -4435,9 +5439,14 @@ static int HFSTest_RunTest(TestData_S *psTestData) {
         return(iErr);
     }
 
+    static mach_timebase_info_data_t sTimebaseInfo;
+    mach_timebase_info(&sTimebaseInfo);
+
     UVFSFileNode RootNode = NULL;
+    uint64_t uMountStart = mach_absolute_time();
     iErr = HFS_fsOps.fsops_mount( iFD, sScanVolsReply.sr_volid, 0, NULL, &RootNode );
-    printf("Mount err [%d]\n", iErr);
+    guMountUSec = (mach_absolute_time() - uMountStart) * sTimebaseInfo.numer / sTimebaseInfo.denom / 1000;
+    printf("Mount err [%d] (%llu usec)\n", iErr, guMountUSec);
     if ( iErr )
     {
         close(iFD);
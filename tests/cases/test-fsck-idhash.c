@@ -0,0 +1,138 @@
+//
+//  test-fsck-idhash.c
+//  hfs
+//
+//  Builds a volume with many folders and a Time Machine style hard
+//  link farm, then times fsck_hfs over it.  CheckFolderCount keeps a
+//  count per folder and CheckHardLinks sorts each inode's link chain
+//  (tsort), both through IDHash.
+//
+
+#include <TargetConditionals.h>
+
+#if !TARGET_OS_IPHONE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "hfs-tests.h"
+#include "disk-image.h"
+#include "systemx.h"
+#include "test-utils.h"
+
+#define IMAGE			"/tmp/fsck-idhash.sparseimage"
+
+/*
+ * kTopFolders * kSubFolders folders.  Every inode gets one link in each
+ * of kSnapshots snapshot folders, more than the 32 links above which
+ * tsort indexes the chain by fileID.
+ */
+#define kTopFolders		250
+#define kSubFolders		200
+#define kInodes			2000
+#define kSnapshots		48
+#define kFsckRuns		3
+
+TEST(fsck_idhash, .run_as_root = true)
+
+static double elapsed(const struct timeval *start)
+{
+	struct timeval now, diff;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &diff);
+	return diff.tv_sec + diff.tv_usec / 1e6;
+}
+
+int run_fsck_idhash(__unused test_ctx_t *ctx)
+{
+	unlink(IMAGE);
+
+	disk_image_t *di = disk_image_create(IMAGE, &(disk_image_opts_t){
+											.size = 4 GB
+										});
+
+	// CheckFolderCount only runs on HFSX, so make the volume case sensitive
+	unmount(di->mount_point, 0);
+	assert(!systemx("/sbin/newfs_hfs", SYSTEMX_QUIET, "-J", "-s", "-v", "fsck-idhash", di->disk, NULL));
+	assert(!systemx("/usr/sbin/diskutil", SYSTEMX_QUIET, "mount", di->disk, NULL));
+
+	free((char *)di->mount_point);
+	di->mount_point = NULL;
+
+	struct statfs *mntbuf;
+	int i, n = getmntinfo(&mntbuf, 0);
+	for (i = 0; i < n; ++i) {
+		if (!strcmp(mntbuf[i].f_mntfromname, di->disk)) {
+			di->mount_point = strdup(mntbuf[i].f_mntonname);
+			break;
+		}
+	}
+	assert(i < n);
+
+	char *path;
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
+	for (int top = 0; top < kTopFolders; ++top) {
+		asprintf(&path, "%s/folders-%d", di->mount_point, top);
+		assert_no_err(mkdir(path, 0777));
+		free(path);
+		for (int sub = 0; sub < kSubFolders; ++sub) {
+			asprintf(&path, "%s/folders-%d/%d", di->mount_point, top, sub);
+			assert_no_err(mkdir(path, 0777));
+			free(path);
+		}
+	}
+
+	asprintf(&path, "%s/inodes", di->mount_point);
+	assert_no_err(mkdir(path, 0777));
+	free(path);
+	for (int inode = 0; inode < kInodes; ++inode) {
+		asprintf(&path, "%s/inodes/%d", di->mount_point, inode);
+		int fd = open(path, O_CREAT | O_RDWR, 0666);
+		assert_with_errno(fd >= 0);
+		assert_no_err(close(fd));
+		free(path);
+	}
+
+	for (int snap = 0; snap < kSnapshots; ++snap) {
+		asprintf(&path, "%s/snapshot-%d", di->mount_point, snap);
+		assert_no_err(mkdir(path, 0777));
+		free(path);
+		for (int inode = 0; inode < kInodes; ++inode) {
+			char *target, *lnk;
+
+			asprintf(&target, "%s/inodes/%d", di->mount_point, inode);
+			asprintf(&lnk, "%s/snapshot-%d/%d", di->mount_point, snap, inode);
+			assert_no_err(link(target, lnk));
+			free(target);
+			free(lnk);
+		}
+	}
+	printf("fsck_idhash: created %d folders and %d links to %d inodes in %.2f s\n",
+		   kTopFolders * (kSubFolders + 1) + kSnapshots + 1, kInodes * kSnapshots,
+		   kInodes, elapsed(&start));
+
+	assert_no_err(unmount(di->mount_point, 0));
+
+	double best = 0;
+	for (int run = 0; run < kFsckRuns; ++run) {
+		gettimeofday(&start, NULL);
+		assert(!systemx("/sbin/fsck_hfs", SYSTEMX_QUIET, "-fn", di->disk, NULL));
+		double secs = elapsed(&start);
+		if (run == 0 || secs < best)
+			best = secs;
+	}
+	printf("fsck_idhash: fsck_hfs -fn best of %d runs: %.2f s\n", kFsckRuns, best);
+
+	return 0;
+}
+
+#endif // !TARGET_OS_IPHONE